@@ -19,6 +19,7 @@ fi
 sudo mount $LOOP_PART $MOUNT_POINT
 sudo grub-install --root-directory=$MOUNT_POINT --no-floppy --modules="normal part_msdos ext2 multiboot" $LOOP_DEV
 sudo cp -r build/kernel-x86_64.bin $MOUNT_POINT/boot/kernel.bin
+sudo cp build/initrd.tar $MOUNT_POINT/boot/initrd.tar
 sudo mkdir -p $MOUNT_POINT/boot/grub
 sudo cp isofiles/boot/grub/grub.cfg $MOUNT_POINT/boot/grub/
 sudo umount $MOUNT_POINT
@@ -1,12 +1,17 @@
 global start
 extern long_mode_start
 
-section .text
+; the kernel is linked at KERNEL_VMA (mmu.h) and loaded at 1 MiB. This code runs before paging, in
+; .boot.text which linker.ld keeps at its load address, so everything else is referenced by its
+; physical address, symbol - KERNEL_VMA
+KERNEL_VMA equ 0xFFFFFFFF80000000
+
+section .boot.text progbits alloc exec nowrite align=16
 bits 32
 start:
-    mov esp, stack_top
+    mov esp, stack_top - KERNEL_VMA
 
-    mov dword [multiboot_info_ptr], ebx
+    mov dword [multiboot_info_ptr - KERNEL_VMA], ebx
 
     call check_multiboot
     call check_cpuid
@@ -15,8 +20,8 @@ start:
     call set_up_page_tables
     call enable_paging
 
-    ; load the 64-bit GDT
-    lgdt [gdt64.pointer]
+    ; load the 64-bit GDT, long_mode_start reloads it at its high address
+    lgdt [gdt64.pointer32 - KERNEL_VMA]
 
     jmp gdt64.code:long_mode_start
 
@@ -88,35 +93,47 @@ check_long_mode:
 set_up_page_tables:
     ; clear all page tables first
     mov eax, 0
-    mov ecx, 4096 * 5  ; 5 pages: PML4 + 4 PDPTs
-    mov edi, p4_table
+    mov ecx, 4096 * 7  ; 7 pages: PML4 + 6 PDPTs
+    mov edi, p4_table - KERNEL_VMA
     rep stosb
     
     ; setting up p4_table (PML4)
-    ; entry 0: identity map for physical memory (0x0000000000000000)
-    mov eax, pdpt_low
+    ; entry 0: identity map of the first 1 GiB, only until MMU_init removes it
+    mov eax, pdpt_low - KERNEL_VMA
     or eax, 0b11 ; present + writable
-    mov [p4_table], eax
+    mov [p4_table - KERNEL_VMA], eax
     
     ; entry 1: kernel heap (0x0000010000000000)
-    mov eax, pdpt_heap
+    mov eax, pdpt_heap - KERNEL_VMA
     or eax, 0b11 ; present + writable
-    mov [p4_table + 8], eax  ; 8 bytes per entry
+    mov [p4_table - KERNEL_VMA + 8], eax  ; 8 bytes per entry
     
     ; entry 15: kernel stacks (0x00000F0000000000)
-    mov eax, pdpt_stacks
+    mov eax, pdpt_stacks - KERNEL_VMA
     or eax, 0b11 ; present + writable
-    mov [p4_table + 15*8], eax
+    mov [p4_table - KERNEL_VMA + 15*8], eax
     
     ; entry 16: user space (0x0000100000000000)
-    mov eax, pdpt_user
+    mov eax, pdpt_user - KERNEL_VMA
+    or eax, 0b11 ; present + writable
+    mov [p4_table - KERNEL_VMA + 16*8], eax
+    
+    ; entry 256: direct map of physical memory (DIRECT_MAP), MMU_init maps the rest of RAM
+    mov eax, pdpt_direct - KERNEL_VMA
     or eax, 0b11 ; present + writable
-    mov [p4_table + 16*8], eax
+    mov [p4_table - KERNEL_VMA + 256*8], eax
     
-    ; setting up pdpt_low (for identity mapping)
-    mov eax, pd_table
+    ; entry 511: the kernel image (KERNEL_VMA)
+    mov eax, pdpt_kernel - KERNEL_VMA
     or eax, 0b11 ; present + writable
-    mov [pdpt_low], eax
+    mov [p4_table - KERNEL_VMA + 511*8], eax
+    
+    ; the same first 1 GiB behind all three
+    mov eax, pd_table - KERNEL_VMA
+    or eax, 0b11 ; present + writable
+    mov [pdpt_low - KERNEL_VMA], eax
+    mov [pdpt_direct - KERNEL_VMA], eax
+    mov [pdpt_kernel - KERNEL_VMA + 510*8], eax
 
     mov ecx, 0
 
@@ -124,8 +141,8 @@ set_up_page_tables:
     ; map ecx-th P2 entry to a huge page that starts at address 2MiB*ecx
     mov eax, 0x200000  ; 2MiB
     mul ecx            ; start address of ecx-th page
-    or eax, 0b10000011 ; present + writable + huge
-    mov [pd_table + ecx * 8], eax ; map ecx-th entry
+    or eax, 0b110000011 ; present + writable + huge + global
+    mov [pd_table - KERNEL_VMA + ecx * 8], eax ; map ecx-th entry
 
     inc ecx            ; increase counter
     cmp ecx, 512       ; if counter == 512, the whole P2 table is mapped
@@ -135,7 +152,7 @@ set_up_page_tables:
 
 enable_paging:
     ; load P4 to cr3 register (cpu uses this to access the P4 table)
-    mov eax, p4_table
+    mov eax, p4_table - KERNEL_VMA
     mov cr3, eax
 
     ; enable PAE-flag in cr4 (Physical Address Extension)
@@ -156,6 +173,13 @@ enable_paging:
 
     ret
 
+error:
+    mov dword [0xb8000], 0x4f524f45
+    mov dword [0xb8004], 0x4f3a4f52
+    mov dword [0xb8008], 0x4f204f20
+    mov byte  [0xb800a], al
+    hlt
+
 section .rodata
 global gdt64
 gdt64:
@@ -167,16 +191,22 @@ gdt64:
 .tss: equ $ - gdt64
     dq 0                          ; TSS descriptor part 1
     dq 0                          ; TSS descriptor part 2
+; user segments sit where SYSRET expects them (STAR base 0x20: ss = 0x28, cs = 0x30)
+.user_data: equ $ - gdt64
+    dq (1<<41) | (1<<44) | (3<<45) | (1<<47) ; data segment, DPL 3
+.user_code: equ $ - gdt64
+    dq (1<<43) | (1<<44) | (3<<45) | (1<<47) | (1<<53) ; code segment, DPL 3
+; TSS descriptors of the APs, written by setup_tss (MAX_CPUS - 1 in cpu.h)
+.tss_ap: equ $ - gdt64
+    times 3 * 2 dq 0
 .pointer:
     dw $ - gdt64 - 1              ; Limit (size of GDT)
     dq gdt64                      ; Base address of GDT
-
-error:
-    mov dword [0xb8000], 0x4f524f45
-    mov dword [0xb8004], 0x4f3a4f52
-    mov dword [0xb8008], 0x4f204f20
-    mov byte  [0xb800a], al
-    hlt
+.pointer32:
+    dw .pointer - gdt64 - 1
+    dd gdt64 - KERNEL_VMA         ; physical, for the lgdt before paging
+global gdt64_pointer
+gdt64_pointer equ gdt64.pointer
 
 section .bss
 align 4096
@@ -191,12 +221,18 @@ pdpt_stacks:
     resb 4096
 pdpt_user:
     resb 4096
+pdpt_direct:
+    resb 4096
+pdpt_kernel:
+    resb 4096
 pd_table:
     resb 4096
+; boot stack, kmain and everything it calls run on it
 stack_bottom:
-    resb 64
+    resb 4096 * 4
 stack_top:
 
 section .data
 multiboot_info_ptr: dd 0
-global multiboot_info_ptr
\ No newline at end of file
+global multiboot_info_ptr
+global stack_top
\ No newline at end of file
@@ -7,139 +7,43 @@ extern interrupt_handler
 
 ; Export all symbols
 global idt_load
-global default_interrupt
-global isr_0
-global isr_1
-global isr_2
-global isr_3
-global isr_4
-global isr_5
-global isr_6
-global isr_7
-global isr_8
-global isr_9
-global isr_10
-global isr_11
-global isr_12
-global isr_13
-global isr_14
-global isr_15
-global isr_16
-global isr_17
-global isr_18
-global isr_19
-global isr_20
-global isr_21
-global isr_22
-global isr_23
-global isr_24
-global isr_25
-global isr_26
-global isr_27
-global isr_28
-global isr_29
-global isr_30
-global isr_31
-global isr_32
-global isr_33
-global isr_34
-global isr_35
-global isr_36
-global isr_37
-global isr_38
-global isr_39
-global isr_40
-global isr_41
-global isr_42
-global isr_43
-global isr_44
-global isr_45
-global isr_46
-global isr_47
+global isr_stub_table
 
 ; Load IDT
 extern idtp
 idt_load:
-    lidt [idtp]
+    lidt [rel idtp]
     ret
 
+; One stub per vector so the handler always knows which vector fired.
+; Exceptions that push an error code only push the vector number, every
+; other stub pushes a dummy error code first so the frame layout is the same.
+; Vectors 0-31: CPU exceptions, 32-47: PIC IRQs, 48-255: dynamically allocated
+%assign i 0
+%rep 256
 align 16
-default_interrupt:
+isr_%+i:
+%if i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30
+    push qword i       ; push interrupt number (error code already on stack)
+%else
     push qword 0       ; push dummy error code
-    push qword 0xFF    ; push a special number to identify default handler
+    push qword i       ; push interrupt number
+%endif
     jmp isr_common     ; jump to common handler
+%assign i i+1
+%endrep
 
-; ISRs for exceptions that don't push an error code
-%macro ISR_NO_ERR 1
-align 16
-isr_%1:
-    push qword 0       ; push dummy error code
-    push qword %1      ; push interrupt number
-    jmp isr_common     ; jump to common handler
-%endmacro
-
-; ISRs for exceptions that do push an error code
-%macro ISR_ERR 1
-align 16
-isr_%1:
-    push qword %1      ; push interrupt number (error code already on stack)
-    jmp isr_common
-%endmacro
-
-; define CPU exception handlers (0-31)
-ISR_NO_ERR 0   ; Divide by Zero
-ISR_NO_ERR 1   ; Debug
-ISR_NO_ERR 2   ; Non-maskable Interrupt
-ISR_NO_ERR 3   ; Breakpoint
-ISR_NO_ERR 4   ; Overflow
-ISR_NO_ERR 5   ; Bound Range Exceeded
-ISR_NO_ERR 6   ; Invalid Opcode
-ISR_NO_ERR 7   ; Device Not Available
-ISR_ERR    8   ; Double Fault (uses IST1)
-ISR_NO_ERR 9   ; Coprocessor Segment Overrun
-ISR_ERR    10  ; Invalid TSS
-ISR_ERR    11  ; Segment Not Present
-ISR_ERR    12  ; Stack-Segment Fault
-ISR_ERR    13  ; General Protection Fault (uses IST3)
-ISR_ERR    14  ; Page Fault (uses IST2)
-ISR_NO_ERR 15  ; Reserved
-ISR_NO_ERR 16  ; x87 FPU Error
-ISR_ERR    17  ; Alignment Check
-ISR_NO_ERR 18  ; Machine Check
-ISR_NO_ERR 19  ; SIMD Floating-point Exception
-ISR_NO_ERR 20  ; Virtualization Exception
-ISR_ERR    21  ; Control Protection Exception
-ISR_NO_ERR 22  ; Reserved
-ISR_NO_ERR 23  ; Reserved
-ISR_NO_ERR 24  ; Reserved
-ISR_NO_ERR 25  ; Reserved
-ISR_NO_ERR 26  ; Reserved
-ISR_NO_ERR 27  ; Reserved
-ISR_NO_ERR 28  ; Reserved
-ISR_NO_ERR 29  ; Reserved
-ISR_ERR    30  ; Reserved
-ISR_NO_ERR 31  ; Reserved
-
-; define IRQs (32-47)
-ISR_NO_ERR 32  ; Timer (IRQ0)
-ISR_NO_ERR 33  ; Keyboard (IRQ1)
-ISR_NO_ERR 34  ; Cascade for Slave PIC (IRQ2)
-ISR_NO_ERR 35  ; COM2 (IRQ3)
-ISR_NO_ERR 36  ; COM1 (IRQ4)
-ISR_NO_ERR 37  ; LPT2 (IRQ5)
-ISR_NO_ERR 38  ; Floppy Disk (IRQ6)
-ISR_NO_ERR 39  ; LPT1 / Spurious (IRQ7)
-ISR_NO_ERR 40  ; CMOS Real Time Clock (IRQ8)
-ISR_NO_ERR 41  ; Free / SCSI / NIC (IRQ9)
-ISR_NO_ERR 42  ; Free / SCSI / NIC (IRQ10)
-ISR_NO_ERR 43  ; Free / SCSI / NIC (IRQ11)
-ISR_NO_ERR 44  ; PS2 Mouse (IRQ12)
-ISR_NO_ERR 45  ; FPU / Coprocessor / Inter-processor (IRQ13)
-ISR_NO_ERR 46  ; Primary ATA Hard Disk (IRQ14)
-ISR_NO_ERR 47  ; Secondary ATA Hard Disk (IRQ15)
-
+; FPU/SSE registers are not saved here: C handlers are built without SSE and
+; state is switched lazily through CR0.TS and #NM (fpu.c)
+; Data segment registers are left alone, long mode ignores them for addressing.
+; Coming from ring 3 the GS base still belongs to the process, swapgs brings in
+; the per-CPU block (and gives the process its base back on the way out).
 align 16
 isr_common:
+    test qword [rsp + 24], 3    ; cs of the interrupted code
+    jz .from_kernel
+    swapgs
+.from_kernel:
     ; save all registers
     push rax
     push rbx
@@ -157,28 +61,10 @@ isr_common:
     push r14
     push r15
 
-    ; save original data segment
-    mov ax, ds
-    push rax
-    
-    ; load kernel data segment
-    mov ax, 0x10       ; kernel data segment selector
-    mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
-    
     ; call C handler (passing pointer to stack as argument)
     mov rdi, rsp
     call interrupt_handler
-    
-    ; restore original data segment
-    pop rax
-    mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
-    
+
     ; restore all registers
     pop r15
     pop r14
@@ -195,7 +81,21 @@ isr_common:
     pop rcx
     pop rbx
     pop rax
-    
+
+    test qword [rsp + 24], 3
+    jz .to_kernel
+    swapgs
+.to_kernel:
     ; clean up error code and interrupt number
     add rsp, 16
-    iretq
\ No newline at end of file
+    iretq
+
+section .rodata
+; stub addresses indexed by vector, used by idt_init
+align 8
+isr_stub_table:
+%assign i 0
+%rep 256
+    dq isr_%+i
+%assign i i+1
+%endrep
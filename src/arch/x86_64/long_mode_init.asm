@@ -1,8 +1,12 @@
 global long_mode_start
 extern kmain
 extern multiboot_info_ptr
+extern stack_top
+extern gdt64_pointer
 
-section .text
+DIRECT_MAP equ 0xFFFF800000000000  ; DIRECT_MAP_ADR in mmu.h
+
+section .boot.text progbits alloc exec nowrite align=16
 bits 64
 long_mode_start:
     ; load 0 into all data segment registers
@@ -13,6 +17,19 @@ long_mode_start:
     mov fs, ax
     mov gs, ax
 
-    mov rdi, [multiboot_info_ptr]
+    ; still running at the load address, the kernel image is mapped at KERNEL_VMA too
+    mov rax, qword higher_half
+    jmp rax
+
+section .text
+higher_half:
+    ; GDT base and stack at their high addresses, the identity map goes away in MMU_init
+    lgdt [rel gdt64_pointer]
+    mov rsp, qword stack_top
+
+    ; the multiboot info through the direct map
+    mov edi, [rel multiboot_info_ptr]
+    mov rax, qword DIRECT_MAP
+    add rdi, rax
 
-    call kmain
\ No newline at end of file
+    call kmain
@@ -0,0 +1,85 @@
+; trampoline.asm - AP startup code, copied to AP_TRAMPOLINE_ADDR (smp.h) below 1 MiB and entered in
+; real mode by the startup IPI. Goes straight to long mode on the kernel page tables and calls
+; ap_entry(cpu) on the stack the BSP left in the parameter block.
+section .text
+bits 16
+
+global trampoline_start
+global trampoline_end
+global trampoline_params
+
+TRAMPOLINE_BASE equ 0x8000
+%define T(x) (x - trampoline_start + TRAMPOLINE_BASE)
+
+trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [T(tramp_gdt.pointer)]
+    mov eax, cr0
+    or eax, 1                       ; protected mode
+    mov cr0, eax
+    jmp tramp_gdt.code32:T(.protected)
+
+bits 32
+.protected:
+    mov ax, tramp_gdt.data
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, 1 << 5                  ; PAE
+    mov cr4, eax
+    mov eax, [T(trampoline_params.cr3)]
+    mov cr3, eax
+    mov ecx, 0xC0000080             ; EFER.LME
+    rdmsr
+    or eax, 1 << 8
+    wrmsr
+    mov eax, cr0
+    or eax, 1 << 31                 ; paging, long mode is active after this
+    mov cr0, eax
+    jmp tramp_gdt.code64:T(.long_mode)
+
+bits 64
+.long_mode:
+    ; from here on the kernel's own GDT and code
+    mov rax, [T(trampoline_params.gdt)]
+    lgdt [rax]
+    xor eax, eax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov fs, ax
+    mov gs, ax
+    mov rsp, [T(trampoline_params.stack)]
+    mov edi, [T(trampoline_params.cpu)]
+    mov rax, [T(trampoline_params.entry)]
+    push 0x08                       ; GDT_KERNEL_CODE
+    push rax
+    retfq
+
+align 8
+tramp_gdt:
+    dq 0
+.code32: equ $ - tramp_gdt
+    dq 0x00CF9A000000FFFF           ; 32-bit code, flat
+.data: equ $ - tramp_gdt
+    dq 0x00CF92000000FFFF           ; data, flat
+.code64: equ $ - tramp_gdt
+    dq (1<<43) | (1<<44) | (1<<47) | (1<<53)
+.pointer:
+    dw $ - tramp_gdt - 1
+    dd T(tramp_gdt)
+
+; filled in by smp_boot_ap for each AP, layout of struct ap_boot_params
+align 8
+trampoline_params:
+.cr3: dq 0
+.gdt: dq 0
+.stack: dq 0
+.entry: dq 0
+.cpu: dq 0
+trampoline_end:
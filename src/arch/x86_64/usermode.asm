@@ -0,0 +1,107 @@
+; usermode.asm - entering ring 3 and getting back out when a process exits
+section .text
+bits 64
+
+global enter_usermode
+global return_to_kernel
+global syscall_entry
+extern syscall_table
+extern syscall_count
+
+USER_DS equ 0x28 | 3
+USER_CS equ 0x30 | 3
+KERNEL_DS equ 0x10
+ENOSYS equ -38
+CPU_LOCAL_KERNEL_RSP equ 8  ; struct cpu_local in cpu.h
+CPU_LOCAL_USER_RSP equ 16
+
+; int enter_usermode(uint64_t entry, uint64_t user_rsp, uint64_t *kernel_rsp)
+; keeps the callee saved registers on this stack and irets to entry, returns the
+; exit code once return_to_kernel comes back to the saved rsp
+enter_usermode:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdx], rsp
+
+    mov ax, USER_DS
+    mov ds, ax
+    mov es, ax
+
+    push USER_DS        ; ss
+    push rsi            ; rsp
+    push 0x202          ; rflags, IF set
+    push USER_CS        ; cs
+    push rdi            ; rip
+
+    ; no kernel values leak into the process
+    xor eax, eax
+    xor ebx, ebx
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor edi, edi
+    xor ebp, ebp
+    xor r8, r8
+    xor r9, r9
+    xor r10, r10
+    xor r11, r11
+    xor r12, r12
+    xor r13, r13
+    xor r14, r14
+    xor r15, r15
+    ; an interrupt between swapgs and iretq would come from kernel CS and keep the user GS base,
+    ; iretq turns IF back on from the frame
+    cli
+    swapgs              ; the process starts with its own (zero) GS base
+    iretq
+
+; void return_to_kernel(uint64_t kernel_rsp, int code)
+; called on the process's kernel stack, whatever is on it is dropped
+return_to_kernel:
+    mov rsp, rdi
+    mov eax, esi
+    mov cx, KERNEL_DS
+    mov ds, cx
+    mov es, cx
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+; SYSCALL lands here with interrupts masked by FMASK, rcx = user rip, r11 = user rflags.
+; Only what SYSRET needs is saved, the C handlers preserve rbx, rbp and r12-r15
+; themselves and the remaining caller saved registers are undefined on return.
+align 16
+syscall_entry:
+    swapgs
+    mov [gs:CPU_LOCAL_USER_RSP], rsp
+    mov rsp, [gs:CPU_LOCAL_KERNEL_RSP]
+    push qword [gs:CPU_LOCAL_USER_RSP]
+    push rcx
+    push r11
+    sub rsp, 8          ; kernel_rsp is page aligned, the handlers get a 16 byte aligned call
+    sti
+
+    cmp rax, [rel syscall_count]
+    jae .enosys
+    mov rcx, r10        ; fourth argument, rcx held the return address
+    call [syscall_table + rax * 8]
+    jmp .done
+.enosys:
+    mov rax, ENOSYS
+.done:
+    cli
+    add rsp, 8
+    pop r11
+    pop rcx
+    pop rsp
+    swapgs
+    ; rcx is always canonical here, user space ends well below the hole
+    o64 sysret
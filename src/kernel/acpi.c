@@ -0,0 +1,99 @@
+#include "acpi.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+
+// the multiboot info isn't reserved, keep our own copy of the RSDP
+static struct acpi_rsdp rsdp;
+static int have_rsdp = 0;
+// every table the root lists, mapped once on the first lookup since the MMIO window is never given back
+static struct acpi_sdt_header *tables[ACPI_MAX_TABLES];
+static int num_tables = -1;
+
+void acpi_set_rsdp(const void *data, uint32_t len) {
+    if (len > sizeof(rsdp)) len = sizeof(rsdp);
+    memset(&rsdp, 0, sizeof(rsdp));
+    memcpy(&rsdp, data, len);
+    if (memcmp(rsdp.signature, "RSD PTR ", 8) != 0) {
+        printk("ACPI: bad RSDP signature\n");
+        return;
+    }
+    have_rsdp = 1;
+    printk("ACPI: RSDP revision %d, RSDT 0x%x, XSDT 0x%lx\n",
+           rsdp.revision, rsdp.rsdt_address, rsdp.revision >= 2 ? rsdp.xsdt_address : 0);
+}
+
+// tables outside the direct map get an uncached mapping in the growth window
+static void *acpi_map(uint64_t paddr, uint64_t len) {
+    if (MMU_direct_mapped(paddr, len)) {
+        return phys_to_virt(paddr);
+    }
+    return MMU_map_mmio(paddr, len);
+}
+
+static int acpi_checksum_ok(const void *table, uint32_t len) {
+    const uint8_t *p = table;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += p[i];
+    return sum == 0;
+}
+
+// maps the header first to learn the length, and again only when the table runs past its pages
+static struct acpi_sdt_header *acpi_map_table(uint64_t paddr) {
+    struct acpi_sdt_header *hdr = acpi_map(paddr, sizeof(*hdr));
+    if (!hdr) return NULL;
+    uint64_t mapped_end = (paddr + sizeof(*hdr) + PAGE_SIZE - 1) & PAGE_MASK;
+    if (!MMU_direct_mapped(paddr, hdr->length) && paddr + hdr->length > mapped_end) {
+        hdr = acpi_map(paddr, hdr->length);
+    }
+    return hdr;
+}
+
+// 0 on success, the table list stays empty when the root table is bad
+static int acpi_map_tables(void) {
+    num_tables = 0;
+    int use_xsdt = rsdp.revision >= 2 && rsdp.xsdt_address;
+    struct acpi_sdt_header *root = acpi_map_table(use_xsdt ? rsdp.xsdt_address : rsdp.rsdt_address);
+    if (!root || !acpi_checksum_ok(root, root->length)) {
+        printk("ACPI: bad root table\n");
+        return -1;
+    }
+
+    int entry_size = use_xsdt ? 8 : 4;
+    int entries = (root->length - sizeof(*root)) / entry_size;
+    if (entries > ACPI_MAX_TABLES) {
+        printk("ACPI: %d tables, only the first %d are used\n", entries, ACPI_MAX_TABLES);
+        entries = ACPI_MAX_TABLES;
+    }
+    uint8_t *ptrs = (uint8_t *)(root + 1);
+    for (int i = 0; i < entries; i++) {
+        uint64_t paddr;
+        if (use_xsdt) {
+            memcpy(&paddr, ptrs + i * 8, 8);   // entries are not 8 byte aligned
+        } else {
+            uint32_t p32;
+            memcpy(&p32, ptrs + i * 4, 4);
+            paddr = p32;
+        }
+        struct acpi_sdt_header *hdr = acpi_map_table(paddr);
+        if (hdr) tables[num_tables++] = hdr;
+    }
+    return 0;
+}
+
+// returns the first table with the given 4 char signature, NULL if there is none
+void *acpi_find_table(const char *signature) {
+    if (!have_rsdp) return NULL;
+    if (num_tables < 0 && acpi_map_tables()) return NULL;
+
+    for (int i = 0; i < num_tables; i++) {
+        struct acpi_sdt_header *hdr = tables[i];
+        if (memcmp(hdr->signature, signature, 4) == 0) {
+            if (!acpi_checksum_ok(hdr, hdr->length)) {
+                printk("ACPI: %s checksum mismatch\n", signature);
+            }
+            return hdr;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,78 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ACPI_SIG_MCFG "MCFG"
+#define ACPI_SIG_MADT "APIC"
+#define ACPI_MAX_TABLES 64      // root table entries kept mapped, the rest aren't searched
+
+struct acpi_rsdp {
+    char signature[8];      // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;       // 0 = ACPI 1.0 (RSDT only), 2+ = XSDT available
+    uint32_t rsdt_address;
+    // revision 2+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;        // whole table including this header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// PCI express memory mapped config space (ECAM), one entry per segment group
+struct acpi_mcfg_entry {
+    uint64_t base_address;
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct acpi_mcfg {
+    struct acpi_sdt_header header;
+    uint64_t reserved;
+    struct acpi_mcfg_entry entries[0];
+} __attribute__((packed));
+
+// multiple APIC description table, followed by variable length entries
+struct acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[0];
+} __attribute__((packed));
+
+#define MADT_TYPE_LAPIC 0
+#define MADT_LAPIC_ENABLED 0x1
+#define MADT_LAPIC_ONLINE_CAPABLE 0x2
+
+struct acpi_madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct acpi_madt_lapic {
+    struct acpi_madt_entry entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+void acpi_set_rsdp(const void *rsdp, uint32_t len);
+void *acpi_find_table(const char *signature);
+
+#endif
@@ -0,0 +1,143 @@
+#include "apic.h"
+#include "acpi.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "printk.h"
+#include "tsc.h"
+
+// local APIC: enabled next to the PICs (LINT0 keeps delivering them), used for IPIs between CPUs
+
+static volatile uint32_t *lapic = NULL;
+static uint64_t timer_hz = 0;              // timer input clock after the divider
+
+static inline int are_interrupts_enabled() {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0"
+                     : "=r"(flags));
+    return flags & 0x200; // Check IF (Interrupt Flag) bit
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+// maps the BSP's APIC page, every CPU sees its own APIC at the same address
+void lapic_init(void) {
+    uint64_t base = rdmsr(MSR_APIC_BASE) & APIC_BASE_ADDR_MASK;
+    lapic = MMU_map_mmio(base, PAGE_SIZE);
+    if (!lapic) {
+        printk("LAPIC: could not map 0x%lx\n", base);
+        return;
+    }
+    lapic_cpu_init();
+    printk("LAPIC: id %d at 0x%lx\n", lapic_id(), base);
+}
+
+// software enables the calling CPU's APIC, accepting every priority
+void lapic_cpu_init(void) {
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+int lapic_present(void) {
+    return lapic != NULL;
+}
+
+uint8_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// the high half of the ICR is per CPU state, so nothing on this CPU may send in between
+static void lapic_send(uint8_t apic_id, uint32_t command) {
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+    lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << ICR_DEST_SHIFT);
+    lapic_write(LAPIC_ICR_LO, command);
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+    lapic_send(apic_id, ICR_FIXED | ICR_ASSERT | vector);
+}
+
+void lapic_send_init(uint8_t apic_id) {
+    lapic_send(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+// the AP starts in real mode at page * 4 KiB
+void lapic_send_startup(uint8_t apic_id, uint8_t page) {
+    lapic_send(apic_id, ICR_STARTUP | ICR_ASSERT | page);
+}
+
+/*-------------------Timer-------------------*/
+
+// counts the divided bus clock against the TSC once, every APIC runs off the same clock
+uint64_t lapic_timer_hz(void) {
+    if (timer_hz || !lapic) return timer_hz;
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    TSC_delay_us(LAPIC_TIMER_CALIBRATE_US);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    timer_hz = (uint64_t)elapsed * (1000000 / LAPIC_TIMER_CALIBRATE_US);
+    printk("LAPIC: timer %lu kHz\n", timer_hz / 1000);
+    return timer_hz;
+}
+
+// periodic interrupt on vector at hz on the calling CPU
+void lapic_timer_start(uint8_t vector, uint32_t hz) {
+    uint64_t clock = lapic_timer_hz();
+    if (!clock || !hz) return;
+    uint64_t count = clock / hz;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | vector);
+    lapic_write(LAPIC_TIMER_INITIAL, (uint32_t)count);
+}
+
+void lapic_timer_stop(void) {
+    if (!lapic) return;
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+// APIC ids of the usable CPUs from the MADT, the BSP included, returns how many
+int madt_cpu_apic_ids(uint8_t *ids, int max) {
+    struct acpi_madt *madt = acpi_find_table(ACPI_SIG_MADT);
+    if (!madt) return 0;
+    int count = 0;
+    uint8_t *p = madt->entries;
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+    while (p + sizeof(struct acpi_madt_entry) <= end) {
+        struct acpi_madt_entry *e = (struct acpi_madt_entry *)p;
+        if (e->length < sizeof(*e) || p + e->length > end) break;
+        if (e->type == MADT_TYPE_LAPIC && e->length >= sizeof(struct acpi_madt_lapic)) {
+            struct acpi_madt_lapic *l = (struct acpi_madt_lapic *)e;
+            if ((l->flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) && count < max) {
+                ids[count++] = l->apic_id;
+            }
+        }
+        p += e->length;
+    }
+    return count;
+}
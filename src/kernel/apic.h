@@ -0,0 +1,53 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1ULL << 11)
+#define APIC_BASE_ADDR_MASK 0xFFFFFF000ULL
+
+// local APIC registers, offsets into its 4 KiB MMIO page
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_ICR_LO 0x300
+#define LAPIC_ICR_HI 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// LVT timer entry
+#define LVT_MASKED (1 << 16)
+#define LVT_TIMER_PERIODIC (1 << 17)
+#define LAPIC_TIMER_DIV16 0x3
+#define LAPIC_TIMER_CALIBRATE_US 10000
+
+// ICR: delivery mode, level and status
+#define ICR_FIXED 0x000
+#define ICR_INIT 0x500
+#define ICR_STARTUP 0x600
+#define ICR_ASSERT 0x4000
+#define ICR_PENDING 0x1000
+#define ICR_DEST_SHIFT 24
+
+void lapic_init(void);
+void lapic_cpu_init(void);
+int lapic_present(void);
+uint8_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+void lapic_send_init(uint8_t apic_id);
+void lapic_send_startup(uint8_t apic_id, uint8_t page);
+void lapic_timer_start(uint8_t vector, uint32_t hz);
+void lapic_timer_stop(void);
+uint64_t lapic_timer_hz(void);
+int madt_cpu_apic_ids(uint8_t *ids, int max);
+
+#endif
@@ -0,0 +1,758 @@
+#include "ata.h"
+#include "block.h"
+#include "interrupts.h"
+#include "mmu.h"
+#include "pci.h"
+#include "printk.h"
+#include "string.h"
+#include "tsc.h"
+
+// ATA disks on the primary IDE channel, LBA48 PIO and bus master DMA
+
+static inline void outb(uint16_t port, uint8_t val) {
+    asm volatile ( "outb %0, %1" : : "a"(val), "Nd"(port) );
+}
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    asm volatile ( "inb %1, %0"
+                    : "=a"(ret)
+                    : "Nd"(port) );
+    return ret;
+}
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile ( "outl %0, %1" : : "a"(val), "Nd"(port) );
+}
+static inline void insw(uint16_t port, void *buf, uint32_t count) {
+    asm volatile ( "rep insw"
+                    : "+D"(buf), "+c"(count)
+                    : "d"(port)
+                    : "memory" );
+}
+static inline void outsw(uint16_t port, const void *buf, uint32_t count) {
+    asm volatile ( "rep outsw"
+                    : "+S"(buf), "+c"(count)
+                    : "d"(port)
+                    : "memory" );
+}
+
+static inline int are_interrupts_enabled() {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0"
+                     : "=r"(flags));
+    return flags & 0x200; // Check IF (Interrupt Flag) bit
+}
+
+static struct ata_drive drives[ATA_NUM_DRIVES];
+
+// bus master registers of the primary channel, 0 when there is no PCI IDE controller
+static uint16_t bmide_base = 0;
+static struct ata_prd *prdt = NULL;
+static uint64_t prdt_phys = 0;
+// for buffers the controller can't reach (above 4 GiB, odd addresses, too fragmented)
+static uint8_t *bounce = NULL;
+static uint64_t bounce_phys = 0;
+
+// request queue, the head is on the wire while active is set
+static struct ata_request *queue[ATA_QUEUE_SIZE];
+static int queue_head = 0, queue_count = 0;
+static struct ata_request *volatile active = NULL;
+static int active_bounced = 0;
+// set while a PIO transfer owns the channel, DMA requests wait in the queue
+static volatile int pio_busy = 0;
+
+/*-------------------Task file-------------------*/
+
+// each status read takes ~100ns, the drive needs 400ns after a select
+static void ata_delay400(void) {
+    for (int i = 0; i < 4; i++) {
+        inb(ATA_PRIMARY_CTRL);
+    }
+}
+
+static void ata_select(int drive) {
+    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, ATA_DRIVE_LBA | (drive ? ATA_DRIVE_SLAVE : 0));
+    ata_delay400();
+}
+
+static int ata_wait_not_busy(uint64_t timeout_us) {
+    uint64_t deadline = TSC_deadline_us(timeout_us);
+    while (inb(ATA_PRIMARY_CTRL) & ATA_SR_BSY) {
+        if (TSC_expired(deadline)) {
+            return ATA_ERR_TIMEOUT;
+        }
+    }
+    return ATA_OK;
+}
+
+// waits for the drive to want data (DRQ) or report an error
+static int ata_wait_drq(uint64_t timeout_us) {
+    uint64_t deadline = TSC_deadline_us(timeout_us);
+    while (1) {
+        uint8_t status = inb(ATA_PRIMARY_CTRL);
+        if (!(status & ATA_SR_BSY)) {
+            if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+                return ATA_ERR_DEVICE;
+            }
+            if (status & ATA_SR_DRQ) {
+                return ATA_OK;
+            }
+        }
+        if (TSC_expired(deadline)) {
+            return ATA_ERR_TIMEOUT;
+        }
+    }
+}
+
+// high bytes go first, the registers are two deep in LBA48 mode
+static void ata_setup_lba48(int drive, uint64_t lba, uint32_t count) {
+    ata_select(drive);
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, (count >> 8) & 0xFF);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, (lba >> 24) & 0xFF);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (lba >> 32) & 0xFF);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, (lba >> 40) & 0xFF);
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, count & 0xFF);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, lba & 0xFF);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, (lba >> 16) & 0xFF);
+}
+
+static int ata_check_request(int drive, uint64_t lba, uint32_t count) {
+    if (drive < 0 || drive >= ATA_NUM_DRIVES || !drives[drive].present) {
+        return ATA_ERR_NODEV;
+    }
+    if (count == 0 || count > ATA_MAX_SECTORS || lba + count > drives[drive].sectors) {
+        return ATA_ERR_INVAL;
+    }
+    return ATA_OK;
+}
+
+/*-------------------Identify-------------------*/
+
+static void ata_identify(int drive) {
+    struct ata_drive *d = &drives[drive];
+    uint16_t id[256];
+
+    ata_select(drive);
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, 0);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, 0);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, 0);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, 0);
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    if (inb(ATA_PRIMARY_IO + ATA_REG_STATUS) == 0) {
+        return;
+    }
+    if (ata_wait_not_busy(ATA_IDENTIFY_TIMEOUT_US) != ATA_OK) {
+        printk("ATA drive %d: IDENTIFY timed out\n", drive);
+        return;
+    }
+    // ATAPI and SATA devices put their signature here and abort the command
+    if (inb(ATA_PRIMARY_IO + ATA_REG_LBA_MID) || inb(ATA_PRIMARY_IO + ATA_REG_LBA_HI)) {
+        printk("ATA drive %d: not an ATA disk (ATAPI?), ignoring\n", drive);
+        return;
+    }
+    if (ata_wait_drq(ATA_IDENTIFY_TIMEOUT_US) != ATA_OK) {
+        return;
+    }
+    insw(ATA_PRIMARY_IO + ATA_REG_DATA, id, 256);
+
+    d->drive = drive;
+    d->lba48 = (id[ATA_ID_COMMAND_SETS] & ATA_CMDSET_LBA48) != 0;
+    d->dma = (id[ATA_ID_CAPABILITIES] & ATA_CAP_DMA) != 0;
+    if (d->lba48) {
+        d->sectors = (uint64_t)id[ATA_ID_LBA48_SECTORS] |
+                     ((uint64_t)id[ATA_ID_LBA48_SECTORS + 1] << 16) |
+                     ((uint64_t)id[ATA_ID_LBA48_SECTORS + 2] << 32) |
+                     ((uint64_t)id[ATA_ID_LBA48_SECTORS + 3] << 48);
+    } else {
+        d->sectors = id[ATA_ID_LBA28_SECTORS] | ((uint32_t)id[ATA_ID_LBA28_SECTORS + 1] << 16);
+    }
+    // the model string is stored with the bytes of each word swapped
+    for (int i = 0; i < ATA_ID_MODEL_LEN / 2; i++) {
+        d->model[i * 2] = id[ATA_ID_MODEL + i] >> 8;
+        d->model[i * 2 + 1] = id[ATA_ID_MODEL + i] & 0xFF;
+    }
+    int len = ATA_ID_MODEL_LEN;
+    while (len > 0 && d->model[len - 1] == ' ') {
+        len--;
+    }
+    d->model[len] = '\0';
+
+    if (!d->lba48) {
+        // every command here is an LBA48 one
+        printk("ATA drive %d: %s has no LBA48 support, ignoring\n", drive, d->model);
+        return;
+    }
+    d->present = 1;
+    printk("ATA drive %d: %s, %lu sectors (%lu MB)%s\n", drive, d->model, d->sectors,
+           d->sectors * ATA_SECTOR_SIZE / (1024 * 1024), d->dma ? ", DMA" : "");
+}
+
+/*-------------------PIO-------------------*/
+
+// takes the channel away from the DMA queue for a polled transfer
+static int ata_pio_begin(void) {
+    uint64_t deadline = TSC_deadline_us(ATA_TIMEOUT_US);
+    while (1) {
+        int enable_ints = 0;
+        if (are_interrupts_enabled()) {
+            enable_ints = 1;
+            __asm__ volatile("cli");
+        }
+        int got = !active && !pio_busy;
+        if (got) {
+            pio_busy = 1;
+        }
+        if (enable_ints) {
+            __asm__ volatile("sti");
+        }
+        if (got) break;
+        if (TSC_expired(deadline)) {
+            return ATA_ERR_TIMEOUT;
+        }
+        __asm__ volatile("pause");
+    }
+    // polled, no IRQ14 per sector
+    outb(ATA_PRIMARY_CTRL, ATA_CTRL_NIEN);
+    return ATA_OK;
+}
+
+static void ata_start_next(void);
+
+static void ata_pio_end(void) {
+    outb(ATA_PRIMARY_CTRL, 0);
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    pio_busy = 0;
+    ata_start_next();
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
+static int ata_pio_transfer(int drive, uint64_t lba, uint32_t count, void *buf, int write) {
+    int ret = ata_check_request(drive, lba, count);
+    if (ret != ATA_OK) return ret;
+    ret = ata_pio_begin();
+    if (ret != ATA_OK) return ret;
+
+    ret = ata_wait_not_busy(ATA_TIMEOUT_US);
+    if (ret == ATA_OK) {
+        ata_setup_lba48(drive, lba, count);
+        outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_READ_PIO_EXT);
+        uint8_t *p = buf;
+        for (uint32_t i = 0; i < count; i++) {
+            ata_delay400();
+            ret = ata_wait_drq(ATA_TIMEOUT_US);
+            if (ret != ATA_OK) break;
+            if (write) {
+                outsw(ATA_PRIMARY_IO + ATA_REG_DATA, p, ATA_SECTOR_SIZE / 2);
+            } else {
+                insw(ATA_PRIMARY_IO + ATA_REG_DATA, p, ATA_SECTOR_SIZE / 2);
+            }
+            p += ATA_SECTOR_SIZE;
+        }
+        if (ret == ATA_OK && write) {
+            ret = ata_wait_not_busy(ATA_TIMEOUT_US);
+        }
+    }
+
+    if (ret != ATA_OK) {
+        printk("ATA drive %d: PIO %s of lba %lu failed (%d, error 0x%x)\n", drive,
+               write ? "write" : "read", lba, ret, inb(ATA_PRIMARY_IO + ATA_REG_ERROR));
+    }
+    ata_pio_end();
+    return ret;
+}
+
+int ata_read_pio(int drive, uint64_t lba, uint32_t count, void *buf) {
+    return ata_pio_transfer(drive, lba, count, buf, 0);
+}
+
+int ata_write_pio(int drive, uint64_t lba, uint32_t count, const void *buf) {
+    return ata_pio_transfer(drive, lba, count, (void *)buf, 1);
+}
+
+int ata_flush(int drive) {
+    if (drive < 0 || drive >= ATA_NUM_DRIVES || !drives[drive].present) {
+        return ATA_ERR_NODEV;
+    }
+    int ret = ata_pio_begin();
+    if (ret != ATA_OK) return ret;
+    ata_select(drive);
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH_EXT);
+    ata_delay400();
+    ret = ata_wait_not_busy(ATA_TIMEOUT_US);
+    if (ret == ATA_OK && (inb(ATA_PRIMARY_IO + ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF))) {
+        ret = ATA_ERR_DEVICE;
+    }
+    ata_pio_end();
+    return ret;
+}
+
+/*-------------------DMA-------------------*/
+
+// one descriptor per physically contiguous run, split at 64 KiB boundaries
+static int ata_add_prd(int n, uint64_t phys, uint32_t len) {
+    while (len > 0) {
+        uint32_t chunk = 0x10000 - (phys & 0xFFFF);
+        if (chunk > len) chunk = len;
+        struct ata_prd *prev = (n > 0) ? &prdt[n - 1] : NULL;
+        uint32_t prev_len = (prev && prev->bytes) ? prev->bytes : 0x10000;
+        if (prev && prev->phys + prev_len == phys && (prev->phys >> 16) == (phys >> 16)) {
+            // a byte count of 0 means a full 64 KiB
+            prev->bytes = (prev_len + chunk) & 0xFFFF;
+        } else {
+            if (n == ATA_PRD_MAX) return -1;
+            prdt[n].phys = phys;
+            prdt[n].bytes = chunk & 0xFFFF;
+            prdt[n].flags = 0;
+            n++;
+        }
+        phys += chunk;
+        len -= chunk;
+    }
+    return n;
+}
+
+// fills the PRD table straight from buf, returns 0 if buf can't be used directly
+static int ata_build_prdt(void *buf, uint32_t len) {
+    if ((uint64_t)buf & 1) return 0;
+    int n = 0;
+    uint8_t *p = buf;
+    struct pt_walker w;
+    pt_walker_init(&w, NULL);
+    while (len > 0) {
+        uint32_t chunk = PAGE_SIZE - ((uint64_t)p & (PAGE_SIZE - 1));
+        if (chunk > len) chunk = len;
+        // faults in demand paged buffers before asking for their frames
+        *(volatile uint8_t *)p;
+        uint64_t phys = virt_to_phys_cached(&w, p);
+        if (phys == 0 || phys + chunk > 0x100000000ULL) return 0;
+        n = ata_add_prd(n, phys, chunk);
+        if (n < 0) return 0;
+        p += chunk;
+        len -= chunk;
+    }
+    prdt[n - 1].flags = ATA_PRD_EOT;
+    return 1;
+}
+
+// called with interrupts off
+static int ata_start_dma(struct ata_request *req) {
+    uint32_t len = req->count * ATA_SECTOR_SIZE;
+    active_bounced = !ata_build_prdt(req->buf, len);
+    if (active_bounced) {
+        int n = ata_add_prd(0, bounce_phys, len);
+        prdt[n - 1].flags = ATA_PRD_EOT;
+        if (req->write) {
+            memcpy(bounce, req->buf, len);
+        }
+    }
+
+    uint8_t status = inb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+    if (status & (ATA_SR_BSY | ATA_SR_DRQ)) {
+        return ATA_ERR_DEVICE;
+    }
+    outb(bmide_base + BMIDE_REG_COMMAND, 0);
+    outl(bmide_base + BMIDE_REG_PRDT, (uint32_t)prdt_phys);
+    // IRQ and error bits are write-one-to-clear
+    outb(bmide_base + BMIDE_REG_STATUS, inb(bmide_base + BMIDE_REG_STATUS) | BMIDE_SR_IRQ | BMIDE_SR_ERR);
+    outb(bmide_base + BMIDE_REG_COMMAND, req->write ? 0 : BMIDE_CMD_READ);
+
+    ata_setup_lba48(req->drive, req->lba, req->count);
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    outb(bmide_base + BMIDE_REG_COMMAND, BMIDE_CMD_START | (req->write ? 0 : BMIDE_CMD_READ));
+    active = req;
+    return ATA_OK;
+}
+
+static void ata_finish(struct ata_request *req, int status) {
+    req->status = status;
+    req->done = 1;
+    if (req->callback) {
+        req->callback(req);
+    }
+}
+
+// called with interrupts off
+static void ata_complete_active(int status) {
+    struct ata_request *req = active;
+    outb(bmide_base + BMIDE_REG_COMMAND, 0);
+    active = NULL;
+    if (status == ATA_OK && active_bounced && !req->write) {
+        memcpy(req->buf, bounce, req->count * ATA_SECTOR_SIZE);
+    }
+    ata_finish(req, status);
+}
+
+// called with interrupts off
+static void ata_start_next(void) {
+    while (!active && !pio_busy && queue_count > 0) {
+        struct ata_request *req = queue[queue_head];
+        queue_head = (queue_head + 1) % ATA_QUEUE_SIZE;
+        queue_count--;
+        int ret = ata_start_dma(req);
+        if (ret != ATA_OK) {
+            ata_finish(req, ret);
+        }
+    }
+}
+
+int ata_submit(struct ata_request *req) {
+    if (!bmide_base) return ATA_ERR_NODEV;
+    int ret = ata_check_request(req->drive, req->lba, req->count);
+    if (ret != ATA_OK) return ret;
+    req->done = 0;
+    req->status = ATA_OK;
+
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    if (queue_count == ATA_QUEUE_SIZE) {
+        ret = ATA_ERR_FULL;
+    } else {
+        queue[(queue_head + queue_count) % ATA_QUEUE_SIZE] = req;
+        queue_count++;
+        ata_start_next();
+    }
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+    return ret;
+}
+
+// waits for one request, stopping the engine if the drive never interrupts
+static int ata_wait(struct ata_request *req) {
+    uint64_t deadline = TSC_deadline_us(ATA_TIMEOUT_US);
+    while (!req->done) {
+        if (TSC_expired(deadline)) {
+            int enable_ints = 0;
+            if (are_interrupts_enabled()) {
+                enable_ints = 1;
+                __asm__ volatile("cli");
+            }
+            if (!req->done && active == req) {
+                printk("ATA drive %d: DMA at lba %lu timed out\n", req->drive, req->lba);
+                ata_complete_active(ATA_ERR_TIMEOUT);
+                ata_start_next();
+            }
+            if (enable_ints) {
+                __asm__ volatile("sti");
+            }
+            // still queued behind someone else's transfer
+            deadline = TSC_deadline_us(ATA_TIMEOUT_US);
+        }
+        __asm__ volatile("pause");
+    }
+    return req->status;
+}
+
+static int ata_dma_transfer(int drive, uint64_t lba, uint32_t count, void *buf, int write) {
+    struct ata_request req = {
+        .drive = drive,
+        .write = write,
+        .lba = lba,
+        .count = count,
+        .buf = buf,
+    };
+    int ret = ata_submit(&req);
+    if (ret != ATA_OK) return ret;
+    return ata_wait(&req);
+}
+
+int ata_read_dma(int drive, uint64_t lba, uint32_t count, void *buf) {
+    return ata_dma_transfer(drive, lba, count, buf, 0);
+}
+
+int ata_write_dma(int drive, uint64_t lba, uint32_t count, const void *buf) {
+    return ata_dma_transfer(drive, lba, count, (void *)buf, 1);
+}
+
+void ata_interrupt_handler(int irq, int error_code, void* arg) {
+    (void)irq;
+    (void)error_code;
+    (void)arg;
+    if (!active) {
+        // reading status acknowledges a stray interrupt
+        inb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+        return;
+    }
+    uint8_t bm_status = inb(bmide_base + BMIDE_REG_STATUS);
+    if (!(bm_status & BMIDE_SR_IRQ)) {
+        return;
+    }
+    uint8_t status = inb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+    outb(bmide_base + BMIDE_REG_STATUS, bm_status | BMIDE_SR_IRQ | BMIDE_SR_ERR);
+    int ret = ATA_OK;
+    if ((bm_status & BMIDE_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+        printk("ATA drive %d: DMA error (status 0x%x, bus master 0x%x)\n",
+               active->drive, status, bm_status);
+        ret = ATA_ERR_DEVICE;
+    }
+    ata_complete_active(ret);
+    ata_start_next();
+}
+
+/*-------------------Block device-------------------*/
+
+// one block request per drive at a time, its runs go out back to back from the completion callback
+struct ata_blk {
+    struct block_device bdev;
+    int drive;
+    struct ata_request areq;
+    struct block_request *req;
+    struct blk_cursor cur;
+    uint64_t lba;
+};
+
+static struct ata_blk ata_blks[ATA_NUM_DRIVES];
+
+static void ata_blk_finish(struct ata_blk *ab, int status) {
+    struct block_request *req = ab->req;
+    ab->req = NULL;
+    blk_request_done(&ab->bdev, req, status);
+}
+
+static void ata_blk_done(struct ata_request *areq);
+
+static void ata_blk_next(struct ata_blk *ab) {
+    while (1) {
+        void *buf;
+        uint32_t bytes = blk_cursor_next(&ab->cur, ATA_MAX_SECTORS * ATA_SECTOR_SIZE, &buf);
+        if (bytes == 0) {
+            ata_blk_finish(ab, BLOCK_OK);
+            return;
+        }
+        int write = ab->req->dir == BIO_WRITE;
+        uint32_t count = bytes / ATA_SECTOR_SIZE;
+        uint64_t lba = ab->lba;
+        ab->lba += count;
+
+        if (ata_dma_available()) {
+            ab->areq.drive = ab->drive;
+            ab->areq.write = write;
+            ab->areq.lba = lba;
+            ab->areq.count = count;
+            ab->areq.buf = buf;
+            ab->areq.callback = ata_blk_done;
+            ab->areq.arg = ab;
+            if (ata_submit(&ab->areq) != ATA_OK) {
+                ata_blk_finish(ab, BLOCK_ERR_IO);
+            }
+            return;
+        }
+        // polled, fine from interrupt context since no DMA can be in flight
+        int ret = write ? ata_write_pio(ab->drive, lba, count, buf) : ata_read_pio(ab->drive, lba, count, buf);
+        if (ret != ATA_OK) {
+            ata_blk_finish(ab, BLOCK_ERR_IO);
+            return;
+        }
+    }
+}
+
+static void ata_blk_done(struct ata_request *areq) {
+    struct ata_blk *ab = areq->arg;
+    if (areq->status != ATA_OK) {
+        ata_blk_finish(ab, BLOCK_ERR_IO);
+    } else {
+        ata_blk_next(ab);
+    }
+}
+
+static int ata_blk_submit(struct block_device *dev, struct block_request *req) {
+    struct ata_blk *ab = dev->driver_data;
+    ab->req = req;
+    ab->lba = req->sector;
+    blk_cursor_init(&ab->cur, req);
+    ata_blk_next(ab);
+    return BLOCK_OK;
+}
+
+static const struct block_device_ops ata_blk_ops = {
+    .submit = ata_blk_submit,
+};
+
+static void ata_register_block(int drive) {
+    struct ata_blk *ab = &ata_blks[drive];
+    strcpy(ab->bdev.name, drive ? "hdb" : "hda");
+    ab->bdev.sectors = drives[drive].sectors;
+    ab->bdev.max_inflight = 1;
+    ab->bdev.ops = &ata_blk_ops;
+    ab->bdev.driver_data = ab;
+    ab->drive = drive;
+    blk_register(&ab->bdev);
+}
+
+/*-------------------Init-------------------*/
+
+static int ide_probe(struct pci_dev *dev) {
+    // native mode channels move off the legacy ports, not handled
+    if (dev->prog_if & 0x01) {
+        printk("IDE controller in native mode, DMA disabled\n");
+        return -1;
+    }
+    if (!dev->bars[4].is_io || !dev->bars[4].io_port || !(dev->prog_if & 0x80)) {
+        printk("IDE controller has no bus master support\n");
+        return -1;
+    }
+    prdt = MMU_dma_alloc(1, &prdt_phys);
+    bounce = MMU_dma_alloc(ATA_MAX_SECTORS * ATA_SECTOR_SIZE / PAGE_SIZE, &bounce_phys);
+    if (!prdt || !bounce) {
+        return -1;
+    }
+    pci_enable(dev, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+    bmide_base = dev->bars[4].io_port;
+    printk("IDE bus master at io 0x%x\n", bmide_base);
+    return 0;
+}
+
+static const struct pci_driver ide_driver = {
+    .name = "ide",
+    .vendor = PCI_ANY_ID,
+    .device = PCI_ANY_ID,
+    .class_code = PCI_CLASS_STORAGE,
+    .subclass = PCI_SUBCLASS_IDE,
+    .probe = ide_probe,
+};
+
+// returns the number of usable drives on the primary channel
+int ata_init(void) {
+    // nothing decodes the ports
+    if (inb(ATA_PRIMARY_IO + ATA_REG_STATUS) == 0xFF) {
+        printk("No ATA controller on the primary channel\n");
+        return 0;
+    }
+    outb(ATA_PRIMARY_CTRL, ATA_CTRL_SRST | ATA_CTRL_NIEN);
+    TSC_delay_us(5);
+    outb(ATA_PRIMARY_CTRL, ATA_CTRL_NIEN);
+    TSC_delay_us(2000);
+    if (ata_wait_not_busy(ATA_TIMEOUT_US) != ATA_OK) {
+        printk("ATA channel stuck busy after reset\n");
+        return 0;
+    }
+
+    int found = 0;
+    for (int drive = 0; drive < ATA_NUM_DRIVES; drive++) {
+        ata_identify(drive);
+        found += drives[drive].present;
+    }
+    if (!found) {
+        printk("No ATA disks found\n");
+        return 0;
+    }
+
+    pci_register_driver(&ide_driver);
+    IRQ_set_handler(ATA_PRIMARY_IRQ, ata_interrupt_handler, NULL);
+    IRQ_clear_mask(2);  // cascade
+    IRQ_clear_mask(ATA_PRIMARY_IRQ);
+    outb(ATA_PRIMARY_CTRL, 0);
+    for (int drive = 0; drive < ATA_NUM_DRIVES; drive++) {
+        if (drives[drive].present) {
+            ata_register_block(drive);
+        }
+    }
+    return found;
+}
+
+struct ata_drive *ata_get_drive(int drive) {
+    if (drive < 0 || drive >= ATA_NUM_DRIVES || !drives[drive].present) return NULL;
+    return &drives[drive];
+}
+
+int ata_dma_available(void) {
+    return bmide_base != 0;
+}
+
+/*-------------------Benchmark-------------------*/
+
+static uint64_t bench_rand_state = 0x2545F4914F6CDD1DULL;
+
+static uint64_t bench_rand(void) {
+    // xorshift64
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+typedef int (*ata_read_fn)(int drive, uint64_t lba, uint32_t count, void *buf);
+
+static void bench_report(const char *name, uint64_t bytes, uint64_t ops, uint64_t cycles) {
+    uint64_t us = TSC_cycles_to_us(cycles);
+    if (us == 0) us = 1;
+    // bytes per microsecond is MB/s
+    uint64_t mbps_x10 = bytes * 10 / us;
+    printk("  %s: %lu KB in %lu us, %lu.%lu MB/s, %lu IOPS\n", name, bytes / 1024, us,
+           mbps_x10 / 10, mbps_x10 % 10, ops * 1000000 / us);
+}
+
+static int bench_sequential(const char *name, ata_read_fn read, int drive, uint8_t *buf, uint64_t total_sectors) {
+    uint64_t ops = 0;
+    uint64_t start = rdtsc();
+    for (uint64_t lba = 0; lba < total_sectors; lba += ATA_MAX_SECTORS) {
+        uint32_t count = (total_sectors - lba < ATA_MAX_SECTORS) ? total_sectors - lba : ATA_MAX_SECTORS;
+        if (read(drive, lba, count, buf) != ATA_OK) return -1;
+        ops++;
+    }
+    bench_report(name, total_sectors * ATA_SECTOR_SIZE, ops, rdtsc() - start);
+    return 0;
+}
+
+static int bench_random(const char *name, ata_read_fn read, int drive, uint8_t *buf, uint64_t total_sectors) {
+    uint32_t count = PAGE_SIZE / ATA_SECTOR_SIZE;
+    uint64_t slots = total_sectors / count;
+    bench_rand_state = 0x2545F4914F6CDD1DULL;  // same offsets for every mode
+    uint64_t start = rdtsc();
+    for (int i = 0; i < ATA_BENCH_RANDOM_OPS; i++) {
+        uint64_t lba = (bench_rand() % slots) * count;
+        if (read(drive, lba, count, buf) != ATA_OK) return -1;
+    }
+    bench_report(name, (uint64_t)ATA_BENCH_RANDOM_OPS * PAGE_SIZE, ATA_BENCH_RANDOM_OPS, rdtsc() - start);
+    return 0;
+}
+
+// sequential 128 KiB and random 4 KiB reads, PIO against DMA
+void ata_benchmark(int drive) {
+    struct ata_drive *d = ata_get_drive(drive);
+    if (!d) return;
+    int buf_pages = ATA_MAX_SECTORS * ATA_SECTOR_SIZE / PAGE_SIZE;
+    uint8_t *buf = MMU_dma_alloc(buf_pages, NULL);
+    uint8_t *check = MMU_alloc_pages(buf_pages);
+    if (!buf || !check) {
+        printk("ATA benchmark: no buffers\n");
+        if (buf) MMU_dma_free(buf, buf_pages);
+        if (check) MMU_free_pages(check, buf_pages);
+        return;
+    }
+    uint64_t sectors = ATA_BENCH_SEQ_BYTES / ATA_SECTOR_SIZE;
+    if (sectors > d->sectors) sectors = d->sectors;
+
+    printk("ATA benchmark on drive %d (%s)\n", drive, d->model);
+    if (bench_sequential("PIO sequential", ata_read_pio, drive, buf, sectors) ||
+        bench_random("PIO random 4K", ata_read_pio, drive, buf, sectors)) {
+        printk("ATA benchmark: PIO read failed\n");
+    }
+    if (!ata_dma_available()) {
+        printk("  DMA: not available\n");
+    } else if (bench_sequential("DMA sequential", ata_read_dma, drive, buf, sectors) ||
+               bench_random("DMA random 4K", ata_read_dma, drive, buf, sectors)) {
+        printk("ATA benchmark: DMA read failed\n");
+    } else {
+        // both paths have to agree on the data
+        uint32_t count = ATA_MAX_SECTORS;
+        if (count > sectors) count = sectors;
+        if (ata_read_pio(drive, 0, count, check) != ATA_OK ||
+            ata_read_dma(drive, 0, count, buf) != ATA_OK ||
+            memcmp(check, buf, count * ATA_SECTOR_SIZE) != 0) {
+            printk("ATA benchmark: PIO and DMA data differ\n");
+        }
+    }
+    MMU_dma_free(buf, buf_pages);
+    MMU_free_pages(check, buf_pages);
+}
@@ -0,0 +1,129 @@
+#ifndef ATA_H
+#define ATA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// primary channel (legacy ports, IRQ14)
+#define ATA_PRIMARY_IO 0x1F0
+#define ATA_PRIMARY_CTRL 0x3F6
+#define ATA_PRIMARY_IRQ 14
+
+// task file registers, offsets from the io base
+#define ATA_REG_DATA 0x00
+#define ATA_REG_ERROR 0x01
+#define ATA_REG_FEATURES 0x01
+#define ATA_REG_SECCOUNT 0x02
+#define ATA_REG_LBA_LO 0x03
+#define ATA_REG_LBA_MID 0x04
+#define ATA_REG_LBA_HI 0x05
+#define ATA_REG_DRIVE 0x06
+#define ATA_REG_STATUS 0x07
+#define ATA_REG_COMMAND 0x07
+
+// status register
+#define ATA_SR_ERR 0x01
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_DF 0x20
+#define ATA_SR_DRDY 0x40
+#define ATA_SR_BSY 0x80
+
+// device control register
+#define ATA_CTRL_NIEN 0x02      // no interrupts
+#define ATA_CTRL_SRST 0x04      // software reset
+
+// drive/head register
+#define ATA_DRIVE_LBA 0xE0      // LBA mode, bits 5 and 7 always set
+#define ATA_DRIVE_SLAVE 0x10
+
+#define ATA_CMD_READ_PIO_EXT 0x24
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_CACHE_FLUSH_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+
+// IDENTIFY words
+#define ATA_ID_MODEL 27
+#define ATA_ID_MODEL_LEN 40
+#define ATA_ID_CAPABILITIES 49
+#define ATA_ID_LBA28_SECTORS 60
+#define ATA_ID_COMMAND_SETS 83
+#define ATA_ID_LBA48_SECTORS 100
+#define ATA_CAP_DMA (1 << 8)
+#define ATA_CMDSET_LBA48 (1 << 10)
+
+// bus master IDE registers (BAR4 of the IDE controller), primary channel
+#define BMIDE_REG_COMMAND 0x00
+#define BMIDE_REG_STATUS 0x02
+#define BMIDE_REG_PRDT 0x04
+#define BMIDE_CMD_START 0x01
+#define BMIDE_CMD_READ 0x08     // device to memory
+#define BMIDE_SR_ACTIVE 0x01
+#define BMIDE_SR_ERR 0x02
+#define BMIDE_SR_IRQ 0x04
+
+// physical region descriptor, one contiguous chunk that may not cross 64 KiB
+struct ata_prd {
+    uint32_t phys;
+    uint16_t bytes;         // 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed));
+#define ATA_PRD_EOT 0x8000
+#define ATA_PRD_MAX 512     // one page of descriptors
+
+#define ATA_SECTOR_SIZE 512
+#define ATA_MODEL_STR_LEN (ATA_ID_MODEL_LEN + 1)
+#define ATA_MAX_SECTORS 256             // per command, also the size of the bounce buffer
+#define ATA_NUM_DRIVES 2
+#define ATA_QUEUE_SIZE 16
+#define ATA_TIMEOUT_US 1000000          // BSY/DRQ and DMA completion
+#define ATA_IDENTIFY_TIMEOUT_US 100000
+#define ATA_BENCH_SEQ_BYTES (4 * 1024 * 1024)
+#define ATA_BENCH_RANDOM_OPS 256       // 4 KiB reads at random offsets
+
+#define ATA_OK 0
+#define ATA_ERR_TIMEOUT -1
+#define ATA_ERR_DEVICE -2
+#define ATA_ERR_NODEV -3
+#define ATA_ERR_FULL -4
+#define ATA_ERR_INVAL -5
+
+struct ata_drive {
+    int present;
+    int drive;              // 0 master, 1 slave
+    int lba48;
+    int dma;
+    uint64_t sectors;
+    char model[ATA_MODEL_STR_LEN];
+};
+
+struct ata_request;
+typedef void (*ata_done_t)(struct ata_request *req);
+
+// asynchronous request, completed from the IRQ14 handler
+struct ata_request {
+    int drive;
+    int write;
+    uint64_t lba;
+    uint32_t count;         // sectors, at most ATA_MAX_SECTORS
+    void *buf;
+    volatile int status;    // ATA_OK or ATA_ERR_*, valid once done is set
+    volatile int done;
+    ata_done_t callback;    // may be NULL, runs in interrupt context
+    void *arg;
+};
+
+int ata_init(void);
+struct ata_drive *ata_get_drive(int drive);
+int ata_dma_available(void);
+int ata_read_pio(int drive, uint64_t lba, uint32_t count, void *buf);
+int ata_write_pio(int drive, uint64_t lba, uint32_t count, const void *buf);
+int ata_submit(struct ata_request *req);
+int ata_read_dma(int drive, uint64_t lba, uint32_t count, void *buf);
+int ata_write_dma(int drive, uint64_t lba, uint32_t count, const void *buf);
+int ata_flush(int drive);
+void ata_interrupt_handler(int irq, int error_code, void* arg);
+void ata_benchmark(int drive);
+
+#endif
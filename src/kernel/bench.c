@@ -0,0 +1,132 @@
+#include "bench.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "tsc.h"
+#include "printk.h"
+#include "string.h"
+
+// runs every registered benchmark with warmup and repetitions and prints one line per benchmark:
+//   BENCH name=<name> reps=<n> min=<cycles> median=<cycles> p99=<cycles> unit=cycles
+// between BENCH-START and BENCH-DONE lines, the Makefile bench target greps them out of COM1. A
+// benchmark that called bench_fail gets a BENCH-FAIL line instead and the run exits with failure
+
+static uint64_t samples[BENCH_MAX_REPS];
+static const char *fail_reason = NULL;
+
+static inline void outb(uint16_t port, uint8_t val) {
+    asm volatile ( "outb %0, %1" : : "a"(val), "Nd"(port) );
+}
+
+// shell sort, the sample arrays are small
+static void sort_samples(uint64_t *s, int n) {
+    for (int gap = n / 2; gap > 0; gap /= 2) {
+        for (int i = gap; i < n; i++) {
+            uint64_t tmp = s[i];
+            int j = i;
+            while (j >= gap && s[j - gap] > tmp) {
+                s[j] = s[j - gap];
+                j -= gap;
+            }
+            s[j] = tmp;
+        }
+    }
+}
+
+// the running benchmark's iteration went wrong, it stops after that iteration
+void bench_fail(const char *why) {
+    fail_reason = why;
+}
+
+// 0 once every repetition ran, -1 if one failed
+static int run_bench(const struct bench *b) {
+    int reps = b->reps;
+    if (reps <= 0 || reps > BENCH_MAX_REPS) reps = BENCH_MAX_REPS;
+    int warmup = reps < BENCH_WARMUP ? reps : BENCH_WARMUP;
+    fail_reason = NULL;
+    for (int i = 0; i < warmup && !fail_reason; i++) {
+        b->fn();
+    }
+    for (int i = 0; i < reps && !fail_reason; i++) {
+        uint64_t start = rdtsc();
+        b->fn();
+        samples[i] = rdtsc() - start;
+    }
+    if (fail_reason) {
+        printk("BENCH-FAIL name=%s %s\n", b->name, fail_reason);
+        return -1;
+    }
+    sort_samples(samples, reps);
+    printk("BENCH name=%s reps=%d min=%lu median=%lu p99=%lu unit=cycles\n", b->name, reps,
+           samples[0], samples[reps / 2], samples[(reps * 99) / 100]);
+    return 0;
+}
+
+// returns how many ran, -1 if none are registered or one failed
+int bench_run_all(void) {
+    int count = __bench_end - __bench_start;
+    int failed = 0;
+    printk("BENCH-START count=%d tsc_khz=%lu\n", count, TSC_khz());
+    for (const struct bench *b = __bench_start; b < __bench_end; b++) {
+        if (run_bench(b)) failed++;
+    }
+    printk("BENCH-DONE count=%d failed=%d\n", count, failed);
+    return count && !failed ? count : -1;
+}
+
+// leaves QEMU through isa-debug-exit, halts when the device isn't there
+void qemu_exit(uint8_t code) {
+    outb(QEMU_EXIT_PORT, code);
+    while (1) {
+        __asm__ volatile("cli");
+        __asm__ volatile("hlt");
+    }
+}
+
+/*-------------------Benchmarks-------------------*/
+
+// what a measurement costs by itself
+BENCH(null) {
+    __asm__ volatile("" ::: "memory");
+}
+
+static uint8_t copy_src[BENCH_COPY_BYTES];
+static uint8_t copy_dst[BENCH_COPY_BYTES];
+
+BENCH(memcpy_4k) {
+    memcpy(copy_dst, copy_src, BENCH_COPY_BYTES);
+}
+
+// goes out over serial and VGA like every other line
+BENCH_N(printk, BENCH_PRINTK_REPS) {
+    printk("bench: printk line\n");
+}
+
+static volatile int irq_seen;
+static int irq_vector = -1;
+
+static int bench_irq(struct interrupt_frame *frame, void *arg) {
+    (void)frame;
+    (void)arg;
+    irq_seen = 1;
+    lapic_eoi();
+    return IRQ_HANDLED;
+}
+
+// self IPI through the local APIC until its handler has run
+BENCH(irq_roundtrip) {
+    if (!lapic_present()) return;
+    if (irq_vector < 0) {
+        irq_vector = alloc_vector(bench_irq, NULL, 0);
+        if (irq_vector < 0) return;
+    }
+    irq_seen = 0;
+    lapic_send_ipi(lapic_id(), irq_vector);
+    uint64_t deadline = TSC_deadline_us(BENCH_IRQ_TIMEOUT_US);
+    while (!irq_seen) {
+        if (TSC_expired(deadline)) {
+            bench_fail("self IPI never arrived");
+            return;
+        }
+        __asm__ volatile("pause");
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// microbenchmarks: BENCH(name) { one iteration } anywhere in the kernel registers itself in the
+// .bench section, booting with "bench" on the command line runs them all and exits QEMU
+#define BENCH_WARMUP 100
+#define BENCH_REPS 1000
+#define BENCH_MAX_REPS 1000
+#define BENCH_PRINTK_REPS 100
+#define BENCH_COPY_BYTES 4096
+#define BENCH_FAULT_PAGES 4
+#define BENCH_WALK_BYTES (1ULL << 30)       // translated page by page per iteration
+#define BENCH_WALK_REPS 20
+#define BENCH_IRQ_TIMEOUT_US 100000         // a self IPI that hasn't arrived by then was lost
+
+// isa-debug-exit, QEMU exits with (code << 1) | 1
+#define QEMU_EXIT_PORT 0xF4
+#define QEMU_EXIT_SUCCESS 0x10              // status 33
+#define QEMU_EXIT_FAILURE 0x11              // status 35
+
+struct bench {
+    const char *name;
+    void (*fn)(void);
+    uint32_t reps;
+};
+
+#define BENCH_N(name, n)                                                                        \
+    static void bench_fn_##name(void);                                                          \
+    static const struct bench bench_##name                                                      \
+        __attribute__((used, section(".bench"), aligned(8))) = { #name, bench_fn_##name, n };   \
+    static void bench_fn_##name(void)
+
+#define BENCH(name) BENCH_N(name, BENCH_REPS)
+
+// linker.ld
+extern const struct bench __bench_start[];
+extern const struct bench __bench_end[];
+
+int bench_run_all(void);
+void bench_fail(const char *why);
+void qemu_exit(uint8_t code) __attribute__((noreturn));
+
+#endif
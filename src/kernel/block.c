@@ -0,0 +1,531 @@
+#include "block.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+#include "tsc.h"
+
+// block layer: bios are merged into requests, ordered by a deadline elevator and handed to drivers
+
+static inline int are_interrupts_enabled() {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0"
+                     : "=r"(flags));
+    return flags & 0x200; // Check IF (Interrupt Flag) bit
+}
+
+static struct block_device *devices[BLOCK_MAX_DEVICES];
+static int num_devices = 0;
+
+static int irq_save(void) {
+    if (are_interrupts_enabled()) {
+        __asm__ volatile("cli");
+        return 1;
+    }
+    return 0;
+}
+
+static void irq_restore(int enable_ints) {
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
+/*-------------------Devices-------------------*/
+
+int blk_register(struct block_device *dev) {
+    if (num_devices == BLOCK_MAX_DEVICES) {
+        printk("block: too many devices, dropping %s\n", dev->name);
+        return -1;
+    }
+    dev->free_reqs = NULL;
+    for (int i = BLOCK_MAX_REQUESTS - 1; i >= 0; i--) {
+        dev->pool[i].next = dev->free_reqs;
+        dev->free_reqs = &dev->pool[i];
+    }
+    dev->pending = NULL;
+    dev->npending = 0;
+    dev->inflight = 0;
+    dev->plugged = 0;
+    dev->dispatching = 0;
+    dev->head_pos = 0;
+    if (dev->max_inflight <= 0) dev->max_inflight = 1;
+    if (dev->max_segments <= 0 || dev->max_segments > BLOCK_MAX_SEGMENTS) dev->max_segments = BLOCK_MAX_SEGMENTS;
+    if (dev->max_sectors == 0) dev->max_sectors = BIO_MAX_VECS * PAGE_SIZE / BLOCK_SECTOR_SIZE;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->stats.start_tsc = rdtsc();
+    devices[num_devices++] = dev;
+    printk("block: %s, %lu sectors (%lu MB)\n", dev->name, dev->sectors,
+           dev->sectors * BLOCK_SECTOR_SIZE / (1024 * 1024));
+    return 0;
+}
+
+struct block_device *blk_get(const char *name) {
+    for (int i = 0; i < num_devices; i++) {
+        if (strcmp(devices[i]->name, name) == 0) return devices[i];
+    }
+    return NULL;
+}
+
+struct block_device *blk_get_index(int index) {
+    if (index < 0 || index >= num_devices) return NULL;
+    return devices[index];
+}
+
+/*-------------------Bios-------------------*/
+
+void bio_init(struct bio *bio, struct block_device *dev, int dir, uint64_t sector) {
+    memset(bio, 0, sizeof(*bio));
+    bio->bdev = dev;
+    bio->dir = dir;
+    bio->sector = sector;
+}
+
+int bio_add_page(struct bio *bio, void *page, uint32_t len, uint32_t offset) {
+    if (len == 0 || len % BLOCK_SECTOR_SIZE || offset % BLOCK_SECTOR_SIZE || offset + len > PAGE_SIZE) {
+        return BLOCK_ERR_INVAL;
+    }
+    struct bio_vec *last = bio->vcnt ? &bio->vecs[bio->vcnt - 1] : NULL;
+    if (last && last->page == page && last->offset + last->len == offset) {
+        last->len += len;
+    } else {
+        if (bio->vcnt == BIO_MAX_VECS) return BLOCK_ERR_NOMEM;
+        bio->vecs[bio->vcnt].page = page;
+        bio->vecs[bio->vcnt].offset = offset;
+        bio->vecs[bio->vcnt].len = len;
+        bio->vcnt++;
+    }
+    bio->size += len;
+    return BLOCK_OK;
+}
+
+static void bio_end(struct bio *bio, int status, uint64_t now) {
+    struct block_device *dev = bio->bdev;
+    uint64_t cycles = now - bio->submit_tsc;
+    dev->stats.bio_cycles += cycles;
+    if (cycles > dev->stats.max_bio_cycles) {
+        dev->stats.max_bio_cycles = cycles;
+    }
+    bio->status = status;
+    bio->done = 1;
+    if (bio->end_io) {
+        bio->end_io(bio);
+    }
+}
+
+/*-------------------Request queue-------------------*/
+
+static void queue_insert_sorted(struct block_device *dev, struct block_request *req) {
+    struct block_request **pp = &dev->pending;
+    while (*pp && (*pp)->sector <= req->sector) {
+        pp = &(*pp)->next;
+    }
+    req->next = *pp;
+    *pp = req;
+    dev->npending++;
+}
+
+static void queue_unlink(struct block_device *dev, struct block_request *req) {
+    struct block_request **pp = &dev->pending;
+    while (*pp && *pp != req) {
+        pp = &(*pp)->next;
+    }
+    if (*pp) {
+        *pp = req->next;
+        dev->npending--;
+    }
+    req->next = NULL;
+}
+
+// back or front merge into a request that hasn't been dispatched yet
+static int queue_try_merge(struct block_device *dev, struct bio *bio) {
+    uint32_t sectors = bio->size / BLOCK_SECTOR_SIZE;
+    for (struct block_request *req = dev->pending; req; req = req->next) {
+        if (req->dir != bio->dir || req->sectors + sectors > dev->max_sectors ||
+            req->nsegs + bio->vcnt > dev->max_segments) {
+            continue;
+        }
+        if (req->sector + req->sectors == bio->sector) {
+            req->bio_tail->next = bio;
+            req->bio_tail = bio;
+        } else if (bio->sector + sectors == req->sector) {
+            bio->next = req->bio_head;
+            req->bio_head = bio;
+            req->sector = bio->sector;
+        } else {
+            continue;
+        }
+        req->sectors += sectors;
+        req->nsegs += bio->vcnt;
+        dev->stats.merges++;
+        return 1;
+    }
+    return 0;
+}
+
+// C-SCAN from the last dispatched sector, unless the oldest request has expired
+static struct block_request *queue_pick(struct block_device *dev) {
+    struct block_request *oldest = dev->pending;
+    for (struct block_request *req = dev->pending; req; req = req->next) {
+        if ((int64_t)(req->deadline - oldest->deadline) < 0) {
+            oldest = req;
+        }
+    }
+    if (TSC_expired(oldest->deadline)) {
+        dev->stats.expired++;
+        return oldest;
+    }
+    for (struct block_request *req = dev->pending; req; req = req->next) {
+        if (req->sector >= dev->head_pos) {
+            return req;
+        }
+    }
+    return dev->pending;
+}
+
+// called with interrupts off
+static void queue_run(struct block_device *dev) {
+    if (dev->dispatching || dev->plugged) return;
+    // drivers may complete inside submit, this keeps that from recursing back in here
+    dev->dispatching = 1;
+    while (dev->pending && dev->inflight < dev->max_inflight) {
+        struct block_request *req = queue_pick(dev);
+        queue_unlink(dev, req);
+        dev->inflight++;
+        req->dispatch_tsc = rdtsc();
+        req->driver_pending = 0;
+        req->driver_status = BLOCK_OK;
+        dev->head_pos = req->sector + req->sectors;
+        dev->stats.requests[req->dir]++;
+        int ret = dev->ops->submit(dev, req);
+        if (ret == BLOCK_ERR_BUSY) {
+            dev->inflight--;
+            dev->stats.requests[req->dir]--;
+            queue_insert_sorted(dev, req);
+            break;
+        } else if (ret != BLOCK_OK) {
+            blk_request_done(dev, req, ret);
+        }
+    }
+    dev->dispatching = 0;
+}
+
+// drivers call this once for every request they accepted, from any context
+void blk_request_done(struct block_device *dev, struct block_request *req, int status) {
+    int enable_ints = irq_save();
+    uint64_t now = rdtsc();
+    dev->stats.driver_cycles += now - req->dispatch_tsc;
+    if (status != BLOCK_OK) {
+        dev->stats.errors++;
+        printk("block: %s %s of %u sectors at %lu failed (%d)\n", dev->name,
+               req->dir == BIO_WRITE ? "write" : "read", req->sectors, req->sector, status);
+    }
+    struct bio *bio = req->bio_head;
+    while (bio) {
+        // end_io may reuse the bio
+        struct bio *next = bio->next;
+        bio_end(bio, status, now);
+        bio = next;
+    }
+    dev->inflight--;
+    req->next = dev->free_reqs;
+    dev->free_reqs = req;
+    queue_run(dev);
+    irq_restore(enable_ints);
+}
+
+// pages are faulted in here, drivers may map them from interrupt context
+static void bio_prefault(struct bio *bio) {
+    for (int i = 0; i < bio->vcnt; i++) {
+        volatile uint8_t *p = (uint8_t *)bio->vecs[i].page + bio->vecs[i].offset;
+        if (bio->dir == BIO_READ) {
+            *p = *p;
+        } else {
+            (void)*p;
+        }
+    }
+}
+
+int blk_submit_bio(struct bio *bio) {
+    struct block_device *dev = bio->bdev;
+    if (!dev || bio->size == 0 || bio->sector + bio->size / BLOCK_SECTOR_SIZE > dev->sectors) {
+        bio->status = BLOCK_ERR_INVAL;
+        bio->done = 1;
+        return BLOCK_ERR_INVAL;
+    }
+    bio_prefault(bio);
+    bio->next = NULL;
+    bio->done = 0;
+    bio->status = BLOCK_OK;
+    bio->submit_tsc = rdtsc();
+
+    int enable_ints = irq_save();
+    dev->stats.bios[bio->dir]++;
+    dev->stats.sectors[bio->dir] += bio->size / BLOCK_SECTOR_SIZE;
+    if (!queue_try_merge(dev, bio)) {
+        // out of requests, whatever is queued has to go out first
+        uint64_t deadline = TSC_deadline_us(BLOCK_TIMEOUT_US);
+        while (!dev->free_reqs) {
+            int plugged = dev->plugged;
+            dev->plugged = 0;
+            queue_run(dev);
+            dev->plugged = plugged;
+            irq_restore(enable_ints);
+            if (TSC_expired(deadline)) {
+                printk("block: %s request queue stuck\n", dev->name);
+                bio->status = BLOCK_ERR_BUSY;
+                bio->done = 1;
+                return BLOCK_ERR_BUSY;
+            }
+            __asm__ volatile("pause");
+            enable_ints = irq_save();
+        }
+        struct block_request *req = dev->free_reqs;
+        dev->free_reqs = req->next;
+        req->dir = bio->dir;
+        req->sector = bio->sector;
+        req->sectors = bio->size / BLOCK_SECTOR_SIZE;
+        req->nsegs = bio->vcnt;
+        req->bio_head = req->bio_tail = bio;
+        req->deadline = TSC_deadline_us(bio->dir == BIO_WRITE ? BLOCK_WRITE_EXPIRE_US : BLOCK_READ_EXPIRE_US);
+        queue_insert_sorted(dev, req);
+    }
+    queue_run(dev);
+    irq_restore(enable_ints);
+    return BLOCK_OK;
+}
+
+// don't wait on a bio submitted under a plug that is still held
+int blk_wait_bio(struct bio *bio) {
+    uint64_t deadline = TSC_deadline_us(BLOCK_TIMEOUT_US);
+    while (!bio->done) {
+        if (TSC_expired(deadline)) {
+            printk("block: %s bio at %lu timed out\n", bio->bdev->name, bio->sector);
+            return BLOCK_ERR_TIMEOUT;
+        }
+        // a driver that said busy only gets retried on the next completion or submit
+        int enable_ints = irq_save();
+        queue_run(bio->bdev);
+        irq_restore(enable_ints);
+        __asm__ volatile("pause");
+    }
+    return bio->status;
+}
+
+// holds back dispatch so a burst of bios can merge and be sorted before the driver sees it
+void blk_start_plug(struct block_device *dev) {
+    int enable_ints = irq_save();
+    dev->plugged++;
+    irq_restore(enable_ints);
+}
+
+void blk_finish_plug(struct block_device *dev) {
+    int enable_ints = irq_save();
+    if (dev->plugged > 0 && --dev->plugged == 0) {
+        queue_run(dev);
+    }
+    irq_restore(enable_ints);
+}
+
+/*-------------------Cursor-------------------*/
+
+void blk_cursor_init(struct blk_cursor *cur, struct block_request *req) {
+    cur->bio = req->bio_head;
+    cur->vec = 0;
+    cur->vec_off = 0;
+}
+
+// next run of virtually contiguous data, at most max_bytes, returns 0 at the end
+uint32_t blk_cursor_next(struct blk_cursor *cur, uint32_t max_bytes, void **buf) {
+    uint32_t bytes = 0;
+    while (cur->bio && bytes < max_bytes) {
+        struct bio_vec *v = &cur->bio->vecs[cur->vec];
+        uint8_t *p = (uint8_t *)v->page + v->offset + cur->vec_off;
+        if (bytes == 0) {
+            *buf = p;
+        } else if ((uint8_t *)*buf + bytes != p) {
+            break;
+        }
+        uint32_t take = v->len - cur->vec_off;
+        if (take > max_bytes - bytes) take = max_bytes - bytes;
+        bytes += take;
+        cur->vec_off += take;
+        if (cur->vec_off == v->len) {
+            cur->vec_off = 0;
+            if (++cur->vec == cur->bio->vcnt) {
+                cur->bio = cur->bio->next;
+                cur->vec = 0;
+            }
+        }
+    }
+    return bytes;
+}
+
+/*-------------------Synchronous helpers-------------------*/
+
+#define BLK_SYNC_BIOS 4
+
+// splits buf into page sized vecs, a few bios at a time under one plug
+static int blk_sync(struct block_device *dev, int dir, uint64_t sector, uint32_t count, void *buf) {
+    if ((uint64_t)buf % BLOCK_SECTOR_SIZE) return BLOCK_ERR_INVAL;
+    struct bio bios[BLK_SYNC_BIOS];
+    uint8_t *p = buf;
+    uint64_t left = (uint64_t)count * BLOCK_SECTOR_SIZE;
+    int ret = BLOCK_OK;
+
+    while (left > 0 && ret == BLOCK_OK) {
+        int nbios = 0;
+        blk_start_plug(dev);
+        while (left > 0 && nbios < BLK_SYNC_BIOS) {
+            struct bio *bio = &bios[nbios];
+            bio_init(bio, dev, dir, sector);
+            while (left > 0) {
+                uint32_t offset = (uint64_t)p & (PAGE_SIZE - 1);
+                uint32_t len = PAGE_SIZE - offset;
+                if (len > left) len = left;
+                if (bio_add_page(bio, p - offset, len, offset) != BLOCK_OK) break;
+                p += len;
+                left -= len;
+            }
+            sector += bio->size / BLOCK_SECTOR_SIZE;
+            if (blk_submit_bio(bio) != BLOCK_OK) {
+                ret = bio->status;
+                break;
+            }
+            nbios++;
+        }
+        blk_finish_plug(dev);
+        for (int i = 0; i < nbios; i++) {
+            int status = blk_wait_bio(&bios[i]);
+            if (status != BLOCK_OK) ret = status;
+        }
+    }
+    return ret;
+}
+
+int blk_read(struct block_device *dev, uint64_t sector, uint32_t count, void *buf) {
+    return blk_sync(dev, BIO_READ, sector, count, buf);
+}
+
+int blk_write(struct block_device *dev, uint64_t sector, uint32_t count, const void *buf) {
+    return blk_sync(dev, BIO_WRITE, sector, count, (void *)buf);
+}
+
+/*-------------------Stats-------------------*/
+
+void blk_stats_dump(struct block_device *dev) {
+    struct block_stats *s = &dev->stats;
+    uint64_t elapsed_us = TSC_cycles_to_us(rdtsc() - s->start_tsc);
+    if (elapsed_us == 0) elapsed_us = 1;
+    uint64_t bios = s->bios[BIO_READ] + s->bios[BIO_WRITE];
+    uint64_t requests = s->requests[BIO_READ] + s->requests[BIO_WRITE];
+    uint64_t bytes = (s->sectors[BIO_READ] + s->sectors[BIO_WRITE]) * BLOCK_SECTOR_SIZE;
+
+    printk("block %s: %lu/%lu bios (r/w), %lu/%lu KB, %lu requests, %lu merges, %lu expired, %lu errors\n",
+           dev->name, s->bios[BIO_READ], s->bios[BIO_WRITE],
+           s->sectors[BIO_READ] * BLOCK_SECTOR_SIZE / 1024, s->sectors[BIO_WRITE] * BLOCK_SECTOR_SIZE / 1024,
+           requests, s->merges, s->expired, s->errors);
+    printk("  %lu KB/s over %lu ms, bio latency avg %lu us max %lu us, driver time avg %lu us\n",
+           bytes * 1000 / elapsed_us * 1000 / 1024, elapsed_us / 1000,
+           bios ? TSC_cycles_to_us(s->bio_cycles) / bios : 0, TSC_cycles_to_us(s->max_bio_cycles),
+           requests ? TSC_cycles_to_us(s->driver_cycles) / requests : 0);
+}
+
+void blk_stats_reset(struct block_device *dev) {
+    int enable_ints = irq_save();
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->stats.start_tsc = rdtsc();
+    irq_restore(enable_ints);
+}
+
+/*-------------------Benchmark-------------------*/
+
+static uint64_t bench_rand_state;
+
+static uint64_t bench_rand(void) {
+    // xorshift64
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+// one page per bio, either submitted and waited one at a time or as a single plugged burst
+static int bench_pass(const char *name, struct block_device *dev, int dir, int plug, int random,
+                      struct bio *bios, uint8_t *buf, int nbios) {
+    uint64_t slots = dev->sectors / (PAGE_SIZE / BLOCK_SECTOR_SIZE);
+    bench_rand_state = 0x2545F4914F6CDD1DULL;
+    uint64_t merges = dev->stats.merges;
+    uint64_t requests = dev->stats.requests[dir];
+
+    uint64_t start = rdtsc();
+    if (plug) blk_start_plug(dev);
+    for (int i = 0; i < nbios; i++) {
+        uint64_t slot = random ? bench_rand() % slots : (uint64_t)i % slots;
+        bio_init(&bios[i], dev, dir, slot * (PAGE_SIZE / BLOCK_SECTOR_SIZE));
+        bio_add_page(&bios[i], buf + (uint64_t)i * PAGE_SIZE, PAGE_SIZE, 0);
+        if (blk_submit_bio(&bios[i]) != BLOCK_OK) {
+            if (plug) blk_finish_plug(dev);
+            return -1;
+        }
+        if (!plug && blk_wait_bio(&bios[i]) != BLOCK_OK) return -1;
+    }
+    if (plug) blk_finish_plug(dev);
+    for (int i = 0; i < nbios; i++) {
+        if (blk_wait_bio(&bios[i]) != BLOCK_OK) return -1;
+    }
+    uint64_t us = TSC_cycles_to_us(rdtsc() - start);
+    if (us == 0) us = 1;
+    uint64_t bytes = (uint64_t)nbios * PAGE_SIZE;
+    // bytes per microsecond is MB/s
+    uint64_t mbps_x10 = bytes * 10 / us;
+    printk("  %s: %lu us, %lu.%lu MB/s, %d bios -> %lu requests (%lu merges)\n", name, us,
+           mbps_x10 / 10, mbps_x10 % 10, nbios, dev->stats.requests[dir] - requests,
+           dev->stats.merges - merges);
+    return 0;
+}
+
+// 4 KiB bios against one device: one at a time, plugged sequential (merged), plugged random (sorted)
+void blk_benchmark(struct block_device *dev, int allow_write) {
+    int nbios = BLOCK_BENCH_BYTES / PAGE_SIZE;
+    if (dev->sectors < (uint64_t)nbios * (PAGE_SIZE / BLOCK_SECTOR_SIZE)) return;
+    int bio_pages = (nbios * sizeof(struct bio) + PAGE_SIZE - 1) / PAGE_SIZE;
+    struct bio *bios = MMU_alloc_pages(bio_pages);
+    uint8_t *buf = MMU_alloc_pages(nbios);
+    if (!bios || !buf) {
+        printk("block benchmark: out of memory\n");
+        if (bios) MMU_free_pages(bios, bio_pages);
+        if (buf) MMU_free_pages(buf, nbios);
+        return;
+    }
+
+    printk("block benchmark on %s\n", dev->name);
+    blk_stats_reset(dev);
+    int ret = 0;
+    if (allow_write) {
+        for (int i = 0; i < nbios * PAGE_SIZE / 4; i++) {
+            ((uint32_t *)buf)[i] = 0xB10C0000 + i;
+        }
+        ret |= bench_pass("write sequential plugged", dev, BIO_WRITE, 1, 0, bios, buf, nbios);
+        memset(buf, 0, (uint64_t)nbios * PAGE_SIZE);
+    }
+    ret |= bench_pass("read sequential QD1", dev, BIO_READ, 0, 0, bios, buf, nbios);
+    ret |= bench_pass("read sequential plugged", dev, BIO_READ, 1, 0, bios, buf, nbios);
+    if (allow_write && ret == 0) {
+        for (int i = 0; i < nbios * PAGE_SIZE / 4; i++) {
+            if (((uint32_t *)buf)[i] != 0xB10C0000 + (uint32_t)i) {
+                printk("block benchmark: %s read back wrong data at word %d\n", dev->name, i);
+                ret = -1;
+                break;
+            }
+        }
+    }
+    ret |= bench_pass("read random QD1", dev, BIO_READ, 0, 1, bios, buf, nbios);
+    ret |= bench_pass("read random plugged", dev, BIO_READ, 1, 1, bios, buf, nbios);
+    if (ret) {
+        printk("block benchmark: %s failed\n", dev->name);
+    }
+    blk_stats_dump(dev);
+    MMU_free_pages(bios, bio_pages);
+    MMU_free_pages(buf, nbios);
+}
@@ -0,0 +1,135 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLOCK_SECTOR_SIZE 512
+#define BLOCK_MAX_DEVICES 8
+#define BLOCK_NAME_LEN 16
+#define BIO_MAX_VECS 32                 // one bio covers at most 128 KiB of pages
+#define BLOCK_MAX_SEGMENTS 64           // after merging
+#define BLOCK_MAX_REQUESTS 64           // per device, pending plus in flight
+#define BLOCK_READ_EXPIRE_US 100000     // deadline scheduler: reads jump the elevator after this
+#define BLOCK_WRITE_EXPIRE_US 1000000
+#define BLOCK_TIMEOUT_US 5000000        // blk_wait_bio
+#define BLOCK_BENCH_BYTES (1024 * 1024)
+
+#define BLOCK_OK 0
+#define BLOCK_ERR_IO -1
+#define BLOCK_ERR_TIMEOUT -2
+#define BLOCK_ERR_INVAL -3
+#define BLOCK_ERR_BUSY -4               // driver can't take the request now, retried later
+#define BLOCK_ERR_NOMEM -5
+
+#define BIO_READ 0
+#define BIO_WRITE 1
+
+// a piece of one page frame
+struct bio_vec {
+    void *page;         // page aligned kernel address
+    uint32_t offset;
+    uint32_t len;       // multiple of BLOCK_SECTOR_SIZE
+};
+
+struct bio;
+typedef void (*bio_end_io_t)(struct bio *bio);
+
+// one I/O as the caller sees it, owned by the caller until end_io/done
+struct bio {
+    struct block_device *bdev;
+    int dir;                        // BIO_READ or BIO_WRITE
+    uint64_t sector;
+    struct bio_vec vecs[BIO_MAX_VECS];
+    int vcnt;
+    uint32_t size;                  // bytes
+    volatile int status;
+    volatile int done;
+    bio_end_io_t end_io;            // may be NULL, runs in interrupt context
+    void *private;
+    uint64_t submit_tsc;
+    struct bio *next;               // within a request
+};
+
+// adjacent bios merged into one transfer, this is what drivers see
+struct block_request {
+    int dir;
+    uint64_t sector;
+    uint32_t sectors;
+    int nsegs;
+    struct bio *bio_head, *bio_tail;
+    uint64_t deadline;              // TSC
+    uint64_t dispatch_tsc;
+    int driver_pending;             // free for the driver to use
+    int driver_status;
+    struct block_request *next;
+};
+
+struct block_device;
+
+struct block_device_ops {
+    // starts req, the driver calls blk_request_done() when it finishes (possibly before
+    // returning), BLOCK_ERR_BUSY leaves it queued
+    int (*submit)(struct block_device *dev, struct block_request *req);
+};
+
+// walks a request's data as virtually contiguous runs, see blk_cursor_next()
+struct blk_cursor {
+    struct bio *bio;
+    int vec;
+    uint32_t vec_off;
+};
+
+struct block_stats {
+    uint64_t bios[2];               // by direction
+    uint64_t sectors[2];
+    uint64_t requests[2];           // dispatched to the driver
+    uint64_t merges;
+    uint64_t expired;               // dispatched out of elevator order by the deadline
+    uint64_t errors;
+    uint64_t bio_cycles;            // submit to completion, summed
+    uint64_t max_bio_cycles;
+    uint64_t driver_cycles;         // dispatch to completion, summed
+    uint64_t start_tsc;
+};
+
+struct block_device {
+    char name[BLOCK_NAME_LEN];
+    uint64_t sectors;
+    uint32_t max_sectors;           // per request
+    int max_segments;               // per request, 0 for BLOCK_MAX_SEGMENTS
+    int max_inflight;
+    const struct block_device_ops *ops;
+    void *driver_data;
+
+    // request queue (interrupts off while touching it)
+    struct block_request pool[BLOCK_MAX_REQUESTS];
+    struct block_request *free_reqs;
+    struct block_request *pending;  // sorted by sector
+    int npending;
+    int inflight;
+    int plugged;
+    int dispatching;
+    uint64_t head_pos;              // sector after the last dispatched request
+    struct block_stats stats;
+};
+
+int blk_register(struct block_device *dev);
+struct block_device *blk_get(const char *name);
+struct block_device *blk_get_index(int index);
+void bio_init(struct bio *bio, struct block_device *dev, int dir, uint64_t sector);
+int bio_add_page(struct bio *bio, void *page, uint32_t len, uint32_t offset);
+int blk_submit_bio(struct bio *bio);
+int blk_wait_bio(struct bio *bio);
+void blk_start_plug(struct block_device *dev);
+void blk_finish_plug(struct block_device *dev);
+void blk_request_done(struct block_device *dev, struct block_request *req, int status);
+int blk_read(struct block_device *dev, uint64_t sector, uint32_t count, void *buf);
+int blk_write(struct block_device *dev, uint64_t sector, uint32_t count, const void *buf);
+void blk_cursor_init(struct blk_cursor *cur, struct block_request *req);
+uint32_t blk_cursor_next(struct blk_cursor *cur, uint32_t max_bytes, void **buf);
+void blk_stats_dump(struct block_device *dev);
+void blk_stats_reset(struct block_device *dev);
+void blk_benchmark(struct block_device *dev, int allow_write);
+
+#endif
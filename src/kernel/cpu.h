@@ -0,0 +1,128 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+#define MAX_CPUS 4
+
+// control register bits
+#define CR0_MP (1ULL << 1)          // monitor coprocessor, WAIT/FWAIT honor TS
+#define CR0_EM (1ULL << 2)          // x87 emulation, must be clear for SSE
+#define CR0_TS (1ULL << 3)          // task switched, next FPU/SSE use raises #NM
+#define CR0_NE (1ULL << 5)          // native x87 error reporting
+#define CR0_WP (1ULL << 16)         // read-only pages fault on kernel writes too (copy-on-write)
+#define CR4_PGE (1ULL << 7)         // global pages survive CR3 writes
+#define CR4_OSFXSR (1ULL << 9)      // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT (1ULL << 10) // unmasked SSE exceptions raise #XM
+#define CR4_PCIDE (1ULL << 17)      // CR3[11:0] tags TLB entries with a PCID
+#define CR4_OSXSAVE (1ULL << 18)    // XSAVE and XCR0 enabled
+
+// MSRs
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081         // SYSCALL/SYSRET segment bases
+#define MSR_LSTAR 0xC0000082        // 64-bit SYSCALL entry point
+#define MSR_FMASK 0xC0000084        // RFLAGS bits cleared by SYSCALL
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102   // swapped with GS base by swapgs
+#define EFER_SCE (1ULL << 0)        // SYSCALL enable
+
+#define RFLAGS_TF (1ULL << 8)
+#define RFLAGS_IF (1ULL << 9)
+#define RFLAGS_DF (1ULL << 10)
+#define RFLAGS_AC (1ULL << 18)
+
+// cpuid leaf 1 feature bits
+#define CPUID_1_ECX_PCID (1U << 17)
+#define CPUID_1_ECX_XSAVE (1U << 26)
+#define CPUID_1_ECX_AVX (1U << 28)
+#define CPUID_1_EDX_PGE (1U << 13)
+#define CPUID_1_EDX_FXSR (1U << 24)
+#define CPUID_1_EDX_SSE (1U << 25)
+#define CPUID_7_EBX_INVPCID (1U << 10)
+#define CPUID_EXT_1_EDX_PDPE1GB (1U << 26)     // leaf 0x80000001, 1 GiB pages
+
+// per-CPU block, the GS base points at it while the CPU is in the kernel (swapgs on every entry
+// from ring 3), offsets are used by the syscall entry stub
+struct cpu_local {
+    struct cpu_local *self;         // gs:0
+    uint64_t kernel_rsp;            // gs:8, stack the syscall entry switches to
+    uint64_t user_rsp;              // gs:16, scratch for the entry stub
+    int cpu_id;
+    uint64_t active_cr3;            // PML4 loaded on this CPU, TLB shootdowns target it
+};
+
+#define CPU_LOCAL_KERNEL_RSP 8
+#define CPU_LOCAL_USER_RSP 16
+
+extern struct cpu_local cpu_locals[MAX_CPUS];
+
+static inline struct cpu_local *this_cpu(void) {
+    struct cpu_local *self;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(self));
+    return self;
+}
+
+// valid once cpu_local_init() ran on this CPU
+static inline int this_cpu_id(void) {
+    int id;
+    __asm__ volatile("mov %%gs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(struct cpu_local, cpu_id)));
+    return id;
+}
+
+typedef struct {
+    volatile int locked;
+} spinlock_t;
+
+static inline int spin_trylock(spinlock_t *lock) {
+    return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    while (!spin_trylock(lock)) {
+        while (lock->locked) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+#endif
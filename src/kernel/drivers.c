@@ -1,6 +1,9 @@
 #include "drivers.h"
 #include "printk.h"
 #include "keyboard_scancodes.h"
+#include "interrupts.h"
+#include "tsc.h"
+#include "tunable.h"
 
 // contains ps2 and keyboard drivers
 
@@ -19,81 +22,357 @@ static inline uint8_t inb(uint16_t port) {
 
 /*-------------------PS2-------------------*/
 
-static void ps2_wait_write(void) {
-    char status = inb(PS2_STATUS);
-    while (status & PS2_STATUS_INPUT) status = inb(PS2_STATUS);
+// set once the controller answers, nothing is sent to a dead controller
+static int ps2_present = 0;
+static int ps2_dual_channel = 0;
+
+static inline int are_interrupts_enabled() {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0"
+                     : "=r"(flags));
+    return flags & 0x200; // Check IF (Interrupt Flag) bit
+}
+
+static int ps2_wait_write(void) {
+    uint64_t deadline = TSC_deadline_us(PS2_TIMEOUT_US);
+    while (inb(PS2_STATUS) & PS2_STATUS_INPUT) {
+        if (TSC_expired(deadline)) return -1;
+    }
+    return 0;
 }
 
-static void ps2_wait_read(void) {
-    char status = inb(PS2_STATUS);
-    while (!(status & PS2_STATUS_OUTPUT)) status = inb(PS2_STATUS);
+static int ps2_wait_read(void) {
+    uint64_t deadline = TSC_deadline_us(PS2_TIMEOUT_US);
+    while (!(inb(PS2_STATUS) & PS2_STATUS_OUTPUT)) {
+        if (TSC_expired(deadline)) return -1;
+    }
+    return 0;
 }
 
-static char ps2_read_data(void) {
-    ps2_wait_read();
+// returns the byte read, or -1 on timeout
+static int ps2_read_data(void) {
+    if (ps2_wait_read() < 0) return -1;
     return inb(PS2_DATA);
 }
 
-static void ps2_write_data(char cmd) {
-    ps2_wait_write();
+static int ps2_write_data(uint8_t cmd) {
+    if (ps2_wait_write() < 0) return -1;
     outb(PS2_DATA, cmd);
+    return 0;
 }
 
-static void ps2_write_command(char cmd) {
-    ps2_wait_write();
+static int ps2_write_command(uint8_t cmd) {
+    if (ps2_wait_write() < 0) return -1;
     outb(PS2_CMD, cmd);
+    return 0;
 }
 
-void ps2_init(void) {
-    char config;
+int ps2_init(void) {
+    int config;
 
-    ps2_write_command(PS2_DISABLE_PORT1);
-    ps2_write_command(PS2_DISABLE_PORT2);
+    // the config byte comes back through the output buffer, keep IRQ1 from eating it
+    IRQ_set_mask(1);
+    ps2_present = 0;
 
-    // flush buf in case there's bad data
-    while (inb(PS2_STATUS) & PS2_STATUS_OUTPUT) {
+    if (ps2_write_command(PS2_DISABLE_PORT1) < 0 ||
+        ps2_write_command(PS2_DISABLE_PORT2) < 0) {
+        printk("PS/2 controller not responding\n");
+        return -1;
+    }
+
+    // flush buf in case there's bad data (bounded, a missing controller reads 0xFF)
+    for (int i = 0; i < 16 && (inb(PS2_STATUS) & PS2_STATUS_OUTPUT); i++) {
         inb(PS2_DATA);
     }
 
-    ps2_write_command(PS2_READ_CONFIG);
-    config = ps2_read_data();
+    if (ps2_write_command(PS2_READ_CONFIG) < 0 || (config = ps2_read_data()) < 0) {
+        printk("PS/2 controller did not return its config byte\n");
+        return -1;
+    }
+
+    // port 2 exists if enabling it clears the clock 2 disable bit
+    ps2_dual_channel = 0;
+    if (config & 0x20) {
+        int check;
+        if (ps2_write_command(PS2_ENABLE_PORT2) == 0 &&
+            ps2_write_command(PS2_READ_CONFIG) == 0 &&
+            (check = ps2_read_data()) >= 0 && !(check & 0x20)) {
+            ps2_dual_channel = 1;
+        }
+        ps2_write_command(PS2_DISABLE_PORT2);
+    }
+
     config &= ~0x10;  // enable clock 1
     config |= 0x01;   // enable interrupt 1
-    config |= 0x20;   // disable clock 2
-    config &= ~0x02;  // disable interrupt 2
+    if (ps2_dual_channel) {
+        config &= ~0x20;  // enable clock 2
+        config |= 0x02;   // enable interrupt 2
+    } else {
+        config |= 0x20;   // disable clock 2
+        config &= ~0x02;  // disable interrupt 2
+    }
     config &= ~0x40;  // disable translation
-    ps2_write_command(PS2_WRITE_CONFIG);
-    ps2_write_data(config);
-    ps2_write_command(PS2_ENABLE_PORT1);
+    if (ps2_write_command(PS2_WRITE_CONFIG) < 0 ||
+        ps2_write_data(config) < 0 ||
+        ps2_write_command(PS2_ENABLE_PORT1) < 0) {
+        printk("PS/2 controller config write timed out\n");
+        return -1;
+    }
+    if (ps2_dual_channel && ps2_write_command(PS2_ENABLE_PORT2) < 0) {
+        ps2_dual_channel = 0;
+    }
+    ps2_present = 1;
+    IRQ_clear_mask(1);
+    return 0;
+}
+
+int ps2_port2_present(void) {
+    return ps2_present && ps2_dual_channel;
+}
+
+/*-------------------PS2 Command Engine-------------------*/
+
+// Device commands are queued one byte at a time. The head byte is sent and the
+// IRQ handler of its port feeds replies back through ps2_cmd_response(): ACK
+// moves on (or starts collecting resp_len result bytes), RESEND retries up to
+// PS2_CMD_RETRIES times. Timeouts are checked against TSC deadlines in
+// ps2_cmd_poll(), so nothing here ever spins on the device.
+
+#define PS2_ENGINE_IDLE 0
+#define PS2_ENGINE_WAIT_ACK 1
+#define PS2_ENGINE_WAIT_RESP 2
+
+struct ps2_cmd {
+    uint8_t port;       // 1 or 2
+    uint8_t data;
+    uint8_t flags;
+    uint8_t resp_len;   // result bytes expected after the ACK
+    ps2_cmd_done_t done;
+    void *arg;
+};
+
+static struct {
+    struct ps2_cmd queue[PS2_CMD_QUEUE_SIZE];
+    int head, count;
+    int state;
+    int retries;
+    uint64_t deadline;
+    uint8_t resp[PS2_CMD_MAX_RESP];
+    int resp_count;
+} ps2_engine;
+
+static int ps2_cmd_send_head(void);
+
+static void ps2_cmd_complete(int status) {
+    struct ps2_cmd cmd = ps2_engine.queue[ps2_engine.head];
+    ps2_engine.head = (ps2_engine.head + 1) % PS2_CMD_QUEUE_SIZE;
+    ps2_engine.count--;
+    ps2_engine.state = PS2_ENGINE_IDLE;
+
+    if (cmd.done) cmd.done(status, ps2_engine.resp, ps2_engine.resp_count, cmd.arg);
+
+    // the rest of a failed command would be misread as a new command, drop it
+    if (status != PS2_CMD_OK) {
+        while (ps2_engine.count > 0) {
+            struct ps2_cmd *next = &ps2_engine.queue[ps2_engine.head];
+            if (next->port != cmd.port || !(next->flags & PS2_CMD_F_CHAIN)) break;
+            ps2_engine.head = (ps2_engine.head + 1) % PS2_CMD_QUEUE_SIZE;
+            ps2_engine.count--;
+            if (next->done) next->done(PS2_CMD_ERR_ABORTED, NULL, 0, next->arg);
+        }
+    }
+    ps2_cmd_send_head();
+}
+
+static int ps2_cmd_send_head(void) {
+    while (ps2_engine.state == PS2_ENGINE_IDLE && ps2_engine.count > 0) {
+        struct ps2_cmd *cmd = &ps2_engine.queue[ps2_engine.head];
+        int err = 0;
+        if (cmd->port == 2) err = ps2_write_command(PS2_WRITE_PORT2);
+        if (!err) err = ps2_write_data(cmd->data);
+        if (err) {
+            // controller input buffer stuck, fail this one and try the next
+            ps2_cmd_complete(PS2_CMD_ERR_TIMEOUT);
+            continue;
+        }
+        ps2_engine.state = PS2_ENGINE_WAIT_ACK;
+        ps2_engine.resp_count = 0;
+        ps2_engine.deadline = TSC_deadline_us(PS2_CMD_ACK_TIMEOUT_US);
+    }
+    return 0;
+}
+
+static void ps2_cmd_retry(int status) {
+    if (++ps2_engine.retries > PS2_CMD_RETRIES) {
+        ps2_engine.retries = 0;
+        ps2_cmd_complete(status);
+        return;
+    }
+    // head stays queued, resend it
+    ps2_engine.state = PS2_ENGINE_IDLE;
+    ps2_cmd_send_head();
+}
+
+int ps2_cmd_submit(uint8_t port, uint8_t data, uint8_t flags, uint8_t resp_len, ps2_cmd_done_t done, void *arg) {
+    if (!ps2_present) return PS2_CMD_ERR_NODEV;
+    if (resp_len > PS2_CMD_MAX_RESP) resp_len = PS2_CMD_MAX_RESP;
+
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+
+    int ret = PS2_CMD_OK;
+    if (ps2_engine.count == PS2_CMD_QUEUE_SIZE) {
+        ret = PS2_CMD_ERR_FULL;
+    } else {
+        int tail = (ps2_engine.head + ps2_engine.count) % PS2_CMD_QUEUE_SIZE;
+        ps2_engine.queue[tail].port = port;
+        ps2_engine.queue[tail].data = data;
+        ps2_engine.queue[tail].flags = flags;
+        ps2_engine.queue[tail].resp_len = resp_len;
+        ps2_engine.queue[tail].done = done;
+        ps2_engine.queue[tail].arg = arg;
+        ps2_engine.count++;
+        if (ps2_engine.count == 1) {
+            ps2_engine.retries = 0;
+            ps2_cmd_send_head();
+        }
+    }
+
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+    return ret;
+}
+
+// called from the port's IRQ handler, returns 1 if the byte was a command reply
+int ps2_cmd_response(uint8_t port, uint8_t data) {
+    if (ps2_engine.state == PS2_ENGINE_IDLE) return 0;
+    struct ps2_cmd *cmd = &ps2_engine.queue[ps2_engine.head];
+    if (cmd->port != port) return 0;
+
+    if (ps2_engine.state == PS2_ENGINE_WAIT_ACK) {
+        if (data == KB_ACK) {
+            ps2_engine.retries = 0;
+            if (cmd->resp_len == 0) {
+                ps2_cmd_complete(PS2_CMD_OK);
+            } else {
+                ps2_engine.state = PS2_ENGINE_WAIT_RESP;
+                ps2_engine.deadline = TSC_deadline_us(PS2_CMD_RESP_TIMEOUT_US);
+            }
+            return 1;
+        }
+        if (data == KB_RESEND_CMD) {
+            ps2_cmd_retry(PS2_CMD_ERR_RESEND);
+            return 1;
+        }
+        return 0;
+    }
+
+    ps2_engine.resp[ps2_engine.resp_count++] = data;
+    if (ps2_engine.resp_count == cmd->resp_len) {
+        ps2_engine.retries = 0;
+        ps2_cmd_complete(PS2_CMD_OK);
+    }
+    return 1;
+}
+
+// expires overdue commands, call from any wait loop
+void ps2_cmd_poll(void) {
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+
+    if (ps2_engine.state != PS2_ENGINE_IDLE && TSC_expired(ps2_engine.deadline)) {
+        if (ps2_engine.state == PS2_ENGINE_WAIT_ACK) {
+            ps2_cmd_retry(PS2_CMD_ERR_TIMEOUT);
+        } else {
+            ps2_engine.retries = 0;
+            ps2_cmd_complete(PS2_CMD_ERR_TIMEOUT);
+        }
+    }
+
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
+int ps2_cmd_idle(void) {
+    return ps2_engine.count == 0;
 }
 
 /*-------------------Keyboard-------------------*/
 
-int kb_init(void) {
-    ps2_write_data(KB_RESET);
-    
-    unsigned char response = ps2_read_data();
+static volatile int kb_state = KB_STATE_OFF;
+static volatile int kb_hotkeys = 0;
 
-    while ((response = ps2_read_data()) != KB_TEST_PASS) {
-        if (response == KB_TEST_FAIL1 || response == KB_TEST_FAIL2) {
-            printk("Keyboard self test failed with code 0x%x\n", response);
-            return -1;
+static void kb_reset_done(int status, const uint8_t *resp, int resp_len, void *arg) {
+    (void)resp_len;
+    (void)arg;
+    if (status != PS2_CMD_OK) {
+        printk("Keyboard reset failed (%d)\n", status);
+        kb_state = KB_STATE_FAILED;
+    } else if (resp[0] != KB_TEST_PASS) {
+        printk("Keyboard self test failed with code 0x%x\n", resp[0]);
+        kb_state = KB_STATE_FAILED;
+    }
+}
+
+static void kb_cmd_done(int status, const uint8_t *resp, int resp_len, void *arg) {
+    (void)resp;
+    (void)resp_len;
+    if (status != PS2_CMD_OK) {
+        if (kb_state != KB_STATE_FAILED && status != PS2_CMD_ERR_ABORTED) {
+            printk("Keyboard command failed (%d)\n", status);
         }
+        kb_state = KB_STATE_FAILED;
+    } else if (arg && kb_state == KB_STATE_RESETTING) {
+        // last byte of the init sequence
+        kb_state = KB_STATE_READY;
     }
+}
+
+// typematic byte sent after KB_REPEAT_RATE: bits 0-4 rate, bits 5-6 delay
+TUNABLE(kb_typematic, uint8_t, KB_TYPEMATIC_DEFAULT);
 
-    ps2_write_data(KB_SCAN);
-    ps2_read_data();
-    ps2_write_data(2);
-    ps2_read_data();
-    ps2_write_data(KB_ENABLE);
-    ps2_read_data();
-    ps2_write_data(KB_REPEAT_RATE);
-    ps2_read_data();
-    ps2_write_data(0x4A);
-    ps2_read_data();
+// queues the reset/configure sequence and returns right away, see kb_init_wait()
+int kb_init(void) {
+    kb_state = KB_STATE_RESETTING;
+    int err = ps2_cmd_submit(1, KB_RESET, 0, 1, kb_reset_done, NULL);
+    err = err ? err : ps2_cmd_submit(1, KB_SCAN, PS2_CMD_F_CHAIN, 0, kb_cmd_done, NULL);
+    err = err ? err : ps2_cmd_submit(1, 2, PS2_CMD_F_CHAIN, 0, kb_cmd_done, NULL);
+    err = err ? err : ps2_cmd_submit(1, KB_ENABLE, PS2_CMD_F_CHAIN, 0, kb_cmd_done, NULL);
+    err = err ? err : ps2_cmd_submit(1, KB_REPEAT_RATE, PS2_CMD_F_CHAIN, 0, kb_cmd_done, NULL);
+    err = err ? err : ps2_cmd_submit(1, kb_typematic, PS2_CMD_F_CHAIN, 0, kb_cmd_done, (void*)1);
+    if (err) {
+        kb_state = KB_STATE_FAILED;
+        return -1;
+    }
     return 0;
 }
 
+// waits for the sequence queued by kb_init(), 0 once the keyboard is usable
+int kb_init_wait(uint64_t timeout_us) {
+    uint64_t deadline = TSC_deadline_us(timeout_us);
+    while (kb_state == KB_STATE_RESETTING && !TSC_expired(deadline)) {
+        ps2_cmd_poll();
+        __asm__ volatile("pause");
+    }
+    return kb_state == KB_STATE_READY ? 0 : -1;
+}
+
+// returns the hotkeys pressed since the last call
+int kb_take_hotkeys(void) {
+    int keys;
+    __asm__ volatile("xchg %0, %1" : "=r"(keys), "+m"(kb_hotkeys) : "0"(0) : "memory");
+    return keys;
+}
+
 char scancode_to_ascii(unsigned char scancode, int extended, int capslock, int shift) {
     // extended
     if (extended) {
@@ -245,21 +524,28 @@ int is_modifier (unsigned char scancode) {
     return 0;
 }
 
+// polling mode waits on the keyboard for as long as it takes
+static unsigned char ps2_poll_byte(void) {
+    int data;
+    while ((data = ps2_read_data()) < 0);
+    return data;
+}
+
 void kb_polling(void) {
     unsigned char scancode;
     int extended = 0, capslock = 0, shift = 0, ctrl = 0, alt = 0;
     char c;
 
     while(1) {
-        scancode = ps2_read_data();
+        scancode = ps2_poll_byte();
 
         // handling prefixes
         if (scancode == KB_EXTENDED) {
             extended = 1;
-            scancode = ps2_read_data();
+            scancode = ps2_poll_byte();
         }
         if (scancode == KB_KEY_RELEASE) {
-            scancode = ps2_read_data();
+            scancode = ps2_poll_byte();
             if (scancode == KB_SC_LSHIFT || scancode == KB_SC_RSHIFT) shift = 0;
             else if (scancode == KB_SC_LCTRL) ctrl = 0;
             else if (scancode == KB_SC_LALT) alt = 0;
@@ -316,9 +602,16 @@ void kb_interrupt_handler(int irq, int error_code, void* arg) {
     static int kb_ctrl = 0;
     static int kb_alt = 0;
     
-    if (inb(PS2_STATUS) & PS2_STATUS_OUTPUT) {
+    uint8_t status = inb(PS2_STATUS);
+    // mouse bytes are left for IRQ12
+    if ((status & PS2_STATUS_OUTPUT) && !(status & PS2_STATUS_AUX)) {
         unsigned char scancode = inb(PS2_DATA);
 
+        // ACK/RESEND/self test bytes belong to the command engine
+        if (ps2_cmd_response(1, scancode)) {
+            return;
+        }
+
         if (scancode == KB_EXTENDED) {
             kb_extended = 1;
             return;
@@ -345,7 +638,9 @@ void kb_interrupt_handler(int irq, int error_code, void* arg) {
         }
         
         // handle modifier keys
-        if (scancode == KB_SC_CAPSLOCK) {
+        if (scancode == KB_SC_F12 && !kb_extended) {
+            kb_hotkeys |= KB_HOTKEY_IRQ_STATS;
+        } else if (scancode == KB_SC_CAPSLOCK) {
             kb_capslock ^= 1;
         } else if (scancode == KB_SC_LSHIFT || scancode == KB_SC_RSHIFT) {
             kb_shift = 1;
@@ -3,6 +3,7 @@
 
 #include "keyboard_scancodes.h"
 #include <stdint.h>
+#include <stddef.h>
 
 /*-------------------PS2-------------------*/
 
@@ -12,6 +13,7 @@
 #define PS2_STATUS PS2_CMD
 #define PS2_STATUS_OUTPUT 1
 #define PS2_STATUS_INPUT (1 << 1)
+#define PS2_STATUS_AUX (1 << 5)                 // output buffer byte came from port 2
 
 // commands
 #define PS2_READ_CONFIG 0x20
@@ -19,6 +21,28 @@
 #define PS2_DISABLE_PORT1 0xAD
 #define PS2_DISABLE_PORT2 0xA7
 #define PS2_ENABLE_PORT1 0xAE
+#define PS2_ENABLE_PORT2 0xA8
+#define PS2_WRITE_PORT2 0xD4                    // next byte on the data port goes to port 2
+
+// command engine
+#define PS2_TIMEOUT_US 10000                    // max wait on the controller status bits
+#define PS2_CMD_ACK_TIMEOUT_US 20000            // device must ACK a byte within this
+#define PS2_CMD_RESP_TIMEOUT_US 500000          // self test results can take a while on real hardware
+#define PS2_CMD_RETRIES 3                       // resends before a byte is given up on
+#define PS2_CMD_QUEUE_SIZE 32                   // keyboard and mouse init sequences fit together
+#define PS2_CMD_MAX_RESP 4
+
+#define PS2_CMD_F_CHAIN 0x01                    // part of the previous command, dropped if an earlier byte failed
+
+// command status passed to completion callbacks
+#define PS2_CMD_OK 0
+#define PS2_CMD_ERR_TIMEOUT -1
+#define PS2_CMD_ERR_RESEND -2                   // device kept asking for a resend
+#define PS2_CMD_ERR_FULL -3
+#define PS2_CMD_ERR_ABORTED -4                  // an earlier byte of the same command failed
+#define PS2_CMD_ERR_NODEV -5
+
+typedef void (*ps2_cmd_done_t)(int status, const uint8_t *resp, int resp_len, void *arg);
 
 /*-------------------Keyboard-------------------*/
 
@@ -27,6 +51,7 @@
 #define KB_ECHO 0xEE                            // sends keyboard an echo
 #define KB_SCAN 0xF0                            // (value) 0: get curr code, 1: set code 1, 2: set code 2, 3: set code 3
 #define KB_REPEAT_RATE 0xF3                     // (bit) 0-4: Repeat rate (00000b = 30 Hz, ..., 11111b = 2 Hz) 
+#define KB_TYPEMATIC_DEFAULT 0x4A               // 10.9 Hz repeat after 750 ms
                                                 //       5-6: Delay before keys repeat (00b = 250 ms, 01b = 500 ms, 10b = 750 ms, 11b = 1000 ms) 
                                                 //       7: must be 0
 #define KB_ENABLE 0xF4                          // Enable scanning (keyboard will send scan codes) 
@@ -52,6 +77,17 @@
 #define KB_TEST_FAIL2 0xFD
 #define KB_RESEND_CMD 0xFE      // keyboard wants the last command to be resent
 
+// keyboard init state
+#define KB_STATE_OFF 0
+#define KB_STATE_RESETTING 1
+#define KB_STATE_READY 2
+#define KB_STATE_FAILED 3
+
+#define KB_INIT_TIMEOUT_US 1000000
+
+// hotkeys latched by the keyboard IRQ, acted on from the main loop
+#define KB_HOTKEY_IRQ_STATS 0x01                // F12: dump interrupt counters
+
 //*-------------------PIC-------------------*/
 
 // PIC ports
@@ -69,8 +105,15 @@
 #define PIC_READ_IRR                0x0a    /* OCW3 irq ready next CMD read */
 #define PIC_READ_ISR                0x0b    /* OCW3 irq service next CMD read */
 
-void ps2_init(void);
+int ps2_init(void);
+int ps2_port2_present(void);
+int ps2_cmd_submit(uint8_t port, uint8_t data, uint8_t flags, uint8_t resp_len, ps2_cmd_done_t done, void *arg);
+int ps2_cmd_response(uint8_t port, uint8_t data);
+void ps2_cmd_poll(void);
+int ps2_cmd_idle(void);
 int kb_init(void);
+int kb_init_wait(uint64_t timeout_us);
+int kb_take_hotkeys(void);
 void kb_polling(void);
 void kb_interrupt_handler(int irq, int error_code, void* arg);
 void PIC_sendEOI(uint8_t irq);
@@ -0,0 +1,51 @@
+#include "elf.h"
+#include "process.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+
+// ELF64 executables: only the headers are read here, PT_LOAD segments become VMAs that the page
+// fault handler fills one page at a time
+
+int elf_load(struct process *p, struct vma_source *src, uint64_t size) {
+    struct elf64_ehdr eh;
+    struct elf64_phdr ph;
+
+    if (size < sizeof(eh) || src->read(src->arg, 0, &eh, sizeof(eh)) != 0) return ELF_ERR_IO;
+    uint32_t magic;
+    memcpy(&magic, eh.e_ident, 4);
+    if (magic != ELF_MAGIC || eh.e_ident[4] != ELFCLASS64 || eh.e_ident[5] != ELFDATA2LSB
+        || eh.e_type != ET_EXEC || eh.e_machine != EM_X86_64 || eh.e_phentsize != sizeof(ph)
+        || eh.e_phnum > ELF_MAX_PHDRS || eh.e_phoff + (uint64_t)eh.e_phnum * sizeof(ph) > size) {
+        printk("elf %s: not a static x86_64 executable\n", p->name);
+        return ELF_ERR_FORMAT;
+    }
+
+    int loaded = 0;
+    for (int i = 0; i < eh.e_phnum; i++) {
+        if (src->read(src->arg, eh.e_phoff + i * sizeof(ph), &ph, sizeof(ph)) != 0) return ELF_ERR_IO;
+        if (ph.p_type != PT_LOAD || ph.p_memsz == 0) continue;
+        if (ph.p_filesz > ph.p_memsz || ph.p_offset + ph.p_filesz > size
+            || (ph.p_vaddr - ph.p_offset) % PAGE_SIZE != 0) {
+            printk("elf %s: bad segment %d\n", p->name, i);
+            return ELF_ERR_FORMAT;
+        }
+        if (ph.p_vaddr < USER_SPACE_ADR || ph.p_vaddr + ph.p_memsz > USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE) {
+            printk("elf %s: segment at 0x%lx is outside user space\n", p->name, ph.p_vaddr);
+            return ELF_ERR_RANGE;
+        }
+        uint32_t flags = 0;
+        if (ph.p_flags & PF_R) flags |= VMA_READ;
+        if (ph.p_flags & PF_W) flags |= VMA_WRITE;
+        if (ph.p_flags & PF_X) flags |= VMA_EXEC;
+        int ret = process_map(p, ph.p_vaddr, ph.p_vaddr + ph.p_memsz, flags, src, ph.p_offset, ph.p_filesz);
+        if (ret != 0) return ret;
+        loaded++;
+    }
+    if (!loaded || eh.e_entry < USER_SPACE_ADR || eh.e_entry >= USER_SPACE_END) {
+        printk("elf %s: no loadable segments or bad entry point\n", p->name);
+        return ELF_ERR_FORMAT;
+    }
+    p->entry = eh.e_entry;
+    return ELF_OK;
+}
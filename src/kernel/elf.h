@@ -0,0 +1,69 @@
+#ifndef ELF_H
+#define ELF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ELF_MAGIC 0x464C457F        // "\x7FELF" read little endian
+#define ELFCLASS64 2
+#define ELFDATA2LSB 1
+#define ET_EXEC 2
+#define EM_X86_64 62
+#define PT_LOAD 1
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+#define ELF_MAX_PHDRS 16
+#define STT_NOTYPE 0                // what NASM gives plain labels
+#define STT_FUNC 2
+#define ELF64_ST_TYPE(info) ((info) & 0xF)
+
+#define ELF_OK 0
+#define ELF_ERR_IO -1
+#define ELF_ERR_FORMAT -2
+#define ELF_ERR_RANGE -3            // segment outside user space
+#define ELF_ERR_NOMEM -4
+
+struct elf64_ehdr {
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+};
+
+struct elf64_phdr {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+};
+
+struct elf64_sym {
+    uint32_t st_name;
+    uint8_t st_info;
+    uint8_t st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+};
+
+struct process;
+struct vma_source;
+
+int elf_load(struct process *p, struct vma_source *src, uint64_t size);
+
+#endif
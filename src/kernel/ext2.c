@@ -0,0 +1,508 @@
+#include "ext2.h"
+#include "block.h"
+#include "pagecache.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+#include "tsc.h"
+
+// read only ext2: metadata and small reads go through the device's page cache object, large file
+// reads are split into physically contiguous runs and go straight to the block layer
+
+#define EXT2_MAX_MOUNTS 2
+#define EXT2_RUN_MAX_BLOCKS 1024
+
+static struct ext2_fs mounts[EXT2_MAX_MOUNTS];
+static int num_mounts = 0;
+
+static int read_bytes(struct ext2_fs *fs, uint64_t offset, void *buf, uint64_t len) {
+    if (pagecache_read(fs->cache, fs->part_offset + offset, buf, len) != (int64_t)len) {
+        return EXT2_ERR_IO;
+    }
+    return EXT2_OK;
+}
+
+static int read_block_entry(struct ext2_fs *fs, uint32_t block, uint32_t index, uint32_t *out) {
+    return read_bytes(fs, (uint64_t)block * fs->block_size + index * 4, out, 4);
+}
+
+/*-------------------Mount-------------------*/
+
+// byte offset of the first Linux partition, 0 if the disk has no MBR
+static uint64_t find_partition(struct cache_object *cache) {
+    uint8_t mbr[512];
+    if (pagecache_read(cache, 0, mbr, sizeof(mbr)) != sizeof(mbr)) return 0;
+    if ((mbr[510] | (mbr[511] << 8)) != MBR_SIGNATURE) return 0;
+    for (int i = 0; i < 4; i++) {
+        uint8_t *entry = mbr + MBR_PART_TABLE + i * 16;
+        uint32_t lba;
+        memcpy(&lba, entry + 8, 4);
+        if (entry[4] == MBR_PART_LINUX && lba) {
+            return (uint64_t)lba * BLOCK_SECTOR_SIZE;
+        }
+    }
+    return 0;
+}
+
+struct ext2_fs *ext2_mount(struct block_device *dev) {
+    if (num_mounts == EXT2_MAX_MOUNTS) return NULL;
+    struct ext2_fs *fs = &mounts[num_mounts];
+    memset(fs, 0, sizeof(*fs));
+    fs->dev = dev;
+    fs->cache = pagecache_bdev_object(dev);
+    if (!fs->cache) return NULL;
+    fs->part_offset = find_partition(fs->cache);
+
+    if (read_bytes(fs, EXT2_SUPERBLOCK_OFFSET, &fs->sb, sizeof(fs->sb)) != EXT2_OK) return NULL;
+    if (fs->sb.s_magic != EXT2_SUPER_MAGIC) return NULL;
+    if (fs->sb.s_rev_level >= 1 && (fs->sb.s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_FILETYPE)) {
+        printk("ext2 %s: unsupported incompat features 0x%x\n", dev->name, fs->sb.s_feature_incompat);
+        return NULL;
+    }
+    fs->block_size = 1024 << fs->sb.s_log_block_size;
+    fs->inode_size = fs->sb.s_rev_level >= 1 ? fs->sb.s_inode_size : EXT2_GOOD_OLD_INODE_SIZE;
+    if (fs->block_size > PAGE_SIZE || fs->sb.s_blocks_per_group == 0 || fs->sb.s_inodes_per_group == 0) {
+        printk("ext2 %s: unsupported geometry (block size %u)\n", dev->name, fs->block_size);
+        return NULL;
+    }
+    fs->groups = (fs->sb.s_blocks_count - fs->sb.s_first_data_block + fs->sb.s_blocks_per_group - 1)
+                 / fs->sb.s_blocks_per_group;
+
+    // the descriptor table starts in the block after the superblock
+    uint64_t gdt_bytes = (uint64_t)fs->groups * sizeof(struct ext2_group_desc);
+    fs->gdt_pages = (gdt_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    fs->gdt = MMU_alloc_pages(fs->gdt_pages);
+    if (!fs->gdt) return NULL;
+    if (read_bytes(fs, (uint64_t)(fs->sb.s_first_data_block + 1) * fs->block_size, fs->gdt, gdt_bytes) != EXT2_OK) {
+        MMU_free_pages(fs->gdt, fs->gdt_pages);
+        return NULL;
+    }
+    num_mounts++;
+    printk("ext2 %s: %u blocks of %u bytes, %u inodes, %u groups, partition at %lu\n",
+           dev->name, fs->sb.s_blocks_count, fs->block_size, fs->sb.s_inodes_count, fs->groups,
+           fs->part_offset / BLOCK_SECTOR_SIZE);
+    return fs;
+}
+
+struct ext2_fs *ext2_mount_first(void) {
+    for (int i = 0; blk_get_index(i); i++) {
+        struct ext2_fs *fs = ext2_mount(blk_get_index(i));
+        if (fs) return fs;
+    }
+    return NULL;
+}
+
+/*-------------------Inode cache-------------------*/
+
+static int read_inode(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *out) {
+    if (ino == 0 || ino > fs->sb.s_inodes_count) return EXT2_ERR_INVAL;
+    struct ext2_cached_inode **bucket = &fs->inode_hash[ino % EXT2_INODE_HASH_SIZE];
+    for (struct ext2_cached_inode *ci = *bucket; ci; ci = ci->hash_next) {
+        if (ci->ino == ino) {
+            fs->stats.inode_hits++;
+            ci->last_used = ++fs->clock;
+            memcpy(out, &ci->raw, sizeof(*out));
+            return EXT2_OK;
+        }
+    }
+    fs->stats.inode_misses++;
+
+    uint32_t group = (ino - 1) / fs->sb.s_inodes_per_group;
+    uint32_t index = (ino - 1) % fs->sb.s_inodes_per_group;
+    uint64_t offset = (uint64_t)fs->gdt[group].bg_inode_table * fs->block_size + (uint64_t)index * fs->inode_size;
+    if (read_bytes(fs, offset, out, sizeof(*out)) != EXT2_OK) return EXT2_ERR_IO;
+
+    // free slot or least recently used
+    struct ext2_cached_inode *victim = &fs->inodes[0];
+    for (int i = 0; i < EXT2_INODE_CACHE_SIZE && victim->ino; i++) {
+        if (!fs->inodes[i].ino || fs->inodes[i].last_used < victim->last_used) victim = &fs->inodes[i];
+    }
+    if (victim->ino) {
+        struct ext2_cached_inode **pp = &fs->inode_hash[victim->ino % EXT2_INODE_HASH_SIZE];
+        while (*pp != victim) pp = &(*pp)->hash_next;
+        *pp = victim->hash_next;
+    }
+    victim->ino = ino;
+    memcpy(&victim->raw, out, sizeof(*out));
+    victim->last_used = ++fs->clock;
+    victim->hash_next = *bucket;
+    *bucket = victim;
+    return EXT2_OK;
+}
+
+/*-------------------Block mapping-------------------*/
+
+// file block to disk block, 0 for a hole
+static int bmap(struct ext2_fs *fs, struct ext2_inode *inode, uint64_t block, uint32_t *out) {
+    uint32_t per = fs->block_size / 4;
+    uint32_t b;
+
+    if (block < EXT2_NDIR_BLOCKS) {
+        *out = inode->i_block[block];
+        return EXT2_OK;
+    }
+    block -= EXT2_NDIR_BLOCKS;
+    if (block < per) {
+        b = inode->i_block[EXT2_IND_BLOCK];
+        if (b && read_block_entry(fs, b, block, &b) != EXT2_OK) return EXT2_ERR_IO;
+        *out = b;
+        return EXT2_OK;
+    }
+    block -= per;
+    if (block < (uint64_t)per * per) {
+        b = inode->i_block[EXT2_DIND_BLOCK];
+        if (b && read_block_entry(fs, b, block / per, &b) != EXT2_OK) return EXT2_ERR_IO;
+        if (b && read_block_entry(fs, b, block % per, &b) != EXT2_OK) return EXT2_ERR_IO;
+        *out = b;
+        return EXT2_OK;
+    }
+    block -= (uint64_t)per * per;
+    if (block < (uint64_t)per * per * per) {
+        b = inode->i_block[EXT2_TIND_BLOCK];
+        if (b && read_block_entry(fs, b, block / ((uint64_t)per * per), &b) != EXT2_OK) return EXT2_ERR_IO;
+        if (b && read_block_entry(fs, b, (block / per) % per, &b) != EXT2_OK) return EXT2_ERR_IO;
+        if (b && read_block_entry(fs, b, block % per, &b) != EXT2_OK) return EXT2_ERR_IO;
+        *out = b;
+        return EXT2_OK;
+    }
+    return EXT2_ERR_INVAL;
+}
+
+// the run containing block, at most max blocks long, remembered in the file for the next call
+static int get_run(struct ext2_file *file, struct ext2_inode *inode, uint64_t block, uint32_t max,
+                   struct ext2_run *run) {
+    struct ext2_run *last = &file->run;
+    if (last->count && block >= last->file_block && block < last->file_block + last->count) {
+        uint64_t skip = block - last->file_block;
+        run->file_block = block;
+        run->disk_block = last->disk_block ? last->disk_block + skip : 0;
+        run->count = last->count - skip;
+        if (run->count > max) run->count = max;
+        return EXT2_OK;
+    }
+
+    uint32_t first, next;
+    if (bmap(file->fs, inode, block, &first) != EXT2_OK) return EXT2_ERR_IO;
+    uint32_t count = 1;
+    // indirect blocks are cached, so walking ahead is cheap
+    while (count < EXT2_RUN_MAX_BLOCKS && (uint64_t)(block + count) * file->fs->block_size < file->size) {
+        if (bmap(file->fs, inode, block + count, &next) != EXT2_OK) break;
+        if (first ? next != first + count : next != 0) break;
+        count++;
+    }
+    last->file_block = block;
+    last->disk_block = first;
+    last->count = count;
+    run->file_block = block;
+    run->disk_block = first;
+    run->count = count < max ? count : max;
+    return EXT2_OK;
+}
+
+/*-------------------Files-------------------*/
+
+int64_t ext2_pread(struct ext2_file *file, uint64_t offset, void *buf, uint64_t len) {
+    struct ext2_fs *fs = file->fs;
+    struct ext2_inode inode;
+    uint8_t *dst = buf;
+    uint64_t done = 0;
+
+    if (offset >= file->size) return 0;
+    if (len > file->size - offset) len = file->size - offset;
+    if (read_inode(fs, file->ino, &inode) != EXT2_OK) return EXT2_ERR_IO;
+
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint64_t block = pos / fs->block_size;
+        uint32_t in_block = pos % fs->block_size;
+        uint64_t want_blocks = (in_block + (len - done) + fs->block_size - 1) / fs->block_size;
+        struct ext2_run run;
+        if (get_run(file, &inode, block, want_blocks > EXT2_RUN_MAX_BLOCKS ? EXT2_RUN_MAX_BLOCKS : want_blocks,
+                    &run) != EXT2_OK) {
+            return done ? (int64_t)done : EXT2_ERR_IO;
+        }
+        uint64_t chunk = (uint64_t)run.count * fs->block_size - in_block;
+        if (chunk > len - done) chunk = len - done;
+        fs->stats.runs++;
+
+        if (!run.disk_block) {
+            memset(dst + done, 0, chunk);
+        } else {
+            uint64_t disk = fs->part_offset + (uint64_t)run.disk_block * fs->block_size + in_block;
+            if (chunk >= EXT2_DIRECT_MIN_BYTES && disk % BLOCK_SECTOR_SIZE == 0
+                && (uint64_t)(dst + done) % BLOCK_SECTOR_SIZE == 0) {
+                // the file system is read only, nothing in the page cache can be newer than the disk
+                chunk -= chunk % BLOCK_SECTOR_SIZE;
+                if (blk_read(fs->dev, disk / BLOCK_SECTOR_SIZE, chunk / BLOCK_SECTOR_SIZE, dst + done) != BLOCK_OK) {
+                    return done ? (int64_t)done : EXT2_ERR_IO;
+                }
+                fs->stats.direct_bytes += chunk;
+            } else {
+                if (pagecache_read(fs->cache, disk, dst + done, chunk) != (int64_t)chunk) {
+                    return done ? (int64_t)done : EXT2_ERR_IO;
+                }
+                fs->stats.cached_bytes += chunk;
+            }
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+int64_t ext2_read(struct ext2_file *file, void *buf, uint64_t len) {
+    int64_t n = ext2_pread(file, file->pos, buf, len);
+    if (n > 0) file->pos += n;
+    return n;
+}
+
+static int open_ino(struct ext2_fs *fs, uint32_t ino, struct ext2_file *file) {
+    struct ext2_inode inode;
+    int ret = read_inode(fs, ino, &inode);
+    if (ret != EXT2_OK) return ret;
+    memset(file, 0, sizeof(*file));
+    file->fs = fs;
+    file->ino = ino;
+    file->mode = inode.i_mode;
+    file->size = inode.i_size;
+    if ((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) {
+        file->size |= (uint64_t)inode.i_size_high << 32;
+    }
+    return EXT2_OK;
+}
+
+/*-------------------Directories-------------------*/
+
+// calls match for every entry until it returns nonzero, returns that value or 0. Each scan has its
+// own block buffer (a frame, blocks are at most a page), so match may look things up itself
+static int dir_iterate(struct ext2_fs *fs, uint32_t dir_ino,
+                       int (*match)(struct ext2_dir_entry *de, void *arg), void *arg) {
+    struct ext2_file dir;
+    int ret = open_ino(fs, dir_ino, &dir);
+    if (ret != EXT2_OK) return ret;
+    if ((dir.mode & EXT2_S_IFMT) != EXT2_S_IFDIR) return EXT2_ERR_NOTDIR;
+    uint8_t *buf = MMU_pf_alloc();
+    if (!buf) return EXT2_ERR_NOMEM;
+
+    ret = 0;
+    for (uint64_t off = 0; off < dir.size && !ret; off += fs->block_size) {
+        int64_t n = ext2_pread(&dir, off, buf, fs->block_size);
+        if (n <= 0) {
+            ret = EXT2_ERR_IO;
+            break;
+        }
+        fs->stats.dir_blocks_scanned++;
+        for (uint32_t pos = 0; pos + 8 <= (uint64_t)n; ) {
+            struct ext2_dir_entry *de = (struct ext2_dir_entry *)(buf + pos);
+            if (de->rec_len < 8 || pos + de->rec_len > (uint64_t)n) break;
+            if (de->inode) {
+                ret = match(de, arg);
+                if (ret) break;
+            }
+            pos += de->rec_len;
+        }
+    }
+    MMU_pf_free(buf);
+    return ret;
+}
+
+struct find_arg {
+    const char *name;
+    int len;
+    uint32_t ino;
+};
+
+static int find_match(struct ext2_dir_entry *de, void *arg) {
+    struct find_arg *fa = arg;
+    if (de->name_len == fa->len && memcmp(de->name, fa->name, fa->len) == 0) {
+        fa->ino = de->inode;
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t dentry_hash(uint32_t parent, const char *name, int len) {
+    // FNV-1a
+    uint32_t h = 2166136261u ^ parent;
+    for (int i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h % EXT2_DCACHE_HASH_SIZE;
+}
+
+static void dcache_insert(struct ext2_fs *fs, uint32_t parent, const char *name, int len, uint32_t ino) {
+    struct ext2_dentry *victim = &fs->dentries[0];
+    for (int i = 0; i < EXT2_DCACHE_SIZE && victim->parent; i++) {
+        if (!fs->dentries[i].parent || fs->dentries[i].last_used < victim->last_used) victim = &fs->dentries[i];
+    }
+    if (victim->parent) {
+        struct ext2_dentry **pp = &fs->dentry_hash[dentry_hash(victim->parent, victim->name, victim->name_len)];
+        while (*pp != victim) pp = &(*pp)->hash_next;
+        *pp = victim->hash_next;
+    }
+    struct ext2_dentry **bucket = &fs->dentry_hash[dentry_hash(parent, name, len)];
+    victim->parent = parent;
+    victim->ino = ino;
+    victim->name_len = len;
+    memcpy(victim->name, name, len);
+    victim->last_used = ++fs->clock;
+    victim->hash_next = *bucket;
+    *bucket = victim;
+}
+
+// one path component, negative results are cached too
+static int lookup_child(struct ext2_fs *fs, uint32_t dir_ino, const char *name, int len, uint32_t *ino) {
+    int cacheable = len <= EXT2_DCACHE_NAME_LEN;
+    if (cacheable) {
+        for (struct ext2_dentry *d = fs->dentry_hash[dentry_hash(dir_ino, name, len)]; d; d = d->hash_next) {
+            if (d->parent == dir_ino && d->name_len == len && memcmp(d->name, name, len) == 0) {
+                fs->stats.dcache_hits++;
+                d->last_used = ++fs->clock;
+                *ino = d->ino;
+                return d->ino ? EXT2_OK : EXT2_ERR_NOENT;
+            }
+        }
+        fs->stats.dcache_misses++;
+    }
+
+    struct find_arg fa = { name, len, 0 };
+    int ret = dir_iterate(fs, dir_ino, find_match, &fa);
+    if (ret < 0) return ret;
+    if (cacheable) dcache_insert(fs, dir_ino, name, len, fa.ino);
+    *ino = fa.ino;
+    return fa.ino ? EXT2_OK : EXT2_ERR_NOENT;
+}
+
+// absolute paths only, symlinks are not followed
+int ext2_lookup(struct ext2_fs *fs, const char *path, uint32_t *ino) {
+    if (path[0] != '/') return EXT2_ERR_INVAL;
+    uint32_t cur = EXT2_ROOT_INO;
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        const char *end = p;
+        while (*end && *end != '/') end++;
+        if (end - p > EXT2_NAME_LEN) return EXT2_ERR_INVAL;
+        int ret = lookup_child(fs, cur, p, end - p, &cur);
+        if (ret != EXT2_OK) return ret;
+        p = end;
+    }
+    *ino = cur;
+    return EXT2_OK;
+}
+
+int ext2_open(struct ext2_fs *fs, const char *path, struct ext2_file *file) {
+    uint32_t ino;
+    int ret = ext2_lookup(fs, path, &ino);
+    if (ret != EXT2_OK) return ret;
+    return open_ino(fs, ino, file);
+}
+
+struct readdir_arg {
+    ext2_dir_cb cb;
+    void *arg;
+};
+
+static int readdir_match(struct ext2_dir_entry *de, void *arg) {
+    struct readdir_arg *ra = arg;
+    ra->cb(de->name, de->name_len, de->inode, de->file_type, ra->arg);
+    return 0;
+}
+
+int ext2_readdir(struct ext2_fs *fs, const char *path, ext2_dir_cb cb, void *arg) {
+    uint32_t ino;
+    int ret = ext2_lookup(fs, path, &ino);
+    if (ret != EXT2_OK) return ret;
+    struct readdir_arg ra = { cb, arg };
+    return dir_iterate(fs, ino, readdir_match, &ra);
+}
+
+/*-------------------Stats-------------------*/
+
+void ext2_stats_dump(struct ext2_fs *fs) {
+    struct ext2_stats *s = &fs->stats;
+    printk("ext2 %s: inode cache %lu hits %lu misses, dcache %lu hits %lu misses, %lu dir blocks scanned\n",
+           fs->dev->name, s->inode_hits, s->inode_misses, s->dcache_hits, s->dcache_misses, s->dir_blocks_scanned);
+    printk("  %lu runs, %lu KB direct, %lu KB through the page cache\n",
+           s->runs, s->direct_bytes / 1024, s->cached_bytes / 1024);
+}
+
+/*-------------------Benchmark-------------------*/
+
+static void print_rate(const char *what, uint64_t bytes, uint64_t us) {
+    if (us == 0) us = 1;
+    // bytes per us is MB/s
+    uint64_t tenths = bytes * 10 / us;
+    printk("ext2 bench: %s: %lu KB in %lu us, %lu.%lu MB/s\n", what, bytes / 1024, us, tenths / 10, tenths % 10);
+}
+
+// reads path in contiguous runs and one block per request, then times cold and warm path lookups
+void ext2_benchmark(struct ext2_fs *fs, const char *path) {
+    struct ext2_file file;
+    struct ext2_inode inode;
+    if (ext2_open(fs, path, &file) != EXT2_OK || read_inode(fs, file.ino, &inode) != EXT2_OK) {
+        printk("ext2 bench: %s not found\n", path);
+        return;
+    }
+    int pages = (file.size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint8_t *a = MMU_alloc_pages(pages);
+    uint8_t *b = MMU_alloc_pages(pages);
+    if (!a || !b) {
+        printk("ext2 bench: out of memory for %lu bytes\n", file.size);
+        if (a) MMU_free_pages(a, pages);
+        if (b) MMU_free_pages(b, pages);
+        return;
+    }
+    // touch the buffers first so demand paging isn't timed
+    memset(a, 0, pages * PAGE_SIZE);
+    memset(b, 0, pages * PAGE_SIZE);
+
+    uint64_t runs = fs->stats.runs;
+    uint64_t best = (uint64_t)-1;
+    for (int pass = 0; pass < EXT2_BENCH_PASSES; pass++) {
+        file.run.count = 0;
+        uint64_t start = rdtsc();
+        if (ext2_pread(&file, 0, a, file.size) != (int64_t)file.size) {
+            printk("ext2 bench: read of %s failed\n", path);
+            goto out;
+        }
+        uint64_t us = TSC_cycles_to_us(rdtsc() - start);
+        if (us < best) best = us;
+    }
+    print_rate("contiguous runs", file.size, best);
+    printk("ext2 bench: %s is %lu bytes in %lu runs\n", path, file.size,
+           (fs->stats.runs - runs) / EXT2_BENCH_PASSES);
+
+    // baseline: what a block at a time driver would do
+    uint64_t start = rdtsc();
+    uint32_t spb = fs->block_size / BLOCK_SECTOR_SIZE;
+    for (uint64_t blk = 0; blk * fs->block_size < file.size; blk++) {
+        uint32_t disk;
+        if (bmap(fs, &inode, blk, &disk) != EXT2_OK) goto out;
+        if (!disk) continue;
+        if (blk_read(fs->dev, fs->part_offset / BLOCK_SECTOR_SIZE + (uint64_t)disk * spb, spb,
+                     b + blk * fs->block_size) != BLOCK_OK) {
+            printk("ext2 bench: block read failed\n");
+            goto out;
+        }
+    }
+    print_rate("block at a time", file.size, TSC_cycles_to_us(rdtsc() - start));
+    printk("ext2 bench: contents %s\n", memcmp(a, b, file.size) == 0 ? "match" : "DIFFER");
+
+    // path lookups, first against an empty dentry cache
+    memset(fs->dentries, 0, sizeof(fs->dentries));
+    memset(fs->dentry_hash, 0, sizeof(fs->dentry_hash));
+    uint32_t ino;
+    start = rdtsc();
+    ext2_lookup(fs, path, &ino);
+    uint64_t cold = TSC_cycles_to_us(rdtsc() - start);
+    start = rdtsc();
+    for (int i = 0; i < 1000; i++) ext2_lookup(fs, path, &ino);
+    uint64_t warm_ns = TSC_cycles_to_us(rdtsc() - start);   // us for 1000 lookups is ns per lookup
+    printk("ext2 bench: lookup %s cold %lu us, cached %lu ns\n", path, cold, warm_ns);
+    ext2_stats_dump(fs);
+out:
+    MMU_free_pages(a, pages);
+    MMU_free_pages(b, pages);
+}
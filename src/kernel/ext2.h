@@ -0,0 +1,198 @@
+#ifndef EXT2_H
+#define EXT2_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_SUPERBLOCK_OFFSET 1024     // bytes into the partition
+#define EXT2_ROOT_INO 2
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK 12
+#define EXT2_DIND_BLOCK 13
+#define EXT2_TIND_BLOCK 14
+#define EXT2_N_BLOCKS 15
+#define EXT2_NAME_LEN 255
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+
+// i_mode
+#define EXT2_S_IFMT 0xF000
+#define EXT2_S_IFREG 0x8000
+#define EXT2_S_IFDIR 0x4000
+#define EXT2_S_IFLNK 0xA000
+
+// incompat features we can read, anything else refuses the mount
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+
+// MBR
+#define MBR_SIGNATURE 0xAA55
+#define MBR_PART_TABLE 446
+#define MBR_PART_LINUX 0x83
+
+#define EXT2_INODE_CACHE_SIZE 128
+#define EXT2_INODE_HASH_SIZE 64
+#define EXT2_DCACHE_SIZE 256
+#define EXT2_DCACHE_HASH_SIZE 128
+#define EXT2_DCACHE_NAME_LEN 32         // longer names are looked up without the cache
+#define EXT2_DIRECT_MIN_BYTES (16 * 1024)   // runs this big skip the page cache
+#define EXT2_PATH_MAX 256
+#define EXT2_BENCH_PASSES 4
+
+#define EXT2_OK 0
+#define EXT2_ERR_IO -1
+#define EXT2_ERR_NOENT -2
+#define EXT2_ERR_NOTDIR -3
+#define EXT2_ERR_INVAL -4
+#define EXT2_ERR_NOMEM -5
+
+struct ext2_superblock {
+    uint32_t s_inodes_count;
+    uint32_t s_blocks_count;
+    uint32_t s_r_blocks_count;
+    uint32_t s_free_blocks_count;
+    uint32_t s_free_inodes_count;
+    uint32_t s_first_data_block;
+    uint32_t s_log_block_size;
+    uint32_t s_log_frag_size;
+    uint32_t s_blocks_per_group;
+    uint32_t s_frags_per_group;
+    uint32_t s_inodes_per_group;
+    uint32_t s_mtime;
+    uint32_t s_wtime;
+    uint16_t s_mnt_count;
+    uint16_t s_max_mnt_count;
+    uint16_t s_magic;
+    uint16_t s_state;
+    uint16_t s_errors;
+    uint16_t s_minor_rev_level;
+    uint32_t s_lastcheck;
+    uint32_t s_checkinterval;
+    uint32_t s_creator_os;
+    uint32_t s_rev_level;
+    uint16_t s_def_resuid;
+    uint16_t s_def_resgid;
+    // EXT2_DYNAMIC_REV
+    uint32_t s_first_ino;
+    uint16_t s_inode_size;
+    uint16_t s_block_group_nr;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t s_uuid[16];
+    char s_volume_name[16];
+} __attribute__((packed));
+
+struct ext2_group_desc {
+    uint32_t bg_block_bitmap;
+    uint32_t bg_inode_bitmap;
+    uint32_t bg_inode_table;
+    uint16_t bg_free_blocks_count;
+    uint16_t bg_free_inodes_count;
+    uint16_t bg_used_dirs_count;
+    uint16_t bg_pad;
+    uint32_t bg_reserved[3];
+} __attribute__((packed));
+
+struct ext2_inode {
+    uint16_t i_mode;
+    uint16_t i_uid;
+    uint32_t i_size;
+    uint32_t i_atime;
+    uint32_t i_ctime;
+    uint32_t i_mtime;
+    uint32_t i_dtime;
+    uint16_t i_gid;
+    uint16_t i_links_count;
+    uint32_t i_blocks;
+    uint32_t i_flags;
+    uint32_t i_osd1;
+    uint32_t i_block[EXT2_N_BLOCKS];
+    uint32_t i_generation;
+    uint32_t i_file_acl;
+    uint32_t i_size_high;           // i_dir_acl for directories
+    uint32_t i_faddr;
+    uint8_t i_osd2[12];
+} __attribute__((packed));
+
+struct ext2_dir_entry {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+    char name[];
+} __attribute__((packed));
+
+// a physically contiguous piece of a file
+struct ext2_run {
+    uint64_t file_block;
+    uint64_t disk_block;            // 0 for a hole
+    uint32_t count;
+};
+
+struct ext2_cached_inode {
+    uint32_t ino;                   // 0 when the slot is free
+    struct ext2_inode raw;
+    uint64_t last_used;
+    struct ext2_cached_inode *hash_next;
+};
+
+struct ext2_dentry {
+    uint32_t parent;                // 0 when the slot is free
+    uint32_t ino;                   // 0 caches a failed lookup
+    uint8_t name_len;
+    char name[EXT2_DCACHE_NAME_LEN];
+    uint64_t last_used;
+    struct ext2_dentry *hash_next;
+};
+
+struct ext2_stats {
+    uint64_t inode_hits;
+    uint64_t inode_misses;
+    uint64_t dcache_hits;
+    uint64_t dcache_misses;
+    uint64_t dir_blocks_scanned;
+    uint64_t runs;                  // contiguous runs read
+    uint64_t direct_bytes;          // read straight from the device into the caller's buffer
+    uint64_t cached_bytes;          // read through the page cache
+};
+
+struct ext2_fs {
+    struct block_device *dev;
+    struct cache_object *cache;     // the whole device, metadata and small reads go through it
+    uint64_t part_offset;           // bytes
+    struct ext2_superblock sb;
+    uint32_t block_size;
+    uint32_t inode_size;
+    uint32_t groups;
+    struct ext2_group_desc *gdt;
+    int gdt_pages;
+    struct ext2_cached_inode inodes[EXT2_INODE_CACHE_SIZE];
+    struct ext2_cached_inode *inode_hash[EXT2_INODE_HASH_SIZE];
+    struct ext2_dentry dentries[EXT2_DCACHE_SIZE];
+    struct ext2_dentry *dentry_hash[EXT2_DCACHE_HASH_SIZE];
+    uint64_t clock;                 // LRU stamp for both caches
+    struct ext2_stats stats;
+};
+
+struct ext2_file {
+    struct ext2_fs *fs;
+    uint32_t ino;
+    uint64_t size;
+    uint16_t mode;
+    uint64_t pos;
+    struct ext2_run run;            // last run looked up
+};
+
+typedef void (*ext2_dir_cb)(const char *name, int name_len, uint32_t ino, uint8_t file_type, void *arg);
+
+struct ext2_fs *ext2_mount(struct block_device *dev);
+struct ext2_fs *ext2_mount_first(void);
+int ext2_lookup(struct ext2_fs *fs, const char *path, uint32_t *ino);
+int ext2_open(struct ext2_fs *fs, const char *path, struct ext2_file *file);
+int64_t ext2_read(struct ext2_file *file, void *buf, uint64_t len);
+int64_t ext2_pread(struct ext2_file *file, uint64_t offset, void *buf, uint64_t len);
+int ext2_readdir(struct ext2_fs *fs, const char *path, ext2_dir_cb cb, void *arg);
+void ext2_stats_dump(struct ext2_fs *fs);
+void ext2_benchmark(struct ext2_fs *fs, const char *path);
+
+#endif
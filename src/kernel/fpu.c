@@ -0,0 +1,215 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "printk.h"
+#include "string.h"
+
+// Lazy FPU switching: the kernel itself is built without SSE, so interrupts
+// never touch the FPU registers. fpu_switch() only sets CR0.TS when another
+// context owns the registers, and the first FPU/SSE instruction after that
+// raises #NM (vector 7), which saves the owner and loads the new context.
+
+#define FPU_SAVE_FXSAVE 0
+#define FPU_SAVE_XSAVE 1
+#define FPU_SAVE_XSAVEOPT 2
+
+static int save_method = FPU_SAVE_FXSAVE;
+static uint64_t xcr0 = 0;
+static uint32_t state_size = 512;
+
+// per-CPU: whose registers are live, and which context is running
+static struct fpu_context *fpu_owner[MAX_CPUS];
+static struct fpu_context *fpu_current[MAX_CPUS];
+static int kernel_fpu_depth[MAX_CPUS];
+static unsigned long kernel_fpu_flags[MAX_CPUS];
+
+// context of kmain and everything that runs before processes exist
+static uint8_t boot_fpu_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+static struct fpu_context boot_fpu_ctx;
+
+static inline void xsetbv(uint32_t reg, uint64_t value) {
+    __asm__ volatile("xsetbv" : : "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void clts(void) {
+    __asm__ volatile("clts");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static void fpu_save(struct fpu_context *ctx) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    switch (save_method) {
+        case FPU_SAVE_XSAVEOPT:
+            __asm__ volatile("xsaveopt64 (%0)" : : "r"(ctx->state), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_SAVE_XSAVE:
+            __asm__ volatile("xsave64 (%0)" : : "r"(ctx->state), "a"(lo), "d"(hi) : "memory");
+            break;
+        default:
+            __asm__ volatile("fxsave64 (%0)" : : "r"(ctx->state) : "memory");
+            break;
+    }
+}
+
+static void fpu_restore(struct fpu_context *ctx) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    if (save_method == FPU_SAVE_FXSAVE) {
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(ctx->state) : "memory");
+    } else {
+        __asm__ volatile("xrstor64 (%0)" : : "r"(ctx->state), "a"(lo), "d"(hi) : "memory");
+    }
+}
+
+// fresh register state for a context that never used the FPU
+static void fpu_load_init_state(void) {
+    uint32_t mxcsr = FPU_MXCSR_DEFAULT;
+    __asm__ volatile("fninit");
+    __asm__ volatile("ldmxcsr %0" : : "m"(mxcsr));
+    if (xcr0 & XCR0_AVX) {
+        __asm__ volatile("vzeroall");
+    }
+}
+
+// #NM: TS was set and the running context wants the FPU back
+static int fpu_nm_handler(struct interrupt_frame *frame, void *arg) {
+    (void)frame;
+    (void)arg;
+    int cpu = this_cpu_id();
+    struct fpu_context *cur = fpu_current[cpu];
+
+    clts();
+    if (fpu_owner[cpu] == cur) {
+        return IRQ_HANDLED;
+    }
+    if (fpu_owner[cpu]) {
+        fpu_save(fpu_owner[cpu]);
+    }
+    if (cur->used) {
+        fpu_restore(cur);
+    } else {
+        fpu_load_init_state();
+        cur->used = 1;
+    }
+    fpu_owner[cpu] = cur;
+    return IRQ_HANDLED;
+}
+
+void fpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_1_EDX_SSE) || !(edx & CPUID_1_EDX_FXSR)) {
+        printk("FPU: no SSE/FXSR, leaving FPU disabled\n");
+        return;
+    }
+
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+    if (ecx & CPUID_1_ECX_XSAVE) {
+        write_cr4(read_cr4() | CR4_OSXSAVE);
+        xcr0 = XCR0_X87 | XCR0_SSE;
+        if (ecx & CPUID_1_ECX_AVX) {
+            xcr0 |= XCR0_AVX;
+        }
+        xsetbv(0, xcr0);
+
+        // ebx of leaf 0xD/0 is the save area size for what XCR0 enables
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        state_size = ebx;
+        cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+        save_method = (eax & 1) ? FPU_SAVE_XSAVEOPT : FPU_SAVE_XSAVE;
+    }
+    if (state_size > FPU_STATE_SIZE) {
+        printk("FPU: xsave area of %u bytes too large, falling back to fxsave\n", state_size);
+        write_cr4(read_cr4() & ~CR4_OSXSAVE);
+        xcr0 = 0;
+        state_size = 512;
+        save_method = FPU_SAVE_FXSAVE;
+    }
+
+    register_vector(7, fpu_nm_handler, NULL, 0);
+
+    int cpu = this_cpu_id();
+    fpu_context_init(&boot_fpu_ctx, boot_fpu_state);
+    fpu_owner[cpu] = NULL;
+    fpu_current[cpu] = &boot_fpu_ctx;
+    kernel_fpu_depth[cpu] = 0;
+    stts();
+
+    printk("FPU: %s, xcr0=0x%lx, state size %u bytes\n",
+           save_method == FPU_SAVE_XSAVEOPT ? "xsaveopt" :
+           save_method == FPU_SAVE_XSAVE ? "xsave" : "fxsave",
+           xcr0, state_size);
+}
+
+// state must be FPU_STATE_SIZE bytes aligned to FPU_STATE_ALIGN (a page frame works)
+void fpu_context_init(struct fpu_context *ctx, void *state) {
+    ctx->state = state;
+    ctx->used = 0;
+    memset(state, 0, FPU_STATE_SIZE);
+}
+
+// forget a dying context so its state is never saved into freed memory
+void fpu_context_release(struct fpu_context *ctx) {
+    int cpu = this_cpu_id();
+    if (fpu_owner[cpu] == ctx) {
+        fpu_owner[cpu] = NULL;
+    }
+    if (fpu_current[cpu] == ctx) {
+        fpu_current[cpu] = &boot_fpu_ctx;
+    }
+}
+
+// called on every context switch, does not touch the FPU registers
+void fpu_switch(struct fpu_context *next) {
+    int cpu = this_cpu_id();
+    fpu_current[cpu] = next;
+    if (fpu_owner[cpu] == next) {
+        clts();
+    } else {
+        stts();
+    }
+}
+
+// Brackets SIMD code in the kernel. The registers of whoever owns the FPU are
+// saved first, interrupts stay off until kernel_fpu_end() so an IRQ can't
+// nest a second user of the registers.
+void kernel_fpu_begin(void) {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0\n\t"
+                     "cli"
+                     : "=r"(flags) : : "memory");
+    int cpu = this_cpu_id();
+    if (kernel_fpu_depth[cpu]++ > 0) {
+        return;
+    }
+    kernel_fpu_flags[cpu] = flags;
+    clts();
+    if (fpu_owner[cpu]) {
+        fpu_save(fpu_owner[cpu]);
+        fpu_owner[cpu] = NULL;
+    }
+}
+
+void kernel_fpu_end(void) {
+    int cpu = this_cpu_id();
+    if (--kernel_fpu_depth[cpu] > 0) {
+        return;
+    }
+    // the running context reloads its registers on its next FPU instruction
+    stts();
+    if (kernel_fpu_flags[cpu] & 0x200) {
+        __asm__ volatile("sti");
+    }
+}
+
+uint32_t fpu_state_size(void) {
+    return state_size;
+}
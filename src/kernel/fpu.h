@@ -0,0 +1,31 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// XCR0 state components
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+
+#define FPU_STATE_SIZE 4096         // one page, fits x87/SSE/AVX (and AVX-512) xsave areas
+#define FPU_STATE_ALIGN 64          // xsave needs 64, fxsave 16
+#define FPU_MXCSR_DEFAULT 0x1F80    // all SSE exceptions masked, round to nearest
+
+// FPU/SSE register state of one execution context (process, kernel thread, ...)
+// the registers are only saved when another context actually touches the FPU
+struct fpu_context {
+    uint8_t *state;             // FPU_STATE_SIZE bytes, FPU_STATE_ALIGN aligned
+    int used;                   // state holds registers to restore
+};
+
+void fpu_init(void);
+void fpu_context_init(struct fpu_context *ctx, void *state);
+void fpu_context_release(struct fpu_context *ctx);
+void fpu_switch(struct fpu_context *next);
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+uint32_t fpu_state_size(void);
+
+#endif
@@ -0,0 +1,181 @@
+#include "initcall.h"
+#include "tsc.h"
+#include "printk.h"
+#include "string.h"
+#include "tunable.h"
+
+// boot timeline and the initcall runner. Timestamps are raw TSC from kmain on, they're only turned
+// into microseconds when printed since the TSC gets calibrated partway through boot
+
+static uint64_t boot_tsc = 0;
+static struct boot_phase phases[BOOT_MAX_PHASES];
+static int nphases = 0;
+static struct initcall *calls = NULL;
+static int ncalls = 0;
+// 0 finishes every phase right after its start, the one after another boot to time overlap against
+TUNABLE(initcall_overlap, int, 1);
+
+/*-------------------Timeline-------------------*/
+
+// first thing kmain does, everything is timed from here
+void boot_timeline_init(void) {
+    boot_tsc = rdtsc();
+}
+
+// returns the entry for boot_phase_end, -1 once the timeline is full
+int boot_phase_begin(const char *name) {
+    if (nphases == BOOT_MAX_PHASES) return -1;
+    struct boot_phase *p = &phases[nphases];
+    p->name = name;
+    p->start = rdtsc() - boot_tsc;
+    p->started = 0;
+    p->finish = 0;
+    p->done = 0;
+    p->failed = 0;
+    return nphases++;
+}
+
+void boot_phase_end(int phase, int failed) {
+    if (phase < 0) return;
+    phases[phase].done = rdtsc() - boot_tsc;
+    if (!phases[phase].started) phases[phase].started = phases[phase].done;
+    phases[phase].failed = failed;
+}
+
+// one line per phase in the order they started. A phase that finished in the background shows how
+// long it ran by itself and how long boot then waited for it
+void boot_timeline_print(void) {
+    uint64_t now = rdtsc() - boot_tsc;
+    uint64_t background = 0;
+    uint64_t waited = 0;
+    printk("\n======== Boot timeline ========\n");
+    for (int i = 0; i < nphases; i++) {
+        struct boot_phase *p = &phases[i];
+        if (!p->done) {
+            printk("  %s: +%lu us, still running\n", p->name, TSC_cycles_to_us(p->start));
+            continue;
+        }
+        printk("  %s: +%lu us, %lu us", p->name, TSC_cycles_to_us(p->start),
+               TSC_cycles_to_us(p->started - p->start));
+        if (p->finish) {
+            printk(", then %lu us in the background and %lu us waiting",
+                   TSC_cycles_to_us(p->finish - p->started), TSC_cycles_to_us(p->done - p->finish));
+            background += p->finish - p->started;
+            waited += p->done - p->finish;
+        }
+        printk("%s\n", p->failed ? " (failed)" : "");
+    }
+    printk("  main loop at +%lu us, %lu us of background work overlapped, %lu us spent waiting on it\n",
+           TSC_cycles_to_us(now), TSC_cycles_to_us(background), TSC_cycles_to_us(waited));
+}
+
+/*-------------------Initcalls-------------------*/
+
+static struct initcall *find_call(const char *name) {
+    for (int i = 0; i < ncalls; i++) {
+        if (strcmp(calls[i].name, name) == 0) return &calls[i];
+    }
+    return NULL;
+}
+
+// unknown names were reported by initcalls_run and don't hold anything up
+static int deps_done(const struct initcall *c) {
+    for (int i = 0; i < INITCALL_MAX_DEPS && c->deps[i]; i++) {
+        struct initcall *dep = find_call(c->deps[i]);
+        if (dep && dep->state != INITCALL_DONE) return 0;
+    }
+    return 1;
+}
+
+static void start_call(struct initcall *c) {
+    c->phase = boot_phase_begin(c->name);
+    int err = c->start ? c->start() : 0;
+    if (c->phase >= 0) phases[c->phase].started = rdtsc() - boot_tsc;
+    if (err || !c->finish) {
+        c->state = INITCALL_DONE;
+        boot_phase_end(c->phase, err != 0);
+    } else {
+        c->state = INITCALL_STARTED;
+    }
+}
+
+static void finish_call(struct initcall *c) {
+    if (c->state != INITCALL_STARTED) return;
+    if (c->phase >= 0) phases[c->phase].finish = rdtsc() - boot_tsc;
+    int err = c->finish();
+    c->state = INITCALL_DONE;
+    boot_phase_end(c->phase, err != 0);
+}
+
+// a started phase that the first blocked phase (in table order) is waiting for
+static struct initcall *blocking_dep(void) {
+    for (int i = 0; i < ncalls; i++) {
+        if (calls[i].state != INITCALL_WAITING) continue;
+        for (int j = 0; j < INITCALL_MAX_DEPS && calls[i].deps[j]; j++) {
+            struct initcall *dep = find_call(calls[i].deps[j]);
+            if (dep && dep->state == INITCALL_STARTED) return dep;
+        }
+    }
+    return NULL;
+}
+
+// starts the first phase in table order whose dependencies are done, and only finishes a pending
+// phase when nothing else can start. Everything is done on return except INITCALL_DEFER phases.
+// -1 for a dependency cycle, those phases still run in table order
+int initcalls_run(struct initcall *table, int n) {
+    calls = table;
+    ncalls = n;
+    for (int i = 0; i < n; i++) {
+        calls[i].state = INITCALL_WAITING;
+        calls[i].phase = -1;
+        for (int j = 0; j < INITCALL_MAX_DEPS && calls[i].deps[j]; j++) {
+            if (!find_call(calls[i].deps[j])) {
+                printk("initcall %s: unknown dependency %s\n", calls[i].name, calls[i].deps[j]);
+            }
+        }
+    }
+
+    while (1) {
+        int started = 0;
+        for (int i = 0; i < n; i++) {
+            if (calls[i].state == INITCALL_WAITING && deps_done(&calls[i])) {
+                start_call(&calls[i]);
+                if (!initcall_overlap) finish_call(&calls[i]);
+                started = 1;
+                break;
+            }
+        }
+        if (started) continue;
+        struct initcall *dep = blocking_dep();
+        if (!dep) break;
+        finish_call(dep);
+    }
+
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        if (calls[i].state == INITCALL_WAITING) {
+            printk("initcall %s: dependency cycle\n", calls[i].name);
+            start_call(&calls[i]);
+            finish_call(&calls[i]);
+            ret = -1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (!(calls[i].flags & INITCALL_DEFER)) finish_call(&calls[i]);
+    }
+    return ret;
+}
+
+// collects a deferred phase, 0 if it succeeded (or was never registered)
+int initcall_finish(const char *name) {
+    struct initcall *c = find_call(name);
+    if (!c) return 0;
+    finish_call(c);
+    return c->phase >= 0 ? -phases[c->phase].failed : 0;
+}
+
+void initcalls_finish_all(void) {
+    for (int i = 0; i < ncalls; i++) {
+        finish_call(&calls[i]);
+    }
+}
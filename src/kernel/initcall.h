@@ -0,0 +1,54 @@
+#ifndef INITCALL_H
+#define INITCALL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// boot phases with dependencies. A phase either runs to completion in start, or start kicks off
+// something that completes by itself (a device reset, a timer one-shot) and finish collects the
+// result. Finishing is put off until a later phase depends on it, so independent work overlaps
+#define INITCALL_MAX_DEPS 4
+#define BOOT_MAX_PHASES 32
+
+#define INITCALL_DEFER 0x1                  // may stay pending past initcalls_run, see initcall_finish
+
+enum initcall_state {
+    INITCALL_WAITING,
+    INITCALL_STARTED,                       // finish still has to run
+    INITCALL_DONE,
+};
+
+struct initcall {
+    const char *name;
+    int (*start)(void);                     // nonzero is a failure, reported in the timeline
+    int (*finish)(void);                    // NULL when start does everything
+    const char *deps[INITCALL_MAX_DEPS];    // phases that have to be done first, NULL terminated
+    uint32_t flags;
+    enum initcall_state state;
+    int phase;                              // its timeline entry
+};
+
+// deps are names, NULL for none
+#define INITCALL(name, start, finish, flags, ...) \
+    { name, start, finish, { __VA_ARGS__ }, flags, INITCALL_WAITING, -1 }
+
+// one timeline entry, TSC cycles since kmain
+struct boot_phase {
+    const char *name;
+    uint64_t start;
+    uint64_t started;                       // start returned
+    uint64_t finish;                        // finish called, 0 for synchronous phases
+    uint64_t done;
+    int failed;
+};
+
+void boot_timeline_init(void);
+int boot_phase_begin(const char *name);
+void boot_phase_end(int phase, int failed);
+void boot_timeline_print(void);
+
+int initcalls_run(struct initcall *calls, int n);
+int initcall_finish(const char *name);
+void initcalls_finish_all(void);
+
+#endif
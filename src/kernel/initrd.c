@@ -0,0 +1,192 @@
+#include "initrd.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+#include "tsc.h"
+
+// initial ramdisk: a ustar archive GRUB loads as a module, indexed in place, nothing is copied
+
+static struct initrd_file files[INITRD_MAX_FILES];
+static struct initrd_file *hash_table[INITRD_HASH_SIZE];
+static int num_files = 0;
+
+static uint64_t parse_octal(const char *s, int len) {
+    uint64_t val = 0;
+    for (int i = 0; i < len && s[i] >= '0' && s[i] <= '7'; i++) {
+        val = val * 8 + (s[i] - '0');
+    }
+    return val;
+}
+
+static uint32_t name_hash(const char *name) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h % INITRD_HASH_SIZE;
+}
+
+// "./a/b/", "a/b" and prefix "x" + "a" all become "/a/b" style paths, 0 if it doesn't fit
+static int build_name(char *out, const struct tar_header *hdr) {
+    int len = 0;
+    const char *parts[2] = { hdr->prefix, hdr->name };
+    int limits[2] = { sizeof(hdr->prefix), sizeof(hdr->name) };
+    for (int p = 0; p < 2; p++) {
+        const char *s = parts[p];
+        int i = 0;
+        if (s[0] == '\0') continue;
+        if (s[0] == '.' && (s[1] == '/' || s[1] == '\0')) i = 1;
+        while (i < limits[p] && s[i] == '/') i++;
+        if (i < limits[p] && s[i]) {
+            if (len + 1 >= INITRD_NAME_LEN) return 0;
+            out[len++] = '/';
+        }
+        for (; i < limits[p] && s[i]; i++) {
+            if (len + 1 >= INITRD_NAME_LEN) return 0;
+            out[len++] = s[i];
+        }
+    }
+    while (len > 1 && out[len - 1] == '/') len--;
+    if (len == 0) out[len++] = '/';
+    out[len] = '\0';
+    return len;
+}
+
+static int header_valid(const struct tar_header *hdr) {
+    if (memcmp(hdr->magic, TAR_MAGIC, 5) != 0) return 0;
+    // checksum is taken with the checksum field as spaces
+    const uint8_t *bytes = (const uint8_t *)hdr;
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        int in_chksum = i >= 148 && i < 156;
+        sum += in_chksum ? ' ' : bytes[i];
+    }
+    return sum == parse_octal(hdr->chksum, sizeof(hdr->chksum));
+}
+
+int initrd_init(void) {
+    const struct boot_module *mod = MMU_find_module(INITRD_MODULE_NAME);
+    if (!mod) mod = MMU_get_module(0);
+    if (!mod) {
+        printk("initrd: no boot module\n");
+        return -1;
+    }
+    if (!MMU_direct_mapped(mod->start, mod->end - mod->start)) {
+        printk("initrd: module at 0x%lx is outside the direct map\n", mod->start);
+        return -1;
+    }
+    const uint8_t *base = phys_to_virt(mod->start);
+    uint64_t size = mod->end - mod->start;
+    uint64_t off = 0;
+
+    while (off + TAR_BLOCK_SIZE <= size) {
+        const struct tar_header *hdr = (const struct tar_header *)(base + off);
+        if (hdr->name[0] == '\0') break;    // two zero blocks end the archive
+        if (!header_valid(hdr)) {
+            printk("initrd: bad header at offset %lu\n", off);
+            return -1;
+        }
+        uint64_t fsize = parse_octal(hdr->size, sizeof(hdr->size));
+        uint64_t data_off = off + TAR_BLOCK_SIZE;
+        if (data_off + fsize > size) {
+            printk("initrd: %s runs past the end of the module\n", hdr->name);
+            return -1;
+        }
+        int is_file = hdr->typeflag == TAR_TYPE_FILE || hdr->typeflag == TAR_TYPE_FILE_OLD;
+        if (is_file || hdr->typeflag == TAR_TYPE_DIR) {
+            if (num_files == INITRD_MAX_FILES) {
+                printk("initrd: more than %d files, ignoring the rest\n", INITRD_MAX_FILES);
+                break;
+            }
+            struct initrd_file *f = &files[num_files];
+            if (build_name(f->name, hdr)) {
+                f->data = base + data_off;
+                f->size = is_file ? fsize : 0;
+                f->is_dir = !is_file;
+                uint32_t slot = name_hash(f->name);
+                f->hash_next = hash_table[slot];
+                hash_table[slot] = f;
+                num_files++;
+            }
+        }
+        off = data_off + (fsize + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+    printk("initrd: %d entries in %lu KB at 0x%lx\n", num_files, size / 1024, mod->start);
+    return num_files;
+}
+
+int initrd_count(void) {
+    return num_files;
+}
+
+const struct initrd_file *initrd_get(int index) {
+    if (index < 0 || index >= num_files) return NULL;
+    return &files[index];
+}
+
+const struct initrd_file *initrd_find(const char *path) {
+    for (struct initrd_file *f = hash_table[name_hash(path)]; f; f = f->hash_next) {
+        if (strcmp(f->name, path) == 0) return f;
+    }
+    return NULL;
+}
+
+/*-------------------Benchmark-------------------*/
+
+static uint64_t checksum(const uint8_t *data, uint64_t len) {
+    uint64_t sum = 0;
+    uint64_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        sum += v;
+    }
+    for (; i < len; i++) sum += data[i];
+    return sum;
+}
+
+static void print_rate(const char *what, uint64_t bytes, uint64_t us) {
+    if (us == 0) us = 1;
+    uint64_t tenths = bytes * 10 / us;
+    printk("initrd bench: %s: %lu KB in %lu us, %lu.%lu MB/s\n", what, bytes / 1024, us, tenths / 10, tenths % 10);
+}
+
+// reading the largest file in place against copying it out first, as a disk backed read would
+void initrd_benchmark(void) {
+    const struct initrd_file *big = NULL;
+    for (int i = 0; i < num_files; i++) {
+        if (!files[i].is_dir && (!big || files[i].size > big->size)) big = &files[i];
+    }
+    if (!big || big->size == 0) return;
+
+    int pages = (big->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint8_t *buf = MMU_alloc_pages(pages);
+    if (!buf) return;
+    memset(buf, 0, pages * PAGE_SIZE);
+
+    uint64_t best_direct = (uint64_t)-1, best_copy = (uint64_t)-1;
+    uint64_t sum_direct = 0, sum_copy = 0;
+    for (int pass = 0; pass < INITRD_BENCH_PASSES; pass++) {
+        uint64_t start = rdtsc();
+        sum_direct = checksum(big->data, big->size);
+        uint64_t us = TSC_cycles_to_us(rdtsc() - start);
+        if (us < best_direct) best_direct = us;
+
+        start = rdtsc();
+        memcpy(buf, big->data, big->size);
+        sum_copy = checksum(buf, big->size);
+        us = TSC_cycles_to_us(rdtsc() - start);
+        if (us < best_copy) best_copy = us;
+    }
+    printk("initrd bench: %s, %lu bytes\n", big->name, big->size);
+    print_rate("in place", big->size, best_direct);
+    print_rate("copied", big->size, best_copy);
+    printk("initrd bench: checksums %s\n", sum_direct == sum_copy ? "match" : "DIFFER");
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 1000; i++) initrd_find(big->name);
+    printk("initrd bench: lookup %lu ns\n", TSC_cycles_to_us(rdtsc() - start));
+    MMU_free_pages(buf, pages);
+}
@@ -0,0 +1,55 @@
+#ifndef INITRD_H
+#define INITRD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define INITRD_MODULE_NAME "initrd"     // module2 argument in grub.cfg
+#define INITRD_MAX_FILES 256
+#define INITRD_HASH_SIZE 128
+#define INITRD_NAME_LEN 128
+#define INITRD_BENCH_PASSES 4
+
+// ustar header, 512 bytes, numbers are octal text
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAGIC "ustar"
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_FILE_OLD '\0'
+#define TAR_TYPE_DIR '5'
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+// file contents stay where GRUB loaded them, data points into the module
+struct initrd_file {
+    char name[INITRD_NAME_LEN];     // absolute, "/dir/file"
+    const uint8_t *data;
+    uint64_t size;
+    int is_dir;
+    struct initrd_file *hash_next;
+};
+
+int initrd_init(void);
+int initrd_count(void);
+const struct initrd_file *initrd_get(int index);
+const struct initrd_file *initrd_find(const char *path);
+void initrd_benchmark(void);
+
+#endif
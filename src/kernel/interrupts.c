@@ -5,15 +5,74 @@
 #include "printk.h"
 #include "serial.h"
 #include "mmu.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "process.h"
+#include "trace.h"
 
 idt_entry_t idt[256];
 idt_ptr_t idtp;
 extern uint64_t gdt64;
-struct tss_struct tss;
+struct tss_struct cpu_tss[MAX_CPUS];
 
-static char double_fault_stack[4096] __attribute__((aligned(16)));
-static char page_fault_stack[4096] __attribute__((aligned(16)));
-static char general_protection_stack[4096] __attribute__((aligned(16)));
+static char double_fault_stack[MAX_CPUS][4096] __attribute__((aligned(16)));
+static char page_fault_stack[MAX_CPUS][4096] __attribute__((aligned(16)));
+static char general_protection_stack[MAX_CPUS][4096] __attribute__((aligned(16)));
+
+// indexed by vector, interrupt_handler makes one indirect call through it
+static struct vector_entry vector_table[NUM_VECTORS];
+static struct vector_action action_pool[MAX_VECTOR_ACTIONS];
+static struct vector_action *free_actions = NULL;
+
+// adapts the (irq, error_code, arg) handlers of IRQ_set_handler to vector handlers
+struct irq_action {
+    irq_handler_t handler;
+    void *arg;
+    int irq;
+};
+static struct irq_action irq_actions[MAX_VECTOR_ACTIONS];
+static int num_irq_actions = 0;
+
+#if IRQ_STATS
+static struct irq_vector_stats irq_stats[MAX_CPUS][NUM_VECTORS];
+#endif
+
+static const char *exception_names[NUM_EXCEPTIONS] = {
+    "Division by Zero Exception",
+    "Debug Exception",
+    "Non-maskable Interrupt",
+    "Breakpoint Exception",
+    "Overflow Exception",
+    "Bound Range Exceeded Exception",
+    "Invalid Opcode Exception",
+    "Device Not Available Exception",
+    "Double Fault Exception",
+    "Coprocessor Segment Overrun",
+    "Invalid TSS Exception",
+    "Segment Not Present Exception",
+    "Stack-Segment Fault Exception",
+    "General Protection Fault",
+    "Page Fault Exception",
+    "Reserved Exception",
+    "x87 Floating-Point Exception",
+    "Alignment Check Exception",
+    "Machine Check Exception",
+    "SIMD Floating-Point Exception",
+    "Virtualization Exception",
+    "Control Protection Exception",
+    "Reserved Exception",
+    "Reserved Exception",
+    "Reserved Exception",
+    "Reserved Exception",
+    "Reserved Exception",
+    "Reserved Exception",
+    "Hypervisor Injection Exception",
+    "VMM Communication Exception",
+    "Security Exception",
+    "Reserved Exception",
+};
+
+static void vector_table_init(void);
 
 static inline uint8_t inb(uint16_t port) {
     uint8_t ret;
@@ -25,6 +84,14 @@ static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
+static inline int are_interrupts_enabled() {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0"
+                     : "=r"(flags));
+    return flags & 0x200; // Check IF (Interrupt Flag) bit
+}
+
 static inline void io_wait(void) {
     outb(0x80, 0);
 }
@@ -71,12 +138,9 @@ void PIC_remap(uint8_t offset1, uint8_t offset2) {
 }
 
 void IRQ_init(void) {
-    for (int i = 0; i < 16; i++) {
-        irq_table[i].handler = NULL;
-        irq_table[i].arg = NULL;
-    }
+    vector_table_init();
     idt_init();
-    PIC_remap(0x20, 0x28);
+    PIC_remap(IRQ_BASE_VECTOR, IRQ_BASE_VECTOR + 8);
     IRQ_set_handler(1, kb_interrupt_handler, NULL);
     IRQ_clear_mask(1);
     IRQ_set_handler(4, serial_interrupt_handler, NULL);
@@ -117,65 +181,17 @@ void IRQ_clear_mask(uint8_t irq) {
 }
 
 void idt_init(void) {
-    setup_tss();
+    setup_tss(0);
     idtp.limit = (sizeof(idt_entry_t) * 256) - 1;
     idtp.base = (uint64_t)&idt;
     memset(&idt, 0, sizeof(idt_entry_t) * 256);
     
-    // exception handlers (0-31)
-    idt_set_gate(0, (uint64_t)isr_0, 0x08, 0, 0x8E);
-    idt_set_gate(1, (uint64_t)isr_1, 0x08, 0, 0x8E);
-    idt_set_gate(2, (uint64_t)isr_2, 0x08, 0, 0x8E);
-    idt_set_gate(3, (uint64_t)isr_3, 0x08, 0, 0x8E);
-    idt_set_gate(4, (uint64_t)isr_4, 0x08, 0, 0x8E);
-    idt_set_gate(5, (uint64_t)isr_5, 0x08, 0, 0x8E);
-    idt_set_gate(6, (uint64_t)isr_6, 0x08, 0, 0x8E);
-    idt_set_gate(7, (uint64_t)isr_7, 0x08, 0, 0x8E);
-    idt_set_gate(8, (uint64_t)isr_8, 0x08, 1, 0x8E);  // Double Fault uses IST1
-    idt_set_gate(9, (uint64_t)isr_9, 0x08, 0, 0x8E);
-    idt_set_gate(10, (uint64_t)isr_10, 0x08, 0, 0x8E);
-    idt_set_gate(11, (uint64_t)isr_11, 0x08, 0, 0x8E);
-    idt_set_gate(12, (uint64_t)isr_12, 0x08, 0, 0x8E);
-    idt_set_gate(13, (uint64_t)isr_13, 0x08, 3, 0x8E); // GP Fault uses IST3
-    idt_set_gate(14, (uint64_t)isr_14, 0x08, 2, 0x8E); // Page Fault uses IST2
-    idt_set_gate(15, (uint64_t)isr_15, 0x08, 0, 0x8E);
-    idt_set_gate(16, (uint64_t)isr_16, 0x08, 0, 0x8E);
-    idt_set_gate(17, (uint64_t)isr_17, 0x08, 0, 0x8E);
-    idt_set_gate(18, (uint64_t)isr_18, 0x08, 0, 0x8E);
-    idt_set_gate(19, (uint64_t)isr_19, 0x08, 0, 0x8E);
-    idt_set_gate(20, (uint64_t)isr_20, 0x08, 0, 0x8E);
-    idt_set_gate(21, (uint64_t)isr_21, 0x08, 0, 0x8E);
-    idt_set_gate(22, (uint64_t)isr_22, 0x08, 0, 0x8E);
-    idt_set_gate(23, (uint64_t)isr_23, 0x08, 0, 0x8E);
-    idt_set_gate(24, (uint64_t)isr_24, 0x08, 0, 0x8E);
-    idt_set_gate(25, (uint64_t)isr_25, 0x08, 0, 0x8E);
-    idt_set_gate(26, (uint64_t)isr_26, 0x08, 0, 0x8E);
-    idt_set_gate(27, (uint64_t)isr_27, 0x08, 0, 0x8E);
-    idt_set_gate(28, (uint64_t)isr_28, 0x08, 0, 0x8E);
-    idt_set_gate(29, (uint64_t)isr_29, 0x08, 0, 0x8E);
-    idt_set_gate(30, (uint64_t)isr_30, 0x08, 0, 0x8E);
-    idt_set_gate(31, (uint64_t)isr_31, 0x08, 0, 0x8E);
-    
-    // IRQ handlers (32-47)
-    idt_set_gate(32, (uint64_t)isr_32, 0x08, 0, 0x8E); // Timer
-    idt_set_gate(33, (uint64_t)isr_33, 0x08, 0, 0x8E); // Keyboard
-    idt_set_gate(34, (uint64_t)isr_34, 0x08, 0, 0x8E);
-    idt_set_gate(35, (uint64_t)isr_35, 0x08, 0, 0x8E);
-    idt_set_gate(36, (uint64_t)isr_36, 0x08, 0, 0x8E); // Serial
-    idt_set_gate(37, (uint64_t)isr_37, 0x08, 0, 0x8E);
-    idt_set_gate(38, (uint64_t)isr_38, 0x08, 0, 0x8E);
-    idt_set_gate(39, (uint64_t)isr_39, 0x08, 0, 0x8E);
-    idt_set_gate(40, (uint64_t)isr_40, 0x08, 0, 0x8E);
-    idt_set_gate(41, (uint64_t)isr_41, 0x08, 0, 0x8E);
-    idt_set_gate(42, (uint64_t)isr_42, 0x08, 0, 0x8E);
-    idt_set_gate(43, (uint64_t)isr_43, 0x08, 0, 0x8E);
-    idt_set_gate(44, (uint64_t)isr_44, 0x08, 0, 0x8E);
-    idt_set_gate(45, (uint64_t)isr_45, 0x08, 0, 0x8E);
-    idt_set_gate(46, (uint64_t)isr_46, 0x08, 0, 0x8E);
-    idt_set_gate(47, (uint64_t)isr_47, 0x08, 0, 0x8E);
-
-    for (int i = 48; i < 256; i++) {
-        idt_set_gate(i, (uint64_t)default_interrupt, 0x08, 0, 0x8E);
+    for (int i = 0; i < NUM_VECTORS; i++) {
+        uint8_t ist = 0;
+        if (i == 8) ist = 1;        // Double Fault uses IST1
+        else if (i == 14) ist = 2;  // Page Fault uses IST2
+        else if (i == 13) ist = 3;  // GP Fault uses IST3
+        idt_set_gate(i, isr_stub_table[i], 0x08, ist, 0x8E);
     }
 
     idt_load();
@@ -191,116 +207,353 @@ void idt_set_gate(uint8_t num, uint64_t handler, uint16_t selector, uint8_t ist,
     idt[num].reserved = 0;
 }
 
-void IRQ_set_handler(int irq, irq_handler_t handler, void* arg) {
-    if (irq >= 0 && irq < 16) {
-        irq_table[irq].handler = handler;
-        irq_table[irq].arg = arg;
-        printk("Handler set for IRQ %d\n", irq);
+/*-------------------Vector dispatch-------------------*/
+
+static int unhandled_vector(struct interrupt_frame *frame, void *arg) {
+    (void)arg;
+    printk("Unhandled Interrupt: %ld\n", frame->int_no);
+    return IRQ_NONE;
+}
+
+// PIC line with nobody listening, interrupt_handler still sends the EOI
+static int unhandled_irq(struct interrupt_frame *frame, void *arg) {
+    (void)frame;
+    (void)arg;
+    return IRQ_NONE;
+}
+
+static int exception_handler(struct interrupt_frame *frame, void *arg) {
+    (void)arg;
+    if (frame->cs & 3) {
+        // only the process dies
+        printk("Process %d: %s at 0x%lx (error 0x%lx)\n", current_process ? current_process->pid : -1,
+               exception_names[frame->int_no], frame->rip, frame->err_code);
+        process_exit(PROCESS_EXIT_FAULT);
+    }
+    printk("%s\n", exception_names[frame->int_no]);
+    if (frame->int_no == 13) {
+        printk("Error code: %lx\n", frame->err_code);
+    } else if (frame->int_no == 8) {
+        // double fault should never return
+        while(1) {
+            __asm__ volatile("cli");
+            __asm__ volatile("hlt");
+        }
+    }
+    return IRQ_HANDLED;
+}
+
+static int page_fault_vector(struct interrupt_frame *frame, void *arg) {
+    (void)arg;
+    page_fault_handler(frame);
+    return IRQ_HANDLED;
+}
+
+static int irq_action_handler(struct interrupt_frame *frame, void *arg) {
+    struct irq_action *action = arg;
+    action->handler(action->irq, frame->err_code, action->arg);
+    return IRQ_HANDLED;
+}
+
+// walks the chain of a vector with more than one handler
+static int shared_vector_handler(struct interrupt_frame *frame, void *arg) {
+    struct vector_entry *v = arg;
+    int ret = IRQ_NONE;
+    for (struct vector_action *a = v->actions; a; a = a->next) {
+        ret |= a->handler(frame, a->arg);
+    }
+    return ret;
+}
+
+// exceptions default to reporting themselves, drivers (#NM, #PF) can still take them over
+static vector_handler_t default_vector_handler(int vec) {
+    if (vec < NUM_EXCEPTIONS) {
+        return exception_handler;
+    }
+    if (vec >= IRQ_BASE_VECTOR && vec < IRQ_BASE_VECTOR + NUM_IRQS) {
+        return unhandled_irq;
+    }
+    return unhandled_vector;
+}
+
+// called with interrupts off, chained actions go back to the pool
+static void reset_vector(int vec) {
+    struct vector_entry *v = &vector_table[vec];
+    v->handler = default_vector_handler(vec);
+    v->arg = NULL;
+    v->flags &= (VEC_F_PIC_EOI | VEC_F_RESERVED | VEC_F_PIC_SPURIOUS);
+    while (v->actions) {
+        struct vector_action *a = v->actions;
+        v->actions = a->next;
+        a->next = free_actions;
+        free_actions = a;
+    }
+}
+
+static struct vector_action *alloc_action(vector_handler_t handler, void *arg) {
+    struct vector_action *a = free_actions;
+    if (!a) {
+        printk("Error: out of vector actions\n");
+        return NULL;
+    }
+    free_actions = a->next;
+    a->handler = handler;
+    a->arg = arg;
+    a->next = NULL;
+    return a;
+}
+
+static void vector_table_init(void) {
+    free_actions = NULL;
+    for (int i = MAX_VECTOR_ACTIONS - 1; i >= 0; i--) {
+        action_pool[i].next = free_actions;
+        free_actions = &action_pool[i];
+    }
+    num_irq_actions = 0;
+    for (int i = 0; i < NUM_VECTORS; i++) {
+        vector_table[i].flags = 0;
+        vector_table[i].actions = NULL;
+        if (i >= IRQ_BASE_VECTOR && i < IRQ_BASE_VECTOR + NUM_IRQS) {
+            vector_table[i].flags = VEC_F_PIC_EOI;
+        }
+        reset_vector(i);
+    }
+    // APIC spurious vector
+    vector_table[0xFF].flags |= VEC_F_RESERVED;
+    // lowest priority line of each PIC, raised when an IRQ goes away before it is acked
+    vector_table[IRQ_BASE_VECTOR + 7].flags |= VEC_F_PIC_SPURIOUS;
+    vector_table[IRQ_BASE_VECTOR + 15].flags |= VEC_F_PIC_SPURIOUS;
+
+    register_vector(14, page_fault_vector, NULL, 0);
+}
+
+// installs handler on vec, returns 0 or -1 if the vector is taken and not shared
+int register_vector(uint8_t vec, vector_handler_t handler, void *arg, uint32_t flags) {
+    struct vector_entry *v = &vector_table[vec];
+    int ret = 0;
+
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+
+    if (!(v->flags & VEC_F_USED)) {
+        v->handler = handler;
+        v->arg = arg;
+        v->flags |= VEC_F_USED | (flags & VEC_F_SHARED);
+    } else if (!(v->flags & VEC_F_SHARED) || !(flags & VEC_F_SHARED)) {
+        printk("Error: vector %d already in use\n", vec);
+        ret = -1;
     } else {
+        // second handler, move the direct one onto the chain first
+        if (!v->actions) {
+            v->actions = alloc_action(v->handler, v->arg);
+        }
+        struct vector_action *a = v->actions ? alloc_action(handler, arg) : NULL;
+        if (!a) {
+            ret = -1;
+        } else {
+            struct vector_action *tail = v->actions;
+            while (tail->next) tail = tail->next;
+            tail->next = a;
+            v->handler = shared_vector_handler;
+            v->arg = v;
+        }
+    }
+
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+    return ret;
+}
+
+int unregister_vector(uint8_t vec, vector_handler_t handler, void *arg) {
+    struct vector_entry *v = &vector_table[vec];
+    int ret = -1;
+
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+
+    if (!v->actions) {
+        if ((v->flags & VEC_F_USED) && v->handler == handler && v->arg == arg) {
+            reset_vector(vec);
+            ret = 0;
+        }
+    } else {
+        struct vector_action **pp = &v->actions;
+        while (*pp && !((*pp)->handler == handler && (*pp)->arg == arg)) {
+            pp = &(*pp)->next;
+        }
+        if (*pp) {
+            struct vector_action *a = *pp;
+            *pp = a->next;
+            a->next = free_actions;
+            free_actions = a;
+            ret = 0;
+        }
+        // back to a direct call once a single handler is left
+        if (v->actions && !v->actions->next) {
+            struct vector_action *last = v->actions;
+            v->handler = last->handler;
+            v->arg = last->arg;
+            v->actions = NULL;
+            last->next = free_actions;
+            free_actions = last;
+        }
+    }
+
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+    return ret;
+}
+
+// hands out a free vector >= DYNAMIC_VECTOR_START (MSI, IPIs), -1 if none are left
+int alloc_vector(vector_handler_t handler, void *arg, uint32_t flags) {
+    for (int vec = DYNAMIC_VECTOR_START; vec < NUM_VECTORS; vec++) {
+        if (vector_table[vec].flags & (VEC_F_USED | VEC_F_RESERVED)) {
+            continue;
+        }
+        if (register_vector(vec, handler, arg, flags) == 0) {
+            return vec;
+        }
+    }
+    printk("Error: no free interrupt vectors\n");
+    return -1;
+}
+
+void free_vector(int vec) {
+    if (vec < DYNAMIC_VECTOR_START || vec >= NUM_VECTORS) {
+        return;
+    }
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    reset_vector(vec);
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
+// legacy PIC handlers, more than one handler on a line is chained (PCI INTx sharing)
+void IRQ_set_handler(int irq, irq_handler_t handler, void* arg) {
+    if (irq < 0 || irq >= NUM_IRQS) {
         printk("Error: Invalid IRQ number %d\n", irq);
+        return;
+    }
+    if (num_irq_actions == MAX_VECTOR_ACTIONS) {
+        printk("Error: out of IRQ handler slots for IRQ %d\n", irq);
+        return;
+    }
+    struct irq_action *action = &irq_actions[num_irq_actions++];
+    action->handler = handler;
+    action->arg = arg;
+    action->irq = irq;
+    if (register_vector(IRQ_BASE_VECTOR + irq, irq_action_handler, action, VEC_F_SHARED) == 0) {
+        printk("Handler set for IRQ %d\n", irq);
     }
 }
 
+// a spurious IRQ7/15 has no bit set in the in-service register
+static int PIC_is_spurious(int irq) {
+    if (irq < 8) {
+        outb(PIC1_COMMAND, PIC_READ_ISR);
+        return !(inb(PIC1_COMMAND) & (1 << irq));
+    }
+    outb(PIC2_COMMAND, PIC_READ_ISR);
+    return !(inb(PIC2_COMMAND) & (1 << (irq - 8)));
+}
+
+DEFINE_TRACEPOINT(irq_entry, "irq", TRACE_BEGIN);
+DEFINE_TRACEPOINT(irq_exit, "irq", TRACE_END);
+
 void interrupt_handler(struct interrupt_frame* frame) {
-    switch (frame->int_no) {
-        // CPU exceptions
-        case 0:
-            printk("Division by Zero Exception\n");
-            break;
-        case 1:
-            printk("Debug Exception\n");
-            break;
-        case 2:
-            printk("Non-maskable Interrupt\n");
-            break;
-        case 3:
-            printk("Breakpoint Exception\n");
-            break;
-        case 4:
-            printk("Overflow Exception\n");
-            break;
-        case 5:
-            printk("Bound Range Exceeded Exception\n");
-            break;
-        case 6:
-            printk("Invalid Opcode Exception\n");
-            break;
-        case 7:
-            printk("Device Not Available Exception\n");
-            break;
-        case 8:
-            printk("Double Fault Exception\n");
-            // double fault should never return
-            while(1) {
-                __asm__ volatile("cli");
-                __asm__ volatile("hlt");
-            }
-            break;
-        case 10:
-            printk("Invalid TSS Exception\n");
-            break;
-        case 11:
-            printk("Segment Not Present Exception\n");
-            break;
-        case 12:
-            printk("Stack-Segment Fault Exception\n");
-            break;
-        case 13:
-            printk("General Protection Fault\n");
-            printk("Error code: %lx\n", frame->err_code);
-            break;
-        case 14:
-            page_fault_handler(frame);
-            break;
-        
-        // hardware interrupts
-        case 33:
-            // keyboard interrupt (IRQ1)
-            if (irq_table[1].handler) {
-                irq_table[1].handler(1, frame->err_code, irq_table[1].arg);
-            } else {
-                inb(PS2_DATA);
-            }
-            PIC_sendEOI(1);
-            break;
-        case 36: 
-            // serial port COM1 interrupt (IRQ4)
-            if (irq_table[4].handler) {
-                irq_table[4].handler(4, frame->err_code, irq_table[4].arg);
-            } else {
-                inb(COM1 + COM_INT_IDENT_REG_OFFSET);
+    struct vector_entry *v = &vector_table[frame->int_no];
+
+    if ((v->flags & VEC_F_PIC_SPURIOUS) && PIC_is_spurious(frame->int_no - IRQ_BASE_VECTOR)) {
+#if IRQ_STATS
+        irq_stats[this_cpu_id()][frame->int_no].spurious++;
+#endif
+        // the master did raise the cascade for a slave spurious IRQ
+        if (frame->int_no - IRQ_BASE_VECTOR >= 8) {
+            outb(PIC1_COMMAND, PIC_EOI);
+        }
+        return;
+    }
+    trace(irq_entry, frame->int_no, frame->err_code);
+
+#if IRQ_STATS
+    uint64_t start = rdtsc();
+    int ret = v->handler(frame, v->arg);
+    uint64_t cycles = rdtsc() - start;
+
+    struct irq_vector_stats *st = &irq_stats[this_cpu_id()][frame->int_no];
+    st->count++;
+    st->total_cycles += cycles;
+    if (cycles > st->max_cycles) st->max_cycles = cycles;
+    if (ret == IRQ_NONE) st->spurious++;
+#else
+    v->handler(frame, v->arg);
+#endif
+
+    if (v->flags & VEC_F_PIC_EOI) {
+        PIC_sendEOI(frame->int_no - IRQ_BASE_VECTOR);
+    }
+    trace(irq_exit, frame->int_no, 0);
+}
+
+void irq_stats_dump(void) {
+#if IRQ_STATS
+    printk("\n======== IRQ Stats ========\n");
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (int vec = 0; vec < NUM_VECTORS; vec++) {
+            struct irq_vector_stats *st = &irq_stats[cpu][vec];
+            if (st->count == 0 && st->spurious == 0) {
+                continue;
             }
-            PIC_sendEOI(4);
-            break;
-            
-        // additional hardware IRQs (34-47)
-        default:
-            if (frame->int_no >= 32 && frame->int_no < 48) {
-                int irq = frame->int_no - 32;
-                if (irq_table[irq].handler)
-                    irq_table[irq].handler(irq, frame->err_code, irq_table[irq].arg);
-                PIC_sendEOI(irq);
-            } else {
-                printk("Unhandled Interrupt: %ld\n", frame->int_no);
+            uint64_t avg = st->count ? st->total_cycles / st->count : 0;
+            printk("  cpu %d vec %d", cpu, vec);
+            if (vec >= IRQ_BASE_VECTOR && vec < IRQ_BASE_VECTOR + NUM_IRQS) {
+                printk(" (IRQ%d)", vec - IRQ_BASE_VECTOR);
             }
-            break;
+            printk(": count=%lu avg=%lu max=%lu cycles, spurious=%lu\n",
+                   st->count, avg, st->max_cycles, st->spurious);
+        }
     }
+    printk("===========================\n\n");
+#else
+    printk("IRQ stats disabled at compile time\n");
+#endif
+}
+
+void irq_stats_reset(void) {
+#if IRQ_STATS
+    memset(irq_stats, 0, sizeof(irq_stats));
+#endif
 }
 
-void setup_tss(void) {
-    memset(&tss, 0, sizeof(tss));
+// every CPU gets its own TSS and IST stacks, loaded into TR of the calling CPU
+void setup_tss(int cpu) {
+    struct tss_struct *tss = &cpu_tss[cpu];
+    memset(tss, 0, sizeof(*tss));
     
     // set up IST entries (stack grows down, so point to the end)
-    tss.ist1 = (uint64_t)&double_fault_stack[sizeof(double_fault_stack)];
-    tss.ist2 = (uint64_t)&page_fault_stack[sizeof(page_fault_stack)];
-    tss.ist3 = (uint64_t)&general_protection_stack[sizeof(general_protection_stack)];
+    tss->ist1 = (uint64_t)&double_fault_stack[cpu][sizeof(double_fault_stack[cpu])];
+    tss->ist2 = (uint64_t)&page_fault_stack[cpu][sizeof(page_fault_stack[cpu])];
+    tss->ist3 = (uint64_t)&general_protection_stack[cpu][sizeof(general_protection_stack[cpu])];
     
     // set I/O permission bitmap offset to the size of the TSS
-    tss.iopb_offset = sizeof(tss);
+    tss->iopb_offset = sizeof(*tss);
     
     // get base address and limit of TSS
-    uint64_t tss_base = (uint64_t)&tss;
-    uint32_t tss_limit = sizeof(tss) - 1;
+    uint64_t tss_base = (uint64_t)tss;
+    uint32_t tss_limit = sizeof(*tss) - 1;
     
     // tss descriptor
     struct tss_gdt_entry tss_entry = {0};
@@ -313,7 +566,7 @@ void setup_tss(void) {
     tss_entry.base_upper = (tss_base >> 32) & 0xFFFFFFFF;
     tss_entry.reserved = 0;
 
-    // 4th entry is tss descriptor
-    memcpy((void*)(&gdt64 + 3), &tss_entry, sizeof(tss_entry));
-    __asm__ volatile("ltr %%ax" : : "a"(0x18));
+    // 4th entry is the BSP's tss descriptor, the APs' follow the user segments
+    memcpy((void*)(&gdt64 + GDT_TSS_SELECTOR(cpu) / 8), &tss_entry, sizeof(tss_entry));
+    __asm__ volatile("ltr %%ax" : : "a"(GDT_TSS_SELECTOR(cpu)));
 }
\ No newline at end of file
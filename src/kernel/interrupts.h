@@ -5,11 +5,6 @@
 
 typedef void (*irq_handler_t)(int irq, int error_code, void* arg);
 
-struct {
-    void *arg;
-    irq_handler_t handler;
-} irq_table[16];
-
 typedef struct {
     uint16_t isr_low;      // the lower 16 bits of the ISR's address
     uint16_t kernel_cs;    // the GDT segment selector that the CPU will load into CS before calling the ISR
@@ -27,7 +22,6 @@ typedef struct {
 
 struct interrupt_frame {
     // pushed by common handler
-    uint64_t ds;
     uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
     uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
     
@@ -43,6 +37,54 @@ struct interrupt_frame {
     uint64_t ss;
 };
 
+// vector layout
+#define NUM_VECTORS 256
+#define NUM_EXCEPTIONS 32
+#define IRQ_BASE_VECTOR 32                  // PIC IRQ 0-15 -> vectors 32-47
+#define NUM_IRQS 16
+#define DYNAMIC_VECTOR_START 48             // MSI and other dynamically allocated vectors
+
+// vector handler return values (used to spot spurious interrupts on shared vectors)
+#define IRQ_NONE 0
+#define IRQ_HANDLED 1
+
+// vector flags
+#define VEC_F_SHARED 0x01                   // more handlers may be chained on the vector
+#define VEC_F_PIC_EOI 0x02                  // PIC line, EOI once all handlers ran
+#define VEC_F_RESERVED 0x04                 // never handed out by alloc_vector
+#define VEC_F_USED 0x08                     // a handler is registered
+#define VEC_F_PIC_SPURIOUS 0x10             // IRQ7/IRQ15, check the PIC ISR before dispatching
+
+// per-CPU, per-vector counters kept by interrupt_handler, build with -DIRQ_STATS=0 to drop them
+#ifndef IRQ_STATS
+#define IRQ_STATS 1
+#endif
+
+#define MAX_VECTOR_ACTIONS 64               // chained handlers across all shared vectors
+
+typedef int (*vector_handler_t)(struct interrupt_frame *frame, void *arg);
+
+// chained handler on a shared vector
+struct vector_action {
+    vector_handler_t handler;
+    void *arg;
+    struct vector_action *next;
+};
+
+struct vector_entry {
+    vector_handler_t handler;               // called directly by interrupt_handler
+    void *arg;
+    uint32_t flags;
+    struct vector_action *actions;          // shared handlers, walked when more than one
+};
+
+struct irq_vector_stats {
+    uint64_t count;
+    uint64_t total_cycles;                  // TSC cycles spent in handlers
+    uint64_t max_cycles;
+    uint64_t spurious;                      // nobody claimed it, or a PIC spurious IRQ
+};
+
 // PIC management
 void PIC_remap(uint8_t offset1, uint8_t offset2);
 void PIC_sendEOI(uint8_t irq);
@@ -57,65 +99,21 @@ void interrupts_init(void);
 
 extern idt_entry_t idt[256];
 extern idt_ptr_t idtp;
-extern struct tss_struct tss;
 
 void IRQ_set_handler(int irq, irq_handler_t handler, void* arg);
+int register_vector(uint8_t vec, vector_handler_t handler, void *arg, uint32_t flags);
+int unregister_vector(uint8_t vec, vector_handler_t handler, void *arg);
+int alloc_vector(vector_handler_t handler, void *arg, uint32_t flags);
+void free_vector(int vec);
 void idt_init(void);
 void idt_set_gate(uint8_t num, uint64_t handler, uint16_t selector, uint8_t ist, uint8_t type_attr);
 extern void idt_load(void);
-void setup_tss(void);
+void setup_tss(int cpu);
 void interrupt_handler(struct interrupt_frame* frame);
-extern void default_interrupt(void);
-
-// isrs
-extern void testirq(void);
-extern void isr_0(void);
-extern void isr_1(void);
-extern void isr_2(void);
-extern void isr_3(void);
-extern void isr_4(void);
-extern void isr_5(void);
-extern void isr_6(void);
-extern void isr_7(void);
-extern void isr_8(void);
-extern void isr_9(void);
-extern void isr_10(void);
-extern void isr_11(void);
-extern void isr_12(void);
-extern void isr_13(void);
-extern void isr_14(void);
-extern void isr_15(void);
-extern void isr_16(void);
-extern void isr_17(void);
-extern void isr_18(void);
-extern void isr_19(void);
-extern void isr_20(void);
-extern void isr_21(void);
-extern void isr_22(void);
-extern void isr_23(void);
-extern void isr_24(void);
-extern void isr_25(void);
-extern void isr_26(void);
-extern void isr_27(void);
-extern void isr_28(void);
-extern void isr_29(void);
-extern void isr_30(void);
-extern void isr_31(void);
-extern void isr_32(void);
-extern void isr_33(void);
-extern void isr_34(void);
-extern void isr_35(void);
-extern void isr_36(void);
-extern void isr_37(void);
-extern void isr_38(void);
-extern void isr_39(void);
-extern void isr_40(void);
-extern void isr_41(void);
-extern void isr_42(void);
-extern void isr_43(void);
-extern void isr_44(void);
-extern void isr_45(void);
-extern void isr_46(void);
-extern void isr_47(void);
+void irq_stats_dump(void);
+void irq_stats_reset(void);
+
+// isr stub addresses, one per vector (isr.asm)
+extern uint64_t isr_stub_table[NUM_VECTORS];
 
 #endif
\ No newline at end of file
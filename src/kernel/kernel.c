@@ -5,27 +5,271 @@
 #include "interrupts.h"
 #include "serial.h"
 #include "mmu.h"
+#include "tsc.h"
+#include "mouse.h"
+#include "fpu.h"
+#include "pci.h"
+#include "ata.h"
+#include "virtio_blk.h"
+#include "block.h"
+#include "ramdisk.h"
+#include "pagecache.h"
+#include "ext2.h"
+#include "initrd.h"
+#include "process.h"
+#include "syscall.h"
+#include "apic.h"
+#include "smp.h"
+#include "ksyms.h"
+#include "profile.h"
+#include "pmu.h"
+#include "bench.h"
+#include "trace.h"
+#include "tunable.h"
+#include "initcall.h"
 
 // x86_64 is little endian
 
 extern uint32_t multiboot_info_ptr;
 
-void kmain(uint64_t multiboot_info) {
-    VGA_clear();
-    
-    printk("Starting kernel\n");
+// whole word on the boot command line
+static int boot_option(const char *word) {
+    const char *p = MMU_boot_cmdline();
+    int len = strlen(word);
+    while (*p) {
+        while (*p == ' ') p++;
+        int n = 0;
+        while (p[n] && p[n] != ' ') n++;
+        if (n == len && memcmp(p, word, len) == 0) return 1;
+        p += n;
+    }
+    return 0;
+}
+
+static void run_process(struct process *p) {
+    printk("Process %d (%s) exited with %d\n", p->pid, p->name, process_run(p));
+}
+
+// with fork set, a copy-on-write clone of the finished process runs again over its dirtied pages
+static void run_initrd_program(const char *path, const char *name, int fork) {
+    const struct initrd_file *file = initrd_find(path);
+    if (!file) return;
+    struct process *p = process_create_from_memory(name, file->data, file->size);
+    if (!p) return;
+    run_process(p);
+    struct process *child = fork ? process_fork(p, name) : NULL;
+    if (child) {
+        run_process(child);
+        process_destroy(child);
+    }
+    process_destroy(p);
+}
+
+/*-------------------Early init-------------------*/
+
+static uint64_t boot_info;
+
+static int irq_phase(void) {
     IRQ_init();
     printk("Interrupts initialized\n");
+    return 0;
+}
+
+static int syscall_phase(void) {
+    syscall_init();
+    return 0;
+}
+
+static int fpu_phase(void) {
+    fpu_init();
+    return 0;
+}
+
+// the loopback self-test is a handful of port accesses, it fits in the TSC calibration window
+static int serial_phase(void) {
     SER_init();
     printk("Serial port initialized\n");
-    ps2_init();
+    return 0;
+}
+
+static int tsc_start(void) {
+    TSC_calibrate_start();
+    return 0;
+}
+
+static int tsc_finish(void) {
+    TSC_calibrate_finish();
+    return 0;
+}
+
+static int pmu_phase(void) {
+    pmu_init();
+    return 0;
+}
+
+static int ps2_phase(void) {
+    if (ps2_init() != 0) return -1;
     printk("PS/2 controller initialized\n");
-    IRQ_set_mask(1);
-    kb_init();
-    printk("Keyboard initialized\n");
-    IRQ_clear_mask(1);
-    MMU_init(multiboot_info);
+    return 0;
+}
+
+// the reset sequences run off IRQ1/IRQ12, collected right before the main loop
+static int kb_start(void) {
+    return kb_init();
+}
+
+static int kb_finish(void) {
+    if (kb_init_wait(KB_INIT_TIMEOUT_US) == 0) {
+        printk("Keyboard initialized\n");
+        return 0;
+    }
+    printk("Keyboard not available\n");
+    return -1;
+}
+
+static int mouse_start(void) {
+    return mouse_init();
+}
+
+static int mouse_finish(void) {
+    if (mouse_init_wait(MOUSE_INIT_TIMEOUT_US) == 0) {
+        printk("Mouse initialized\n");
+        return 0;
+    }
+    printk("Mouse not available\n");
+    return -1;
+}
+
+static int mmu_phase(void) {
+    MMU_init(boot_info);
     printk("MMU initialized\n");
+    return 0;
+}
+
+static int ksyms_phase(void) {
+    ksyms_init();
+    return 0;
+}
+
+static int trace_phase(void) {
+    trace_init();
+    return 0;
+}
+
+static int lapic_phase(void) {
+    lapic_init();
+    return 0;
+}
+
+static int smp_start_phase(void) {
+    smp_start();
+    return 0;
+}
+
+static int smp_finish_phase(void) {
+    smp_finish();
+    return 0;
+}
+
+// in the order they'd run one after another, initcalls_run moves a phase up when it can go early.
+// Nothing may use a TSC timeout before "tsc" is done
+static struct initcall early_initcalls[] = {
+    INITCALL("irq", irq_phase, NULL, 0, NULL),
+    INITCALL("tsc", tsc_start, tsc_finish, 0, NULL),
+    INITCALL("syscall", syscall_phase, NULL, 0, "irq"),
+    INITCALL("fpu", fpu_phase, NULL, 0, "irq"),
+    INITCALL("serial", serial_phase, NULL, 0, "irq"),
+    INITCALL("trace", trace_phase, NULL, 0, NULL),
+    INITCALL("pmu", pmu_phase, NULL, 0, "tsc"),
+    INITCALL("ps2", ps2_phase, NULL, 0, "irq", "tsc"),
+    INITCALL("keyboard", kb_start, kb_finish, INITCALL_DEFER, "ps2"),
+    INITCALL("mouse", mouse_start, mouse_finish, INITCALL_DEFER, "ps2"),
+    // the free list build reports its time, so after calibration
+    INITCALL("mmu", mmu_phase, NULL, 0, "irq", "pmu"),
+    INITCALL("lapic", lapic_phase, NULL, 0, "mmu"),
+    INITCALL("smp", smp_start_phase, smp_finish_phase, 0, "lapic", "pmu"),
+    // symbol sorting runs while the APs sit out their INIT delay
+    INITCALL("ksyms", ksyms_phase, NULL, 0, "mmu"),
+};
+
+void kmain(uint64_t multiboot_info) {
+    boot_timeline_init();
+    cpu_local_init(0);
+    VGA_clear();
+    
+    printk("Starting kernel\n");
+    // before anything reads a tunable, the allocator included
+    tunables_init(MMU_read_cmdline(multiboot_info));
+    boot_info = multiboot_info;
+    initcalls_run(early_initcalls, sizeof(early_initcalls) / sizeof(early_initcalls[0]));
+    // the one off benchmarks and self tests only run with "bench", which exits QEMU after the
+    // BENCH() harness, so a normal boot's timeline is boot alone
+    int bench = boot_option("bench");
+    // "trace" records the first processes, tools/trace_decode.py turns the dump into a Chrome trace
+    int tracing = boot_option("trace");
+    if (tracing) {
+        trace_enable("all", 1);
+    }
+    int phase = boot_phase_begin("initrd");
+    int files = initrd_init();
+    boot_phase_end(phase, files < 0);
+    if (bench && files > 0) {
+        initrd_benchmark();
+    }
+    run_initrd_program("/bin/hello", "hello", 1);
+    if (bench) {
+        run_initrd_program("/bin/sysbench", "sysbench", 0);
+    }
+    if (tracing) {
+        trace_enable("all", 0);
+        trace_dump();
+    }
+    if (bench) {
+        MMU_cow_benchmark(COW_BENCH_BYTES);
+        MMU_tlb_benchmark();
+        MMU_shootdown_benchmark();
+    }
+    phase = boot_phase_begin("pci");
+    pci_init();
+    boot_phase_end(phase, 0);
+    if (ata_init() > 0 && bench) {
+        ata_benchmark(ata_get_drive(0) ? 0 : 1);
+    }
+    if (virtio_blk_init() == 0 && bench) {
+        virtio_blk_benchmark();
+    }
+    if (ramdisk_init("ram0", RAMDISK_DEFAULT_SECTORS) == 0 && bench) {
+        blk_benchmark(blk_get("ram0"), 1);
+    }
+    // read only on real disks, they hold the boot file system
+    for (int i = 0; bench && blk_get_index(i); i++) {
+        if (strcmp(blk_get_index(i)->name, "ram0") != 0) {
+            blk_benchmark(blk_get_index(i), 0);
+        }
+    }
+    phase = boot_phase_begin("pagecache");
+    pagecache_init();
+    boot_phase_end(phase, 0);
+    phase = boot_phase_begin("rootfs");
+    struct ext2_fs *rootfs = ext2_mount_first();
+    boot_phase_end(phase, rootfs == NULL);
+    if (bench) {
+        // where the file system workload spends its time
+        int profiling = profile_start(PROFILE_DEFAULT_HZ) == 0;
+        pagecache_selftest();
+        if (rootfs) {
+            ext2_benchmark(rootfs, "/boot/kernel.bin");
+        }
+        if (profiling) {
+            profile_stop();
+            profile_report(PROFILE_TOP_N);
+        }
+        VGA_scroll_report();
+        qemu_exit(bench_run_all() > 0 ? QEMU_EXIT_SUCCESS : QEMU_EXIT_FAILURE);
+    }
+    // the tick wakes the idle loop so the page cache flusher runs even with no other interrupts
+    PIT_start_tick(PIT_TICK_HZ);
+    initcalls_finish_all();
     printk("Virtual memory initialized (by boot.asm)\n");
     printk("Testing virtual memory functions\n");
     printk("Test 1: MMU_alloc_page and MMU_free_page\n");
@@ -73,9 +317,20 @@ void kmain(uint64_t multiboot_info) {
         printk("ERROR: Failed to allocate multiple pages\n");
     }
     printk("Virtual mem test complete\n");
+    boot_timeline_print();
     
     // Main system loop
     while (1) {
+        struct mouse_event ev;
+        while (mouse_read_event(&ev)) {
+            printk("Mouse: dx=%d dy=%d dz=%d buttons=0x%x (%u packets)\n",
+                   ev.dx, ev.dy, ev.dz, ev.buttons, ev.packets);
+        }
+        if (kb_take_hotkeys() & KB_HOTKEY_IRQ_STATS) {
+            irq_stats_dump();
+        }
+        pagecache_flush_tick();
+        tunable_console_poll();
         __asm__ volatile("hlt");
     }
 }
\ No newline at end of file
@@ -1,6 +1,19 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 
+#include "cpu.h"
+
+// GDT selectors (boot.asm), the user pair is laid out for SYSRET
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_TSS 0x18
+#define GDT_USER_DATA 0x28
+#define GDT_USER_CODE 0x30
+#define GDT_TSS_AP 0x38             // one 16 byte TSS descriptor per AP after the user segments
+#define GDT_TSS_SELECTOR(cpu) ((cpu) == 0 ? GDT_TSS : GDT_TSS_AP + ((cpu) - 1) * 16)
+#define USER_DS (GDT_USER_DATA | 3)
+#define USER_CS (GDT_USER_CODE | 3)
+
 static inline void lgdt(void* base, uint16_t size) {
     static struct {
         uint16_t length;
@@ -42,6 +55,8 @@ struct tss_gdt_entry {
     uint32_t reserved;
 } __attribute__((packed));
 
-void setup_tss(void);
+extern struct tss_struct cpu_tss[MAX_CPUS];
+
+void setup_tss(int cpu);
 
 #endif
\ No newline at end of file
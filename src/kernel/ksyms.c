@@ -0,0 +1,105 @@
+#include "ksyms.h"
+#include "elf.h"
+#include "mmu.h"
+#include "printk.h"
+
+// kernel symbols out of the ELF symbol table GRUB loads next to the image
+
+static struct ksym *ksyms = NULL;
+static int nksyms = 0;
+
+// linker.ld
+extern const char __text_start[];
+extern const char __text_end[];
+
+// C functions, and asm labels in .text (NOTYPE, no size). NASM names local labels parent.local,
+// those stay part of their parent
+static int is_code_symbol(const struct elf64_sym *sym, const char *name) {
+    if (!sym->st_value) return 0;
+    if (ELF64_ST_TYPE(sym->st_info) == STT_FUNC) return 1;
+    if (ELF64_ST_TYPE(sym->st_info) != STT_NOTYPE) return 0;
+    if (sym->st_value < (uint64_t)__text_start || sym->st_value >= (uint64_t)__text_end) return 0;
+    for (const char *p = name; *p; p++) {
+        if (*p == '.') return 0;
+    }
+    return name[0] != '\0';
+}
+
+// shell sort by address, runs once at boot
+static void sort_ksyms(void) {
+    for (int gap = nksyms / 2; gap > 0; gap /= 2) {
+        for (int i = gap; i < nksyms; i++) {
+            struct ksym tmp = ksyms[i];
+            int j = i;
+            while (j >= gap && ksyms[j - gap].addr > tmp.addr) {
+                ksyms[j] = ksyms[j - gap];
+                j -= gap;
+            }
+            ksyms[j] = tmp;
+        }
+    }
+}
+
+void ksyms_init(void) {
+    const struct kernel_symtab *tab = MMU_kernel_symtab();
+    if (!tab->symtab) {
+        printk("ksyms: no symbol table from the bootloader\n");
+        return;
+    }
+    const struct elf64_sym *syms = phys_to_virt(tab->symtab);
+    const char *strtab = phys_to_virt(tab->strtab);
+    int count = tab->symtab_size / sizeof(struct elf64_sym);
+    int funcs = 0;
+    for (int i = 0; i < count; i++) {
+        if (syms[i].st_name >= tab->strtab_size) continue;
+        if (is_code_symbol(&syms[i], strtab + syms[i].st_name)) funcs++;
+    }
+    if (!funcs) return;
+    int pages = (funcs * sizeof(struct ksym) + PAGE_SIZE - 1) / PAGE_SIZE;
+    ksyms = MMU_alloc_pages(pages);
+    if (!ksyms) {
+        printk("ksyms: out of memory\n");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        const struct elf64_sym *sym = &syms[i];
+        if (sym->st_name >= tab->strtab_size) continue;
+        if (!is_code_symbol(sym, strtab + sym->st_name)) continue;
+        ksyms[nksyms].addr = sym->st_value;
+        ksyms[nksyms].size = sym->st_size;
+        ksyms[nksyms].name = strtab + sym->st_name;
+        nksyms++;
+    }
+    sort_ksyms();
+    printk("ksyms: %d functions\n", nksyms);
+}
+
+int ksyms_count(void) {
+    return nksyms;
+}
+
+// the function containing addr, asm labels without a size cover up to the next symbol
+const struct ksym *ksym_find(uint64_t addr) {
+    int lo = 0;
+    int hi = nksyms - 1;
+    const struct ksym *best = NULL;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ksyms[mid].addr <= addr) {
+            best = &ksyms[mid];
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (!best) return NULL;
+    if (best->size && addr >= best->addr + best->size) return NULL;
+    return best;
+}
+
+const char *ksym_lookup(uint64_t addr, uint64_t *offset) {
+    const struct ksym *sym = ksym_find(addr);
+    if (!sym) return NULL;
+    if (offset) *offset = addr - sym->addr;
+    return sym->name;
+}
@@ -0,0 +1,19 @@
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// kernel function symbols, sorted by address for lookups
+struct ksym {
+    uint64_t addr;
+    uint64_t size;
+    const char *name;           // points into the loaded .strtab
+};
+
+void ksyms_init(void);
+int ksyms_count(void);
+const struct ksym *ksym_find(uint64_t addr);
+const char *ksym_lookup(uint64_t addr, uint64_t *offset);
+
+#endif
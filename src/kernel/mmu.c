@@ -1,6 +1,16 @@
 #include "mmu.h"
 #include "printk.h"
 #include "string.h"
+#include "acpi.h"
+#include "process.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "apic.h"
+#include "smp.h"
+#include "pmu.h"
+#include "bench.h"
+#include "trace.h"
+#include "tunable.h"
 
 static struct mem_region memory_regions[MAX_MEMORY_REGIONS];
 static int num_memory_regions = 0;
@@ -10,12 +20,57 @@ static uint64_t total_pages = 0;
 static uint64_t free_pages = 0;
 static uint64_t reserved_pages = 0;
 static int free_list_initialized = 0;
+static struct boot_module boot_modules[MAX_BOOT_MODULES];
+static int num_boot_modules = 0;
+static struct kernel_symtab kernel_symtab;
+
+DEFINE_TRACEPOINT(frame_alloc, "frame", TRACE_INSTANT);
+DEFINE_TRACEPOINT(frame_free, "frame", TRACE_INSTANT);
+DEFINE_TRACEPOINT(pf_begin, "page fault", TRACE_BEGIN);
+DEFINE_TRACEPOINT(pf_end, "page fault", TRACE_END);
+static char boot_cmdline[BOOT_CMDLINE_LEN];
+
+// physically contiguous pages below 4 GiB that devices can DMA into
+static uint64_t dma_pool_phys = 0;
+static uint64_t kernel_cr3 = 0;
+static uint8_t dma_pool_used[DMA_POOL_PAGES];
+// per CPU PCID allocator: slots are handed out in order until they run out, then the generation
+// rolls over and every PCID is flushed at once
+struct pcid_cpu {
+    uint64_t owner[PCID_SLOTS];     // PML4 using each PCID in this generation, 0 if none
+    uint64_t generation;
+    int next;
+};
+static struct pcid_cpu pcid_cpus[MAX_CPUS];
+static int pcid_enabled = 0;
+static int invpcid_supported = 0;
+static int global_pages = 0;
+
+TUNABLE(tlb_full_flush_pages, uint64_t, TLB_FULL_FLUSH_PAGES);
+
+static struct tlb_stats tlb_stats[MAX_CPUS];
+static spinlock_t shootdown_lock;
+// the one shootdown in flight, each target clears its bit in shootdown_todo once it flushed
+static struct tlb_batch shootdown;
+static volatile uint32_t shootdown_todo = 0;
+// mappings per frame, 1 from MMU_pf_alloc, more once copy-on-write clones share it. One per frame
+// up to the top of RAM, taken out of memory by MMU_init
+static uint16_t *frame_refs = NULL;
+static uint64_t nframe_refs = 0;
+static uint64_t phys_top = 0;                       // end of the highest RAM in the memory map
+static uint64_t direct_map_end = BOOT_DIRECT_MAP_END;
+static uint64_t low_identity_pml4e = 0;             // boot.asm's identity map, for the AP trampoline
 
 static void process_mmap_tag(struct multiboot2_tag_mmap *mmap_tag) {
     uint8_t *entry_ptr = (uint8_t *)mmap_tag->entries;
     uint8_t *end_ptr = (uint8_t *)mmap_tag + mmap_tag->size;
     while (entry_ptr < end_ptr) {
         struct multiboot2_mmap_entry *entry = (struct multiboot2_mmap_entry *)entry_ptr;
+        // ACPI tables live in RAM too, the direct map covers them
+        if ((entry->type == MULTIBOOT_MEMORY_AVAILABLE || entry->type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE ||
+             entry->type == MULTIBOOT_MEMORY_NVS) && entry->addr + entry->len > phys_top) {
+            phys_top = entry->addr + entry->len;
+        }
         if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
             if (num_memory_regions < MAX_MEMORY_REGIONS) {
                 // aligning to page boundaries
@@ -40,9 +95,73 @@ static void process_mmap_tag(struct multiboot2_tag_mmap *mmap_tag) {
     }
 }
 
+// carves [start, end) out of the available regions, before the free list is built
+static void reserve_range(uint64_t start, uint64_t end) {
+    // aligning to page size
+    uint64_t page_start = start & ~(PAGE_SIZE - 1);
+    uint64_t page_end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    // mark pages used as reserved
+    for (int j = 0; j < num_memory_regions; j++) {
+        // skip non-available memory regions
+        if (memory_regions[j].type != MULTIBOOT_MEMORY_AVAILABLE) {
+            continue;
+        }
+        if (!(page_start >= memory_regions[j].end || page_end <= memory_regions[j].start)) {
+            uint64_t overlap_start = (page_start > memory_regions[j].start) ? 
+                                   page_start : memory_regions[j].start;
+            uint64_t overlap_end = (page_end < memory_regions[j].end) ? 
+                                 page_end : memory_regions[j].end;
+            // skip if there's no actual overlap after alignment
+            if (overlap_start >= overlap_end) {
+                continue;
+            }
+            // updating stats for reserved pages
+            uint64_t overlap_pages = (overlap_end - overlap_start) / PAGE_SIZE;
+            free_pages -= overlap_pages;
+            reserved_pages += overlap_pages;
+            // dealing with overalp
+            if (overlap_start == memory_regions[j].start && 
+                overlap_end == memory_regions[j].end) {
+                // completely overlapped - mark as reserved
+                memory_regions[j].type = MULTIBOOT_MEMORY_RESERVED;
+            } 
+            else if (overlap_start == memory_regions[j].start) {
+                // overlaps beginning - adjust start address
+                memory_regions[j].start = overlap_end;
+            } 
+            else if (overlap_end == memory_regions[j].end) {
+                // overlaps end - adjust end address
+                memory_regions[j].end = overlap_start;
+            } 
+            else if (num_memory_regions < MAX_MEMORY_REGIONS) {
+                // splits region in two - create new region
+                memory_regions[num_memory_regions].start = overlap_end;
+                memory_regions[num_memory_regions].end = memory_regions[j].end;
+                memory_regions[num_memory_regions].type = MULTIBOOT_MEMORY_AVAILABLE;
+                num_memory_regions++;
+                memory_regions[j].end = overlap_start;
+            } 
+            else {
+                printk("WARNING: No space for split region, marking entire region as reserved\n");
+                memory_regions[j].type = MULTIBOOT_MEMORY_RESERVED;
+            }
+        }
+    }
+}
+
 static void process_elf_sections_tag(struct multiboot2_tag_elf_sections *elf_tag) {
     for (uint32_t i = 0; i < elf_tag->num; i++) {
         struct elf64_shdr *shdr = (struct elf64_shdr *)(elf_tag->sections + i * elf_tag->entsize);
+        // GRUB loads the symbol table and its strings too, kept for ksyms
+        if (shdr->sh_type == SHT_SYMTAB && shdr->sh_addr && shdr->sh_link < elf_tag->num) {
+            struct elf64_shdr *strtab = (struct elf64_shdr *)(elf_tag->sections + shdr->sh_link * elf_tag->entsize);
+            if (strtab->sh_addr) {
+                kernel_symtab.symtab = shdr->sh_addr;
+                kernel_symtab.symtab_size = shdr->sh_size;
+                kernel_symtab.strtab = strtab->sh_addr;
+                kernel_symtab.strtab_size = strtab->sh_size;
+            }
+        }
         // skip sections that don't occupy memory
         if (!(shdr->sh_flags & SHF_ALLOC)) {
             continue;
@@ -60,64 +179,210 @@ static void process_elf_sections_tag(struct multiboot2_tag_elf_sections *elf_tag
         } else if (shdr->sh_type == SHT_NOBITS) {
             section_type = "bss";
         }
-        uint64_t start = shdr->sh_addr;
-        uint64_t end = shdr->sh_addr + shdr->sh_size;
+        // linked in the higher half, loaded at 1 MiB
+        uint64_t start = shdr->sh_addr >= KERNEL_VMA ? shdr->sh_addr - KERNEL_VMA : shdr->sh_addr;
+        uint64_t end = start + shdr->sh_size;
         // skip empty sections
         if (start == end) {
             continue;
         }
-        printk("  Kernel section (%s): addr=0x%lx, size=0x%lx\n", section_type, start, shdr->sh_size);
-        // aligning to page size
-        uint64_t page_start = start & ~(PAGE_SIZE - 1);
-        uint64_t page_end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-        // mark pages used as reserved
-        for (int j = 0; j < num_memory_regions; j++) {
-            // skip non-available memory regions
-            if (memory_regions[j].type != MULTIBOOT_MEMORY_AVAILABLE) {
-                continue;
-            }
-            if (!(page_start >= memory_regions[j].end || page_end <= memory_regions[j].start)) {
-                uint64_t overlap_start = (page_start > memory_regions[j].start) ? 
-                                       page_start : memory_regions[j].start;
-                uint64_t overlap_end = (page_end < memory_regions[j].end) ? 
-                                     page_end : memory_regions[j].end;
-                // skip if there's no actual overlap after alignment
-                if (overlap_start >= overlap_end) {
-                    continue;
-                }
-                // updating stats for reserved pages
-                uint64_t overlap_pages = (overlap_end - overlap_start) / PAGE_SIZE;
-                free_pages -= overlap_pages;
-                reserved_pages += overlap_pages;
-                // dealing with overalp
-                if (overlap_start == memory_regions[j].start && 
-                    overlap_end == memory_regions[j].end) {
-                    // completely overlapped - mark as reserved
-                    memory_regions[j].type = MULTIBOOT_MEMORY_RESERVED;
-                } 
-                else if (overlap_start == memory_regions[j].start) {
-                    // overlaps beginning - adjust start address
-                    memory_regions[j].start = overlap_end;
-                } 
-                else if (overlap_end == memory_regions[j].end) {
-                    // overlaps end - adjust end address
-                    memory_regions[j].end = overlap_start;
-                } 
-                else if (num_memory_regions < MAX_MEMORY_REGIONS) {
-                    // splits region in two - create new region
-                    memory_regions[num_memory_regions].start = overlap_end;
-                    memory_regions[num_memory_regions].end = memory_regions[j].end;
-                    memory_regions[num_memory_regions].type = MULTIBOOT_MEMORY_AVAILABLE;
-                    num_memory_regions++;
-                    memory_regions[j].end = overlap_start;
-                } 
-                else {
-                    printk("WARNING: No space for split region, marking entire region as reserved\n");
-                    memory_regions[j].type = MULTIBOOT_MEMORY_RESERVED;
-                }
+        printk("  Kernel section (%s): addr=0x%lx, size=0x%lx\n", section_type, shdr->sh_addr, shdr->sh_size);
+        reserve_range(start, end);
+    }
+}
+
+// GRUB puts module tags before the memory map, so they are only recorded here and reserved later
+static void process_module_tag(struct multiboot2_tag_module *mod_tag) {
+    if (num_boot_modules == MAX_BOOT_MODULES) {
+        printk("WARNING: Too many boot modules, ignoring %s\n", mod_tag->cmdline);
+        return;
+    }
+    struct boot_module *mod = &boot_modules[num_boot_modules++];
+    mod->start = mod_tag->mod_start;
+    mod->end = mod_tag->mod_end;
+    int len = 0;
+    while (len < BOOT_MODULE_CMDLINE_LEN - 1 && mod_tag->cmdline[len]) {
+        mod->cmdline[len] = mod_tag->cmdline[len];
+        len++;
+    }
+    mod->cmdline[len] = '\0';
+    printk("  Boot module '%s': addr=0x%lx, size=0x%lx\n", mod->cmdline, mod->start, mod->end - mod->start);
+}
+
+// takes pages off the top of the first available region with room for them below limit, before
+// the free list is built. Returns their physical address, 0 if no region has room
+static uint64_t carve_pages(uint64_t pages, uint64_t limit) {
+    uint64_t size = pages * PAGE_SIZE;
+    for (int i = 0; i < num_memory_regions; i++) {
+        struct mem_region *r = &memory_regions[i];
+        if (r->type != MULTIBOOT_MEMORY_AVAILABLE) {
+            continue;
+        }
+        uint64_t start = (r->start < 0x100000) ? 0x100000 : r->start;
+        uint64_t end = (r->end < limit) ? r->end : limit;
+        if (end < start + size) {
+            continue;
+        }
+        reserve_range(end - size, end);
+        return end - size;
+    }
+    return 0;
+}
+
+static void reserve_dma_pool(void) {
+    dma_pool_phys = carve_pages(DMA_POOL_PAGES, DMA_POOL_LIMIT);
+    if (!dma_pool_phys) {
+        printk("WARNING: No low memory region for the DMA pool\n");
+        return;
+    }
+    printk("  DMA pool: 0x%lx - 0x%lx\n", dma_pool_phys, dma_pool_phys + (uint64_t)DMA_POOL_PAGES * PAGE_SIZE);
+}
+
+static inline uint64_t get_cr3(void);
+static void tlb_init(void);
+static int tlb_shootdown_vector(struct interrupt_frame *frame, void *arg);
+
+// every kernel PML4 slot gets its PDPT now, so address spaces that copy the slots see later
+// kernel mappings too
+static void share_kernel_slots(void) {
+    kernel_cr3 = get_cr3() & PAGE_MASK;
+    uint64_t *pml4t = phys_to_virt(kernel_cr3);
+    for (int i = 1; i < KERNEL_PML4_SLOTS; i++) {
+        if (pml4t[i] & PTE_PRESENT) continue;
+        void *pdpt = MMU_pf_alloc();
+        if (!pdpt) return;
+        pml4t[i] = virt_to_phys(pdpt) | PTE_PRESENT | PTE_WRITABLE;
+    }
+}
+
+/*-------------------Direct map-------------------*/
+
+static int cpu_has_1g_pages(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000001) return 0;
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    return (edx & CPUID_EXT_1_EDX_PDPE1GB) != 0;
+}
+
+// zeroed page table from memory the boot map already covers
+static uint64_t *direct_map_table(void) {
+    uint64_t phys = carve_pages(1, BOOT_DIRECT_MAP_END);
+    if (!phys) return NULL;
+    uint64_t *table = phys_to_virt(phys);
+    memset(table, 0, PAGE_SIZE);
+    return table;
+}
+
+// extends the boot map of the first 1 GiB up to the end of RAM, 1 GiB pages when the CPU has them.
+// Holes in the memory map come along: MTRRs keep the PCI hole uncached, and devices are only ever
+// reached through MMU_map_mmio
+static void build_direct_map(void) {
+    uint64_t top = phys_top;
+    if (top > DIRECT_MAP_MAX) {
+        top = DIRECT_MAP_MAX;
+        printk("WARNING: only the first %lu GB are direct mapped\n", top >> 30);
+    }
+    int huge_1g = cpu_has_1g_pages();
+    uint64_t flags = PTE_PRESENT | PTE_WRITABLE | PTE_GLOBAL | PTE_HUGE;
+    uint64_t *pml4t = phys_to_virt(get_cr3() & PAGE_MASK);
+    uint64_t addr = BOOT_DIRECT_MAP_END;
+    while (addr < top) {
+        uint64_t va = DIRECT_MAP_ADR + addr;
+        uint64_t *pml4e = &pml4t[(va >> PML4_SHIFT) & (ENTRY_PER_TABLE - 1)];
+        if (!(*pml4e & PTE_PRESENT)) {
+            uint64_t *pdpt = direct_map_table();
+            if (!pdpt) break;
+            *pml4e = virt_to_phys(pdpt) | PTE_PRESENT | PTE_WRITABLE;
+        }
+        uint64_t *pdpt = phys_to_virt(*pml4e & PAGE_MASK);
+        uint64_t *pdpte = &pdpt[(va >> PDPT_SHIFT) & (ENTRY_PER_TABLE - 1)];
+        if (huge_1g) {
+            *pdpte = addr | flags;
+        } else {
+            uint64_t *pd = direct_map_table();
+            if (!pd) break;
+            for (int i = 0; i < ENTRY_PER_TABLE; i++) {
+                pd[i] = (addr + ((uint64_t)i << PD_SHIFT)) | flags;
             }
+            *pdpte = virt_to_phys(pd) | PTE_PRESENT | PTE_WRITABLE;
+        }
+        addr += 1ULL << PDPT_SHIFT;
+    }
+    if (addr > direct_map_end) direct_map_end = addr;
+    if (direct_map_end < top) {
+        printk("WARNING: out of page tables, only the first %lu MB are direct mapped\n", direct_map_end >> 20);
+    }
+    printk("  Direct map: %lu MB, %s pages\n", direct_map_end >> 20, huge_1g ? "1 GiB" : "2 MiB");
+}
+
+// reference counts for every frame the direct map reaches. Copy-on-write can't tell a shared
+// frame from a private one without them, so running on is not an option
+static void init_frame_refs(void) {
+    uint64_t top = phys_top < direct_map_end ? phys_top : direct_map_end;
+    uint64_t frames = top / PAGE_SIZE;
+    uint64_t pages = (frames * sizeof(uint16_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t phys = carve_pages(pages, direct_map_end);
+    if (!phys) {
+        printk("No room for frame reference counts - halting\n");
+        while(1) {
+            __asm__ volatile("cli");
+            __asm__ volatile("hlt");
+        }
+    }
+    frame_refs = phys_to_virt(phys);
+    memset(frame_refs, 0, pages * PAGE_SIZE);
+    nframe_refs = frames;
+}
+
+// boot.asm's identity map only got the kernel to the higher half, slot 0 is empty from now on
+static void unmap_low_identity(void) {
+    uint64_t *pml4t = phys_to_virt(get_cr3() & PAGE_MASK);
+    low_identity_pml4e = pml4t[0];
+    pml4t[0] = 0;
+    // CR4.PGE is still off, the boot map's global bits don't keep it in the TLB
+    __asm__ volatile("mov %0, %%cr3" : : "r"(get_cr3()) : "memory");
+}
+
+int MMU_direct_mapped(uint64_t paddr, uint64_t len) {
+    return paddr + len >= paddr && paddr + len <= direct_map_end;
+}
+
+// the kernel PML4 plus the identity map, the AP trampoline turns paging on at its physical address
+void MMU_trampoline_pml4(uint64_t *pml4t) {
+    uint64_t *kernel_pml4t = phys_to_virt(kernel_cr3);
+    for (int i = 0; i < ENTRY_PER_TABLE; i++) {
+        pml4t[i] = kernel_pml4t[i];
+    }
+    pml4t[0] = low_identity_pml4e;
+}
+
+static void save_cmdline(const char *cmdline) {
+    int len = 0;
+    while (len < BOOT_CMDLINE_LEN - 1 && cmdline[len]) {
+        boot_cmdline[len] = cmdline[len];
+        len++;
+    }
+    boot_cmdline[len] = '\0';
+}
+
+// only the command line tag, for tunables that have to be set before MMU_init
+const char *MMU_read_cmdline(uint64_t multiboot_info) {
+    struct multiboot2_header *mbi = (struct multiboot2_header *)multiboot_info;
+    uint8_t *current = (uint8_t *)multiboot_info + 8;
+    uint8_t *end = (uint8_t *)multiboot_info + mbi->total_size;
+    while (current < end) {
+        struct multiboot2_tag *tag = (struct multiboot2_tag *)current;
+        if (tag->type == MULTIBOOT_TAG_TYPE_END || tag->size < 8 || current + tag->size > end) {
+            break;
+        }
+        if (tag->type == MULTIBOOT_TAG_TYPE_CMDLINE) {
+            save_cmdline(((struct multiboot2_tag_string *)tag)->string);
+            break;
         }
+        current = (uint8_t *)tag + ((tag->size + 7) & ~7);
     }
+    return boot_cmdline;
 }
 
 void MMU_init(uint64_t multiboot_info) {
@@ -141,14 +406,21 @@ void MMU_init(uint64_t multiboot_info) {
             case MULTIBOOT_TAG_TYPE_ELF_SECTIONS:
                 process_elf_sections_tag((struct multiboot2_tag_elf_sections *)tag);
                 break;                
+            case MULTIBOOT_TAG_TYPE_MODULE:
+                process_module_tag((struct multiboot2_tag_module *)tag);
+                break;
             case MULTIBOOT_TAG_TYPE_CMDLINE:
-                printk("Command line: %s\n", 
-                       ((struct multiboot2_tag_string *)tag)->string);
+                save_cmdline(((struct multiboot2_tag_string *)tag)->string);
+                printk("Command line: %s\n", boot_cmdline);
                 break;               
             case MULTIBOOT_TAG_TYPE_BOOT_LOADER_NAME:
                 printk("Boot loader: %s\n", 
                        ((struct multiboot2_tag_string *)tag)->string);
                 break;               
+            case MULTIBOOT_TAG_TYPE_ACPI_OLD:
+            case MULTIBOOT_TAG_TYPE_ACPI_NEW:
+                acpi_set_rsdp(((struct multiboot2_tag_acpi *)tag)->rsdp, tag->size - 8);
+                break;
             case MULTIBOOT_TAG_TYPE_BASIC_MEMINFO:
                 printk("Basic memory info: lower=%uKB, upper=%uKB\n",
                        ((struct multiboot2_tag_basic_meminfo *)tag)->mem_lower,
@@ -160,6 +432,20 @@ void MMU_init(uint64_t multiboot_info) {
         }
         current = (uint8_t *)tag + ((tag->size + 7) & ~7);
     }
+    for (int i = 0; i < num_boot_modules; i++) {
+        reserve_range(boot_modules[i].start, boot_modules[i].end);
+    }
+    if (kernel_symtab.symtab) {
+        reserve_range(kernel_symtab.symtab, kernel_symtab.symtab + kernel_symtab.symtab_size);
+        reserve_range(kernel_symtab.strtab, kernel_symtab.strtab + kernel_symtab.strtab_size);
+    }
+    build_direct_map();
+    reserve_dma_pool();
+    init_frame_refs();
+    unmap_low_identity();
+    share_kernel_slots();
+    tlb_init();
+    MMU_cpu_init();
     printk("Memory management initialized:\n");
     printk("  Total memory: %lu MB\n", total_memory / (1024 * 1024));
     printk("  Total pages: %lu\n", total_pages);
@@ -177,17 +463,22 @@ static void add_page_to_free_list(void *page) {
 static void init_free_page_list(void) {
     if (free_list_initialized) return;
     free_list_initialized = 1;
+    struct pmu_counts pmu;
+    pmu_begin(&pmu);
     for (int i = 0; i < num_memory_regions; i++) {
         if (memory_regions[i].type == MULTIBOOT_MEMORY_AVAILABLE) {
             uint64_t start = memory_regions[i].start;
             uint64_t end = memory_regions[i].end;
             if (start < 0x100000) start = 0x100000;
+            if (end > direct_map_end) end = direct_map_end;
             if (start >= end) continue;
             for (uint64_t addr = start; addr < end; addr += PAGE_SIZE) {
-                add_page_to_free_list((void *)addr);
+                add_page_to_free_list(phys_to_virt(addr));
             }
         }
     }
+    pmu_end(&pmu);
+    pmu_report("free list build", &pmu, 1);
 }
 
 void *MMU_pf_alloc(void) {
@@ -202,9 +493,13 @@ void *MMU_pf_alloc(void) {
     free_page_head = page->next;
     memset(page, 0, PAGE_SIZE);
     free_pages--;
+    uint64_t pfn = virt_to_phys(page) / PAGE_SIZE;
+    if (pfn < nframe_refs) frame_refs[pfn] = 1;
+    trace(frame_alloc, page, 0);
     return page;
 }
 
+// drops one reference, the frame goes back on the free list with the last one
 void MMU_pf_free(void *pf) {
     if (pf == NULL) {
         printk("ERROR: Null page\n");
@@ -214,10 +509,63 @@ void MMU_pf_free(void *pf) {
         printk("ERROR: Trying to free unaligned page: 0x%p\n", pf);
         return;
     }
+    uint64_t pfn = virt_to_phys(pf) / PAGE_SIZE;
+    if (pfn < nframe_refs) {
+        uint16_t *ref = &frame_refs[pfn];
+        if (*ref > 1) {
+            (*ref)--;
+            trace(frame_free, pf, *ref);
+            return;
+        }
+        *ref = 0;
+    }
+    trace(frame_free, pf, 0);
     add_page_to_free_list(pf);
     free_pages++;
 }
 
+uint64_t MMU_free_page_count(void) {
+    return free_pages;
+}
+
+void MMU_page_ref(void *pf) {
+    uint64_t pfn = virt_to_phys(pf) / PAGE_SIZE;
+    if (pfn < nframe_refs) frame_refs[pfn]++;
+}
+
+// every allocatable frame is below nframe_refs, past it are only device frames, which are never copied
+int MMU_page_refcount(void *pf) {
+    uint64_t pfn = virt_to_phys(pf) / PAGE_SIZE;
+    if (pfn >= nframe_refs) return 1;
+    return frame_refs[pfn];
+}
+
+int MMU_module_count(void) {
+    return num_boot_modules;
+}
+
+const struct boot_module *MMU_get_module(int index) {
+    if (index < 0 || index >= num_boot_modules) return NULL;
+    return &boot_modules[index];
+}
+
+// empty when the bootloader passed none
+const char *MMU_boot_cmdline(void) {
+    return boot_cmdline;
+}
+
+// zeroed when the bootloader didn't load the symbol table
+const struct kernel_symtab *MMU_kernel_symtab(void) {
+    return &kernel_symtab;
+}
+
+const struct boot_module *MMU_find_module(const char *cmdline) {
+    for (int i = 0; i < num_boot_modules; i++) {
+        if (strcmp(boot_modules[i].cmdline, cmdline) == 0) return &boot_modules[i];
+    }
+    return NULL;
+}
+
 void MMU_print_memory_map(void) {
     printk("\n======== Memory Map ========\n");
     printk("  Total memory: %lu MB\n", total_memory / (1024 * 1024));
@@ -245,6 +593,7 @@ void MMU_print_memory_map(void) {
 // virtual addressing
 
 static uint64_t kernel_brk = KERNEL_HEAP_ADR;
+static uint64_t kernel_growth_brk = KERNEL_GROWTH_ADR_START;
 
 static inline uint64_t get_cr3(void) {
     uint64_t cr3_value;
@@ -252,132 +601,400 @@ static inline uint64_t get_cr3(void) {
     return cr3_value;
 }
 
+static inline int are_interrupts_enabled() {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0"
+                     : "=r"(flags));
+    return flags & 0x200; // Check IF (Interrupt Flag) bit
+}
+
+/*-------------------TLB and PCIDs-------------------*/
+
+// kernel mappings are global, user ones get a PCID when the CPU has them
+static void tlb_init(void) {
+    uint32_t eax, ebx, ecx, edx, max_leaf;
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    global_pages = (edx & CPUID_1_EDX_PGE) != 0;
+    if (ecx & CPUID_1_ECX_PCID) {
+        pcid_enabled = 1;
+        if (max_leaf >= 7) {
+            cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+            invpcid_supported = (ebx & CPUID_7_EBX_INVPCID) != 0;
+        }
+    }
+    register_vector(TLB_SHOOTDOWN_VECTOR, tlb_shootdown_vector, NULL, 0);
+    printk("TLB: global pages %s, PCID %s\n", global_pages ? "on" : "off",
+           pcid_enabled ? (invpcid_supported ? "on (INVPCID)" : "on") : "off");
+}
+
+// paging features of the calling CPU, the BSP from MMU_init and every AP as it starts
+void MMU_cpu_init(void) {
+    write_cr0(read_cr0() | CR0_WP);
+    if (global_pages) write_cr4(read_cr4() | CR4_PGE);
+    // PCIDE can only be set while CR3[11:0] is 0, which the boot CR3 is
+    if (pcid_enabled) write_cr4(read_cr4() | CR4_PCIDE);
+    this_cpu()->active_cr3 = get_cr3() & PAGE_MASK;
+}
+
+// drops the non-global entries of every PCID
+static void flush_all_pcids(void) {
+    if (invpcid_supported) {
+        uint64_t desc[2] = { 0, 0 };
+        __asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"(3ULL) : "memory");
+        return;
+    }
+    // clearing PCIDE flushes everything, it needs PCID 0 loaded first
+    __asm__ volatile("mov %0, %%cr3" : : "r"(kernel_cr3) : "memory");
+    write_cr4(read_cr4() & ~CR4_PCIDE);
+    write_cr4(read_cr4() | CR4_PCIDE);
+}
+
+// fresh is set when the PCID is new to pml4 and has to be flushed on load
+static uint64_t pcid_for(uint64_t pml4, int *fresh) {
+    *fresh = 0;
+    if (pml4 == kernel_cr3) return 0;
+    struct pcid_cpu *pc = &pcid_cpus[this_cpu_id()];
+    for (int i = 1; i < pc->next; i++) {
+        if (pc->owner[i] == pml4) return i;
+    }
+    if (pc->next == 0 || pc->next == PCID_SLOTS) {
+        pc->generation++;
+        memset(pc->owner, 0, sizeof(pc->owner));
+        flush_all_pcids();
+        pc->next = 1;
+    }
+    pc->owner[pc->next] = pml4;
+    *fresh = 1;
+    return pc->next++;
+}
+
+// flush drops the address space's cached translations, otherwise a PCID still holding them is reused
+static void load_cr3(uint64_t cr3, int flush) {
+    uint64_t pml4 = cr3 & PAGE_MASK;
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    // published before the PCID lookup, a shootdown either sees this CPU active or took the PCID away
+    this_cpu()->active_cr3 = pml4;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!pcid_enabled) {
+        __asm__ volatile("mov %0, %%cr3" : : "r"(pml4) : "memory");
+        if (enable_ints) {
+            __asm__ volatile("sti");
+        }
+        return;
+    }
+    int fresh;
+    uint64_t value = pml4 | pcid_for(pml4, &fresh);
+    if (!fresh && !flush) value |= CR3_NOFLUSH;
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
 // switch address space (multiple processes)
 void set_cr3(uint64_t cr3_value) {
-    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3_value) : "memory");
+    load_cr3(cr3_value, 0);
 }
 
-// flush specified TLB entry
-void invlpg(void *addr) {
-    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+// after page table changes that were not invalidated page by page: CPUs with the address space loaded
+// flush it now, any other loses its PCID and gets a flushed one on its next load
+void MMU_flush_address_space(uint64_t cr3) {
+    struct tlb_batch b;
+    tlb_batch_init(&b, cr3);
+    b.full = 1;
+    tlb_batch_flush(&b, 1);
 }
 
-static void get_page_indices(uint64_t vaddr, uint64_t *pml4_idx, uint64_t *pdpt_idx, 
-                             uint64_t *pd_idx, uint64_t *pt_idx, uint64_t *offset) {
-    *pml4_idx = (vaddr >> PML4_SHIFT) & (ENTRY_PER_TABLE - 1);
-    *pdpt_idx = (vaddr >> PDPT_SHIFT) & (ENTRY_PER_TABLE - 1);
-    *pd_idx = (vaddr >> PD_SHIFT) & (ENTRY_PER_TABLE - 1);
-    *pt_idx = (vaddr >> PT_SHIFT) & (ENTRY_PER_TABLE - 1);
-    *offset = vaddr & (PAGE_SIZE - 1);
-}
+/*-------------------TLB shootdown-------------------*/
 
-static void* phys_to_virt(uint64_t paddr) {
-    // its identity mapped so not much to do
-    return (void*)paddr;
+// takes pml4's PCID away from cpu, atomically since a shootdown can run on another CPU
+static void drop_pcid(int cpu, uint64_t pml4) {
+    for (int i = 1; i < PCID_SLOTS; i++) {
+        uint64_t expected = pml4;
+        __atomic_compare_exchange_n(&pcid_cpus[cpu].owner[i], &expected, 0, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
 }
 
-uint64_t virt_to_phys(void *vaddr) {
-    uint64_t *pml4t, *pdpt, *pdt, *pt;
-    uint64_t pml4_idx, pdpt_idx, pd_idx, pt_idx, offset;
-    uint64_t pml4e, pdpte, pde, pte;
+// everything including global entries
+static void flush_everything(void) {
+    if (global_pages) {
+        uint64_t cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else if (pcid_enabled) {
+        flush_all_pcids();
+        load_cr3(this_cpu()->active_cr3, 1);
+    } else {
+        __asm__ volatile("mov %0, %%cr3" : : "r"(get_cr3()) : "memory");
+    }
+}
 
-    pml4t = phys_to_virt(get_cr3() & PAGE_MASK);
-    get_page_indices((uint64_t)vaddr, &pml4_idx, &pdpt_idx, &pd_idx, &pt_idx, &offset);
+// cr3 0 is the kernel half (global entries), any other is the user half of that address space
+void tlb_batch_init(struct tlb_batch *b, uint64_t cr3) {
+    b->pml4 = cr3 & PAGE_MASK;
+    b->nranges = 0;
+    b->full = 0;
+    b->total = 0;
+}
 
-    pml4e = pml4t[pml4_idx];
-    if (!(pml4e & PTE_PRESENT)) {
-        printk("PML4 entry not present for address %p\n", vaddr);
-        return 0;
+void tlb_batch_add(struct tlb_batch *b, uint64_t vaddr, uint64_t pages) {
+    vaddr &= PAGE_MASK;
+    b->total += pages;
+    if (b->full) return;
+    if (b->total > tlb_full_flush_pages) {
+        b->full = 1;
+        return;
     }
-    pdpt = phys_to_virt(pml4e & PAGE_MASK);
-    pdpte = pdpt[pdpt_idx];
-    if (!(pdpte & PTE_PRESENT)) {
-        printk("PDPT entry not present for address %p\n", vaddr);
-        return 0;
+    if (b->nranges > 0) {
+        int last = b->nranges - 1;
+        if (b->start[last] + b->pages[last] * PAGE_SIZE == vaddr) {
+            b->pages[last] += pages;
+            return;
+        }
     }
-    
-    // check if a 1GB page
-    if (pdpte & PTE_HUGE) {
-        return (pdpte & 0xFFFFFFC0000000ULL) + ((uint64_t)vaddr & 0x3FFFFFFF);
+    if (b->nranges == TLB_BATCH_RANGES) {
+        b->full = 1;
+        return;
     }
-    
-    pdt = phys_to_virt(pdpte & PAGE_MASK);
-    pde = pdt[pd_idx];
-    if (!(pde & PTE_PRESENT)) {
-        printk("PD entry not present for address %p\n", vaddr);
-        return 0;
+    b->start[b->nranges] = vaddr;
+    b->pages[b->nranges] = pages;
+    b->nranges++;
+}
+
+// invalidates the batch on the calling CPU
+static void tlb_flush_local(const struct tlb_batch *b) {
+    int cpu = this_cpu_id();
+    if (b->pml4 && this_cpu()->active_cr3 != b->pml4) {
+        // not loaded here, only a PCID can still hold its entries
+        drop_pcid(cpu, b->pml4);
+        return;
     }
-    
-    // check if a 2MB page
-    if (pde & PTE_HUGE) {
-        return (pde & 0xFFFFFFFE00000ULL) + ((uint64_t)vaddr & 0x1FFFFF);
+    if (b->full) {
+        if (b->pml4) {
+            load_cr3(b->pml4, 1);
+        } else {
+            flush_everything();
+        }
+        return;
     }
-    
-    pt = phys_to_virt(pde & PAGE_MASK);
-    pte = pt[pt_idx];
-    if (!(pte & PTE_PRESENT)) {
-        printk("PT entry not present for address %p\n", vaddr);
-        return 0;
+    for (int r = 0; r < b->nranges; r++) {
+        for (uint64_t i = 0; i < b->pages[r]; i++) {
+            invlpg((void*)(b->start[r] + i * PAGE_SIZE));
+        }
     }
-    
-    return (pte & PAGE_MASK) + offset;
 }
 
-// gets addr of page table entry for virt addr
-// can be used to modify page table entries
-// if create_if_not_exist true, allocates missing page tables
-uint64_t* get_pte(uint64_t *pml4t, uint64_t vaddr, int create_if_not_exist) {
-    uint64_t *pdpt, *pdt, *pt;
-    uint64_t pml4_idx, pdpt_idx, pd_idx, pt_idx, offset;
-    uint64_t *pml4e, *pdpte, *pde;
-
-    get_page_indices(vaddr, &pml4_idx, &pdpt_idx, &pd_idx, &pt_idx, &offset);
-    pml4e = &pml4t[pml4_idx];
-    if (!(*pml4e & PTE_PRESENT)) {
-        if (!create_if_not_exist) {
-            return NULL;
+// handles the in-flight shootdown if this CPU is one of its targets
+static void tlb_shootdown_poll(void) {
+    int cpu = this_cpu_id();
+    uint32_t bit = 1U << cpu;
+    if (!(__atomic_load_n(&shootdown_todo, __ATOMIC_ACQUIRE) & bit)) return;
+    tlb_flush_local(&shootdown);
+    tlb_stats[cpu].received++;
+    if (shootdown.full) {
+        tlb_stats[cpu].full++;
+    } else {
+        tlb_stats[cpu].pages += shootdown.total;
+    }
+    __atomic_and_fetch(&shootdown_todo, ~bit, __ATOMIC_RELEASE);
+}
+
+static int tlb_shootdown_vector(struct interrupt_frame *frame, void *arg) {
+    (void)frame;
+    (void)arg;
+    tlb_shootdown_poll();
+    lapic_eoi();
+    return IRQ_HANDLED;
+}
+
+// flushes the batch here and on every other CPU that can cache it. Without wait the IPIs are
+// acknowledged lazily, fine as long as nothing the old translations point at is freed or reused
+// before tlb_shootdown_wait() (the next shootdown waits as well)
+void tlb_batch_flush(struct tlb_batch *b, int wait) {
+    if (!b->nranges && !b->full) return;
+    tlb_flush_local(b);
+    if (smp_cpu_count() == 1) return;
+
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    int self = this_cpu_id();
+    uint32_t others = smp_online_mask() & ~(1U << self);
+    uint32_t targets = others;
+    if (b->pml4) {
+        // CPUs that do not have it loaded just lose their PCID, see load_cr3
+        targets = 0;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (others & (1U << cpu)) drop_pcid(cpu, b->pml4);
         }
-        void *new_pdpt = MMU_pf_alloc();
-        if (!new_pdpt) {
-            printk("Failed to allocate PDPT\n");
-            return NULL;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if ((others & (1U << cpu)) && cpu_locals[cpu].active_cr3 == b->pml4) targets |= 1U << cpu;
         }
-        memset(new_pdpt, 0, PAGE_SIZE);
-        *pml4e = ((uint64_t)new_pdpt & PAGE_MASK) | PTE_PRESENT | PTE_WRITABLE;
     }
-    
-    pdpt = phys_to_virt(*pml4e & PAGE_MASK);
-    pdpte = &pdpt[pdpt_idx];
-    if (!(*pdpte & PTE_PRESENT)) {
-        if (!create_if_not_exist) {
-            return NULL;
+    if (targets) {
+        // a CPU waiting here with interrupts off still serves the shootdown in flight
+        while (!spin_trylock(&shootdown_lock)) {
+            tlb_shootdown_poll();
+            __asm__ volatile("pause");
         }
-        void *new_pd = MMU_pf_alloc();
-        if (!new_pd) {
-            printk("Failed to allocate PD\n");
-            return NULL;
+        // a lazy shootdown can still be waiting on this CPU, its IPI is held off by the cli
+        while (__atomic_load_n(&shootdown_todo, __ATOMIC_ACQUIRE)) {
+            tlb_shootdown_poll();
+            __asm__ volatile("pause");
+        }
+        shootdown = *b;
+        __atomic_store_n(&shootdown_todo, targets, __ATOMIC_RELEASE);
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (targets & (1U << cpu)) lapic_send_ipi(smp_apic_id(cpu), TLB_SHOOTDOWN_VECTOR);
         }
-        memset(new_pd, 0, PAGE_SIZE);
-        *pdpte = ((uint64_t)new_pd & PAGE_MASK) | PTE_PRESENT | PTE_WRITABLE;
+        tlb_stats[self].sent++;
+        if (wait) {
+            while (__atomic_load_n(&shootdown_todo, __ATOMIC_ACQUIRE)) {
+                __asm__ volatile("pause");
+            }
+        }
+        spin_unlock(&shootdown_lock);
     }
-    
-    pdt = phys_to_virt(*pdpte & PAGE_MASK);
-    pde = &pdt[pd_idx];
-    if (!(*pde & PTE_PRESENT)) {
-        if (!create_if_not_exist) {
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
+// waits for the acknowledgements a lazy tlb_batch_flush left outstanding
+void tlb_shootdown_wait(void) {
+    while (__atomic_load_n(&shootdown_todo, __ATOMIC_ACQUIRE)) {
+        tlb_shootdown_poll();
+        __asm__ volatile("pause");
+    }
+}
+
+void tlb_stats_dump(void) {
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!(smp_online_mask() & (1U << cpu))) continue;
+        struct tlb_stats *st = &tlb_stats[cpu];
+        printk("tlb cpu %d: %lu shootdowns sent, %lu received, %lu pages and %lu full flushes for others\n",
+               cpu, st->sent, st->received, st->pages, st->full);
+    }
+}
+
+// flush specified TLB entry
+void invlpg(void *addr) {
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+/*-------------------Page table walks-------------------*/
+
+// NULL means the current address space
+void pt_walker_init(struct pt_walker *w, uint64_t *pml4t) {
+    w->pml4t = pml4t ? pml4t : phys_to_virt(get_cr3() & PAGE_MASK);
+    w->pdpt = NULL;
+    w->pdt = NULL;
+    w->pt = NULL;
+    // no address shifts down to all ones
+    w->pdpt_tag = ~0ULL;
+    w->pdt_tag = ~0ULL;
+    w->pt_tag = ~0ULL;
+}
+
+static inline int is_huge(uint64_t entry) {
+    return (entry & (PTE_PRESENT | PTE_HUGE)) == (PTE_PRESENT | PTE_HUGE);
+}
+
+// the table entry points to, allocated when create is set. NULL if it's missing or a huge page
+static uint64_t *next_table(uint64_t *entry, int create, uint64_t table_flags) {
+    if (!(*entry & PTE_PRESENT)) {
+        if (!create) return NULL;
+        void *table = MMU_pf_alloc();
+        if (!table) {
+            printk("Failed to allocate page table\n");
             return NULL;
         }
-        void *new_pt = MMU_pf_alloc();
-        if (!new_pt) {
-            printk("Failed to allocate PT\n");
-            return NULL;
+        memset(table, 0, PAGE_SIZE);
+        *entry = virt_to_phys(table) | table_flags;
+    }
+    if (*entry & PTE_HUGE) return NULL;
+    return phys_to_virt(*entry & PAGE_MASK);
+}
+
+// the entry that maps vaddr and the size of its page, a PDPTE or PDE for huge pages. A level is only
+// read again when vaddr left the range the cursor's table covers
+static uint64_t *walk_leaf(struct pt_walker *w, uint64_t vaddr, int create, uint64_t *page_size) {
+    // user mappings need the user bit on every level
+    uint64_t table_flags = PTE_PRESENT | PTE_WRITABLE | (IS_USER_ADDR(vaddr) ? PTE_USER : 0);
+    *page_size = PAGE_SIZE;
+    if ((vaddr >> PD_SHIFT) != w->pt_tag) {
+        if ((vaddr >> PDPT_SHIFT) != w->pdt_tag) {
+            if ((vaddr >> PML4_SHIFT) != w->pdpt_tag) {
+                uint64_t *pdpt = next_table(&w->pml4t[(vaddr >> PML4_SHIFT) & (ENTRY_PER_TABLE - 1)],
+                                            create, table_flags);
+                if (!pdpt) return NULL;
+                w->pdpt = pdpt;
+                w->pdpt_tag = vaddr >> PML4_SHIFT;
+            }
+            uint64_t *pdpte = &w->pdpt[(vaddr >> PDPT_SHIFT) & (ENTRY_PER_TABLE - 1)];
+            if (is_huge(*pdpte)) {
+                *page_size = 1ULL << PDPT_SHIFT;
+                return pdpte;
+            }
+            uint64_t *pdt = next_table(pdpte, create, table_flags);
+            if (!pdt) return NULL;
+            w->pdt = pdt;
+            w->pdt_tag = vaddr >> PDPT_SHIFT;
         }
-        memset(new_pt, 0, PAGE_SIZE);
-        *pde = ((uint64_t)new_pt & PAGE_MASK) | PTE_PRESENT | PTE_WRITABLE;
+        uint64_t *pde = &w->pdt[(vaddr >> PD_SHIFT) & (ENTRY_PER_TABLE - 1)];
+        if (is_huge(*pde)) {
+            *page_size = 1ULL << PD_SHIFT;
+            return pde;
+        }
+        uint64_t *pt = next_table(pde, create, table_flags);
+        if (!pt) return NULL;
+        w->pt = pt;
+        w->pt_tag = vaddr >> PD_SHIFT;
     }
-    
-    pt = phys_to_virt(*pde & PAGE_MASK);
-    return &pt[pt_idx];
+    return &w->pt[(vaddr >> PT_SHIFT) & (ENTRY_PER_TABLE - 1)];
+}
+
+// the 4 KiB PTE for vaddr, page tables are allocated on the way when create is set. NULL when a
+// level is missing or a huge page covers vaddr
+uint64_t* pt_walk(struct pt_walker *w, uint64_t vaddr, int create) {
+    uint64_t page_size;
+    uint64_t *entry = walk_leaf(w, vaddr, create, &page_size);
+    if (!entry || page_size != PAGE_SIZE) return NULL;
+    return entry;
+}
+
+// physical address vaddr maps to, 0 if it isn't present. Doesn't log, unmapped is a normal answer
+uint64_t pt_walk_phys(struct pt_walker *w, uint64_t vaddr) {
+    uint64_t page_size;
+    uint64_t *entry = walk_leaf(w, vaddr, 0, &page_size);
+    if (!entry || !(*entry & PTE_PRESENT)) return 0;
+    return (*entry & PAGE_MASK & ~(page_size - 1)) + (vaddr & (page_size - 1));
+}
+
+// virt_to_phys for addresses outside the direct map and the kernel image
+uint64_t virt_to_phys_walk(void *vaddr) {
+    struct pt_walker w;
+    pt_walker_init(&w, NULL);
+    uint64_t paddr = pt_walk_phys(&w, (uint64_t)vaddr);
+    if (!paddr) printk("No mapping for address %p\n", vaddr);
+    return paddr;
+}
+
+// one off walk, use a pt_walker for runs of pages
+uint64_t* get_pte(uint64_t *pml4t, uint64_t vaddr, int create_if_not_exist) {
+    struct pt_walker w;
+    pt_walker_init(&w, pml4t);
+    return pt_walk(&w, vaddr, create_if_not_exist);
 }
 
 // map phys page to virt addr
@@ -388,15 +1005,41 @@ void map_page(uint64_t *pml4t, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
         return;
     }
     
+    // the kernel half is the same in every address space, its entries survive CR3 switches
+    if (!IS_USER_ADDR(vaddr)) flags |= PTE_GLOBAL;
     *pte = (paddr & PAGE_MASK) | flags | PTE_PRESENT;
     invlpg((void*)vaddr);
 }
 
+// maps device memory uncached into the kernel growth window, returns the virt addr of paddr
+void* MMU_map_mmio(uint64_t paddr, uint64_t size) {
+    uint64_t offset = paddr & (PAGE_SIZE - 1);
+    uint64_t start = paddr & PAGE_MASK;
+    uint64_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (kernel_growth_brk + pages * PAGE_SIZE > KERNEL_GROWTH_ADR_END) {
+        printk("MMIO window exhausted mapping 0x%lx\n", paddr);
+        return NULL;
+    }
+    uint64_t vaddr = kernel_growth_brk;
+    kernel_growth_brk += pages * PAGE_SIZE;
+
+    uint64_t *pml4t = phys_to_virt(get_cr3() & PAGE_MASK);
+    for (uint64_t i = 0; i < pages; i++) {
+        map_page(pml4t, vaddr + i * PAGE_SIZE, start + i * PAGE_SIZE,
+                 PTE_WRITABLE | PTE_NOT_CACHEABLE | PTE_WRITETHROUGH);
+    }
+    return (void*)(vaddr + offset);
+}
+
+// the frame stays with the caller, who has to tlb_shootdown_wait() before freeing it
 void unmap_page(uint64_t *pml4t, uint64_t vaddr) {
     uint64_t *pte = get_pte(pml4t, vaddr, 0);
     if (pte && (*pte & PTE_PRESENT)) {
         *pte = 0;
-        invlpg((void*)vaddr);
+        struct tlb_batch b;
+        tlb_batch_init(&b, IS_USER_ADDR(vaddr) ? virt_to_phys(pml4t) : 0);
+        tlb_batch_add(&b, vaddr, 1);
+        tlb_batch_flush(&b, 0);
     }
 }
 
@@ -420,10 +1063,11 @@ void* MMU_alloc_page(void) {
 void* MMU_alloc_pages(int num) {
     if (num <= 0) return NULL;
     void *start_addr = (void*)kernel_brk;
-    uint64_t *pml4t = phys_to_virt(get_cr3() & PAGE_MASK);
+    struct pt_walker w;
+    pt_walker_init(&w, NULL);
     for (int i = 0; i < num; i++) {
         uint64_t vaddr = kernel_brk;
-        uint64_t *pte = get_pte(pml4t, vaddr, 1);
+        uint64_t *pte = pt_walk(&w, vaddr, 1);
         if (!pte) {
             // failed to set up page table
             MMU_free_pages(start_addr, i);
@@ -436,33 +1080,252 @@ void* MMU_alloc_pages(int num) {
 }
 
 void MMU_free_page(void *vaddr) {
+    MMU_free_pages(vaddr, 1);
+}
+
+// unmaps up to TLB_BATCH_PAGES pages per shootdown, frames are freed once no CPU can reach them
+void MMU_free_pages(void *vaddr, int num) {
     uint64_t *pml4t = phys_to_virt(get_cr3() & PAGE_MASK);
-    uint64_t *pte = get_pte(pml4t, (uint64_t)vaddr, 0);
-    if (pte) {
-        if (*pte & PTE_PRESENT) {
-            void *page_frame = (void*)(*pte & PAGE_MASK);
-            MMU_pf_free(page_frame);
+    uint64_t base = (uint64_t)vaddr;
+    void *frames[TLB_BATCH_PAGES];
+    struct pt_walker w;
+    pt_walker_init(&w, pml4t);
+    for (int done = 0; done < num; ) {
+        struct tlb_batch b;
+        tlb_batch_init(&b, IS_USER_ADDR(base) ? virt_to_phys(pml4t) : 0);
+        int nframes = 0;
+        for (int i = 0; i < TLB_BATCH_PAGES && done < num; i++, done++) {
+            uint64_t va = base + (uint64_t)done * PAGE_SIZE;
+            uint64_t *pte = pt_walk(&w, va, 0);
+            if (!pte) continue;
+            if (*pte & PTE_PRESENT) {
+                frames[nframes++] = phys_to_virt(*pte & PAGE_MASK);
+                tlb_batch_add(&b, va, 1);
+            }
+            *pte = 0;
+        }
+        tlb_batch_flush(&b, 1);
+        for (int i = 0; i < nframes; i++) {
+            MMU_pf_free(frames[i]);
         }
-        *pte = 0;
-        invlpg(vaddr);
     }
 }
 
-void MMU_free_pages(void *vaddr, int num) {
-    for (int i = 0; i < num; i++) {
-        MMU_free_page((void*)((uint64_t)vaddr + i * PAGE_SIZE));
+// first fit over the DMA pool, returns zeroed pages and their physical address
+void* MMU_dma_alloc(int pages, uint64_t *phys) {
+    if (!dma_pool_phys || pages <= 0) return NULL;
+    for (int i = 0; i + pages <= DMA_POOL_PAGES; i++) {
+        int run = 0;
+        while (run < pages && !dma_pool_used[i + run]) {
+            run++;
+        }
+        if (run < pages) {
+            i += run;
+            continue;
+        }
+        memset(&dma_pool_used[i], 1, pages);
+        uint64_t paddr = dma_pool_phys + (uint64_t)i * PAGE_SIZE;
+        void *vaddr = phys_to_virt(paddr);
+        memset(vaddr, 0, (uint64_t)pages * PAGE_SIZE);
+        if (phys) *phys = paddr;
+        return vaddr;
     }
+    printk("ERROR: DMA pool exhausted (%d pages requested)\n", pages);
+    return NULL;
 }
 
-void page_fault_handler(struct interrupt_frame* frame) {
-    uint64_t fault_address;
-    // cr2 contains virtual address of page that faulted
-    __asm__ volatile("mov %%cr2, %0" : "=r" (fault_address));
+void MMU_dma_free(void *vaddr, int pages) {
+    uint64_t paddr = virt_to_phys(vaddr);
+    if (paddr < dma_pool_phys || paddr >= dma_pool_phys + (uint64_t)DMA_POOL_PAGES * PAGE_SIZE) {
+        printk("ERROR: Freeing %p which is not in the DMA pool\n", vaddr);
+        return;
+    }
+    int first = (paddr - dma_pool_phys) / PAGE_SIZE;
+    for (int i = first; i < first + pages && i < DMA_POOL_PAGES; i++) {
+        dma_pool_used[i] = 0;
+    }
+}
+
+/*-------------------Address spaces-------------------*/
+
+uint64_t MMU_kernel_cr3(void) {
+    return kernel_cr3;
+}
+
+// new PML4 sharing the kernel slots, the user slot starts empty
+uint64_t MMU_create_address_space(void) {
+    uint64_t *pml4t = MMU_pf_alloc();
+    if (!pml4t) return 0;
+    uint64_t *kernel_pml4t = phys_to_virt(kernel_cr3);
+    for (int i = 0; i < ENTRY_PER_TABLE; i++) {
+        if (i < KERNEL_PML4_SLOTS || i >= KERNEL_HIGH_PML4_SLOT) pml4t[i] = kernel_pml4t[i];
+    }
+    return virt_to_phys(pml4t);
+}
+
+static void free_table(uint64_t *table, int level) {
+    for (int i = 0; i < ENTRY_PER_TABLE; i++) {
+        uint64_t e = table[i];
+        if (!(e & PTE_PRESENT)) continue;
+        if (level > 1) {
+            free_table(phys_to_virt(e & PAGE_MASK), level - 1);
+        } else {
+            MMU_pf_free(phys_to_virt(e & PAGE_MASK));
+        }
+    }
+    MMU_pf_free(table);
+}
+
+// frees the user half: page tables and every frame mapped there
+void MMU_destroy_address_space(uint64_t cr3) {
+    if ((get_cr3() & PAGE_MASK) == cr3) {
+        set_cr3(kernel_cr3);
+    }
+    // the PML4 can come back as another address space, its PCID must not
+    MMU_flush_address_space(cr3);
+    uint64_t *pml4t = phys_to_virt(cr3);
+    for (int i = KERNEL_PML4_SLOTS; i < KERNEL_HIGH_PML4_SLOT; i++) {
+        if (pml4t[i] & PTE_PRESENT) {
+            free_table(phys_to_virt(pml4t[i] & PAGE_MASK), 3);
+        }
+    }
+    MMU_pf_free(pml4t);
+}
+
+// copies one level of the user half, leaf frames are shared instead of copied: writable ones lose
+// the write bit in both trees and get PTE_COW. Returns the number of tables allocated, -1 when out of
+// memory (whatever was copied stays in dst for MMU_destroy_address_space)
+static int clone_table(uint64_t *src, uint64_t *dst, int level) {
+    int tables = 0;
+    for (int i = 0; i < ENTRY_PER_TABLE; i++) {
+        uint64_t e = src[i];
+        if (level == 1) {
+            // demand paging entries are copied as they are, each side fills its own frame
+            if (e & PTE_PRESENT) {
+                if (e & (PTE_WRITABLE | PTE_COW)) {
+                    e = (e & ~PTE_WRITABLE) | PTE_COW;
+                    src[i] = e;
+                }
+                MMU_page_ref(phys_to_virt(e & PAGE_MASK));
+            }
+            dst[i] = e;
+            continue;
+        }
+        if (!(e & PTE_PRESENT)) continue;
+        uint64_t *table = MMU_pf_alloc();
+        if (!table) return -1;
+        dst[i] = virt_to_phys(table) | (e & ~PAGE_MASK);
+        int n = clone_table(phys_to_virt(e & PAGE_MASK), table, level - 1);
+        if (n < 0) return -1;
+        tables += n + 1;
+    }
+    return tables;
+}
+
+static uint64_t clone_address_space(uint64_t cr3, int *tables) {
+    uint64_t child = MMU_create_address_space();
+    if (!child) return 0;
+    uint64_t *src = phys_to_virt(cr3), *dst = phys_to_virt(child);
+    int total = 1;
+    for (int i = KERNEL_PML4_SLOTS; i < KERNEL_HIGH_PML4_SLOT; i++) {
+        if (!(src[i] & PTE_PRESENT)) continue;
+        uint64_t *table = MMU_pf_alloc();
+        int n = table ? 0 : -1;
+        if (table) {
+            dst[i] = virt_to_phys(table) | (src[i] & ~PAGE_MASK);
+            n = clone_table(phys_to_virt(src[i] & PAGE_MASK), table, 3);
+        }
+        if (n < 0) {
+            MMU_destroy_address_space(child);
+            child = 0;
+            break;
+        }
+        total += n + 1;
+    }
+    // the source lost write access to its shared pages
+    MMU_flush_address_space(cr3);
+    if (tables) *tables = total;
+    return child;
+}
+
+// copy-on-write clone of the user half, costs the page tables and nothing per resident page
+uint64_t MMU_clone_address_space(uint64_t cr3) {
+    return clone_address_space(cr3, NULL);
+}
+
+// kernel stacks are mapped present, a fault while pushing an exception frame would double fault
+void* MMU_alloc_kstack(int slot) {
+    uint64_t base = KERNEL_STACKS_ADR + (uint64_t)slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+    uint64_t *pml4t = phys_to_virt(kernel_cr3);
+    for (int i = 0; i < KSTACK_PAGES; i++) {
+        void *frame = MMU_pf_alloc();
+        if (!frame) {
+            MMU_free_kstack(slot);
+            return NULL;
+        }
+        map_page(pml4t, base + i * PAGE_SIZE, virt_to_phys(frame), PTE_WRITABLE);
+    }
+    return (void*)(base + KSTACK_PAGES * PAGE_SIZE);
+}
+
+void MMU_free_kstack(int slot) {
+    uint64_t base = KERNEL_STACKS_ADR + (uint64_t)slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+    uint64_t *pml4t = phys_to_virt(kernel_cr3);
+    void *frames[KSTACK_PAGES];
+    int nframes = 0;
+    struct tlb_batch b;
+    tlb_batch_init(&b, 0);
+    for (int i = 0; i < KSTACK_PAGES; i++) {
+        uint64_t *pte = get_pte(pml4t, base + i * PAGE_SIZE, 0);
+        if (pte && (*pte & PTE_PRESENT)) {
+            frames[nframes++] = phys_to_virt(*pte & PAGE_MASK);
+            *pte = 0;
+            tlb_batch_add(&b, base + i * PAGE_SIZE, 1);
+        }
+    }
+    tlb_batch_flush(&b, 1);
+    for (int i = 0; i < nframes; i++) {
+        MMU_pf_free(frames[i]);
+    }
+}
+
+static void handle_page_fault(struct interrupt_frame* frame, uint64_t fault_address) {
     uint64_t cr3 = get_cr3();
     uint64_t *pml4t = phys_to_virt(cr3 & PAGE_MASK);
     uint64_t *pte = get_pte(pml4t, fault_address, 0);
     
-    // check if demand paging
+    int user_page = fault_address >= USER_SPACE_ADR && fault_address < USER_SPACE_END;
+    // another CPU already fixed the PTE up, only this TLB is stale
+    if (user_page && pte && (*pte & PTE_PRESENT) && (*pte & PTE_USER)
+        && (!(frame->err_code & 2) || (*pte & PTE_WRITABLE))) {
+        invlpg((void*)fault_address);
+        return;
+    }
+    // write to a page shared by a clone, the last sharer keeps the frame
+    if (pte && (*pte & PTE_COW) && (frame->err_code & 3) == 3) {
+        void *shared = phys_to_virt(*pte & PAGE_MASK);
+        if (MMU_page_refcount(shared) > 1) {
+            void *copy = MMU_pf_alloc();
+            if (!copy) {
+                printk("Out of memory during copy-on-write\n");
+                goto error;
+            }
+            memcpy(copy, shared, PAGE_SIZE);
+            *pte = virt_to_phys(copy) | ((*pte & ~PAGE_MASK & ~PTE_COW) | PTE_WRITABLE);
+            // other CPUs running this address space must stop reading the shared frame first
+            struct tlb_batch b;
+            tlb_batch_init(&b, cr3);
+            tlb_batch_add(&b, fault_address, 1);
+            tlb_batch_flush(&b, 1);
+            MMU_pf_free(shared);
+            return;
+        }
+        // upgrading needs no shootdown, a stale read-only entry elsewhere faults into the check above
+        *pte = (*pte & ~PTE_COW) | PTE_WRITABLE;
+        invlpg((void*)fault_address);
+        return;
+    }
+    // check if demand paging, nothing caches a non-present entry so only this CPU needs an invlpg
     if (pte && (*pte & PTE_DEMAND_PAGING)) {
         void *page_frame = MMU_pf_alloc();
         if (!page_frame) {
@@ -470,13 +1333,24 @@ void page_fault_handler(struct interrupt_frame* frame) {
             goto error;
         }
         memset(page_frame, 0, PAGE_SIZE);
-        *pte = ((uint64_t)page_frame & PAGE_MASK) | 
+        // user pages may be backed by a file (ELF segments)
+        if (user_page && process_fill_page(fault_address & PAGE_MASK, page_frame) != 0) {
+            MMU_pf_free(page_frame);
+            goto error;
+        }
+        *pte = virt_to_phys(page_frame) | 
                (*pte & ~PTE_DEMAND_PAGING) | 
-               PTE_PRESENT;
+               PTE_PRESENT | (IS_USER_ADDR(fault_address) ? 0 : PTE_GLOBAL);
         invlpg((void*)fault_address);
         return;
     }
 error:
+    // a bad user access only takes down the process
+    if ((frame->cs & 3) || (user_page && current_process)) {
+        printk("Process %d: page fault at 0x%lx (error 0x%lx, rip 0x%lx)\n",
+               current_process ? current_process->pid : -1, fault_address, frame->err_code, frame->rip);
+        process_exit(PROCESS_EXIT_FAULT);
+    }
     printk("=== PAGE FAULT ===\n");
     printk("Address: 0x%lx\n", fault_address);
     printk("Page table (CR3): 0x%lx\n", cr3);
@@ -508,4 +1382,212 @@ error:
         __asm__ volatile("cli");
         __asm__ volatile("hlt");
     }
-}
\ No newline at end of file
+}
+
+void page_fault_handler(struct interrupt_frame* frame) {
+    uint64_t fault_address;
+    // cr2 contains virtual address of page that faulted
+    __asm__ volatile("mov %%cr2, %0" : "=r" (fault_address));
+    trace(pf_begin, fault_address, frame->err_code);
+    handle_page_fault(frame, fault_address);
+    trace(pf_end, fault_address, frame->err_code);
+}
+
+/*-------------------Copy-on-write benchmark-------------------*/
+
+// touches one byte in each of the first n pages at USER_SPACE_ADR of the loaded address space
+static uint64_t touch_pages(int n, int write) {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < n; i++) {
+        volatile uint8_t *p = (volatile uint8_t *)(USER_SPACE_ADR + (uint64_t)i * PAGE_SIZE);
+        if (write) {
+            *p = (uint8_t)i;
+        } else {
+            (void)*p;
+        }
+    }
+    return rdtsc() - start;
+}
+
+// maps up to pages fresh frames at USER_SPACE_ADR, returns how many it got
+static uint64_t populate_user(uint64_t cr3, uint64_t pages) {
+    uint64_t *pml4t = phys_to_virt(cr3);
+    uint64_t resident = 0;
+    for (; resident < pages; resident++) {
+        void *frame = MMU_pf_alloc();
+        if (!frame) break;
+        map_page(pml4t, USER_SPACE_ADR + resident * PAGE_SIZE, virt_to_phys(frame), PTE_WRITABLE | PTE_USER);
+    }
+    return resident;
+}
+
+// clones an address space with bytes resident and times the clone and both write fault paths
+void MMU_cow_benchmark(uint64_t bytes) {
+    uint64_t pages = bytes / PAGE_SIZE;
+    // leave a quarter of free memory for the page tables and copies
+    if (pages > free_pages * 3 / 4) pages = free_pages * 3 / 4;
+    if (pages < COW_BENCH_WRITES) return;
+
+    uint64_t parent = MMU_create_address_space();
+    if (!parent) return;
+    uint64_t resident = populate_user(parent, pages);
+
+    int tables = 0;
+    uint64_t start = rdtsc();
+    uint64_t child = clone_address_space(parent, &tables);
+    uint64_t clone_cycles = rdtsc() - start;
+    if (!child) {
+        printk("cow bench: clone failed\n");
+        MMU_destroy_address_space(parent);
+        return;
+    }
+
+    // child writes copy, then the parent is the only sharer left and gets its frames back writable
+    set_cr3(child);
+    uint64_t copy_cycles = touch_pages(COW_BENCH_WRITES, 1);
+    set_cr3(kernel_cr3);
+    MMU_destroy_address_space(child);
+    set_cr3(parent);
+    uint64_t reuse_cycles = touch_pages(COW_BENCH_WRITES, 1);
+    set_cr3(kernel_cr3);
+    MMU_destroy_address_space(parent);
+
+    printk("cow bench: %lu MiB resident, clone %lu us (%d page tables)\n",
+           resident * PAGE_SIZE / (1024 * 1024), TSC_cycles_to_us(clone_cycles), tables);
+    printk("cow bench: write fault %lu cycles with a copy, %lu cycles reusing the frame\n",
+           copy_cycles / COW_BENCH_WRITES, reuse_cycles / COW_BENCH_WRITES);
+}
+
+/*-------------------TLB benchmark-------------------*/
+
+// ping-pongs between two address spaces, touching every page after each switch, once flushing on
+// each CR3 write like before PCIDs and once keeping the PCID's entries
+void MMU_tlb_benchmark(void) {
+    uint64_t as[2] = { MMU_create_address_space(), MMU_create_address_space() };
+    if (!as[0] || !as[1] || populate_user(as[0], TLB_BENCH_PAGES) < TLB_BENCH_PAGES
+        || populate_user(as[1], TLB_BENCH_PAGES) < TLB_BENCH_PAGES) {
+        printk("tlb bench: out of memory\n");
+        if (as[0]) MMU_destroy_address_space(as[0]);
+        if (as[1]) MMU_destroy_address_space(as[1]);
+        return;
+    }
+    const char *modes[2] = { "flush", "keep" };
+    for (int mode = 0; mode < 2; mode++) {
+        uint64_t switch_cycles = 0, touch_cycles = 0;
+        for (int round = 0; round < TLB_BENCH_ROUNDS; round++) {
+            for (int i = 0; i < 2; i++) {
+                uint64_t start = rdtsc();
+                load_cr3(as[i], mode == 0);
+                switch_cycles += rdtsc() - start;
+                touch_cycles += touch_pages(TLB_BENCH_PAGES, 0);
+            }
+        }
+        printk("tlb bench: %s, switch %lu cycles, %d pages after it %lu cycles\n", modes[mode],
+               switch_cycles / (2 * TLB_BENCH_ROUNDS), TLB_BENCH_PAGES, touch_cycles / (2 * TLB_BENCH_ROUNDS));
+    }
+    set_cr3(kernel_cr3);
+    MMU_destroy_address_space(as[0]);
+    MMU_destroy_address_space(as[1]);
+    if (!pcid_enabled) printk("tlb bench: no PCIDs, both modes flush\n");
+}
+
+/*-------------------Shootdown benchmark-------------------*/
+
+// frees demand paged kernel heap pages batched and one at a time, kernel mappings go to every CPU
+void MMU_shootdown_benchmark(void) {
+    uint64_t cycles[2];
+    uint64_t ipis[2];
+    for (int batched = 1; batched >= 0; batched--) {
+        uint8_t *buf = MMU_alloc_pages(SHOOTDOWN_BENCH_PAGES);
+        if (!buf) return;
+        for (int i = 0; i < SHOOTDOWN_BENCH_PAGES; i++) {
+            buf[i * PAGE_SIZE] = 1;
+        }
+        uint64_t sent = tlb_stats[this_cpu_id()].sent;
+        uint64_t start = rdtsc();
+        if (batched) {
+            MMU_free_pages(buf, SHOOTDOWN_BENCH_PAGES);
+        } else {
+            for (int i = 0; i < SHOOTDOWN_BENCH_PAGES; i++) {
+                MMU_free_page(buf + i * PAGE_SIZE);
+            }
+        }
+        cycles[batched] = rdtsc() - start;
+        ipis[batched] = tlb_stats[this_cpu_id()].sent - sent;
+    }
+    printk("shootdown bench: %d CPUs, %d pages\n", smp_cpu_count(), SHOOTDOWN_BENCH_PAGES);
+    printk("shootdown bench: batched %lu cycles per page (%lu shootdowns), single %lu cycles per page (%lu shootdowns)\n",
+           cycles[1] / SHOOTDOWN_BENCH_PAGES, ipis[1], cycles[0] / SHOOTDOWN_BENCH_PAGES, ipis[0]);
+    tlb_stats_dump();
+}
+
+/*-------------------Microbenchmarks-------------------*/
+
+BENCH(pf_alloc) {
+    void *pf = MMU_pf_alloc();
+    if (pf) MMU_pf_free(pf);
+}
+
+// heap pages are demand paged, so this is the allocation plus one fault per page plus the free
+BENCH(alloc_pages_fault) {
+    uint8_t *p = MMU_alloc_pages(BENCH_FAULT_PAGES);
+    if (!p) return;
+    for (int i = 0; i < BENCH_FAULT_PAGES; i++) {
+        p[i * PAGE_SIZE] = 1;
+    }
+    MMU_free_pages(p, BENCH_FAULT_PAGES);
+}
+
+// BENCH_WALK_BYTES translated a page at a time, the first walks from the top for every page like
+// get_pte used to, the second keeps one cursor. The direct map uses 2 MiB or 1 GiB pages, so they
+// walk a range of the growth window mapped with 4 KiB pages, a DMA list's case, where the cursor
+// also saves the PDE read for 511 of every 512 pages
+static volatile uint64_t walk_sink;
+static uint64_t walk_base = 0;
+
+// built on first use, every PTE points at the same read only frame
+static uint64_t walk_range(void) {
+    if (walk_base) return walk_base;
+    uint64_t base = (kernel_growth_brk + BENCH_WALK_BYTES - 1) & ~(BENCH_WALK_BYTES - 1);
+    if (base + BENCH_WALK_BYTES > KERNEL_GROWTH_ADR_END) return 0;
+    void *frame = MMU_pf_alloc();
+    if (!frame) return 0;
+    struct pt_walker w;
+    pt_walker_init(&w, phys_to_virt(kernel_cr3));
+    for (uint64_t off = 0; off < BENCH_WALK_BYTES; off += PAGE_SIZE) {
+        uint64_t *pte = pt_walk(&w, base + off, 1);
+        if (!pte) {
+            printk("bench: no page tables for the walk range\n");
+            return 0;
+        }
+        *pte = virt_to_phys(frame) | PTE_PRESENT | PTE_GLOBAL;
+    }
+    kernel_growth_brk = base + BENCH_WALK_BYTES;
+    walk_base = base;
+    return base;
+}
+
+BENCH_N(walk_1g, BENCH_WALK_REPS) {
+    uint64_t base = walk_range();
+    if (!base) return;
+    uint64_t *pml4t = phys_to_virt(kernel_cr3);
+    uint64_t sum = 0;
+    for (uint64_t off = 0; off < BENCH_WALK_BYTES; off += PAGE_SIZE) {
+        struct pt_walker w;
+        pt_walker_init(&w, pml4t);
+        sum += pt_walk_phys(&w, base + off);
+    }
+    walk_sink = sum;
+}
+
+BENCH_N(walk_1g_cursor, BENCH_WALK_REPS) {
+    uint64_t base = walk_range();
+    if (!base) return;
+    struct pt_walker w;
+    pt_walker_init(&w, phys_to_virt(kernel_cr3));
+    uint64_t sum = 0;
+    for (uint64_t off = 0; off < BENCH_WALK_BYTES; off += PAGE_SIZE) {
+        sum += pt_walk_phys(&w, base + off);
+    }
+    walk_sink = sum;
+}
@@ -91,6 +91,14 @@ struct multiboot2_tag_string {
     char string[0];
 };
 
+struct multiboot2_tag_module {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;     // physical
+    uint32_t mod_end;
+    char cmdline[0];
+};
+
 struct multiboot2_mmap_entry {
     uint64_t addr;  // base address
     uint64_t len;
@@ -106,6 +114,12 @@ struct multiboot2_tag_mmap {
     struct multiboot2_mmap_entry entries[0];
 };
 
+struct multiboot2_tag_acpi {
+    uint32_t type;
+    uint32_t size;
+    uint8_t rsdp[0];   // copy of the RSDP (v1 for type 14, v2+ for type 15)
+};
+
 struct multiboot2_tag_elf_sections {
     uint32_t type;
     uint32_t size;
@@ -134,6 +148,25 @@ struct mem_region {
     uint32_t type;    // region type (1 = available, 2 = reserved, etc.)
 };
 
+#define MAX_BOOT_MODULES 8
+#define BOOT_MODULE_CMDLINE_LEN 64
+#define BOOT_CMDLINE_LEN 256
+
+// copied out of the multiboot info, which isn't reserved
+struct boot_module {
+    uint64_t start;         // physical, reserved in memory_regions
+    uint64_t end;
+    char cmdline[BOOT_MODULE_CMDLINE_LEN];
+};
+
+// .symtab and its .strtab, physical addresses
+struct kernel_symtab {
+    uint64_t symtab;
+    uint64_t symtab_size;
+    uint64_t strtab;
+    uint64_t strtab_size;
+};
+
 struct free_page {
     struct free_page *next;
 };
@@ -142,17 +175,94 @@ void MMU_init(uint64_t multiboot_info);
 void *MMU_pf_alloc(void);
 void MMU_pf_free(void *pf);
 void MMU_print_memory_map(void);
+uint64_t MMU_free_page_count(void);
+void MMU_page_ref(void *pf);
+int MMU_page_refcount(void *pf);
+int MMU_module_count(void);
+const struct boot_module *MMU_get_module(int index);
+const struct boot_module *MMU_find_module(const char *cmdline);
+const struct kernel_symtab *MMU_kernel_symtab(void);
+const char *MMU_boot_cmdline(void);
+const char *MMU_read_cmdline(uint64_t multiboot_info);
 
 // virtual address space
 // go into boot.asm and change the page table there to match this struct (make sure to update cr3)
 // after that, it should be safe to use cr3, and for multiprocessing, pass in the cr3 as a param for them (later on)
 // write funcs to walk through the page table
-#define PHYS_PF_ADR 0x0000000000                // PML4E slot 0
+// PML4E slot 0 is left unmapped once MMU_init is done
 #define KERNEL_HEAP_ADR 0x10000000000           // PML4E slot 1
 #define KERNEL_GROWTH_ADR_START 0x20000000000   // PML4E slot 2 - 14
 #define KERNEL_GROWTH_ADR_END 0xEFFFFFFFFFF
 #define KERNEL_STACKS_ADR 0xF0000000000         // PML4E slot 15
 #define USER_SPACE_ADR 0x100000000000           // PML4E slot 16
+#define USER_SPACE_END 0x108000000000
+#define USER_STACK_TOP USER_SPACE_END             // grows down, demand paged
+#define USER_STACK_PAGES 16
+#define USER_PML4_SLOT 16
+#define KERNEL_PML4_SLOTS 16                     // slots 0-15 are shared by every address space
+#define KERNEL_HIGH_PML4_SLOT 256                // and so is everything from here up
+#define IS_USER_ADDR(va) ((va) >= USER_SPACE_ADR && (va) < USER_SPACE_END)
+
+// all physical memory at DIRECT_MAP_ADR + paddr (PML4E slots 256 - 319), the kernel image at
+// KERNEL_VMA + paddr (slot 511, the top 2 GiB for -mcmodel=kernel, boot.asm and linker.ld)
+#define DIRECT_MAP_ADR 0xFFFF800000000000
+#define DIRECT_MAP_SLOTS 64                      // 32 TiB
+#define DIRECT_MAP_MAX (DIRECT_MAP_SLOTS * (1ULL << 39))
+#define BOOT_DIRECT_MAP_END 0x40000000           // boot.asm maps the first 1 GiB with 2 MiB pages
+#define KERNEL_VMA 0xFFFFFFFF80000000
+#define KERNEL_IMAGE_END (KERNEL_VMA + 0x40000000)
+
+#define KSTACK_PAGES 4                           // per process kernel stack (TSS rsp0)
+#define KSTACK_SLOT_SIZE ((KSTACK_PAGES + 1) * PAGE_SIZE)   // plus an unmapped guard page
+#define KSTACK_AP_SLOT_BASE 64                   // AP stacks use the slots after the processes'
+#define KSTACK_SLOT_AP(cpu) (KSTACK_AP_SLOT_BASE + (cpu))
+
+#define DMA_POOL_PAGES 256                       // physically contiguous pages (1 MiB) for device DMA
+#define DMA_POOL_LIMIT 0x100000000ULL            // 32 bit DMA addresses (ATA PRDs)
+#define COW_BENCH_BYTES (64ULL * 1024 * 1024)
+
+// cursor for walking runs of addresses: keeps the tables of the last walk and only re-reads the
+// levels whose index changed. Goes stale when page tables are freed (address space teardown)
+struct pt_walker {
+    uint64_t *pml4t;
+    uint64_t *pdpt;
+    uint64_t *pdt;
+    uint64_t *pt;
+    uint64_t pdpt_tag;                          // vaddr >> PML4_SHIFT the pdpt was read for
+    uint64_t pdt_tag;                           // vaddr >> PDPT_SHIFT
+    uint64_t pt_tag;                            // vaddr >> PD_SHIFT
+};
+
+// PCIDs 1..PCID_SLOTS-1 are handed out per CPU, 0 is the kernel address space
+#define PCID_SLOTS 64
+#define CR3_PCID_MASK 0xFFFULL
+#define CR3_NOFLUSH (1ULL << 63)        // keep the PCID's TLB entries on this CR3 write
+#define TLB_BENCH_ROUNDS 1000
+#define TLB_BENCH_PAGES 64
+
+// TLB shootdowns: ranges are batched and sent with one IPI to the CPUs that can cache them
+#define TLB_SHOOTDOWN_VECTOR 0xF0
+#define TLB_BATCH_RANGES 8
+#define TLB_BATCH_PAGES 32                  // frames MMU_free_pages releases per shootdown
+#define TLB_FULL_FLUSH_PAGES 64             // bigger batches flush the whole TLB instead
+#define SHOOTDOWN_BENCH_PAGES 256
+
+struct tlb_batch {
+    uint64_t pml4;          // address space of the ranges, 0 for the kernel half every CPU shares
+    int nranges;
+    int full;
+    uint64_t start[TLB_BATCH_RANGES];
+    uint64_t pages[TLB_BATCH_RANGES];
+    uint64_t total;
+};
+
+struct tlb_stats {
+    uint64_t sent;          // shootdowns this CPU started that needed IPIs
+    uint64_t received;
+    uint64_t pages;         // pages invalidated on behalf of other CPUs
+    uint64_t full;          // whole TLB flushes on behalf of other CPUs
+};
+#define COW_BENCH_WRITES 256
 
 #define PTE_PRESENT (1ULL << 0) // ULL to make sure its a 64 bit int
 #define PTE_WRITABLE (1ULL << 1)
@@ -164,6 +274,7 @@ void MMU_print_memory_map(void);
 #define PTE_HUGE (1ULL << 7)
 #define PTE_GLOBAL (1ULL << 8)
 #define PTE_DEMAND_PAGING (1ULL << 9) 
+#define PTE_COW (1ULL << 10)            // shared read-only after a clone, copied on the first write
 #define PTE_NX (1ULL << 63)
 
 #define PAGE_SHIFT 12
@@ -176,8 +287,23 @@ void MMU_print_memory_map(void);
 #define PML4E_BITS 9
 
 void set_cr3(uint64_t cr3_value);
+void MMU_cpu_init(void);
+void tlb_batch_init(struct tlb_batch *b, uint64_t cr3);
+void tlb_batch_add(struct tlb_batch *b, uint64_t vaddr, uint64_t pages);
+void tlb_batch_flush(struct tlb_batch *b, int wait);
+void tlb_shootdown_wait(void);
+void tlb_stats_dump(void);
+void MMU_shootdown_benchmark(void);
+void MMU_flush_address_space(uint64_t cr3);
+void MMU_tlb_benchmark(void);
+void* MMU_map_mmio(uint64_t paddr, uint64_t size);
 void invlpg(void *addr);
-uint64_t virt_to_phys(void *vaddr);
+uint64_t virt_to_phys_walk(void *vaddr);
+int MMU_direct_mapped(uint64_t paddr, uint64_t len);
+void MMU_trampoline_pml4(uint64_t *pml4t);
+void pt_walker_init(struct pt_walker *w, uint64_t *pml4t);
+uint64_t* pt_walk(struct pt_walker *w, uint64_t vaddr, int create);
+uint64_t pt_walk_phys(struct pt_walker *w, uint64_t vaddr);
 uint64_t* get_pte(uint64_t *pml4t, uint64_t vaddr, int create_if_not_exist);
 void map_page(uint64_t *pml4t, uint64_t vaddr, uint64_t paddr, uint64_t flags);
 void unmap_page(uint64_t *pml4t, uint64_t vaddr);
@@ -186,5 +312,45 @@ void* MMU_alloc_page(void);
 void* MMU_alloc_pages(int num);
 void MMU_free_page(void *vaddr);
 void MMU_free_pages(void *vaddr, int num);
+void* MMU_dma_alloc(int pages, uint64_t *phys);
+uint64_t MMU_kernel_cr3(void);
+uint64_t MMU_create_address_space(void);
+void MMU_destroy_address_space(uint64_t cr3);
+uint64_t MMU_clone_address_space(uint64_t cr3);
+void MMU_cow_benchmark(uint64_t bytes);
+void* MMU_alloc_kstack(int slot);
+void MMU_free_kstack(int slot);
+void MMU_dma_free(void *vaddr, int pages);
+
+// everything physical is reached through the direct map
+static inline void *phys_to_virt(uint64_t paddr) {
+    return (void *)(paddr + DIRECT_MAP_ADR);
+}
+
+// a subtraction for direct mapped and kernel image addresses, a page table walk for the rest
+static inline uint64_t virt_to_phys(void *vaddr) {
+    uint64_t va = (uint64_t)vaddr;
+    if (va >= KERNEL_VMA) return va - KERNEL_VMA;
+    if (va >= DIRECT_MAP_ADR && va < DIRECT_MAP_ADR + DIRECT_MAP_MAX) return va - DIRECT_MAP_ADR;
+    return virt_to_phys_walk(vaddr);
+}
+
+// same without the log line for unmapped addresses, they're 0
+static inline uint64_t virt_to_phys_quiet(void *vaddr) {
+    uint64_t va = (uint64_t)vaddr;
+    if (va >= KERNEL_VMA) return va - KERNEL_VMA;
+    if (va >= DIRECT_MAP_ADR && va < DIRECT_MAP_ADR + DIRECT_MAP_MAX) return va - DIRECT_MAP_ADR;
+    struct pt_walker w;
+    pt_walker_init(&w, NULL);
+    return pt_walk_phys(&w, va);
+}
+
+// virt_to_phys_quiet for consecutive addresses, w is only walked outside the direct map and image
+static inline uint64_t virt_to_phys_cached(struct pt_walker *w, void *vaddr) {
+    uint64_t va = (uint64_t)vaddr;
+    if (va >= KERNEL_VMA) return va - KERNEL_VMA;
+    if (va >= DIRECT_MAP_ADR && va < DIRECT_MAP_ADR + DIRECT_MAP_MAX) return va - DIRECT_MAP_ADR;
+    return pt_walk_phys(w, va);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include "mouse.h"
+#include "drivers.h"
+#include "interrupts.h"
+#include "printk.h"
+#include "tsc.h"
+
+// ps2 mouse on the second controller port
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    asm volatile ( "inb %1, %0"
+                    : "=a"(ret)
+                    : "Nd"(port) );
+    return ret;
+}
+
+static inline int are_interrupts_enabled() {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0"
+                     : "=r"(flags));
+    return flags & 0x200; // Check IF (Interrupt Flag) bit
+}
+
+static volatile int mouse_state = MOUSE_STATE_OFF;
+static uint8_t mouse_id = MOUSE_ID_STANDARD;
+static int packet_size = 3;
+
+// packet assembly (IRQ12 only)
+static uint8_t packet[4];
+static int packet_idx = 0;
+static uint64_t last_byte_tsc = 0;
+
+// event ring, consumers read from head
+static struct mouse_event events[MOUSE_EVENT_QUEUE_SIZE];
+static int ev_head = 0, ev_count = 0;
+static struct mouse_stats stats;
+
+/*-------------------Init-------------------*/
+
+static void mouse_reset_done(int status, const uint8_t *resp, int resp_len, void *arg) {
+    (void)resp_len;
+    (void)arg;
+    if (status != PS2_CMD_OK) {
+        printk("Mouse reset failed (%d)\n", status);
+        mouse_state = MOUSE_STATE_FAILED;
+    } else if (resp[0] != KB_TEST_PASS) {
+        printk("Mouse self test failed with code 0x%x\n", resp[0]);
+        mouse_state = MOUSE_STATE_FAILED;
+    }
+}
+
+static void mouse_id_done(int status, const uint8_t *resp, int resp_len, void *arg) {
+    (void)arg;
+    if (status == PS2_CMD_OK && resp_len > 0) {
+        mouse_id = resp[0];
+        packet_size = (mouse_id == MOUSE_ID_INTELLIMOUSE) ? 4 : 3;
+    } else if (status != PS2_CMD_ERR_ABORTED) {
+        printk("Mouse id query failed (%d)\n", status);
+        mouse_state = MOUSE_STATE_FAILED;
+    }
+}
+
+static void mouse_cmd_done(int status, const uint8_t *resp, int resp_len, void *arg) {
+    (void)resp;
+    (void)resp_len;
+    if (status != PS2_CMD_OK) {
+        if (mouse_state != MOUSE_STATE_FAILED && status != PS2_CMD_ERR_ABORTED) {
+            printk("Mouse command failed (%d)\n", status);
+        }
+        mouse_state = MOUSE_STATE_FAILED;
+    } else if (arg && mouse_state == MOUSE_STATE_RESETTING) {
+        // last byte of the init sequence
+        packet_idx = 0;
+        mouse_state = MOUSE_STATE_READY;
+    }
+}
+
+// queues the reset/configure sequence, see mouse_init_wait()
+int mouse_init(void) {
+    // 200, 100, 80 is the IntelliMouse knock, a wheel mouse then reports id 3
+    static const uint8_t rates[] = {200, 100, 80};
+
+    if (!ps2_port2_present()) {
+        mouse_state = MOUSE_STATE_FAILED;
+        return -1;
+    }
+    mouse_state = MOUSE_STATE_RESETTING;
+    IRQ_set_handler(MOUSE_IRQ, mouse_interrupt_handler, NULL);
+    IRQ_clear_mask(2);  // cascade
+    IRQ_clear_mask(MOUSE_IRQ);
+
+    int err = ps2_cmd_submit(2, MOUSE_RESET, 0, 2, mouse_reset_done, NULL);
+    for (int i = 0; i < 3; i++) {
+        err = err ? err : ps2_cmd_submit(2, MOUSE_SET_SAMPLE_RATE, PS2_CMD_F_CHAIN, 0, mouse_cmd_done, NULL);
+        err = err ? err : ps2_cmd_submit(2, rates[i], PS2_CMD_F_CHAIN, 0, mouse_cmd_done, NULL);
+    }
+    err = err ? err : ps2_cmd_submit(2, MOUSE_GET_ID, PS2_CMD_F_CHAIN, 1, mouse_id_done, NULL);
+    err = err ? err : ps2_cmd_submit(2, MOUSE_SET_SAMPLE_RATE, PS2_CMD_F_CHAIN, 0, mouse_cmd_done, NULL);
+    err = err ? err : ps2_cmd_submit(2, 100, PS2_CMD_F_CHAIN, 0, mouse_cmd_done, NULL);
+    err = err ? err : ps2_cmd_submit(2, MOUSE_ENABLE_REPORTING, PS2_CMD_F_CHAIN, 0, mouse_cmd_done, (void*)1);
+    if (err) {
+        mouse_state = MOUSE_STATE_FAILED;
+        return -1;
+    }
+    return 0;
+}
+
+int mouse_init_wait(uint64_t timeout_us) {
+    uint64_t deadline = TSC_deadline_us(timeout_us);
+    while (mouse_state == MOUSE_STATE_RESETTING && !TSC_expired(deadline)) {
+        ps2_cmd_poll();
+        __asm__ volatile("pause");
+    }
+    if (mouse_state == MOUSE_STATE_READY) {
+        printk("Mouse id %d, %d byte packets\n", mouse_id, packet_size);
+        return 0;
+    }
+    return -1;
+}
+
+/*-------------------Events-------------------*/
+
+// called with interrupts off (IRQ12)
+static void mouse_queue_event(int dx, int dy, int dz, uint8_t buttons) {
+    if (ev_count > 0) {
+        struct mouse_event *last = &events[(ev_head + ev_count - 1) % MOUSE_EVENT_QUEUE_SIZE];
+        if (last->buttons == buttons) {
+            last->dx += dx;
+            last->dy += dy;
+            last->dz += dz;
+            last->packets++;
+            return;
+        }
+    }
+    if (ev_count == MOUSE_EVENT_QUEUE_SIZE) {
+        stats.dropped++;
+        return;
+    }
+    struct mouse_event *ev = &events[(ev_head + ev_count) % MOUSE_EVENT_QUEUE_SIZE];
+    ev->dx = dx;
+    ev->dy = dy;
+    ev->dz = dz;
+    ev->buttons = buttons;
+    ev->packets = 1;
+    ev_count++;
+}
+
+// returns 1 and fills ev if an event was pending
+int mouse_read_event(struct mouse_event *ev) {
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+
+    int ret = 0;
+    if (ev_count > 0) {
+        *ev = events[ev_head];
+        ev_head = (ev_head + 1) % MOUSE_EVENT_QUEUE_SIZE;
+        ev_count--;
+        ret = 1;
+    }
+
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+    return ret;
+}
+
+void mouse_get_stats(struct mouse_stats *out) {
+    *out = stats;
+}
+
+/*-------------------Interrupts-------------------*/
+
+static void mouse_decode_packet(void) {
+    uint8_t flags = packet[0];
+    stats.packets++;
+
+    if (flags & (MOUSE_PKT_X_OVERFLOW | MOUSE_PKT_Y_OVERFLOW)) {
+        // deltas are garbage, keep the button state
+        stats.overflows++;
+        mouse_queue_event(0, 0, 0, flags & MOUSE_PKT_BUTTONS);
+        return;
+    }
+
+    // 9 bit two's complement, sign bits live in byte 0
+    int dx = (int)packet[1] - ((flags & MOUSE_PKT_X_SIGN) ? 0x100 : 0);
+    int dy = (int)packet[2] - ((flags & MOUSE_PKT_Y_SIGN) ? 0x100 : 0);
+    int dz = 0;
+    if (packet_size == 4) {
+        // low nibble is a signed 4 bit value
+        dz = (int)(packet[3] & 0x0F) - ((packet[3] & 0x08) ? 0x10 : 0);
+    }
+    mouse_queue_event(dx, dy, dz, flags & MOUSE_PKT_BUTTONS);
+}
+
+void mouse_interrupt_handler(int irq, int error_code, void* arg) {
+    (void)irq;
+    (void)error_code;
+    (void)arg;
+
+    uint8_t status = inb(PS2_STATUS);
+    if (!(status & PS2_STATUS_OUTPUT) || !(status & PS2_STATUS_AUX)) {
+        return;
+    }
+    uint8_t data = inb(PS2_DATA);
+
+    if (ps2_cmd_response(2, data)) {
+        return;
+    }
+    if (mouse_state != MOUSE_STATE_READY) {
+        return;
+    }
+
+    // a packet that stalls mid way lost a byte, start over with this one
+    uint64_t now = rdtsc();
+    if (packet_idx > 0 && now - last_byte_tsc > TSC_us_to_cycles(MOUSE_PACKET_TIMEOUT_US)) {
+        stats.resyncs += packet_idx;
+        packet_idx = 0;
+    }
+    last_byte_tsc = now;
+
+    // byte 0 always has bit 3 set, anything else can't start a packet
+    if (packet_idx == 0 && !(data & MOUSE_PKT_ALWAYS1)) {
+        stats.resyncs++;
+        return;
+    }
+
+    packet[packet_idx++] = data;
+    if (packet_idx == packet_size) {
+        packet_idx = 0;
+        mouse_decode_packet();
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef MOUSE_H
+#define MOUSE_H
+
+#include <stdint.h>
+
+/*-------------------PS2 Mouse-------------------*/
+
+// commands (sent to port 2 through the ps2 command engine)
+#define MOUSE_SET_RESOLUTION 0xE8
+#define MOUSE_GET_ID 0xF2                       // replies with the device id
+#define MOUSE_SET_SAMPLE_RATE 0xF3              // (value) samples per second
+#define MOUSE_ENABLE_REPORTING 0xF4
+#define MOUSE_DISABLE_REPORTING 0xF5
+#define MOUSE_SET_DEFAULTS 0xF6
+#define MOUSE_RESET 0xFF                        // replies 0xAA then the device id
+
+// device ids
+#define MOUSE_ID_STANDARD 0x00                  // 3 byte packets
+#define MOUSE_ID_INTELLIMOUSE 0x03              // 4 byte packets, 4th byte is the scroll wheel
+
+// packet byte 0
+#define MOUSE_PKT_LEFT 0x01
+#define MOUSE_PKT_RIGHT 0x02
+#define MOUSE_PKT_MIDDLE 0x04
+#define MOUSE_PKT_ALWAYS1 0x08                  // used to find the start of a packet
+#define MOUSE_PKT_X_SIGN 0x10
+#define MOUSE_PKT_Y_SIGN 0x20
+#define MOUSE_PKT_X_OVERFLOW 0x40
+#define MOUSE_PKT_Y_OVERFLOW 0x80
+#define MOUSE_PKT_BUTTONS 0x07
+
+#define MOUSE_IRQ 12
+#define MOUSE_EVENT_QUEUE_SIZE 32
+#define MOUSE_PACKET_TIMEOUT_US 20000           // bytes of one packet arrive back to back
+
+// init state
+#define MOUSE_STATE_OFF 0
+#define MOUSE_STATE_RESETTING 1
+#define MOUSE_STATE_READY 2
+#define MOUSE_STATE_FAILED 3
+
+#define MOUSE_INIT_TIMEOUT_US 1000000
+
+// motion is coalesced: consecutive packets with the same buttons add up into one event
+struct mouse_event {
+    int32_t dx;
+    int32_t dy;             // positive is up
+    int32_t dz;             // scroll wheel, positive is down
+    uint8_t buttons;        // MOUSE_PKT_LEFT | MOUSE_PKT_RIGHT | MOUSE_PKT_MIDDLE
+    uint32_t packets;       // number of packets merged into this event
+};
+
+struct mouse_stats {
+    uint64_t packets;
+    uint64_t resyncs;       // bytes dropped to find the start of a packet again
+    uint64_t overflows;
+    uint64_t dropped;       // events lost to a full queue
+};
+
+int mouse_init(void);
+int mouse_init_wait(uint64_t timeout_us);
+int mouse_read_event(struct mouse_event *ev);
+void mouse_get_stats(struct mouse_stats *stats);
+void mouse_interrupt_handler(int irq, int error_code, void* arg);
+
+#endif
@@ -0,0 +1,599 @@
+#include "pagecache.h"
+#include "block.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+#include "tunable.h"
+#include "tsc.h"
+
+// page cache: page frames keyed by (object, page index), shared by block devices and files.
+// Only touched from process context (callers and the idle loop flusher), never from interrupts.
+
+static struct cache_page pages[PAGECACHE_MAX_PAGES];
+static struct cache_page *hash_table[PAGECACHE_HASH_SIZE];
+static struct cache_page *free_descs;
+static int clock_hand = 0;
+static uint64_t ndirty = 0;
+static uint64_t last_flush_tick = 0;
+static struct pagecache_stats stats;
+static int initialized = 0;
+
+TUNABLE(pagecache_flush_batch, int, PAGECACHE_FLUSH_BATCH);
+TUNABLE(pagecache_dirty_max, uint64_t, PAGECACHE_DIRTY_MAX);
+
+static struct cache_object bdev_objects[BLOCK_MAX_DEVICES];
+static struct block_device *bdev_owners[BLOCK_MAX_DEVICES];
+
+static uint64_t object_pages(struct cache_object *obj) {
+    return (obj->size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+void pagecache_init(void) {
+    if (initialized) return;
+    free_descs = NULL;
+    for (int i = PAGECACHE_MAX_PAGES - 1; i >= 0; i--) {
+        pages[i].obj = NULL;
+        pages[i].hash_next = free_descs;
+        free_descs = &pages[i];
+    }
+    memset(hash_table, 0, sizeof(hash_table));
+    memset(&stats, 0, sizeof(stats));
+    ndirty = 0;
+    clock_hand = 0;
+    initialized = 1;
+    printk("pagecache: %d pages, %d hash buckets\n", PAGECACHE_MAX_PAGES, PAGECACHE_HASH_SIZE);
+}
+
+void pagecache_object_init(struct cache_object *obj, const struct cache_object_ops *ops, uint64_t size, void *private) {
+    memset(obj, 0, sizeof(*obj));
+    obj->ops = ops;
+    obj->size = size;
+    obj->private = private;
+    obj->last_index = (uint64_t)-1;
+}
+
+/*-------------------Hash-------------------*/
+
+static inline uint32_t hash_slot(struct cache_object *obj, uint64_t index) {
+    uint64_t key = ((uint64_t)obj >> 4) ^ (index * 0x9E3779B97F4A7C15ULL);
+    return (key >> (64 - PAGECACHE_HASH_BITS)) & (PAGECACHE_HASH_SIZE - 1);
+}
+
+static struct cache_page *hash_lookup(struct cache_object *obj, uint64_t index) {
+    for (struct cache_page *p = hash_table[hash_slot(obj, index)]; p; p = p->hash_next) {
+        if (p->obj == obj && p->index == index) return p;
+    }
+    return NULL;
+}
+
+static void hash_insert(struct cache_page *page) {
+    uint32_t slot = hash_slot(page->obj, page->index);
+    page->hash_next = hash_table[slot];
+    hash_table[slot] = page;
+}
+
+static void hash_remove(struct cache_page *page) {
+    struct cache_page **pp = &hash_table[hash_slot(page->obj, page->index)];
+    while (*pp && *pp != page) pp = &(*pp)->hash_next;
+    if (*pp) *pp = page->hash_next;
+}
+
+/*-------------------Eviction-------------------*/
+
+static void release_page(struct cache_page *page) {
+    hash_remove(page);
+    page->obj->nr_pages--;
+    MMU_pf_free(page->frame);
+    page->obj = NULL;
+    page->frame = NULL;
+    page->flags = 0;
+    page->hash_next = free_descs;
+    free_descs = page;
+    stats.cached--;
+}
+
+// CLOCK: referenced pages get a second chance, dirty and in-use pages are skipped
+static struct cache_page *clock_find_victim(void) {
+    for (int scanned = 0; scanned < 2 * PAGECACHE_MAX_PAGES; scanned++) {
+        struct cache_page *p = &pages[clock_hand];
+        clock_hand = (clock_hand + 1) % PAGECACHE_MAX_PAGES;
+        if (!p->obj || p->refcount > 0 || (p->flags & CP_DIRTY)) continue;
+        if (p->flags & CP_REFERENCED) {
+            p->flags &= ~CP_REFERENCED;
+            continue;
+        }
+        return p;
+    }
+    return NULL;
+}
+
+static int writeback_cluster(struct cache_page *page);
+
+static int evict_one(void) {
+    struct cache_page *victim = clock_find_victim();
+    if (!victim) {
+        // everything is dirty, clean the oldest pages the hand will reach and try again
+        for (int i = 0; i < PAGECACHE_MAX_PAGES && !victim; i++) {
+            struct cache_page *p = &pages[(clock_hand + i) % PAGECACHE_MAX_PAGES];
+            if (p->obj && p->refcount == 0 && (p->flags & CP_DIRTY)) {
+                if (writeback_cluster(p) > 0) victim = p;
+            }
+        }
+        if (!victim) return 0;
+    }
+    release_page(victim);
+    stats.evictions++;
+    return 1;
+}
+
+int pagecache_shrink(int count) {
+    int freed = 0;
+    while (freed < count && evict_one()) freed++;
+    return freed;
+}
+
+/*-------------------Lookup and fill-------------------*/
+
+static struct cache_page *alloc_page(struct cache_object *obj, uint64_t index) {
+    // direct reclaim: the flusher normally keeps free memory above the low watermark
+    if (!free_descs || MMU_free_page_count() < PAGECACHE_LOW_WATERMARK) {
+        evict_one();
+    }
+    if (!free_descs) return NULL;
+    void *frame = MMU_pf_alloc();
+    if (!frame) return NULL;
+    struct cache_page *page = free_descs;
+    free_descs = page->hash_next;
+    page->obj = obj;
+    page->index = index;
+    page->frame = frame;
+    page->flags = 0;
+    page->refcount = 1;     // keeps the CLOCK hand off it until it is filled and hashed
+    page->dirty_tsc = 0;
+    page->hash_next = NULL;
+    return page;
+}
+
+static void free_unused(struct cache_page *page) {
+    MMU_pf_free(page->frame);
+    page->obj = NULL;
+    page->frame = NULL;
+    page->hash_next = free_descs;
+    free_descs = page;
+}
+
+// reads up to n pages starting at index with one read_pages call, stopping at the first cached
+// page or the end of the object, returns how many were added
+static int fill_range(struct cache_object *obj, uint64_t index, int n, uint32_t flags) {
+    struct cache_page *run[PAGECACHE_CLUSTER_MAX];
+    void *frames[PAGECACHE_CLUSTER_MAX];
+    uint64_t end = object_pages(obj);
+    int count = 0;
+
+    if (n > PAGECACHE_CLUSTER_MAX) n = PAGECACHE_CLUSTER_MAX;
+    while (count < n && index + count < end && !hash_lookup(obj, index + count)) {
+        struct cache_page *page = alloc_page(obj, index + count);
+        if (!page) break;
+        run[count] = page;
+        frames[count] = page->frame;
+        count++;
+    }
+    if (count == 0) return 0;
+
+    stats.read_calls++;
+    if (obj->ops->read_pages(obj, index, frames, count) != 0) {
+        for (int i = 0; i < count; i++) free_unused(run[i]);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        run[i]->flags = flags;
+        run[i]->refcount = 0;
+        hash_insert(run[i]);
+    }
+    obj->nr_pages += count;
+    stats.cached += count;
+    return count;
+}
+
+// reads the demand page (if any) and the read-ahead window behind it in one call, the page half
+// way into the window carries the mark that starts the next window
+static int read_window(struct cache_object *obj, uint64_t start, int demand) {
+    int n = fill_range(obj, start, demand + obj->ra_window, CP_READAHEAD);
+    if (n <= 0) return n;
+    if (demand) hash_lookup(obj, start)->flags &= ~CP_READAHEAD;
+    int ahead = n - demand;
+    if (ahead > 0) {
+        stats.readahead_pages += ahead;
+        obj->ra_next = start + n;
+        struct cache_page *mark = hash_lookup(obj, start + demand + ahead / 2);
+        if (mark) mark->flags |= CP_RA_MARK;
+    }
+    return n;
+}
+
+static void ra_grow(struct cache_object *obj) {
+    if (obj->ra_window == 0) {
+        obj->ra_window = PAGECACHE_RA_MIN;
+    } else if (obj->ra_window < PAGECACHE_RA_MAX) {
+        obj->ra_window *= 2;
+    }
+}
+
+static struct cache_page *find_or_read(struct cache_object *obj, uint64_t index, int fill) {
+    int sequential = index == obj->last_index + 1 || index == obj->last_index;
+    obj->last_index = index;
+
+    struct cache_page *page = hash_lookup(obj, index);
+    if (page) {
+        stats.hits++;
+        if (page->flags & CP_READAHEAD) {
+            page->flags &= ~CP_READAHEAD;
+            stats.readahead_hits++;
+        }
+        if (page->flags & CP_RA_MARK) {
+            page->flags &= ~CP_RA_MARK;
+            ra_grow(obj);
+            read_window(obj, obj->ra_next, 0);
+        }
+    } else {
+        stats.misses++;
+        if (!fill) {
+            // whole page is about to be overwritten, skip the read
+            page = alloc_page(obj, index);
+            if (!page) return NULL;
+            page->refcount = 0;
+            hash_insert(page);
+            obj->nr_pages++;
+            stats.cached++;
+        } else {
+            if (sequential) {
+                ra_grow(obj);
+            } else {
+                obj->ra_window = 0;
+            }
+            if (read_window(obj, index, 1) <= 0) return NULL;
+            page = hash_lookup(obj, index);
+        }
+    }
+    page->flags |= CP_REFERENCED;
+    page->refcount++;
+    return page;
+}
+
+// returns the page with a reference held, NULL past the end of the object or on I/O error
+struct cache_page *pagecache_get(struct cache_object *obj, uint64_t index) {
+    if (index >= object_pages(obj)) return NULL;
+    return find_or_read(obj, index, 1);
+}
+
+void pagecache_put(struct cache_page *page) {
+    if (page->refcount <= 0) {
+        printk("pagecache: put on unreferenced page %lu\n", page->index);
+        return;
+    }
+    page->refcount--;
+}
+
+void pagecache_mark_dirty(struct cache_page *page) {
+    if (!(page->flags & CP_DIRTY)) {
+        page->flags |= CP_DIRTY;
+        page->dirty_tsc = rdtsc();
+        ndirty++;
+    }
+}
+
+/*-------------------Write-back-------------------*/
+
+// writes page and its dirty neighbours as one write_pages call
+static int writeback_cluster(struct cache_page *page) {
+    struct cache_object *obj = page->obj;
+    struct cache_page *run[PAGECACHE_CLUSTER_MAX];
+    void *frames[PAGECACHE_CLUSTER_MAX];
+    uint64_t start = page->index;
+    int count = 0;
+
+    while (start > 0 && page->index - start < PAGECACHE_CLUSTER_MAX / 2) {
+        struct cache_page *prev = hash_lookup(obj, start - 1);
+        if (!prev || !(prev->flags & CP_DIRTY)) break;
+        start--;
+    }
+    while (count < PAGECACHE_CLUSTER_MAX) {
+        struct cache_page *p = hash_lookup(obj, start + count);
+        if (!p || !(p->flags & CP_DIRTY)) break;
+        run[count] = p;
+        frames[count] = p->frame;
+        count++;
+    }
+
+    stats.write_calls++;
+    if (obj->ops->write_pages(obj, start, frames, count) != 0) {
+        printk("pagecache: write-back of pages %lu-%lu failed\n", start, start + count - 1);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        run[i]->flags &= ~CP_DIRTY;
+    }
+    ndirty -= count;
+    stats.writeback_pages += count;
+    return count;
+}
+
+int pagecache_sync(struct cache_object *obj) {
+    int ret = 0;
+    for (int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        struct cache_page *p = &pages[i];
+        if (p->obj && (p->flags & CP_DIRTY) && (!obj || p->obj == obj)) {
+            if (writeback_cluster(p) < 0) ret = -1;
+        }
+    }
+    return ret;
+}
+
+// writes back and drops every unreferenced page of obj
+void pagecache_invalidate(struct cache_object *obj) {
+    pagecache_sync(obj);
+    for (int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        struct cache_page *p = &pages[i];
+        if (p->obj == obj && p->refcount == 0 && !(p->flags & CP_DIRTY)) {
+            release_page(p);
+        }
+    }
+    obj->last_index = (uint64_t)-1;
+    obj->ra_window = 0;
+}
+
+// called from the idle loop, does at most one batch of work per timer tick
+void pagecache_flush_tick(void) {
+    if (!initialized) return;
+    uint64_t tick = PIT_ticks();
+    if (tick == last_flush_tick) return;
+    last_flush_tick = tick;
+
+    if (ndirty) {
+        uint64_t expire = TSC_us_to_cycles(PAGECACHE_DIRTY_EXPIRE_US);
+        uint64_t now = rdtsc();
+        int written = 0;
+        for (int i = 0; i < PAGECACHE_MAX_PAGES && written < pagecache_flush_batch; i++) {
+            struct cache_page *p = &pages[i];
+            if (p->obj && (p->flags & CP_DIRTY) && now - p->dirty_tsc > expire) {
+                int n = writeback_cluster(p);
+                if (n > 0) written += n;
+            }
+        }
+    }
+
+    // background reclaim back up to the high watermark
+    if (MMU_free_page_count() < PAGECACHE_LOW_WATERMARK) {
+        uint64_t want = PAGECACHE_HIGH_WATERMARK - MMU_free_page_count();
+        pagecache_shrink(want < PAGECACHE_SHRINK_BATCH ? want : PAGECACHE_SHRINK_BATCH);
+    }
+}
+
+/*-------------------Byte interface-------------------*/
+
+int64_t pagecache_read(struct cache_object *obj, uint64_t offset, void *buf, uint64_t len) {
+    if (offset >= obj->size) return 0;
+    if (len > obj->size - offset) len = obj->size - offset;
+    uint8_t *dst = buf;
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint32_t in_page = pos % PAGE_SIZE;
+        uint64_t chunk = PAGE_SIZE - in_page;
+        if (chunk > len - done) chunk = len - done;
+        struct cache_page *page = pagecache_get(obj, pos / PAGE_SIZE);
+        if (!page) return done ? (int64_t)done : -1;
+        memcpy(dst + done, (uint8_t *)page->frame + in_page, chunk);
+        pagecache_put(page);
+        done += chunk;
+    }
+    return done;
+}
+
+// writes stay in the cache until the flusher or pagecache_sync picks them up
+int64_t pagecache_write(struct cache_object *obj, uint64_t offset, const void *buf, uint64_t len) {
+    if (offset >= obj->size) return 0;
+    if (len > obj->size - offset) len = obj->size - offset;
+    const uint8_t *src = buf;
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint32_t in_page = pos % PAGE_SIZE;
+        uint64_t chunk = PAGE_SIZE - in_page;
+        if (chunk > len - done) chunk = len - done;
+        uint64_t index = pos / PAGE_SIZE;
+        int whole = in_page == 0 && (chunk == PAGE_SIZE || pos + chunk == obj->size);
+        struct cache_page *page = find_or_read(obj, index, !whole);
+        if (!page) return done ? (int64_t)done : -1;
+        memcpy((uint8_t *)page->frame + in_page, src + done, chunk);
+        pagecache_mark_dirty(page);
+        pagecache_put(page);
+        done += chunk;
+
+        // throttle writers that outrun the flusher
+        if (ndirty > pagecache_dirty_max) {
+            for (int i = 0; i < PAGECACHE_MAX_PAGES && ndirty > pagecache_dirty_max / 2; i++) {
+                struct cache_page *p = &pages[i];
+                if (p->obj && (p->flags & CP_DIRTY)) writeback_cluster(p);
+            }
+        }
+    }
+    return done;
+}
+
+/*-------------------Block devices-------------------*/
+
+static int bdev_rw_pages(struct cache_object *obj, int dir, uint64_t index, void **frames, int n) {
+    struct block_device *dev = obj->private;
+    struct bio bio;
+    uint64_t remaining = obj->size - index * PAGE_SIZE;
+
+    bio_init(&bio, dev, dir, index * (PAGE_SIZE / BLOCK_SECTOR_SIZE));
+    for (int i = 0; i < n; i++) {
+        // a device that isn't a whole number of pages ends in a partial page
+        uint32_t len = remaining < PAGE_SIZE ? remaining : PAGE_SIZE;
+        if (bio_add_page(&bio, frames[i], len, 0) != BLOCK_OK) return BLOCK_ERR_INVAL;
+        remaining -= len;
+    }
+    if (blk_submit_bio(&bio) != BLOCK_OK) return bio.status;
+    return blk_wait_bio(&bio);
+}
+
+static int bdev_read_pages(struct cache_object *obj, uint64_t index, void **frames, int n) {
+    return bdev_rw_pages(obj, BIO_READ, index, frames, n);
+}
+
+static int bdev_write_pages(struct cache_object *obj, uint64_t index, void **frames, int n) {
+    return bdev_rw_pages(obj, BIO_WRITE, index, frames, n);
+}
+
+static const struct cache_object_ops bdev_ops = {
+    .read_pages = bdev_read_pages,
+    .write_pages = bdev_write_pages,
+};
+
+// the cache object for a whole block device, created on first use
+struct cache_object *pagecache_bdev_object(struct block_device *dev) {
+    for (int i = 0; i < BLOCK_MAX_DEVICES; i++) {
+        if (bdev_owners[i] == dev) return &bdev_objects[i];
+    }
+    for (int i = 0; i < BLOCK_MAX_DEVICES; i++) {
+        if (!bdev_owners[i]) {
+            bdev_owners[i] = dev;
+            pagecache_object_init(&bdev_objects[i], &bdev_ops, dev->sectors * BLOCK_SECTOR_SIZE, dev);
+            return &bdev_objects[i];
+        }
+    }
+    return NULL;
+}
+
+/*-------------------Stats-------------------*/
+
+void pagecache_stats_dump(void) {
+    uint64_t lookups = stats.hits + stats.misses;
+    printk("pagecache: %lu cached, %lu dirty, %lu free frames\n", stats.cached, ndirty, MMU_free_page_count());
+    printk("  hits %lu misses %lu (%lu%% hit), evictions %lu\n", stats.hits, stats.misses,
+           lookups ? stats.hits * 100 / lookups : 0, stats.evictions);
+    printk("  read calls %lu, read-ahead %lu pages (%lu used), write-back %lu pages in %lu calls\n",
+           stats.read_calls, stats.readahead_pages, stats.readahead_hits, stats.writeback_pages, stats.write_calls);
+}
+
+/*-------------------Self test-------------------*/
+
+#define SELFTEST_PAGES 256
+
+// RAM backed object so the cache can be exercised without a disk
+static int ram_read_pages(struct cache_object *obj, uint64_t index, void **frames, int n) {
+    uint8_t *mem = obj->private;
+    for (int i = 0; i < n; i++) {
+        memcpy(frames[i], mem + (index + i) * PAGE_SIZE, PAGE_SIZE);
+    }
+    return 0;
+}
+
+static int ram_write_pages(struct cache_object *obj, uint64_t index, void **frames, int n) {
+    uint8_t *mem = obj->private;
+    for (int i = 0; i < n; i++) {
+        memcpy(mem + (index + i) * PAGE_SIZE, frames[i], PAGE_SIZE);
+    }
+    return 0;
+}
+
+static const struct cache_object_ops ram_ops = {
+    .read_pages = ram_read_pages,
+    .write_pages = ram_write_pages,
+};
+
+static inline uint8_t pattern(uint64_t pos) {
+    return (uint8_t)(pos ^ (pos >> 8) ^ (pos >> 17));
+}
+
+static int check_pattern(const uint8_t *buf, uint64_t pos, uint64_t len) {
+    for (uint64_t i = 0; i < len; i++) {
+        if (buf[i] != pattern(pos + i)) return 0;
+    }
+    return 1;
+}
+
+void pagecache_selftest(void) {
+    struct cache_object obj;
+    uint8_t *backing = MMU_alloc_pages(SELFTEST_PAGES);
+    uint8_t *buf = MMU_alloc_pages(1);
+    int ok = 1;
+
+    if (!backing || !buf) {
+        printk("pagecache selftest: out of memory\n");
+        return;
+    }
+    pagecache_object_init(&obj, &ram_ops, SELFTEST_PAGES * PAGE_SIZE, backing);
+
+    // unaligned writes, then sync, the backing store has to match
+    uint64_t write_calls = stats.write_calls;
+    for (uint64_t pos = 0; pos < obj.size; pos += 1000) {
+        uint64_t len = obj.size - pos < 1000 ? obj.size - pos : 1000;
+        for (uint64_t i = 0; i < len; i++) buf[i] = pattern(pos + i);
+        if (pagecache_write(&obj, pos, buf, len) != (int64_t)len) ok = 0;
+    }
+    pagecache_sync(&obj);
+    if (!check_pattern(backing, 0, obj.size)) ok = 0;
+    printk("pagecache selftest: write + sync %s, %lu write-back calls for %d pages\n",
+           ok ? "ok" : "FAILED", stats.write_calls - write_calls, SELFTEST_PAGES);
+
+    // cold sequential read, read-ahead should turn 256 misses into a handful of calls
+    pagecache_invalidate(&obj);
+    uint64_t calls = stats.read_calls;
+    uint64_t misses = stats.misses;
+    for (uint64_t pos = 0; pos < obj.size; pos += PAGE_SIZE) {
+        if (pagecache_read(&obj, pos, buf, PAGE_SIZE) != PAGE_SIZE || !check_pattern(buf, pos, PAGE_SIZE)) ok = 0;
+    }
+    printk("pagecache selftest: sequential read %s, %lu misses, %lu read calls\n",
+           ok ? "ok" : "FAILED", stats.misses - misses, stats.read_calls - calls);
+
+    // random reads over a warm cache
+    uint64_t hits = stats.hits;
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    for (int i = 0; i < 1024; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint64_t pos = state % (obj.size - 64);
+        if (pagecache_read(&obj, pos, buf, 64) != 64 || !check_pattern(buf, pos, 64)) ok = 0;
+    }
+    printk("pagecache selftest: random read %s, %lu/1024 hits\n", ok ? "ok" : "FAILED", stats.hits - hits);
+
+    // dirty half of it and force everything out, dirty pages must be written before they go
+    for (uint64_t pos = 0; pos < obj.size / 2; pos += PAGE_SIZE) {
+        struct cache_page *page = pagecache_get(&obj, pos / PAGE_SIZE);
+        if (!page) { ok = 0; break; }
+        ((uint8_t *)page->frame)[0] = pattern(pos) ^ 0xFF;
+        pagecache_mark_dirty(page);
+        pagecache_put(page);
+    }
+    int evicted = pagecache_shrink(PAGECACHE_MAX_PAGES);
+    for (uint64_t pos = 0; pos < obj.size / 2; pos += PAGE_SIZE) {
+        uint8_t want = pattern(pos) ^ 0xFF;
+        if (backing[pos] != want) ok = 0;
+    }
+    if (obj.nr_pages != 0) ok = 0;
+    printk("pagecache selftest: eviction %s, %d pages evicted\n", ok ? "ok" : "FAILED", evicted);
+
+    // same path through a block device
+    struct block_device *dev = blk_get("ram0");
+    struct cache_object *bobj = dev ? pagecache_bdev_object(dev) : NULL;
+    if (bobj) {
+        for (uint64_t i = 0; i < PAGE_SIZE; i++) buf[i] = pattern(i + 12345);
+        int bok = pagecache_write(bobj, 3 * PAGE_SIZE + 512, buf, PAGE_SIZE) == PAGE_SIZE;
+        bok = bok && pagecache_sync(bobj) == 0;
+        memset(buf, 0, PAGE_SIZE);
+        bok = bok && blk_read(dev, 3 * (PAGE_SIZE / BLOCK_SECTOR_SIZE) + 1, PAGE_SIZE / BLOCK_SECTOR_SIZE, buf) == BLOCK_OK;
+        bok = bok && check_pattern(buf, 12345, PAGE_SIZE);
+        pagecache_invalidate(bobj);
+        printk("pagecache selftest: %s round trip %s\n", dev->name, bok ? "ok" : "FAILED");
+        ok = ok && bok;
+    }
+
+    pagecache_stats_dump();
+    printk("pagecache selftest: %s\n", ok ? "passed" : "FAILED");
+    MMU_free_pages(buf, 1);
+    MMU_free_pages(backing, SELFTEST_PAGES);
+}
@@ -0,0 +1,84 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PAGECACHE_MAX_PAGES 2048            // 8 MiB of cached data at most
+#define PAGECACHE_HASH_BITS 10
+#define PAGECACHE_HASH_SIZE (1 << PAGECACHE_HASH_BITS)
+#define PAGECACHE_RA_MIN 4                  // read-ahead window in pages, doubles on sequential access
+#define PAGECACHE_RA_MAX 32
+#define PAGECACHE_CLUSTER_MAX 32            // pages per read_pages/write_pages call
+#define PAGECACHE_LOW_WATERMARK 1024        // free frames, below this the cache gives pages back
+#define PAGECACHE_HIGH_WATERMARK 2048
+#define PAGECACHE_SHRINK_BATCH 32
+#define PAGECACHE_DIRTY_EXPIRE_US 500000    // flusher writes back pages dirty for longer
+#define PAGECACHE_DIRTY_MAX (PAGECACHE_MAX_PAGES / 4)   // writers flush synchronously above this
+#define PAGECACHE_FLUSH_BATCH 64            // pages per flusher tick
+
+// page flags
+#define CP_DIRTY 0x01
+#define CP_REFERENCED 0x02      // CLOCK second chance
+#define CP_READAHEAD 0x04       // brought in by read-ahead, not used yet
+#define CP_RA_MARK 0x08         // hitting this page starts the next read-ahead window
+
+struct cache_object;
+struct block_device;
+
+// n consecutive pages starting at index, each frame is one page
+struct cache_object_ops {
+    int (*read_pages)(struct cache_object *obj, uint64_t index, void **frames, int n);
+    int (*write_pages)(struct cache_object *obj, uint64_t index, void **frames, int n);
+};
+
+// anything with pages behind it: a block device, a file
+struct cache_object {
+    const struct cache_object_ops *ops;
+    uint64_t size;              // bytes
+    void *private;
+    uint64_t nr_pages;          // cached right now
+    uint64_t last_index;        // for sequential detection
+    uint64_t ra_next;           // first page past the last read-ahead window
+    uint32_t ra_window;
+};
+
+struct cache_page {
+    struct cache_object *obj;   // NULL when the descriptor is free
+    uint64_t index;
+    void *frame;
+    uint32_t flags;
+    int refcount;
+    uint64_t dirty_tsc;
+    struct cache_page *hash_next;
+};
+
+struct pagecache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead_pages;
+    uint64_t readahead_hits;
+    uint64_t read_calls;        // read_pages calls
+    uint64_t evictions;
+    uint64_t writeback_pages;
+    uint64_t write_calls;       // write_pages calls
+    uint64_t cached;
+    uint64_t dirty;
+};
+
+void pagecache_init(void);
+void pagecache_object_init(struct cache_object *obj, const struct cache_object_ops *ops, uint64_t size, void *private);
+struct cache_object *pagecache_bdev_object(struct block_device *dev);
+struct cache_page *pagecache_get(struct cache_object *obj, uint64_t index);
+void pagecache_put(struct cache_page *page);
+void pagecache_mark_dirty(struct cache_page *page);
+int64_t pagecache_read(struct cache_object *obj, uint64_t offset, void *buf, uint64_t len);
+int64_t pagecache_write(struct cache_object *obj, uint64_t offset, const void *buf, uint64_t len);
+int pagecache_sync(struct cache_object *obj);
+void pagecache_invalidate(struct cache_object *obj);
+int pagecache_shrink(int pages);
+void pagecache_flush_tick(void);
+void pagecache_stats_dump(void);
+void pagecache_selftest(void);
+
+#endif
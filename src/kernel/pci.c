@@ -0,0 +1,404 @@
+#include "pci.h"
+#include "acpi.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+#include "tsc.h"
+
+// PCI bus enumeration, config space access and driver matching
+
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile ( "outl %0, %1" : : "a"(val), "Nd"(port) );
+}
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    asm volatile ( "inl %1, %0"
+                    : "=a"(ret)
+                    : "Nd"(port) );
+    return ret;
+}
+
+static struct pci_dev pci_devices[PCI_MAX_DEVICES];
+static int num_pci_devices = 0;
+static const struct pci_driver *pci_drivers[PCI_MAX_DRIVERS];
+static int num_pci_drivers = 0;
+static int pci_enumerated = 0;
+
+// ECAM (from the ACPI MCFG table), each bus is mapped the first time it is touched
+static uint64_t ecam_base = 0;
+static uint8_t ecam_start_bus = 0, ecam_end_bus = 0;
+static volatile uint8_t *ecam_bus_virt[PCI_MAX_BUSES];
+static uint8_t bus_scanned[PCI_MAX_BUSES];
+
+/*-------------------Config space-------------------*/
+
+static volatile uint8_t *ecam_address(uint8_t bus, uint8_t slot, uint8_t func, uint16_t off) {
+    if (!ecam_base || bus < ecam_start_bus || bus > ecam_end_bus) {
+        return NULL;
+    }
+    if (!ecam_bus_virt[bus]) {
+        // 32 slots * 8 functions * 4 KiB per bus, the MCFG base is bus 0's even when start_bus isn't 0
+        uint64_t phys = ecam_base + ((uint64_t)bus << 20);
+        ecam_bus_virt[bus] = MMU_map_mmio(phys, 1 << 20);
+        if (!ecam_bus_virt[bus]) return NULL;
+    }
+    return ecam_bus_virt[bus] + ((uint32_t)slot << 15) + ((uint32_t)func << 12) + off;
+}
+
+static uint32_t legacy_address(uint8_t bus, uint8_t slot, uint8_t func, uint16_t off) {
+    return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+           ((uint32_t)func << 8) | (off & 0xFC);
+}
+
+static uint32_t cfg_read32(uint8_t bus, uint8_t slot, uint8_t func, uint16_t off) {
+    volatile uint8_t *p = ecam_address(bus, slot, func, off);
+    if (p) return *(volatile uint32_t *)p;
+    outl(PCI_CONFIG_ADDRESS, legacy_address(bus, slot, func, off));
+    return inl(PCI_CONFIG_DATA);
+}
+
+static void cfg_write32(uint8_t bus, uint8_t slot, uint8_t func, uint16_t off, uint32_t val) {
+    volatile uint8_t *p = ecam_address(bus, slot, func, off);
+    if (p) {
+        *(volatile uint32_t *)p = val;
+        return;
+    }
+    outl(PCI_CONFIG_ADDRESS, legacy_address(bus, slot, func, off));
+    outl(PCI_CONFIG_DATA, val);
+}
+
+// narrower accesses are done as read-modify-write of the containing dword
+static uint16_t cfg_read16(uint8_t bus, uint8_t slot, uint8_t func, uint16_t off) {
+    return cfg_read32(bus, slot, func, off & ~3) >> ((off & 2) * 8);
+}
+
+static uint8_t cfg_read8(uint8_t bus, uint8_t slot, uint8_t func, uint16_t off) {
+    return cfg_read32(bus, slot, func, off & ~3) >> ((off & 3) * 8);
+}
+
+uint32_t pci_read32(struct pci_dev *dev, uint16_t off) {
+    return cfg_read32(dev->bus, dev->slot, dev->func, off);
+}
+
+uint16_t pci_read16(struct pci_dev *dev, uint16_t off) {
+    return cfg_read16(dev->bus, dev->slot, dev->func, off);
+}
+
+uint8_t pci_read8(struct pci_dev *dev, uint16_t off) {
+    return cfg_read8(dev->bus, dev->slot, dev->func, off);
+}
+
+void pci_write32(struct pci_dev *dev, uint16_t off, uint32_t val) {
+    cfg_write32(dev->bus, dev->slot, dev->func, off, val);
+}
+
+void pci_write16(struct pci_dev *dev, uint16_t off, uint16_t val) {
+    int shift = (off & 2) * 8;
+    uint32_t dword = pci_read32(dev, off & ~3);
+    dword = (dword & ~(0xFFFFU << shift)) | ((uint32_t)val << shift);
+    pci_write32(dev, off & ~3, dword);
+}
+
+void pci_write8(struct pci_dev *dev, uint16_t off, uint8_t val) {
+    int shift = (off & 3) * 8;
+    uint32_t dword = pci_read32(dev, off & ~3);
+    dword = (dword & ~(0xFFU << shift)) | ((uint32_t)val << shift);
+    pci_write32(dev, off & ~3, dword);
+}
+
+/*-------------------Device setup-------------------*/
+
+void pci_enable(struct pci_dev *dev, uint16_t command_bits) {
+    pci_write16(dev, PCI_COMMAND, pci_read16(dev, PCI_COMMAND) | command_bits);
+}
+
+// writes all ones to each BAR, the bits that stay zero give its size
+static void pci_size_bars(struct pci_dev *dev) {
+    int num_bars = 0;
+    if ((dev->header_type & PCI_HEADER_TYPE_MASK) == 0) num_bars = PCI_NUM_BARS;
+    else if ((dev->header_type & PCI_HEADER_TYPE_MASK) == PCI_HEADER_TYPE_BRIDGE) num_bars = 2;
+
+    // no decoding while the BARs hold garbage
+    uint16_t command = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+
+    for (int i = 0; i < num_bars; i++) {
+        uint16_t off = PCI_BAR0 + i * 4;
+        uint32_t orig = pci_read32(dev, off);
+        pci_write32(dev, off, 0xFFFFFFFF);
+        uint32_t mask = pci_read32(dev, off);
+        pci_write32(dev, off, orig);
+        if (mask == 0) continue;
+
+        struct pci_bar *bar = &dev->bars[i];
+        if (orig & PCI_BAR_IO) {
+            bar->is_io = 1;
+            bar->io_port = orig & ~0x3;
+            bar->size = (uint16_t)(~(mask & ~0x3) + 1);
+            continue;
+        }
+
+        bar->prefetch = (orig & PCI_BAR_PREFETCH) != 0;
+        bar->phys = orig & ~0xF;
+        if ((orig & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64 && i + 1 < num_bars) {
+            uint32_t orig_hi = pci_read32(dev, off + 4);
+            pci_write32(dev, off + 4, 0xFFFFFFFF);
+            uint32_t mask_hi = pci_read32(dev, off + 4);
+            pci_write32(dev, off + 4, orig_hi);
+            bar->is_64 = 1;
+            bar->phys |= (uint64_t)orig_hi << 32;
+            bar->size = ~(((uint64_t)mask_hi << 32) | (mask & ~0xF)) + 1;
+            i++;  // upper half lives in the next BAR
+        } else {
+            bar->size = (uint32_t)(~(mask & ~0xF) + 1);
+        }
+    }
+
+    pci_write16(dev, PCI_COMMAND, command);
+}
+
+// returns the offset of the next capability with cap_id after start (0 to search from the top)
+uint8_t pci_find_capability(struct pci_dev *dev, uint8_t cap_id, uint8_t start) {
+    if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+    uint8_t ptr = start ? pci_read8(dev, start + 1) : pci_read8(dev, PCI_CAPABILITY_LIST);
+    // bounded in case the list loops
+    for (int i = 0; i < 48 && ptr >= 0x40; i++) {
+        ptr &= ~0x3;
+        if (pci_read8(dev, ptr) == cap_id) {
+            return ptr;
+        }
+        ptr = pci_read8(dev, ptr + 1);
+    }
+    return 0;
+}
+
+static void pci_parse_capabilities(struct pci_dev *dev) {
+    dev->msi_cap = pci_find_capability(dev, PCI_CAP_ID_MSI, 0);
+    dev->msix_cap = pci_find_capability(dev, PCI_CAP_ID_MSIX, 0);
+    if (dev->msix_cap) {
+        uint16_t flags = pci_read16(dev, dev->msix_cap + PCI_MSIX_FLAGS);
+        uint32_t table = pci_read32(dev, dev->msix_cap + PCI_MSIX_TABLE);
+        dev->msix_table_size = (flags & PCI_MSIX_FLAGS_QSIZE) + 1;
+        dev->msix_bir = table & 0x7;
+        dev->msix_table_offset = table & ~0x7;
+    }
+}
+
+void *pci_map_bar(struct pci_dev *dev, int bar) {
+    if (bar < 0 || bar >= PCI_NUM_BARS) return NULL;
+    struct pci_bar *b = &dev->bars[bar];
+    if (b->is_io || b->size == 0) {
+        return NULL;
+    }
+    if (!b->virt) {
+        b->virt = MMU_map_mmio(b->phys, b->size);
+    }
+    return b->virt;
+}
+
+// one message, fixed delivery, edge triggered, to the given local APIC
+// (the handler must EOI the local APIC, not the PIC)
+int pci_enable_msi(struct pci_dev *dev, uint8_t vector, uint8_t apic_id) {
+    if (!dev->msi_cap) return -1;
+    uint8_t cap = dev->msi_cap;
+    uint16_t flags = pci_read16(dev, cap + PCI_MSI_FLAGS);
+
+    pci_write32(dev, cap + PCI_MSI_ADDRESS_LO, MSI_ADDRESS_BASE | ((uint32_t)apic_id << MSI_ADDRESS_DEST_SHIFT));
+    if (flags & PCI_MSI_FLAGS_64BIT) {
+        pci_write32(dev, cap + PCI_MSI_ADDRESS_HI, 0);
+        pci_write16(dev, cap + PCI_MSI_DATA_64, vector);
+    } else {
+        pci_write16(dev, cap + PCI_MSI_DATA_32, vector);
+    }
+    flags &= ~PCI_MSI_FLAGS_QSIZE;
+    flags |= PCI_MSI_FLAGS_ENABLE;
+    pci_write16(dev, cap + PCI_MSI_FLAGS, flags);
+    pci_enable(dev, PCI_COMMAND_INTX_DISABLE);
+    return 0;
+}
+
+int pci_enable_msix(struct pci_dev *dev, int entry, uint8_t vector, uint8_t apic_id) {
+    if (!dev->msix_cap || entry < 0 || entry >= dev->msix_table_size) return -1;
+    uint8_t *bar = pci_map_bar(dev, dev->msix_bir);
+    if (!bar) return -1;
+
+    volatile uint32_t *e = (volatile uint32_t *)(bar + dev->msix_table_offset + entry * PCI_MSIX_ENTRY_SIZE);
+    e[0] = MSI_ADDRESS_BASE | ((uint32_t)apic_id << MSI_ADDRESS_DEST_SHIFT);
+    e[1] = 0;
+    e[2] = vector;
+    e[3] &= ~PCI_MSIX_ENTRY_CTRL_MASKBIT;
+
+    uint16_t flags = pci_read16(dev, dev->msix_cap + PCI_MSIX_FLAGS);
+    flags |= PCI_MSIX_FLAGS_ENABLE;
+    flags &= ~PCI_MSIX_FLAGS_MASKALL;
+    pci_write16(dev, dev->msix_cap + PCI_MSIX_FLAGS, flags);
+    pci_enable(dev, PCI_COMMAND_INTX_DISABLE);
+    return 0;
+}
+
+/*-------------------Driver registry-------------------*/
+
+static int pci_driver_matches(const struct pci_driver *drv, struct pci_dev *dev) {
+    return (drv->vendor == PCI_ANY_ID || drv->vendor == dev->vendor) &&
+           (drv->device == PCI_ANY_ID || drv->device == dev->device) &&
+           (drv->class_code == PCI_ANY_CLASS || drv->class_code == dev->class_code) &&
+           (drv->subclass == PCI_ANY_CLASS || drv->subclass == dev->subclass);
+}
+
+static void pci_probe_device(struct pci_dev *dev, const struct pci_driver *drv) {
+    if (dev->driver || !pci_driver_matches(drv, dev)) {
+        return;
+    }
+    if (drv->probe(dev) == 0) {
+        dev->driver = drv;
+        printk("PCI %d:%d.%d bound to %s\n", dev->bus, dev->slot, dev->func, drv->name);
+    }
+}
+
+// drivers registered after pci_init() are matched against the devices found so far
+int pci_register_driver(const struct pci_driver *drv) {
+    if (num_pci_drivers == PCI_MAX_DRIVERS) {
+        printk("PCI: too many drivers, dropping %s\n", drv->name);
+        return -1;
+    }
+    pci_drivers[num_pci_drivers++] = drv;
+    if (pci_enumerated) {
+        for (int i = 0; i < num_pci_devices; i++) {
+            pci_probe_device(&pci_devices[i], drv);
+        }
+    }
+    return 0;
+}
+
+struct pci_dev *pci_get_device(int index) {
+    if (index < 0 || index >= num_pci_devices) return NULL;
+    return &pci_devices[index];
+}
+
+int pci_device_count(void) {
+    return num_pci_devices;
+}
+
+/*-------------------Enumeration-------------------*/
+
+static void pci_scan_bus(uint8_t bus);
+
+static void pci_scan_function(uint8_t bus, uint8_t slot, uint8_t func) {
+    uint16_t vendor = cfg_read16(bus, slot, func, PCI_VENDOR_ID);
+    if (vendor == 0xFFFF) {
+        return;
+    }
+    if (num_pci_devices == PCI_MAX_DEVICES) {
+        printk("PCI: too many devices, ignoring %d:%d.%d\n", bus, slot, func);
+        return;
+    }
+
+    struct pci_dev *dev = &pci_devices[num_pci_devices++];
+    memset(dev, 0, sizeof(*dev));
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    dev->vendor = vendor;
+    dev->device = cfg_read16(bus, slot, func, PCI_DEVICE_ID);
+    dev->revision = cfg_read8(bus, slot, func, PCI_REVISION_ID);
+    dev->prog_if = cfg_read8(bus, slot, func, PCI_PROG_IF);
+    dev->subclass = cfg_read8(bus, slot, func, PCI_SUBCLASS);
+    dev->class_code = cfg_read8(bus, slot, func, PCI_CLASS);
+    dev->header_type = cfg_read8(bus, slot, func, PCI_HEADER_TYPE);
+    dev->irq_line = cfg_read8(bus, slot, func, PCI_INTERRUPT_LINE);
+    dev->irq_pin = cfg_read8(bus, slot, func, PCI_INTERRUPT_PIN);
+    pci_size_bars(dev);
+    pci_parse_capabilities(dev);
+
+    // follow bridges to the buses behind them
+    if (dev->class_code == PCI_CLASS_BRIDGE && dev->subclass == PCI_SUBCLASS_PCI_BRIDGE) {
+        uint8_t secondary = cfg_read8(bus, slot, func, PCI_SECONDARY_BUS);
+        if (secondary > bus) {
+            pci_scan_bus(secondary);
+        }
+    }
+}
+
+static void pci_scan_slot(uint8_t bus, uint8_t slot) {
+    if (cfg_read16(bus, slot, 0, PCI_VENDOR_ID) == 0xFFFF) {
+        return;
+    }
+    pci_scan_function(bus, slot, 0);
+    if (cfg_read8(bus, slot, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION) {
+        for (uint8_t func = 1; func < PCI_MAX_FUNCS; func++) {
+            pci_scan_function(bus, slot, func);
+        }
+    }
+}
+
+static void pci_scan_bus(uint8_t bus) {
+    if (bus_scanned[bus]) return;
+    bus_scanned[bus] = 1;
+    for (uint8_t slot = 0; slot < PCI_MAX_SLOTS; slot++) {
+        pci_scan_slot(bus, slot);
+    }
+}
+
+static void pci_print_device(struct pci_dev *dev) {
+    printk("  %d:%d.%d %x:%x class %x:%x prog-if %x irq %d",
+           dev->bus, dev->slot, dev->func, dev->vendor, dev->device,
+           dev->class_code, dev->subclass, dev->prog_if, dev->irq_line);
+    if (dev->msi_cap) printk(" msi");
+    if (dev->msix_cap) printk(" msi-x(%d)", dev->msix_table_size);
+    printk("\n");
+    for (int i = 0; i < PCI_NUM_BARS; i++) {
+        struct pci_bar *bar = &dev->bars[i];
+        if (bar->size == 0) continue;
+        if (bar->is_io) {
+            printk("    BAR%d io 0x%x size 0x%lx\n", i, bar->io_port, bar->size);
+        } else {
+            printk("    BAR%d mem 0x%lx size 0x%lx%s%s\n", i, bar->phys, bar->size,
+                   bar->is_64 ? " 64-bit" : "", bar->prefetch ? " prefetch" : "");
+        }
+    }
+}
+
+void pci_init(void) {
+    uint64_t start = rdtsc();
+
+    struct acpi_mcfg *mcfg = acpi_find_table(ACPI_SIG_MCFG);
+    if (mcfg && mcfg->header.length >= sizeof(*mcfg) + sizeof(struct acpi_mcfg_entry)) {
+        // segment group 0 only
+        ecam_base = mcfg->entries[0].base_address;
+        ecam_start_bus = mcfg->entries[0].start_bus;
+        ecam_end_bus = mcfg->entries[0].end_bus;
+        printk("PCI: ECAM at 0x%lx, buses %d-%d\n", ecam_base, ecam_start_bus, ecam_end_bus);
+    } else {
+        printk("PCI: no MCFG, using config ports 0xCF8/0xCFC\n");
+    }
+    uint64_t probed = rdtsc();
+
+    memset(bus_scanned, 0, sizeof(bus_scanned));
+    num_pci_devices = 0;
+    // a multifunction host bridge means one host controller (and root bus) per function
+    if (cfg_read8(0, 0, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION) {
+        for (uint8_t func = 0; func < PCI_MAX_FUNCS; func++) {
+            if (cfg_read16(0, 0, func, PCI_VENDOR_ID) != 0xFFFF) {
+                pci_scan_bus(func);
+            }
+        }
+    } else {
+        pci_scan_bus(0);
+    }
+    uint64_t scanned = rdtsc();
+    pci_enumerated = 1;
+
+    printk("PCI: %d devices, config probe %lu us, enumeration %lu us\n", num_pci_devices,
+           TSC_cycles_to_us(probed - start), TSC_cycles_to_us(scanned - probed));
+    for (int i = 0; i < num_pci_devices; i++) {
+        pci_print_device(&pci_devices[i]);
+    }
+
+    for (int d = 0; d < num_pci_drivers; d++) {
+        for (int i = 0; i < num_pci_devices; i++) {
+            pci_probe_device(&pci_devices[i], pci_drivers[d]);
+        }
+    }
+}
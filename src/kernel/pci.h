@@ -0,0 +1,145 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// legacy config mechanism #1
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+// config space header (type 0)
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_REVISION_ID 0x08
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0A
+#define PCI_CLASS 0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_SECONDARY_BUS 0x19     // type 1 (bridge) header
+#define PCI_SUBSYSTEM_ID 0x2E
+#define PCI_CAPABILITY_LIST 0x34
+#define PCI_INTERRUPT_LINE 0x3C
+#define PCI_INTERRUPT_PIN 0x3D
+
+#define PCI_COMMAND_IO 0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_BUS_MASTER 0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+
+#define PCI_STATUS_CAP_LIST 0x0010
+
+#define PCI_HEADER_TYPE_MASK 0x7F
+#define PCI_HEADER_TYPE_BRIDGE 0x01
+#define PCI_HEADER_MULTIFUNCTION 0x80
+
+#define PCI_BAR_IO 0x01
+#define PCI_BAR_TYPE_MASK 0x06
+#define PCI_BAR_TYPE_64 0x04
+#define PCI_BAR_PREFETCH 0x08
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_CLASS_BRIDGE 0x06
+#define PCI_SUBCLASS_PCI_BRIDGE 0x04
+
+// capabilities
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_VNDR 0x09
+#define PCI_CAP_ID_MSIX 0x11
+
+#define PCI_MSI_FLAGS 0x02
+#define PCI_MSI_FLAGS_ENABLE 0x0001
+#define PCI_MSI_FLAGS_QMASK 0x000E    // multiple message capable
+#define PCI_MSI_FLAGS_QSIZE 0x0070    // multiple message enable
+#define PCI_MSI_FLAGS_64BIT 0x0080
+#define PCI_MSI_ADDRESS_LO 0x04
+#define PCI_MSI_ADDRESS_HI 0x08
+#define PCI_MSI_DATA_32 0x08
+#define PCI_MSI_DATA_64 0x0C
+
+#define PCI_MSIX_FLAGS 0x02
+#define PCI_MSIX_FLAGS_QSIZE 0x07FF   // table size - 1
+#define PCI_MSIX_FLAGS_MASKALL 0x4000
+#define PCI_MSIX_FLAGS_ENABLE 0x8000
+#define PCI_MSIX_TABLE 0x04           // BIR in bits 0-2, offset in the rest
+#define PCI_MSIX_PBA 0x08
+#define PCI_MSIX_ENTRY_SIZE 16
+#define PCI_MSIX_ENTRY_CTRL_MASKBIT 0x1
+
+// MSI messages target the local APIC
+#define MSI_ADDRESS_BASE 0xFEE00000
+#define MSI_ADDRESS_DEST_SHIFT 12
+
+#define PCI_MAX_BUSES 256
+#define PCI_MAX_SLOTS 32
+#define PCI_MAX_FUNCS 8
+#define PCI_NUM_BARS 6
+#define PCI_MAX_DEVICES 64
+#define PCI_MAX_DRIVERS 16
+
+// driver match wildcards
+#define PCI_ANY_ID 0xFFFF
+#define PCI_ANY_CLASS 0xFF
+
+struct pci_bar {
+    uint64_t phys;          // bus address (memory BARs)
+    uint64_t size;
+    uint16_t io_port;       // base port (I/O BARs)
+    uint8_t is_io;
+    uint8_t is_64;
+    uint8_t prefetch;
+    void *virt;             // uncached mapping, set by pci_map_bar
+};
+
+struct pci_driver;
+
+struct pci_dev {
+    uint8_t bus, slot, func;
+    uint16_t vendor, device;
+    uint8_t class_code, subclass, prog_if, revision;
+    uint8_t header_type;
+    uint8_t irq_line, irq_pin;
+    struct pci_bar bars[PCI_NUM_BARS];
+
+    // capability offsets, 0 if absent
+    uint8_t msi_cap;
+    uint8_t msix_cap;
+    uint16_t msix_table_size;
+    uint8_t msix_bir;
+    uint32_t msix_table_offset;
+
+    const struct pci_driver *driver;
+    void *driver_data;
+};
+
+// vendor/device/class of PCI_ANY_ID/PCI_ANY_CLASS match anything
+struct pci_driver {
+    const char *name;
+    uint16_t vendor, device;
+    uint8_t class_code, subclass;
+    int (*probe)(struct pci_dev *dev);    // 0 binds the driver to the device
+};
+
+void pci_init(void);
+int pci_register_driver(const struct pci_driver *drv);
+struct pci_dev *pci_get_device(int index);
+int pci_device_count(void);
+
+uint8_t pci_read8(struct pci_dev *dev, uint16_t off);
+uint16_t pci_read16(struct pci_dev *dev, uint16_t off);
+uint32_t pci_read32(struct pci_dev *dev, uint16_t off);
+void pci_write8(struct pci_dev *dev, uint16_t off, uint8_t val);
+void pci_write16(struct pci_dev *dev, uint16_t off, uint16_t val);
+void pci_write32(struct pci_dev *dev, uint16_t off, uint32_t val);
+
+void pci_enable(struct pci_dev *dev, uint16_t command_bits);
+void *pci_map_bar(struct pci_dev *dev, int bar);
+uint8_t pci_find_capability(struct pci_dev *dev, uint8_t cap_id, uint8_t start);
+int pci_enable_msi(struct pci_dev *dev, uint8_t vector, uint8_t apic_id);
+int pci_enable_msix(struct pci_dev *dev, int entry, uint8_t vector, uint8_t apic_id);
+
+#endif
@@ -0,0 +1,157 @@
+#include "pmu.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "printk.h"
+
+// hardware performance counters for measuring kernel code. Fixed counters take cycles and
+// instructions when there are any, the rest get general purpose counters. Without a PMU (QEMU
+// TCG, non-Intel CPUs) only the TSC is measured.
+
+static int pmu_version = 0;
+static int num_gp = 0;
+static int num_fixed = 0;
+static uint64_t gp_mask = 0;                // counter width masks, deltas wrap at these
+static uint64_t fixed_mask = 0;
+
+struct pmu_event_desc {
+    const char *name;
+    uint8_t event;
+    uint8_t umask;
+    uint32_t missing_bit;                   // CPUID.0AH:EBX bit, 0 for non-architectural events
+    int fixed;                              // fixed counter that counts it, -1 for none
+};
+
+static const struct pmu_event_desc event_descs[PMU_NR_EVENTS] = {
+    [PMU_CYCLES] = { "cycles", 0x3C, 0x00, PMU_ARCH_CYCLES_MISSING, 1 },
+    [PMU_INSTRUCTIONS] = { "instructions", 0xC0, 0x00, PMU_ARCH_INSTRUCTIONS_MISSING, 0 },
+    [PMU_LLC_MISSES] = { "LLC misses", 0x2E, 0x41, PMU_ARCH_LLC_MISSES_MISSING, -1 },
+    [PMU_DTLB_MISSES] = { "dTLB misses", 0x08, 0x01, 0, -1 },
+    [PMU_BRANCH_MISSES] = { "branch misses", 0xC5, 0x00, PMU_ARCH_BRANCH_MISSES_MISSING, -1 },
+};
+
+// what rdpmc reads for each event, or -1. Set before pmu_init since the VGA console measures
+// itself from the first line printed
+static int64_t event_counter[PMU_NR_EVENTS] = { [0 ... PMU_NR_EVENTS - 1] = -1 };
+static uint64_t evtsel[PMU_MAX_GP];
+static uint64_t fixed_ctrl = 0;
+static uint64_t global_ctrl = 0;
+
+static uint64_t width_mask(uint32_t bits) {
+    return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+static inline uint64_t rdpmc(uint32_t counter) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// picks counters for the events this CPU has, then programs the BSP
+void pmu_init(void) {
+    uint32_t max_leaf, eax, ebx, ecx, edx;
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf < CPUID_PMU_LEAF) {
+        printk("PMU: not available, TSC only\n");
+        return;
+    }
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t family = (eax >> 8) & 0xF;
+    uint32_t missing;
+    cpuid(CPUID_PMU_LEAF, 0, &eax, &missing, &ecx, &edx);
+    pmu_version = eax & 0xFF;
+    num_gp = (eax >> 8) & 0xFF;
+    if (pmu_version == 0 || num_gp == 0) {
+        pmu_version = 0;
+        printk("PMU: not available, TSC only\n");
+        return;
+    }
+    if (num_gp > PMU_MAX_GP) num_gp = PMU_MAX_GP;
+    gp_mask = width_mask((eax >> 16) & 0xFF);
+    if (pmu_version >= 2) {
+        num_fixed = edx & 0x1F;
+        if (num_fixed > PMU_MAX_FIXED) num_fixed = PMU_MAX_FIXED;
+        fixed_mask = width_mask((edx >> 5) & 0xFF);
+    }
+
+    int next_gp = 0;
+    for (int i = 0; i < PMU_NR_EVENTS; i++) {
+        const struct pmu_event_desc *d = &event_descs[i];
+        if (d->fixed >= 0 && d->fixed < num_fixed) {
+            event_counter[i] = RDPMC_FIXED | d->fixed;
+            fixed_ctrl |= (uint64_t)FIXED_CTR_CTRL_ALL << (4 * d->fixed);
+            global_ctrl |= 1ULL << (32 + d->fixed);
+            continue;
+        }
+        if (d->missing_bit ? (missing & d->missing_bit) : family != 6) continue;
+        if (next_gp == num_gp) continue;
+        evtsel[next_gp] = d->event | ((uint64_t)d->umask << 8) | PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN;
+        global_ctrl |= 1ULL << next_gp;
+        event_counter[i] = next_gp++;
+    }
+    pmu_cpu_init();
+    printk("PMU: version %d, %d general purpose and %d fixed counters\n", pmu_version, num_gp, num_fixed);
+}
+
+// counters are per CPU, every AP programs its own the same way
+void pmu_cpu_init(void) {
+    if (!pmu_version) return;
+    if (pmu_version >= 2) wrmsr(MSR_PERF_GLOBAL_CTRL, 0);
+    for (int i = 0; i < num_gp; i++) {
+        wrmsr(MSR_PERFEVTSEL0 + i, evtsel[i]);
+        wrmsr(MSR_PMC0 + i, 0);
+    }
+    if (num_fixed) wrmsr(MSR_FIXED_CTR_CTRL, fixed_ctrl);
+    if (pmu_version >= 2) wrmsr(MSR_PERF_GLOBAL_CTRL, global_ctrl);
+}
+
+int pmu_available(void) {
+    return pmu_version != 0;
+}
+
+int pmu_event_supported(int event) {
+    return event >= 0 && event < PMU_NR_EVENTS && event_counter[event] >= 0;
+}
+
+static void read_counters(struct pmu_counts *c) {
+    for (int i = 0; i < PMU_NR_EVENTS; i++) {
+        c->events[i] = event_counter[i] >= 0 ? rdpmc(event_counter[i]) : 0;
+    }
+}
+
+// start of a measured block, the caller keeps c on its stack until pmu_end
+void pmu_begin(struct pmu_counts *c) {
+    read_counters(c);
+    c->tsc = rdtsc();
+}
+
+// c becomes what happened since pmu_begin on this CPU
+void pmu_end(struct pmu_counts *c) {
+    uint64_t tsc = rdtsc();
+    struct pmu_counts now;
+    read_counters(&now);
+    c->tsc = tsc - c->tsc;
+    for (int i = 0; i < PMU_NR_EVENTS; i++) {
+        uint64_t mask = (event_counter[i] & RDPMC_FIXED) ? fixed_mask : gp_mask;
+        c->events[i] = (now.events[i] - c->events[i]) & mask;
+    }
+}
+
+void pmu_add(struct pmu_counts *sum, const struct pmu_counts *delta) {
+    sum->tsc += delta->tsc;
+    for (int i = 0; i < PMU_NR_EVENTS; i++) {
+        sum->events[i] += delta->events[i];
+    }
+}
+
+// totals over runs measured blocks
+void pmu_report(const char *what, const struct pmu_counts *c, uint64_t runs) {
+    printk("PMU %s: %lu runs, %lu us", what, runs, TSC_cycles_to_us(c->tsc));
+    for (int i = 0; i < PMU_NR_EVENTS; i++) {
+        if (event_counter[i] >= 0) printk(", %lu %s", c->events[i], event_descs[i].name);
+    }
+    if (event_counter[PMU_CYCLES] >= 0 && event_counter[PMU_INSTRUCTIONS] >= 0 && c->events[PMU_CYCLES]) {
+        uint64_t ipc = c->events[PMU_INSTRUCTIONS] * 100 / c->events[PMU_CYCLES];
+        printk(", IPC %lu.%lu%lu", ipc / 100, (ipc / 10) % 10, ipc % 10);
+    }
+    printk("\n");
+}
@@ -0,0 +1,55 @@
+#ifndef PMU_H
+#define PMU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// architectural performance monitoring (CPUID leaf 0xA)
+#define CPUID_PMU_LEAF 0xA
+#define MSR_PMC0 0xC1
+#define MSR_PERFEVTSEL0 0x186
+#define MSR_FIXED_CTR0 0x309                // instructions retired
+#define MSR_FIXED_CTR1 0x30A                // core cycles
+#define MSR_FIXED_CTR_CTRL 0x38D
+#define MSR_PERF_GLOBAL_CTRL 0x38F          // version 2+
+
+#define PERFEVTSEL_USR (1ULL << 16)
+#define PERFEVTSEL_OS (1ULL << 17)
+#define PERFEVTSEL_EN (1ULL << 22)
+#define FIXED_CTR_CTRL_ALL 0x3              // per fixed counter nibble: count in ring 0 and 3
+#define RDPMC_FIXED (1U << 30)
+
+#define PMU_MAX_GP 8
+#define PMU_MAX_FIXED 3
+
+// CPUID.0AH:EBX, a set bit means the architectural event is missing
+#define PMU_ARCH_CYCLES_MISSING (1U << 0)
+#define PMU_ARCH_INSTRUCTIONS_MISSING (1U << 1)
+#define PMU_ARCH_LLC_MISSES_MISSING (1U << 4)
+#define PMU_ARCH_BRANCH_MISSES_MISSING (1U << 6)
+
+enum pmu_event {
+    PMU_CYCLES,
+    PMU_INSTRUCTIONS,
+    PMU_LLC_MISSES,
+    PMU_DTLB_MISSES,                        // page walks from load misses, family 6 only
+    PMU_BRANCH_MISSES,
+    PMU_NR_EVENTS
+};
+
+// raw counts between pmu_begin and pmu_end, TSC always, events only where pmu_event_supported()
+struct pmu_counts {
+    uint64_t tsc;
+    uint64_t events[PMU_NR_EVENTS];
+};
+
+void pmu_init(void);
+void pmu_cpu_init(void);
+int pmu_available(void);
+int pmu_event_supported(int event);
+void pmu_begin(struct pmu_counts *c);
+void pmu_end(struct pmu_counts *c);
+void pmu_add(struct pmu_counts *sum, const struct pmu_counts *delta);
+void pmu_report(const char *what, const struct pmu_counts *c, uint64_t runs);
+
+#endif
@@ -0,0 +1,198 @@
+#include "process.h"
+#include "elf.h"
+#include "mmu.h"
+#include "kernel.h"
+#include "printk.h"
+#include "string.h"
+#include "cpu.h"
+
+// user processes: one PML4 each (kernel slots shared), demand paged VMAs, run to completion from
+// process_run() until they exit or fault
+
+struct process *current_process = NULL;
+static struct process processes[MAX_PROCESSES];
+static int next_pid = 1;
+
+/*-------------------Address space-------------------*/
+
+int process_user_range_ok(uint64_t addr, uint64_t len) {
+    return addr >= USER_SPACE_ADR && len <= USER_SPACE_END - addr;
+}
+
+// records the VMA and leaves demand paging PTEs for the page fault handler
+int process_map(struct process *p, uint64_t start, uint64_t end, uint32_t flags,
+                struct vma_source *source, uint64_t file_offset, uint64_t file_size) {
+    struct address_space *as = &p->as;
+    if (as->nvmas == MAX_VMAS || end <= start || !process_user_range_ok(start, end - start)) {
+        return -1;
+    }
+    struct vma *vma = &as->vmas[as->nvmas++];
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->file_offset = file_offset;
+    vma->file_size = file_size;
+    if (source) {
+        vma->source = *source;
+    } else {
+        vma->source.read = NULL;
+        vma->source.arg = NULL;
+    }
+
+    struct pt_walker w;
+    pt_walker_init(&w, phys_to_virt(as->cr3));
+    uint64_t pte_flags = PTE_DEMAND_PAGING | PTE_USER | ((flags & VMA_WRITE) ? PTE_WRITABLE : 0);
+    for (uint64_t va = start & PAGE_MASK; va < end; va += PAGE_SIZE) {
+        uint64_t *pte = pt_walk(&w, va, 1);
+        if (!pte) return -1;
+        // segments can share a page, it gets the permissions of both
+        *pte |= pte_flags;
+    }
+    return 0;
+}
+
+// page fault handler, fills a fresh zeroed frame from every VMA overlapping the page
+int process_fill_page(uint64_t vaddr, void *frame) {
+    if (!current_process) return -1;
+    struct address_space *as = &current_process->as;
+    int found = 0;
+    for (int i = 0; i < as->nvmas; i++) {
+        struct vma *vma = &as->vmas[i];
+        if (vma->end <= vaddr || vma->start >= vaddr + PAGE_SIZE) continue;
+        found = 1;
+        uint64_t file_end = vma->start + vma->file_size;
+        uint64_t lo = vaddr > vma->start ? vaddr : vma->start;
+        uint64_t hi = vaddr + PAGE_SIZE < file_end ? vaddr + PAGE_SIZE : file_end;
+        if (lo < hi && vma->source.read(vma->source.arg, vma->file_offset + (lo - vma->start),
+                                        (uint8_t *)frame + (lo - vaddr), hi - lo) != 0) {
+            return -1;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+/*-------------------Lifecycle-------------------*/
+
+// takes a free slot around cr3 with its own kernel and FPU state, cr3 is freed on failure
+static struct process *process_alloc(const char *name, uint64_t cr3) {
+    int slot = -1;
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        if (processes[i].state == PROC_UNUSED) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        printk("process: table full\n");
+        if (cr3) MMU_destroy_address_space(cr3);
+        return NULL;
+    }
+    if (!cr3) {
+        printk("process %s: out of memory\n", name);
+        return NULL;
+    }
+    struct process *p = &processes[slot];
+    memset(p, 0, sizeof(*p));
+    p->pid = next_pid++;
+    int len = 0;
+    while (len < PROCESS_NAME_LEN - 1 && name[len]) {
+        p->name[len] = name[len];
+        len++;
+    }
+    p->name[len] = '\0';
+
+    p->as.cr3 = cr3;
+    p->kstack_top = MMU_alloc_kstack(slot);
+    void *fpu_state = MMU_pf_alloc();
+    if (!p->kstack_top || !fpu_state) {
+        printk("process %s: out of memory\n", p->name);
+        if (fpu_state) MMU_pf_free(fpu_state);
+        if (p->kstack_top) MMU_free_kstack(slot);
+        MMU_destroy_address_space(cr3);
+        return NULL;
+    }
+    fpu_context_init(&p->fpu, fpu_state);
+    p->user_rsp = USER_STACK_TOP;
+    p->state = PROC_READY;
+    return p;
+}
+
+struct process *process_create(const char *name, struct vma_source *image, uint64_t image_size) {
+    struct process *p = process_alloc(name, MMU_create_address_space());
+    if (!p) return NULL;
+    if (elf_load(p, image, image_size) != ELF_OK
+        || process_map(p, USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE, USER_STACK_TOP,
+                       VMA_READ | VMA_WRITE, NULL, 0, 0) != 0) {
+        process_destroy(p);
+        return NULL;
+    }
+    return p;
+}
+
+// copy-on-write duplicate of parent's memory, the child starts over at the entry point since there is
+// no fork system call while processes run to completion
+struct process *process_fork(struct process *parent, const char *name) {
+    if (parent->state == PROC_UNUSED || parent == current_process) return NULL;
+    struct process *p = process_alloc(name, MMU_clone_address_space(parent->as.cr3));
+    if (!p) return NULL;
+    for (int i = 0; i < parent->as.nvmas; i++) {
+        p->as.vmas[i] = parent->as.vmas[i];
+    }
+    p->as.nvmas = parent->as.nvmas;
+    p->entry = parent->entry;
+    return p;
+}
+
+static int memory_read(void *arg, uint64_t offset, void *buf, uint64_t len) {
+    memcpy(buf, (const uint8_t *)arg + offset, len);
+    return 0;
+}
+
+// image has to stay put while the process lives (an initrd file does)
+struct process *process_create_from_memory(const char *name, const void *image, uint64_t size) {
+    struct vma_source src = { memory_read, (void *)image };
+    return process_create(name, &src, size);
+}
+
+// runs p in ring 3 until it exits, returns its exit code
+int process_run(struct process *p) {
+    if (p->state != PROC_READY) return PROCESS_EXIT_FAULT;
+    p->state = PROC_RUNNING;
+    current_process = p;
+    cpu_tss[this_cpu_id()].rsp0 = (uint64_t)p->kstack_top;
+    this_cpu()->kernel_rsp = (uint64_t)p->kstack_top;
+    set_cr3(p->as.cr3);
+    fpu_switch(&p->fpu);
+
+    int code = enter_usermode(p->entry, p->user_rsp, &p->kernel_rsp);
+
+    // back from process_exit, possibly out of an exception with interrupts off
+    set_cr3(MMU_kernel_cr3());
+    fpu_context_release(&p->fpu);
+    current_process = NULL;
+    p->state = PROC_EXITED;
+    p->exit_code = code;
+    __asm__ volatile("sti");
+    return code;
+}
+
+void process_exit(int code) {
+    if (!current_process) {
+        printk("process_exit outside a process\n");
+        while (1) {
+            __asm__ volatile("cli");
+            __asm__ volatile("hlt");
+        }
+    }
+    return_to_kernel(current_process->kernel_rsp, code);
+}
+
+void process_destroy(struct process *p) {
+    int slot = p - processes;
+    if (p == current_process) return;
+    fpu_context_release(&p->fpu);
+    if (p->fpu.state) MMU_pf_free(p->fpu.state);
+    MMU_free_kstack(slot);
+    MMU_destroy_address_space(p->as.cr3);
+    p->state = PROC_UNUSED;
+}
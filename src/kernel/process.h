@@ -0,0 +1,75 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "fpu.h"
+
+#define MAX_PROCESSES 16
+#define PROCESS_NAME_LEN 32
+#define MAX_VMAS 16
+#define PROCESS_EXIT_FAULT -1       // killed by an exception
+
+#define PROC_UNUSED 0
+#define PROC_READY 1
+#define PROC_RUNNING 2
+#define PROC_EXITED 3
+
+// VMA flags
+#define VMA_READ 0x1
+#define VMA_WRITE 0x2
+#define VMA_EXEC 0x4
+
+// where the initial contents of a mapping come from, read from the page fault handler (interrupts off)
+struct vma_source {
+    int (*read)(void *arg, uint64_t offset, void *buf, uint64_t len);
+    void *arg;
+};
+
+// [start, end) of user memory, the first file_size bytes come from source at file_offset, the rest is zero
+struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint32_t flags;
+    uint64_t file_offset;
+    uint64_t file_size;
+    struct vma_source source;
+};
+
+struct address_space {
+    uint64_t cr3;
+    struct vma vmas[MAX_VMAS];
+    int nvmas;
+};
+
+struct process {
+    int pid;
+    int state;
+    char name[PROCESS_NAME_LEN];
+    struct address_space as;
+    void *kstack_top;               // TSS rsp0 while the process runs
+    uint64_t entry;
+    uint64_t user_rsp;
+    int exit_code;
+    struct fpu_context fpu;
+    uint64_t kernel_rsp;            // process_run's stack, process_exit returns there
+};
+
+extern struct process *current_process;
+
+struct process *process_create(const char *name, struct vma_source *image, uint64_t image_size);
+struct process *process_create_from_memory(const char *name, const void *image, uint64_t size);
+struct process *process_fork(struct process *parent, const char *name);
+int process_map(struct process *p, uint64_t start, uint64_t end, uint32_t flags,
+                struct vma_source *source, uint64_t file_offset, uint64_t file_size);
+int process_run(struct process *p);
+void process_exit(int code) __attribute__((noreturn));
+void process_destroy(struct process *p);
+int process_fill_page(uint64_t vaddr, void *frame);
+int process_user_range_ok(uint64_t addr, uint64_t len);
+
+// usermode.asm
+extern int enter_usermode(uint64_t entry, uint64_t user_rsp, uint64_t *kernel_rsp);
+extern void return_to_kernel(uint64_t kernel_rsp, int code) __attribute__((noreturn));
+
+#endif
@@ -0,0 +1,281 @@
+#include "profile.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "ksyms.h"
+#include "mmu.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "printk.h"
+#include "string.h"
+
+// sampling profiler on the LAPIC timer. Samples land in a per-CPU ring without locks, profile_drain()
+// folds them into per-function and per-stack counts that profile_report() prints over serial.
+// Code running with interrupts off is charged to whatever runs right after sti.
+
+#define PROFILE_USER_KEY 1              // stands for every ring 3 address
+
+struct profile_sym {
+    uint64_t key;                       // function start, or the raw address if unknown
+    uint64_t count;
+};
+
+struct profile_stack {
+    uint64_t keys[PROFILE_STACK_DEPTH + 1];     // innermost first
+    uint32_t depth;
+    uint64_t count;
+};
+
+static struct profile_ring rings[MAX_CPUS];
+static int vector_registered = 0;
+static int running_cpus = 0;
+static uint32_t profile_hz = 0;
+static uint64_t start_tsc = 0;
+static uint64_t elapsed_cycles = 0;
+
+static struct profile_sym syms[PROFILE_MAX_SYMS];
+static int nsyms = 0;
+static struct profile_stack stacks[PROFILE_MAX_STACKS];
+static int nstacks = 0;
+static uint64_t total_samples = 0;
+static uint64_t user_samples = 0;
+static uint64_t unaggregated = 0;       // tables were full
+
+/*-------------------Sampling-------------------*/
+
+// saved rbp slots can be read without faulting: the kernel image (the boot stack), or a kernel stack
+// page (never the guard page at the bottom of the slot or past the top)
+static int frame_ok(uint64_t rbp) {
+    if (rbp & 7) return 0;
+    if (rbp >= KERNEL_STACKS_ADR && rbp < USER_SPACE_ADR) {
+        uint64_t off = (rbp - KERNEL_STACKS_ADR) % KSTACK_SLOT_SIZE;
+        return off >= PAGE_SIZE && off + 16 <= KSTACK_SLOT_SIZE;
+    }
+    return rbp >= KERNEL_VMA && rbp + 16 <= KERNEL_IMAGE_END;
+}
+
+// the kernel is built with frame pointers: [rbp] is the caller's rbp, [rbp + 8] the return address
+static void record_sample(struct profile_ring *ring, struct interrupt_frame *frame) {
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == PROFILE_RING_SAMPLES) {
+        ring->dropped++;
+        return;
+    }
+    struct profile_sample *s = &ring->samples[head & (PROFILE_RING_SAMPLES - 1)];
+    s->rip = frame->rip;
+    s->depth = 0;
+    s->user = (frame->cs & 3) != 0;
+    if (!s->user) {
+        uint64_t rbp = frame->rbp;
+        while (s->depth < PROFILE_STACK_DEPTH && frame_ok(rbp)) {
+            uint64_t *fp = (uint64_t *)rbp;
+            uint64_t ret = fp[1];
+            if (ret < KERNEL_VMA || ret >= KERNEL_IMAGE_END) break;
+            s->stack[s->depth++] = ret;
+            uint64_t next = fp[0];
+            // callers live higher up the same stack
+            if (next <= rbp || next - rbp > PROFILE_MAX_FRAME) break;
+            rbp = next;
+        }
+    }
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int profile_vector(struct interrupt_frame *frame, void *arg) {
+    (void)arg;
+    struct profile_ring *ring = &rings[this_cpu_id()];
+    if (ring->samples) {
+        record_sample(ring, frame);
+    }
+    lapic_eoi();
+    return IRQ_HANDLED;
+}
+
+// starts sampling the calling CPU at hz, the first call sets up its ring
+int profile_start(uint32_t hz) {
+    if (!lapic_present() || !lapic_timer_hz()) {
+        printk("profile: no LAPIC timer\n");
+        return -1;
+    }
+    if (!vector_registered) {
+        if (register_vector(PROFILE_VECTOR, profile_vector, NULL, 0) != 0) return -1;
+        vector_registered = 1;
+    }
+    struct profile_ring *ring = &rings[this_cpu_id()];
+    if (!ring->samples) {
+        int pages = (PROFILE_RING_SAMPLES * sizeof(struct profile_sample) + PAGE_SIZE - 1) / PAGE_SIZE;
+        struct profile_sample *samples = MMU_alloc_pages(pages);
+        if (!samples) {
+            printk("profile: out of memory\n");
+            return -1;
+        }
+        // fault the demand paged ring in now rather than from the timer interrupt
+        memset(samples, 0, (uint64_t)pages * PAGE_SIZE);
+        ring->samples = samples;
+    }
+    if (!hz) hz = PROFILE_DEFAULT_HZ;
+    profile_hz = hz;
+    if (running_cpus++ == 0) {
+        start_tsc = rdtsc();
+    }
+    lapic_timer_start(PROFILE_VECTOR, hz);
+    return 0;
+}
+
+void profile_stop(void) {
+    lapic_timer_stop();
+    if (running_cpus > 0 && --running_cpus == 0) {
+        elapsed_cycles += rdtsc() - start_tsc;
+    }
+}
+
+/*-------------------Aggregation-------------------*/
+
+static uint64_t symbol_key(uint64_t addr) {
+    const struct ksym *sym = ksym_find(addr);
+    return sym ? sym->addr : addr;
+}
+
+static void count_symbol(uint64_t key) {
+    for (int i = 0; i < nsyms; i++) {
+        if (syms[i].key == key) {
+            syms[i].count++;
+            return;
+        }
+    }
+    if (nsyms == PROFILE_MAX_SYMS) {
+        unaggregated++;
+        return;
+    }
+    syms[nsyms].key = key;
+    syms[nsyms].count = 1;
+    nsyms++;
+}
+
+static void count_stack(const uint64_t *keys, uint32_t depth) {
+    for (int i = 0; i < nstacks; i++) {
+        if (stacks[i].depth == depth && memcmp(stacks[i].keys, keys, depth * sizeof(uint64_t)) == 0) {
+            stacks[i].count++;
+            return;
+        }
+    }
+    if (nstacks == PROFILE_MAX_STACKS) {
+        unaggregated++;
+        return;
+    }
+    memcpy(stacks[nstacks].keys, keys, depth * sizeof(uint64_t));
+    stacks[nstacks].depth = depth;
+    stacks[nstacks].count = 1;
+    nstacks++;
+}
+
+static void aggregate(const struct profile_sample *s) {
+    uint64_t keys[PROFILE_STACK_DEPTH + 1];
+    uint32_t depth = 0;
+    total_samples++;
+    if (s->user) {
+        user_samples++;
+        keys[depth++] = PROFILE_USER_KEY;
+    } else {
+        keys[depth++] = symbol_key(s->rip);
+        // a return address can be the first byte after a noreturn call, look up the call itself
+        for (uint32_t i = 0; i < s->depth; i++) {
+            keys[depth++] = symbol_key(s->stack[i] - 1);
+        }
+    }
+    count_symbol(keys[0]);
+    count_stack(keys, depth);
+}
+
+// empties every CPU's ring into the tables, can run while sampling continues
+void profile_drain(void) {
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct profile_ring *ring = &rings[cpu];
+        if (!ring->samples) continue;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = ring->tail;
+        while (tail != head) {
+            aggregate(&ring->samples[tail & (PROFILE_RING_SAMPLES - 1)]);
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+// drops everything collected so far
+void profile_reset(void) {
+    profile_drain();
+    nsyms = 0;
+    nstacks = 0;
+    total_samples = 0;
+    user_samples = 0;
+    unaggregated = 0;
+    elapsed_cycles = 0;
+    if (running_cpus) start_tsc = rdtsc();
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        rings[cpu].dropped = 0;
+    }
+}
+
+/*-------------------Report-------------------*/
+
+static void print_key(uint64_t key) {
+    if (key == PROFILE_USER_KEY) {
+        printk("[user]");
+        return;
+    }
+    const char *name = ksym_lookup(key, NULL);
+    if (name) {
+        printk("%s", name);
+    } else {
+        printk("0x%lx", key);
+    }
+}
+
+// flat top_n by samples in the function itself, then every stack in folded form (outermost
+// first, "a;b;c count") between marker lines so it can be cut out of the serial log
+void profile_report(int top_n) {
+    profile_drain();
+    uint64_t dropped = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        dropped += rings[cpu].dropped;
+    }
+    uint64_t cycles = elapsed_cycles + (running_cpus ? rdtsc() - start_tsc : 0);
+    printk("\n======== Profile ========\n");
+    printk("  %lu samples at %u Hz over %lu ms, %lu in user mode, %lu dropped, %lu not aggregated\n",
+           total_samples, profile_hz, TSC_cycles_to_us(cycles) / 1000, user_samples, dropped, unaggregated);
+    if (!total_samples) return;
+    if (!ksyms_count()) {
+        printk("  no kernel symbols, addresses are raw\n");
+    }
+
+    // by count, descending
+    for (int gap = nsyms / 2; gap > 0; gap /= 2) {
+        for (int i = gap; i < nsyms; i++) {
+            struct profile_sym tmp = syms[i];
+            int j = i;
+            while (j >= gap && syms[j - gap].count < tmp.count) {
+                syms[j] = syms[j - gap];
+                j -= gap;
+            }
+            syms[j] = tmp;
+        }
+    }
+    if (top_n <= 0) top_n = PROFILE_TOP_N;
+    printk("  samples  percent  function\n");
+    for (int i = 0; i < nsyms && i < top_n; i++) {
+        uint64_t permille = syms[i].count * 1000 / total_samples;
+        printk("  %lu  %lu.%lu%%  ", syms[i].count, permille / 10, permille % 10);
+        print_key(syms[i].key);
+        printk("\n");
+    }
+
+    printk("profile: folded stacks begin\n");
+    for (int i = 0; i < nstacks; i++) {
+        for (int j = stacks[i].depth - 1; j >= 0; j--) {
+            print_key(stacks[i].keys[j]);
+            if (j) printk(";");
+        }
+        printk(" %lu\n", stacks[i].count);
+    }
+    printk("profile: folded stacks end\n");
+}
@@ -0,0 +1,39 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// sampling profiler: the LAPIC timer interrupts at a fixed rate and the handler records where the
+// CPU was plus a frame pointer backtrace into a per-CPU ring
+#define PROFILE_VECTOR 0xF1
+#define PROFILE_DEFAULT_HZ 997          // not a multiple of the PIT tick, so the two don't beat
+#define PROFILE_RING_SAMPLES 8192       // per CPU, power of two
+#define PROFILE_STACK_DEPTH 8
+#define PROFILE_MAX_FRAME 0x10000       // biggest step between saved rbps that is still believed
+#define PROFILE_MAX_SYMS 512            // distinct functions in the flat report
+#define PROFILE_MAX_STACKS 256          // distinct folded stacks
+#define PROFILE_TOP_N 15
+
+struct profile_sample {
+    uint64_t rip;
+    uint64_t stack[PROFILE_STACK_DEPTH];    // return addresses, innermost first
+    uint32_t depth;
+    uint32_t user;                          // interrupted ring 3, no backtrace
+};
+
+// single producer (the timer interrupt on its CPU), single consumer (profile_drain)
+struct profile_ring {
+    struct profile_sample *samples;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint64_t dropped;                       // ring was full
+};
+
+int profile_start(uint32_t hz);
+void profile_stop(void);
+void profile_drain(void);
+void profile_reset(void);
+void profile_report(int top_n);
+
+#endif
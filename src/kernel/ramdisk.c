@@ -0,0 +1,63 @@
+#include "ramdisk.h"
+#include "block.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+
+// RAM disks on demand paged kernel memory, requests complete inside submit
+
+struct ramdisk {
+    struct block_device bdev;
+    uint8_t *mem;
+};
+
+static struct ramdisk ramdisks[RAMDISK_MAX];
+static int num_ramdisks = 0;
+
+static int ramdisk_submit(struct block_device *dev, struct block_request *req) {
+    struct ramdisk *rd = dev->driver_data;
+    uint8_t *disk = rd->mem + req->sector * BLOCK_SECTOR_SIZE;
+    struct blk_cursor cur;
+    void *buf;
+    uint32_t bytes;
+
+    blk_cursor_init(&cur, req);
+    while ((bytes = blk_cursor_next(&cur, req->sectors * BLOCK_SECTOR_SIZE, &buf)) > 0) {
+        if (req->dir == BIO_WRITE) {
+            memcpy(disk, buf, bytes);
+        } else {
+            memcpy(buf, disk, bytes);
+        }
+        disk += bytes;
+    }
+    blk_request_done(dev, req, BLOCK_OK);
+    return BLOCK_OK;
+}
+
+static const struct block_device_ops ramdisk_ops = {
+    .submit = ramdisk_submit,
+};
+
+int ramdisk_init(const char *name, uint64_t sectors) {
+    if (num_ramdisks == RAMDISK_MAX || strlen(name) >= BLOCK_NAME_LEN) {
+        return -1;
+    }
+    struct ramdisk *rd = &ramdisks[num_ramdisks];
+    int pages = (sectors * BLOCK_SECTOR_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+    rd->mem = MMU_alloc_pages(pages);
+    if (!rd->mem) {
+        printk("ramdisk %s: out of memory\n", name);
+        return -1;
+    }
+    strcpy(rd->bdev.name, name);
+    rd->bdev.sectors = sectors;
+    rd->bdev.max_inflight = 1;
+    rd->bdev.ops = &ramdisk_ops;
+    rd->bdev.driver_data = rd;
+    if (blk_register(&rd->bdev) != 0) {
+        MMU_free_pages(rd->mem, pages);
+        return -1;
+    }
+    num_ramdisks++;
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+
+#define RAMDISK_MAX 2
+#define RAMDISK_DEFAULT_SECTORS 8192    // 4 MiB
+
+int ramdisk_init(const char *name, uint64_t sectors);
+
+#endif
@@ -1,9 +1,17 @@
 #include "serial.h"
 #include "interrupts.h"
 #include "printk.h"
+#include "trace.h"
+#include "tunable.h"
 
 static struct UART_State state;
 
+DEFINE_TRACEPOINT(serial_tx, "serial", TRACE_INSTANT);
+
+// only read by SER_init
+TUNABLE(ser_baud_divisor, uint16_t, COM_BAUD_DIVISOR_115200);
+TUNABLE(ser_fifo_trigger, int, 14);             // bytes: 1, 4, 8 or 14
+
 static inline void outb(uint16_t port, uint8_t val) {
     asm volatile ( "outb %0, %1" : : "a"(val), "Nd"(port) );
 }
@@ -36,17 +44,22 @@ void SER_init(void) {
     // Enable DLAB to set baud rate
     outb(state.port_base + COM_LINE_CTL_REG_OFFSET, COM_LINE_CTL_DLAB);
     
-    // Set divisor for 115200 baud
-    outb(state.port_base + COM_DIV_LATCH_LOW_OFFSET, COM_BAUD_DIVISOR_115200 & 0xFF); // low byte
-    outb(state.port_base + COM_DIV_LATCH_HIGH_OFFSET, (COM_BAUD_DIVISOR_115200 >> 8) & 0xFF); // high byte
+    // Set divisor, 115200 baud unless ser_baud_divisor says otherwise
+    uint16_t divisor = ser_baud_divisor ? ser_baud_divisor : COM_BAUD_DIVISOR_115200;
+    outb(state.port_base + COM_DIV_LATCH_LOW_OFFSET, divisor & 0xFF); // low byte
+    outb(state.port_base + COM_DIV_LATCH_HIGH_OFFSET, (divisor >> 8) & 0xFF); // high byte
     
     // 8 bits, no parity, one stop bit and disable DLAB
     outb(state.port_base + COM_LINE_CTL_REG_OFFSET, 
          COM_LINE_CTL_DATA_BITS_8 | COM_LINE_CTL_STOP_BITS_1 | COM_LINE_CTL_PARITY_NONE);
     
-    // Enable FIFO, clear them, with 14-byte threshold
+    // Enable FIFO, clear them, with the ser_fifo_trigger threshold (14 bytes by default)
+    uint8_t trigger = COM_FIFO_CTL_TRIGGER_LEVEL_14;
+    if (ser_fifo_trigger == 1) trigger = COM_FIFO_CTL_TRIGGER_LEVEL_1;
+    else if (ser_fifo_trigger == 4) trigger = COM_FIFO_CTL_TRIGGER_LEVEL_4;
+    else if (ser_fifo_trigger == 8) trigger = COM_FIFO_CTL_TRIGGER_LEVEL_8;
     outb(state.port_base + COM_FIFO_CTL_REG_OFFSET, 
-         COM_FIFO_CTL_ENABLE | COM_FIFO_CTL_CLEAR_TRANSMIT | COM_FIFO_CTL_TRIGGER_LEVEL_14);
+         COM_FIFO_CTL_ENABLE | COM_FIFO_CTL_CLEAR_TRANSMIT | COM_FIFO_CTL_CLEAR_RECEIVE | trigger);
     
     // Enable IRQs, RTS/DSR set
     outb(state.port_base + COM_MODEM_CTL_REG_OFFSET, 
@@ -70,8 +83,9 @@ void SER_init(void) {
     outb(state.port_base + COM_MODEM_CTL_REG_OFFSET, 
          COM_MODEM_CTL_DTR | COM_MODEM_CTL_RTS | COM_MODEM_CTL_AUX_OUT2);
     
-    // enable transmitter empty and line status interrupts
-    outb(state.port_base + COM_INT_ENABLE_REG_OFFSET, COM_INT_ENABLE_TRANSMITTER_EMPTY | COM_INT_ENABLE_LINE_STATUS);
+    // enable transmitter empty, received data and line status interrupts
+    outb(state.port_base + COM_INT_ENABLE_REG_OFFSET,
+         COM_INT_ENABLE_TRANSMITTER_EMPTY | COM_INT_ENABLE_RECEIVED_DATA | COM_INT_ENABLE_LINE_STATUS);
     IRQ_clear_mask(4);
     state.initialized = 1;
 }
@@ -84,6 +98,7 @@ static void hardware_write(void) {
         if (state.consumer >= &state.buff[BUFF_SIZE]) 
             state.consumer = &state.buff[0];
         state.count--;
+        trace(serial_tx, (uint8_t)next_byte, state.count);
         outb(state.port_base + COM_TRANSMIT_OFFSET, next_byte);
     }
 }
@@ -115,6 +130,28 @@ int SER_write(const char *buff, int len) {
     return bytes_to_copy;
 }
 
+// takes up to len received bytes, returns how many
+int SER_read(char *buff, int len) {
+    uint32_t head = __atomic_load_n(&state.rx_head, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (n < len && state.rx_tail != head) {
+        buff[n++] = state.rx_buff[state.rx_tail % RX_BUFF_SIZE];
+        state.rx_tail++;
+    }
+    return n;
+}
+
+// drains the receive FIFO, bytes that don't fit are dropped
+static void hardware_read(void) {
+    while (inb(state.port_base + COM_LINE_STATUS_OFFSET) & COM_LINE_STATUS_DATA_READY) {
+        char c = inb(state.port_base + COM_RECIEVE_OFFSET);
+        if (state.rx_head - state.rx_tail < RX_BUFF_SIZE) {
+            state.rx_buff[state.rx_head % RX_BUFF_SIZE] = c;
+            __atomic_store_n(&state.rx_head, state.rx_head + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
 void serial_interrupt_handler(int irq, int error_code, void* arg) {
     (void)irq;
     (void)error_code;
@@ -150,9 +187,13 @@ void serial_interrupt_handler(int irq, int error_code, void* arg) {
             hardware_write();
             break;
         }
+        case COM_INT_IDENT_RECEIVED_DATA:
+        case COM_INT_IDENT_CHAR_TIMEOUT:
+            hardware_read();
+            break;
         default:
-            // clear non-TX interrupts
-            inb(state.port_base + COM_RECIEVE_OFFSET);
+            // modem status, cleared by reading the MSR
+            inb(state.port_base + COM_MODEM_STATUS_OFFSET);
             break;
     }
     if (interrupt_source == COM_INT_IDENT_TRANSMITTER_EMPTY) {
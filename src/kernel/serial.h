@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #define BUFF_SIZE 16
+#define RX_BUFF_SIZE 256     // received bytes waiting for SER_read, power of two
 
 // COM ports
 #define COM1 0x3F8 // irq4
@@ -115,10 +116,13 @@ struct UART_State {
     char *consumer, *producer;
     int tx_busy, count, initialized;
     uint16_t port_base;
+    char rx_buff[RX_BUFF_SIZE];
+    uint32_t rx_head, rx_tail;  // head written by the interrupt handler
 };
 
 extern void SER_init(void);
 extern int SER_write(const char *buff, int len);
+extern int SER_read(char *buff, int len);
 void serial_interrupt_handler(int irq, int error_code, void* arg);
 
 #endif
\ No newline at end of file
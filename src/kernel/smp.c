@@ -0,0 +1,144 @@
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "mmu.h"
+#include "pmu.h"
+#include "printk.h"
+#include "string.h"
+#include "tsc.h"
+
+// application processors: started through the trampoline, they only take IPIs for now
+
+struct cpu_local cpu_locals[MAX_CPUS];
+static uint8_t cpu_apic_ids[MAX_CPUS];
+static volatile uint32_t online_mask = 0;
+static int num_cpus = 1;
+static uint8_t ap_ids[MAX_CPUS];            // from the MADT, BSP included
+static int ap_found = 0;
+static uint64_t init_deadline = 0;
+// the kernel PML4 plus the identity map the trampoline needs while it turns paging on
+static uint64_t trampoline_pml4[ENTRY_PER_TABLE] __attribute__((aligned(PAGE_SIZE)));
+
+static struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) bsp_gdtr;
+
+// GS base for the kernel side, the process side starts at 0
+void cpu_local_init(int cpu) {
+    struct cpu_local *cl = &cpu_locals[cpu];
+    cl->self = cl;
+    cl->cpu_id = cpu;
+    wrmsr(MSR_GS_BASE, (uint64_t)cl);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+int smp_cpu_count(void) {
+    return num_cpus;
+}
+
+uint32_t smp_online_mask(void) {
+    return online_mask;
+}
+
+uint8_t smp_apic_id(int cpu) {
+    return cpu_apic_ids[cpu];
+}
+
+// first C code on an AP, on the kernel stack the BSP allocated for it
+static void ap_entry(int cpu) {
+    // off the trampoline's page tables, nothing runs in the low half from here on
+    __asm__ volatile("mov %0, %%cr3" : : "r"(MMU_kernel_cr3()) : "memory");
+    cpu_local_init(cpu);
+    idt_load();
+    setup_tss(cpu);
+    MMU_cpu_init();
+    pmu_cpu_init();
+    lapic_cpu_init();
+    __atomic_or_fetch(&online_mask, 1U << cpu, __ATOMIC_RELEASE);
+    __asm__ volatile("sti");
+    while (1) {
+        __asm__ volatile("hlt");
+    }
+}
+
+// up to two startup IPIs to an AP that got its INIT, waits for it to mark itself online
+static int smp_boot_ap(int cpu) {
+    void *stack = MMU_alloc_kstack(KSTACK_SLOT_AP(cpu));
+    if (!stack) return -1;
+    struct ap_boot_params *params = phys_to_virt(AP_TRAMPOLINE_ADDR + (trampoline_params - trampoline_start));
+    params->cr3 = virt_to_phys(trampoline_pml4);
+    params->gdt = (uint64_t)&bsp_gdtr;
+    params->stack = (uint64_t)stack - 8;      // as if ap_entry had been called
+    params->entry = (uint64_t)ap_entry;
+    params->cpu = cpu;
+
+    uint8_t apic_id = cpu_apic_ids[cpu];
+    for (int attempt = 0; attempt < 2; attempt++) {
+        lapic_send_startup(apic_id, AP_TRAMPOLINE_PAGE);
+        TSC_delay_us(AP_SIPI_DELAY_US);
+        if (online_mask & (1U << cpu)) return 0;
+    }
+    uint64_t deadline = TSC_deadline_us(AP_START_TIMEOUT_US);
+    while (!(online_mask & (1U << cpu))) {
+        if (TSC_expired(deadline)) {
+            printk("SMP: CPU %d (APIC %d) did not start\n", cpu, apic_id);
+            // the SIPIs went out, park it in wait-for-SIPI before a late start runs on the freed
+            // stack. One that came up meanwhile is reset too and must not count as online
+            lapic_send_init(apic_id);
+            TSC_delay_us(AP_SIPI_DELAY_US);
+            __atomic_and_fetch(&online_mask, ~(1U << cpu), __ATOMIC_RELEASE);
+            MMU_free_kstack(KSTACK_SLOT_AP(cpu));
+            return -1;
+        }
+        __asm__ volatile("pause");
+    }
+    return 0;
+}
+
+// sends INIT to every other CPU the MADT lists. They all sit out the INIT delay together, and
+// boot goes on meanwhile until smp_finish()
+void smp_start(void) {
+    online_mask = 1;
+    ap_found = 0;
+    if (!lapic_present()) return;
+    int found = madt_cpu_apic_ids(ap_ids, MAX_CPUS);
+    uint8_t bsp = lapic_id();
+    cpu_apic_ids[0] = bsp;
+    if (found <= 1) {
+        printk("SMP: single CPU\n");
+        return;
+    }
+
+    memcpy(phys_to_virt(AP_TRAMPOLINE_ADDR), trampoline_start, trampoline_end - trampoline_start);
+    MMU_trampoline_pml4(trampoline_pml4);
+    __asm__ volatile("sgdt %0" : "=m"(bsp_gdtr));
+    for (int i = 0; i < found; i++) {
+        if (ap_ids[i] != bsp) lapic_send_init(ap_ids[i]);
+    }
+    init_deadline = TSC_deadline_us(AP_INIT_DELAY_US);
+    ap_found = found;
+}
+
+// startup IPIs one AP at a time since they share the trampoline
+void smp_finish(void) {
+    if (ap_found <= 1) return;
+    while (!TSC_expired(init_deadline)) {
+        __asm__ volatile("pause");
+    }
+    uint8_t bsp = cpu_apic_ids[0];
+    for (int i = 0; i < ap_found; i++) {
+        if (ap_ids[i] == bsp) continue;
+        int cpu = num_cpus;
+        cpu_apic_ids[cpu] = ap_ids[i];
+        if (smp_boot_ap(cpu) == 0) num_cpus++;
+    }
+    printk("SMP: %d of %d CPUs online\n", num_cpus, ap_found);
+    ap_found = 0;
+}
+
+void smp_init(void) {
+    smp_start();
+    smp_finish();
+}
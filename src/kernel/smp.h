@@ -0,0 +1,35 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AP_TRAMPOLINE_ADDR 0x8000           // trampoline.asm TRAMPOLINE_BASE, below 1 MiB and page aligned
+#define AP_TRAMPOLINE_PAGE (AP_TRAMPOLINE_ADDR / 0x1000)
+#define AP_INIT_DELAY_US 10000
+#define AP_SIPI_DELAY_US 200
+#define AP_START_TIMEOUT_US 100000
+
+// written into the copied trampoline before each startup IPI
+struct ap_boot_params {
+    uint64_t cr3;
+    uint64_t gdt;           // GDTR of the BSP (limit + base)
+    uint64_t stack;
+    uint64_t entry;         // ap_entry
+    uint64_t cpu;
+} __attribute__((packed));
+
+void cpu_local_init(int cpu);
+void smp_init(void);
+void smp_start(void);
+void smp_finish(void);
+int smp_cpu_count(void);
+uint32_t smp_online_mask(void);
+uint8_t smp_apic_id(int cpu);
+
+// trampoline.asm
+extern char trampoline_start[];
+extern char trampoline_end[];
+extern char trampoline_params[];
+
+#endif
@@ -3,8 +3,13 @@
 
 #include <stddef.h>
 
+// below this the kernel_fpu_begin/end cost outweighs the wider copies
+#define MEMCPY_SSE_MIN 512
+
 extern void *memset(void *dst, int c, size_t n);
 extern void *memcpy(void *dest, const void *src, size_t n);
+extern void *memcpy_sse(void *dest, const void *src, size_t n);
+extern int memcmp(const void *s1, const void *s2, size_t n);
 extern size_t strlen(const char *s);
 extern char *strcpy(char *dest, const char *src);
 extern int strcmp(const char *s1, const char *s2);
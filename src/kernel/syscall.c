@@ -0,0 +1,66 @@
+#include "syscall.h"
+#include "interrupts.h"
+#include "process.h"
+#include "kernel.h"
+#include "printk.h"
+#include "cpu.h"
+
+// system call table, entered through SYSCALL (syscall_entry in usermode.asm) or the int 0x80 gate
+
+static int64_t sys_exit(uint64_t code, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5;
+    process_exit((int)code);
+}
+
+// fd 1 and 2 go to the console
+static int64_t sys_write(uint64_t fd, uint64_t buf, uint64_t len, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)a3; (void)a4; (void)a5;
+    if (fd != 1 && fd != 2) return SYSCALL_EBADF;
+    if (!process_user_range_ok(buf, len)) return SYSCALL_EFAULT;
+    const char *src = (const char *)buf;
+    char chunk[SYSCALL_WRITE_CHUNK + 1];
+    for (uint64_t done = 0; done < len; ) {
+        uint64_t n = len - done < SYSCALL_WRITE_CHUNK ? len - done : SYSCALL_WRITE_CHUNK;
+        for (uint64_t i = 0; i < n; i++) chunk[i] = src[done + i];
+        chunk[n] = '\0';
+        printk("%s", chunk);
+        done += n;
+    }
+    return len;
+}
+
+static int64_t sys_getpid(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)a0; (void)a1; (void)a2; (void)a3; (void)a4; (void)a5;
+    return current_process ? current_process->pid : 0;
+}
+
+const syscall_fn_t syscall_table[NR_SYSCALLS] = {
+    [SYS_EXIT] = sys_exit,
+    [SYS_WRITE] = sys_write,
+    [SYS_GETPID] = sys_getpid,
+};
+
+// the bound syscall_entry checks against, so it can't fall out of step with NR_SYSCALLS
+const uint64_t syscall_count = NR_SYSCALLS;
+
+static int syscall_vector(struct interrupt_frame *frame, void *arg) {
+    (void)arg;
+    if (frame->rax >= NR_SYSCALLS) {
+        frame->rax = SYSCALL_ENOSYS;
+        return IRQ_HANDLED;
+    }
+    frame->rax = syscall_table[frame->rax](frame->rdi, frame->rsi, frame->rdx, frame->r10, frame->r8, frame->r9);
+    return IRQ_HANDLED;
+}
+
+void syscall_init(void) {
+    register_vector(SYSCALL_VECTOR, syscall_vector, NULL, 0);
+    // reachable from ring 3
+    idt_set_gate(SYSCALL_VECTOR, isr_stub_table[SYSCALL_VECTOR], GDT_KERNEL_CODE, 0, 0xEE);
+
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+    wrmsr(MSR_STAR, ((uint64_t)SYSCALL_STAR_SYSRET_BASE << 48) | ((uint64_t)GDT_KERNEL_CODE << 32));
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
+    // the entry stub runs with interrupts off until it is on the kernel stack
+    wrmsr(MSR_FMASK, RFLAGS_IF | RFLAGS_DF | RFLAGS_TF | RFLAGS_AC);
+}
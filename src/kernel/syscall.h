@@ -0,0 +1,33 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SYSCALL_VECTOR 0x80         // int 0x80, DPL 3 gate, the slow path
+#define SYSCALL_STAR_SYSRET_BASE 0x20   // SYSRET: ss = base + 8, cs = base + 16
+
+// rax = number, rdi rsi rdx r10 r8 r9 = arguments, result in rax
+// SYSCALL clobbers rcx and r11, the fast path also leaves the other caller saved registers undefined
+#define SYS_EXIT 0
+#define SYS_WRITE 1
+#define SYS_GETPID 2
+#define NR_SYSCALLS 3
+
+#define SYSCALL_ENOSYS -38
+#define SYSCALL_EFAULT -14
+#define SYSCALL_EBADF -9
+
+#define SYSCALL_WRITE_CHUNK 128
+
+typedef int64_t (*syscall_fn_t)(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5);
+
+extern const syscall_fn_t syscall_table[NR_SYSCALLS];
+extern const uint64_t syscall_count;
+
+void syscall_init(void);
+
+// usermode.asm
+extern void syscall_entry(void);
+
+#endif
@@ -0,0 +1,160 @@
+#include "trace.h"
+#include "serial.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "printk.h"
+#include "string.h"
+
+// tracepoint rings and the jump site patching. Records go into static per-CPU rings (frame
+// allocation is traced, so they can't come from the heap) and are only read by trace_dump, which
+// sends them over COM1 for tools/trace_decode.py:
+//   TRACE-DUMP\n, header, tracepoint table, records, \nTRACE-END\n
+
+struct trace_ring {
+    struct trace_record records[TRACE_RING_RECORDS];
+    uint32_t head;                          // total written, the slot is head % TRACE_RING_RECORDS
+} __attribute__((aligned(64)));
+
+// follows the magic in the dump, all little endian
+struct trace_header {
+    uint32_t record_size;
+    uint64_t tsc_khz;
+    uint32_t ntracepoints;
+    uint32_t nrecords;
+} __attribute__((packed));
+
+static struct trace_ring trace_rings[MAX_CPUS];
+static int ntracepoints = 0;
+
+void trace_init(void) {
+    ntracepoints = __tracepoints_end - __tracepoints_start;
+    if (ntracepoints > TRACE_MAX_TRACEPOINTS) {
+        printk("trace: only the first %d tracepoints are used\n", TRACE_MAX_TRACEPOINTS);
+        ntracepoints = TRACE_MAX_TRACEPOINTS;
+    }
+    for (int i = 0; i < ntracepoints; i++) {
+        __tracepoints_start[i].id = i;
+    }
+    printk("trace: %d tracepoints, %d sites\n", ntracepoints, (int)(__jump_table_end - __jump_table_start));
+}
+
+// runs on whatever CPU the tracepoint fired on, interrupts may nest so the slot is claimed atomically
+void trace_record(struct tracepoint *tp, uint64_t arg0, uint32_t arg1) {
+    int cpu = this_cpu_id();
+    struct trace_ring *ring = &trace_rings[cpu];
+    uint32_t slot = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    struct trace_record *rec = &ring->records[slot & (TRACE_RING_RECORDS - 1)];
+    rec->tsc = rdtsc();
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    rec->id = tp->id;
+    rec->cpu = cpu;
+    rec->reserved = 0;
+}
+
+/*-------------------Jump sites-------------------*/
+
+// nop or jmp rel32 over the low five bytes of the aligned quadword, one atomic store
+static void patch_site(struct jump_entry *e, int on) {
+    uint64_t *site = (uint64_t *)e->code;
+    uint64_t insn;
+    if (on) {
+        uint32_t rel = (uint32_t)(e->target - (e->code + 5));
+        insn = 0xE9 | ((uint64_t)rel << 8);
+    } else {
+        insn = 0x0000441F0FULL;             // nopl 0x0(%rax,%rax,1)
+    }
+    uint64_t old = *site;
+    __atomic_store_n(site, (old & ~0xFFFFFFFFFFULL) | insn, __ATOMIC_RELEASE);
+}
+
+static void set_tracepoint(struct tracepoint *tp, int on) {
+    if (tp->enabled == on) return;
+    tp->enabled = on;
+    for (struct jump_entry *e = __jump_table_start; e < __jump_table_end; e++) {
+        if (e->key == (uint64_t)tp) patch_site(e, on);
+    }
+}
+
+// by name, "all" for every tracepoint, returns how many changed state or -1 for an unknown name.
+// Other CPUs only reach trace sites through interrupts and iretq serializes, so they pick up the
+// new code on their next entry
+int trace_enable(const char *name, int on) {
+    int all = strcmp(name, "all") == 0;
+    int found = 0;
+    int changed = 0;
+    for (struct tracepoint *tp = __tracepoints_start; tp < __tracepoints_start + ntracepoints; tp++) {
+        if (!all && strcmp(tp->name, name) != 0) continue;
+        found = 1;
+        if (tp->enabled != on) changed++;
+        set_tracepoint(tp, on);
+    }
+    return found ? changed : -1;
+}
+
+/*-------------------Dump-------------------*/
+
+// SER_write takes what fits in its buffer, the rest waits for the transmit interrupt
+static void serial_write_all(const void *buf, int len) {
+    const char *p = buf;
+    while (len > 0) {
+        int n = SER_write(p, len);
+        p += n;
+        len -= n;
+        if (!n) __asm__ volatile("pause");
+    }
+}
+
+// needs interrupts on, tracing is paused meanwhile so the dump doesn't trace itself
+void trace_dump(void) {
+    int was_enabled[TRACE_MAX_TRACEPOINTS];
+    for (int i = 0; i < ntracepoints; i++) {
+        was_enabled[i] = __tracepoints_start[i].enabled;
+        set_tracepoint(&__tracepoints_start[i], 0);
+    }
+
+    struct trace_header hdr;
+    hdr.record_size = sizeof(struct trace_record);
+    hdr.tsc_khz = TSC_khz();
+    hdr.ntracepoints = ntracepoints;
+    hdr.nrecords = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint32_t head = trace_rings[cpu].head;
+        hdr.nrecords += head < TRACE_RING_RECORDS ? head : TRACE_RING_RECORDS;
+    }
+    serial_write_all(TRACE_DUMP_BEGIN, strlen(TRACE_DUMP_BEGIN));
+    serial_write_all(TRACE_MAGIC, strlen(TRACE_MAGIC));
+    serial_write_all(&hdr, sizeof(hdr));
+
+    // id, phase, name and span lengths, then both strings
+    for (int i = 0; i < ntracepoints; i++) {
+        struct tracepoint *tp = &__tracepoints_start[i];
+        uint8_t entry[5];
+        uint8_t name_len = strlen(tp->name);
+        uint8_t span_len = strlen(tp->span);
+        entry[0] = tp->id & 0xFF;
+        entry[1] = tp->id >> 8;
+        entry[2] = tp->phase;
+        entry[3] = name_len;
+        entry[4] = span_len;
+        serial_write_all(entry, sizeof(entry));
+        serial_write_all(tp->name, name_len);
+        serial_write_all(tp->span, span_len);
+    }
+
+    // oldest first on each CPU, the decoder merges them by timestamp
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct trace_ring *ring = &trace_rings[cpu];
+        uint32_t head = ring->head;
+        uint32_t first = head < TRACE_RING_RECORDS ? 0 : head - TRACE_RING_RECORDS;
+        for (uint32_t i = first; i < head; i++) {
+            serial_write_all(&ring->records[i & (TRACE_RING_RECORDS - 1)], sizeof(struct trace_record));
+        }
+        ring->head = 0;
+    }
+    serial_write_all(TRACE_DUMP_END, strlen(TRACE_DUMP_END));
+
+    for (int i = 0; i < ntracepoints; i++) {
+        set_tracepoint(&__tracepoints_start[i], was_enabled[i]);
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// static tracepoints: every trace() site is a 5 byte nop until its tracepoint is enabled, then it
+// is patched into a jump to the code that records a binary event into the per-CPU ring
+#define TRACE_RING_RECORDS 2048             // per CPU, power of two, the oldest are overwritten
+#define TRACE_MAX_TRACEPOINTS 64
+#define TRACE_MAGIC "TRC1"
+#define TRACE_DUMP_BEGIN "TRACE-DUMP\n"
+#define TRACE_DUMP_END "\nTRACE-END\n"
+
+// Chrome trace event phases
+#define TRACE_BEGIN 'B'
+#define TRACE_END 'E'
+#define TRACE_INSTANT 'i'
+
+struct tracepoint {
+    const char *name;
+    const char *span;                       // begin/end pairs share it, shown as the slice name
+    uint16_t id;                            // index in .tracepoints, set by trace_init
+    char phase;
+    int enabled;
+};
+
+// one recorded event, written out as is (little endian) by trace_dump
+struct trace_record {
+    uint64_t tsc;
+    uint64_t arg0;
+    uint32_t arg1;
+    uint16_t id;
+    uint8_t cpu;
+    uint8_t reserved;
+} __attribute__((packed));
+
+// __jump_table entry for one trace() site
+struct jump_entry {
+    uint64_t code;                          // the 5 byte nop, 8 byte aligned
+    uint64_t target;                        // where the enabled jump goes
+    uint64_t key;                           // struct tracepoint
+};
+
+#define DEFINE_TRACEPOINT(tp, span_name, ph)                                                    \
+    static struct tracepoint __tracepoint_##tp                                                 \
+        __attribute__((used, section(".tracepoints"), aligned(8))) = { #tp, span_name, 0, ph, 0 }
+
+// falls through while disabled. The site is aligned so patching it is one 8 byte store, another
+// CPU never sees half an instruction
+static inline __attribute__((always_inline)) int tracepoint_active(struct tracepoint *tp) {
+    __asm__ goto(".balign 8, 0x90\n\t"
+                 "1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+                 ".pushsection __jump_table, \"aw\"\n\t"
+                 ".balign 8\n\t"
+                 ".quad 1b, %l[active], %c0\n\t"
+                 ".popsection"
+                 : : "i"(tp) : : active);
+    return 0;
+active:
+    return 1;
+}
+
+#define trace(tp, a0, a1)                                                                       \
+    do {                                                                                        \
+        if (tracepoint_active(&__tracepoint_##tp)) {                                            \
+            trace_record(&__tracepoint_##tp, (uint64_t)(a0), (uint32_t)(a1));                   \
+        }                                                                                       \
+    } while (0)
+
+// linker.ld
+extern struct tracepoint __tracepoints_start[];
+extern struct tracepoint __tracepoints_end[];
+extern struct jump_entry __jump_table_start[];
+extern struct jump_entry __jump_table_end[];
+
+void trace_init(void);
+void trace_record(struct tracepoint *tp, uint64_t arg0, uint32_t arg1);
+int trace_enable(const char *name, int on);
+void trace_dump(void);
+
+#endif
@@ -0,0 +1,116 @@
+#include "tsc.h"
+#include "printk.h"
+#include "interrupts.h"
+#include <stddef.h>
+
+// calibrated TSC rate, used for all timeouts and delays
+static uint64_t tsc_khz = TSC_DEFAULT_KHZ;
+static volatile uint64_t pit_ticks = 0;
+
+static inline void outb(uint16_t port, uint8_t val) {
+    asm volatile ( "outb %0, %1" : : "a"(val), "Nd"(port) );
+}
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    asm volatile ( "inb %1, %0"
+                    : "=a"(ret)
+                    : "Nd"(port) );
+    return ret;
+}
+
+static uint64_t calibrate_start = 0;
+
+// counts TSC cycles across a PIT channel 2 one-shot of TSC_CALIBRATE_MS. The one-shot runs by
+// itself, so boot can do other work until TSC_calibrate_finish() (nothing in between may use
+// TSC timeouts, they still assume TSC_DEFAULT_KHZ)
+void TSC_calibrate_start(void) {
+    uint16_t latch = PIT_FREQUENCY / (1000 / TSC_CALIBRATE_MS);
+
+    // gate ch2 on, speaker off
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+
+    // ch2, lobyte/hibyte, mode 0 (interrupt on terminal count), binary
+    outb(PIT_MODE_CMD, 0xB0);
+    outb(PIT_CH2_DATA, latch & 0xFF);
+    outb(PIT_CH2_DATA, (latch >> 8) & 0xFF);
+
+    calibrate_start = rdtsc();
+}
+
+// waits for the one-shot to run out. If it already has, the end can't be timed any more and the
+// calibration runs again in full
+void TSC_calibrate_finish(void) {
+    if (inb(PIT_GATE_PORT) & 0x20) {
+        printk("TSC calibration window overrun, calibrating again\n");
+        TSC_calibrate_start();
+    }
+    // bounded so a missing PIT can't hang boot (the port read alone is ~1us)
+    uint32_t spins = 0;
+    while (!(inb(PIT_GATE_PORT) & 0x20)) {
+        if (++spins > 1000000) {
+            printk("TSC calibration timed out, assuming %lu kHz\n", tsc_khz);
+            return;
+        }
+    }
+    uint64_t end = rdtsc();
+
+    if (end > calibrate_start) {
+        tsc_khz = (end - calibrate_start) / TSC_CALIBRATE_MS;
+    }
+    printk("TSC calibrated: %lu kHz\n", tsc_khz);
+}
+
+void TSC_init(void) {
+    TSC_calibrate_start();
+    TSC_calibrate_finish();
+}
+
+uint64_t TSC_khz(void) {
+    return tsc_khz;
+}
+
+uint64_t TSC_us_to_cycles(uint64_t us) {
+    return us * tsc_khz / 1000;
+}
+
+uint64_t TSC_cycles_to_us(uint64_t cycles) {
+    return cycles * 1000 / tsc_khz;
+}
+
+uint64_t TSC_deadline_us(uint64_t us) {
+    return rdtsc() + TSC_us_to_cycles(us);
+}
+
+int TSC_expired(uint64_t deadline) {
+    return (int64_t)(rdtsc() - deadline) >= 0;
+}
+
+void TSC_delay_us(uint64_t us) {
+    uint64_t deadline = TSC_deadline_us(us);
+    while (!TSC_expired(deadline)) {
+        __asm__ volatile("pause");
+    }
+}
+
+static void pit_tick_handler(int irq, int error_code, void* arg) {
+    (void)irq;
+    (void)error_code;
+    (void)arg;
+    pit_ticks++;
+}
+
+// channel 0 as a rate generator on IRQ0, timekeeping still uses the TSC
+void PIT_start_tick(uint32_t hz) {
+    uint32_t divisor = PIT_FREQUENCY / hz;
+    if (divisor > 0xFFFF) divisor = 0xFFFF;
+    // ch0, lobyte/hibyte, mode 2 (rate generator), binary
+    outb(PIT_MODE_CMD, 0x34);
+    outb(PIT_CH0_DATA, divisor & 0xFF);
+    outb(PIT_CH0_DATA, (divisor >> 8) & 0xFF);
+    IRQ_set_handler(0, pit_tick_handler, NULL);
+    IRQ_clear_mask(0);
+}
+
+uint64_t PIT_ticks(void) {
+    return pit_ticks;
+}
@@ -0,0 +1,36 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdint.h>
+
+// PIT ports (channel 0 drives the periodic tick, channel 2 calibrates the TSC)
+#define PIT_CH0_DATA 0x40
+#define PIT_CH2_DATA 0x42
+#define PIT_MODE_CMD 0x43
+#define PIT_GATE_PORT 0x61          // bit 0: ch2 gate, bit 1: speaker, bit 5: ch2 output
+#define PIT_FREQUENCY 1193182       // Hz
+
+#define PIT_TICK_HZ 100             // wakes the idle loop for background work
+
+#define TSC_CALIBRATE_MS 10
+#define TSC_DEFAULT_KHZ 1000000     // assumed 1 GHz if the PIT never answers
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void TSC_init(void);
+void TSC_calibrate_start(void);
+void TSC_calibrate_finish(void);
+uint64_t TSC_khz(void);
+uint64_t TSC_us_to_cycles(uint64_t us);
+uint64_t TSC_cycles_to_us(uint64_t cycles);
+uint64_t TSC_deadline_us(uint64_t us);
+int TSC_expired(uint64_t deadline);
+void TSC_delay_us(uint64_t us);
+void PIT_start_tick(uint32_t hz);
+uint64_t PIT_ticks(void);
+
+#endif
@@ -0,0 +1,224 @@
+#include "tunable.h"
+#include "serial.h"
+#include "printk.h"
+#include "string.h"
+
+// tunables registry. Names are hashed into a fixed table once, so the command line is applied in
+// O(tunables + command line length) without the allocator
+
+static int16_t hash_table[TUNABLE_HASH_SIZE];   // index into .tunables + 1, 0 is empty
+static int ntunables = 0;
+static char console_line[TUNABLE_LINE_LEN];
+static int console_len = 0;
+
+// FNV-1a over len bytes
+static uint32_t hash_name(const char *name, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int name_matches(const char *name, const char *s, int len) {
+    for (int i = 0; i < len; i++) {
+        if (name[i] != s[i]) return 0;
+    }
+    return name[len] == '\0';
+}
+
+// name is not null terminated
+const struct tunable *tunable_find(const char *name, int len) {
+    uint32_t h = hash_name(name, len);
+    for (int probe = 0; probe < TUNABLE_HASH_SIZE; probe++) {
+        int slot = hash_table[(h + probe) & (TUNABLE_HASH_SIZE - 1)];
+        if (!slot) return NULL;
+        const struct tunable *t = &__tunables_start[slot - 1];
+        if (name_matches(t->name, name, len)) return t;
+    }
+    return NULL;
+}
+
+int tunable_get(const struct tunable *t, int64_t *value) {
+    switch (t->size) {
+        case 1:
+            if (t->is_signed) *value = *(int8_t *)t->value;
+            else *value = *(uint8_t *)t->value;
+            break;
+        case 2:
+            if (t->is_signed) *value = *(int16_t *)t->value;
+            else *value = *(uint16_t *)t->value;
+            break;
+        case 4:
+            if (t->is_signed) *value = *(int32_t *)t->value;
+            else *value = *(uint32_t *)t->value;
+            break;
+        case 8:
+            *value = *(int64_t *)t->value;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+// -1 when value doesn't fit the variable's type
+int tunable_set(const struct tunable *t, int64_t value) {
+    if (t->size < 8) {
+        int bits = t->size * 8;
+        int64_t min = t->is_signed ? -(1LL << (bits - 1)) : 0;
+        int64_t max = t->is_signed ? (1LL << (bits - 1)) - 1 : (1LL << bits) - 1;
+        if (value < min || value > max) return -1;
+    } else if (!t->is_signed && value < 0) {
+        return -1;
+    }
+    switch (t->size) {
+        case 1: *(uint8_t *)t->value = value; break;
+        case 2: *(uint16_t *)t->value = value; break;
+        case 4: *(uint32_t *)t->value = value; break;
+        case 8: *(uint64_t *)t->value = value; break;
+        default: return -1;
+    }
+    return 0;
+}
+
+// decimal, 0x hex or a leading minus, the whole of [s, s + len)
+static int parse_value(const char *s, int len, int64_t *value) {
+    int neg = 0;
+    int base = 10;
+    int i = 0;
+    if (i < len && s[i] == '-') {
+        neg = 1;
+        i++;
+    }
+    if (i + 1 < len && s[i] == '0' && (s[i + 1] == 'x' || s[i + 1] == 'X')) {
+        base = 16;
+        i += 2;
+    }
+    if (i == len) return -1;
+    uint64_t v = 0;
+    for (; i < len; i++) {
+        char c = s[i];
+        int d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f') d = c - 'a' + 10;
+        else if (base == 16 && c >= 'A' && c <= 'F') d = c - 'A' + 10;
+        else return -1;
+        v = v * base + d;
+    }
+    *value = neg ? -(int64_t)v : (int64_t)v;
+    return 0;
+}
+
+// "name=value" or a bare "name" (1), reports what it did when verbose
+static int apply_setting(const char *s, int len, int verbose) {
+    int name_len = 0;
+    while (name_len < len && s[name_len] != '=') name_len++;
+    const struct tunable *t = tunable_find(s, name_len);
+    if (!t) return -1;
+    int64_t value = 1;
+    if (name_len < len && parse_value(s + name_len + 1, len - name_len - 1, &value) != 0) {
+        printk("tunable %s: bad value\n", t->name);
+        return -1;
+    }
+    if (tunable_set(t, value) != 0) {
+        printk("tunable %s: %ld out of range\n", t->name, value);
+        return -1;
+    }
+    if (verbose) printk("tunable %s=%ld\n", t->name, value);
+    return 0;
+}
+
+// builds the name table and applies the command line, words that aren't tunables are left alone
+void tunables_init(const char *cmdline) {
+    ntunables = __tunables_end - __tunables_start;
+    if (ntunables > TUNABLE_MAX) {
+        printk("tunables: only the first %d are registered\n", TUNABLE_MAX);
+        ntunables = TUNABLE_MAX;
+    }
+    for (int i = 0; i < ntunables; i++) {
+        const char *name = __tunables_start[i].name;
+        uint32_t h = hash_name(name, strlen(name));
+        int probe = 0;
+        while (hash_table[(h + probe) & (TUNABLE_HASH_SIZE - 1)]) probe++;
+        hash_table[(h + probe) & (TUNABLE_HASH_SIZE - 1)] = i + 1;
+    }
+    if (!cmdline) return;
+    const char *p = cmdline;
+    while (*p) {
+        while (*p == ' ') p++;
+        int n = 0;
+        while (p[n] && p[n] != ' ') n++;
+        if (n) apply_setting(p, n, 1);
+        p += n;
+    }
+}
+
+/*-------------------Serial console-------------------*/
+
+static void list_tunables(void) {
+    for (int i = 0; i < ntunables; i++) {
+        const struct tunable *t = &__tunables_start[i];
+        int64_t value;
+        if (tunable_get(t, &value) != 0) continue;
+        printk("  %s=%ld (default %ld)\n", t->name, value, t->def);
+    }
+}
+
+// "list", "get name", "set name value" or "name=value"
+static void console_command(char *line, int len) {
+    while (len > 0 && line[len - 1] == ' ') len--;
+    line[len] = '\0';
+    if (len == 0) return;
+    if (strcmp(line, "list") == 0) {
+        list_tunables();
+    } else if (len > 4 && memcmp(line, "get ", 4) == 0) {
+        const struct tunable *t = tunable_find(line + 4, len - 4);
+        int64_t value;
+        if (t && tunable_get(t, &value) == 0) {
+            printk("tunable %s=%ld\n", t->name, value);
+        } else {
+            printk("no tunable %s\n", line + 4);
+        }
+    } else if (len > 4 && memcmp(line, "set ", 4) == 0) {
+        // same as name=value
+        for (int i = 4; i < len; i++) {
+            if (line[i] == ' ') {
+                line[i] = '=';
+                break;
+            }
+        }
+        if (apply_setting(line + 4, len - 4, 1) != 0) printk("set failed: %s\n", line + 4);
+    } else {
+        int has_value = 0;
+        for (int i = 0; i < len; i++) {
+            if (line[i] == '=') has_value = 1;
+        }
+        // a bare name is only set from the command line
+        if (!has_value || apply_setting(line, len, 1) != 0) {
+            printk("commands: list, get <name>, set <name> <value>, <name>=<value>\n");
+        }
+    }
+}
+
+// called from the idle loop, takes whatever COM1 received and runs complete lines
+void tunable_console_poll(void) {
+    char buf[16];
+    int n;
+    while ((n = SER_read(buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < n; i++) {
+            char c = buf[i];
+            if (c == '\r' || c == '\n') {
+                SER_write("\r\n", 2);
+                console_command(console_line, console_len);
+                console_len = 0;
+            } else if ((c == '\b' || c == 0x7F) && console_len > 0) {
+                console_len--;
+                SER_write("\b \b", 3);
+            } else if (c >= ' ' && console_len < TUNABLE_LINE_LEN - 1) {
+                console_line[console_len++] = c;
+                SER_write(&c, 1);
+            }
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef TUNABLE_H
+#define TUNABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// runtime knobs: TUNABLE(name, type, default) defines a static variable of an integer type and
+// registers it in the .tunables section. "name=value" on the boot command line sets it before the
+// allocator starts, the serial console reads and writes it later
+#define TUNABLE_MAX 64
+#define TUNABLE_HASH_SIZE 128               // power of two, at least twice TUNABLE_MAX
+#define TUNABLE_LINE_LEN 128
+
+struct tunable {
+    const char *name;
+    void *value;
+    uint8_t size;                           // 1, 2, 4 or 8 bytes
+    uint8_t is_signed;
+    int64_t def;
+};
+
+// all ones shifted down to the top bit stays -1 only for signed types (a plain < 0 trips -Wtype-limits)
+#define TUNABLE_SIGNED(type) (((type)-1 >> (sizeof(type) * 8 - 1)) != 1)
+
+#define TUNABLE(name, type, default_value)                                                      \
+    static type name = default_value;                                                          \
+    static const struct tunable __tunable_##name                                               \
+        __attribute__((used, section(".tunables"), aligned(8))) =                              \
+        { #name, &name, sizeof(type), TUNABLE_SIGNED(type), default_value }
+
+// linker.ld
+extern const struct tunable __tunables_start[];
+extern const struct tunable __tunables_end[];
+
+void tunables_init(const char *cmdline);
+const struct tunable *tunable_find(const char *name, int len);
+int tunable_get(const struct tunable *t, int64_t *value);
+int tunable_set(const struct tunable *t, int64_t value);
+void tunable_console_poll(void);
+
+#endif
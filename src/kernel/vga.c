@@ -1,10 +1,13 @@
 #include "vga.h"
 #include "string.h"
+#include "pmu.h"
+#include "mmu.h"
+#include "tunable.h"
 
 // constants for VGA text mode
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
-static volatile uint16_t* const VGA_MEMORY = (volatile uint16_t*)0xb8000; // volatile because it may change at any time
+static volatile uint16_t* const VGA_MEMORY = (volatile uint16_t*)(DIRECT_MAP_ADR + 0xb8000); // volatile because it may change at any time
 
 // color declarations
 #define VGA_BLACK 0
@@ -42,6 +45,12 @@ static inline int are_interrupts_enabled() {
 static int cursor_x = 0;
 static int cursor_y = 0;
 
+// cost of scrolling, summed over every scroll. Off unless "vga_scroll_pmu=1" is on the command line,
+// which the bench image sets, the counter reads would cost every console line otherwise
+TUNABLE(vga_scroll_pmu, int, 0);
+static struct pmu_counts scroll_counts;
+static uint64_t scrolls = 0;
+
 // helper func to determine index in buffer
 static inline int vga_index(int x, int y) {
     return y * VGA_WIDTH + x;
@@ -54,6 +63,9 @@ static void vga_scroll() {
         enable_ints = 1;
         __asm__ volatile("cli");
     }
+    struct pmu_counts pmu;
+    int measure = vga_scroll_pmu;
+    if (measure) pmu_begin(&pmu);
 
     // moves lines up by one
     for (int y = 0; y < VGA_HEIGHT - 1; y++) {
@@ -66,6 +78,11 @@ static void vga_scroll() {
     for (int x = 0; x < VGA_WIDTH; x++) {
         VGA_MEMORY[vga_index(x, VGA_HEIGHT - 1)] = VGA_DEFAULT_COLOR << 8 | ' ';
     }
+    if (measure) {
+        pmu_end(&pmu);
+        pmu_add(&scroll_counts, &pmu);
+        scrolls++;
+    }
 
     if (enable_ints) {
         __asm__ volatile("sti");
@@ -141,4 +158,9 @@ void VGA_display_str(const char *str) {
         VGA_display_char(*str);
         str++;
     }
-}
\ No newline at end of file
+}
+
+void VGA_scroll_report(void) {
+    if (!vga_scroll_pmu) return;
+    pmu_report("vga_scroll", &scroll_counts, scrolls);
+}
@@ -6,5 +6,6 @@
 extern void VGA_clear(void);
 extern void VGA_display_char(char c);
 extern void VGA_display_str(const char *str);
+extern void VGA_scroll_report(void);
 
 #endif
\ No newline at end of file
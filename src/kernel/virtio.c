@@ -0,0 +1,372 @@
+#include "virtio.h"
+#include "mmu.h"
+#include "printk.h"
+#include "string.h"
+
+// virtio PCI transport (legacy I/O port and modern capability layouts) and split virtqueues
+
+static inline void outb(uint16_t port, uint8_t val) {
+    asm volatile ( "outb %0, %1" : : "a"(val), "Nd"(port) );
+}
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    asm volatile ( "inb %1, %0"
+                    : "=a"(ret)
+                    : "Nd"(port) );
+    return ret;
+}
+static inline void outw(uint16_t port, uint16_t val) {
+    asm volatile ( "outw %0, %1" : : "a"(val), "Nd"(port) );
+}
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    asm volatile ( "inw %1, %0"
+                    : "=a"(ret)
+                    : "Nd"(port) );
+    return ret;
+}
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile ( "outl %0, %1" : : "a"(val), "Nd"(port) );
+}
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    asm volatile ( "inl %1, %0"
+                    : "=a"(ret)
+                    : "Nd"(port) );
+    return ret;
+}
+
+// x86 keeps stores in order, only the compiler has to be stopped from reordering ring updates
+#define virtio_wmb() __asm__ volatile("" ::: "memory")
+#define virtio_rmb() __asm__ volatile("" ::: "memory")
+// store of avail->idx against the load of avail_event/used flags
+#define virtio_mb() __asm__ volatile("mfence" ::: "memory")
+
+/*-------------------Transport-------------------*/
+
+static uint8_t virtio_get_status(struct virtio_dev *vdev) {
+    if (vdev->modern) return vdev->common->device_status;
+    return inb(vdev->io_base + VIRTIO_LEGACY_STATUS);
+}
+
+static void virtio_set_status(struct virtio_dev *vdev, uint8_t status) {
+    if (vdev->modern) {
+        vdev->common->device_status = status;
+    } else {
+        outb(vdev->io_base + VIRTIO_LEGACY_STATUS, status);
+    }
+}
+
+// prefers the modern layout when the device exposes all of its capabilities
+static void virtio_find_modern(struct virtio_dev *vdev, struct pci_dev *pci) {
+    uint8_t cap = pci_find_capability(pci, PCI_CAP_ID_VNDR, 0);
+    for (; cap; cap = pci_find_capability(pci, PCI_CAP_ID_VNDR, cap)) {
+        uint8_t type = pci_read8(pci, cap + VIRTIO_PCI_CAP_CFG_TYPE);
+        uint8_t bar = pci_read8(pci, cap + VIRTIO_PCI_CAP_BAR);
+        uint32_t offset = pci_read32(pci, cap + VIRTIO_PCI_CAP_OFFSET);
+        if (bar >= PCI_NUM_BARS || pci->bars[bar].is_io) {
+            continue;
+        }
+        uint8_t *base = pci_map_bar(pci, bar);
+        if (!base) continue;
+        switch (type) {
+            case VIRTIO_PCI_CAP_COMMON_CFG:
+                if (!vdev->common) vdev->common = (volatile struct virtio_pci_common_cfg *)(base + offset);
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                if (!vdev->notify_base) {
+                    vdev->notify_base = base + offset;
+                    vdev->notify_multiplier = pci_read32(pci, cap + VIRTIO_PCI_NOTIFY_MULTIPLIER);
+                }
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG:
+                if (!vdev->isr) vdev->isr = base + offset;
+                break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG:
+                if (!vdev->device_cfg) vdev->device_cfg = base + offset;
+                break;
+        }
+    }
+    vdev->modern = vdev->common && vdev->notify_base && vdev->isr;
+}
+
+// resets the device and leaves it at ACKNOWLEDGE|DRIVER
+int virtio_pci_init(struct virtio_dev *vdev, struct pci_dev *pci) {
+    memset(vdev, 0, sizeof(*vdev));
+    vdev->pci = pci;
+    virtio_find_modern(vdev, pci);
+    if (!vdev->modern) {
+        if (!pci->bars[0].is_io || !pci->bars[0].io_port) {
+            printk("virtio %d:%d.%d: no usable transport\n", pci->bus, pci->slot, pci->func);
+            return -1;
+        }
+        vdev->io_base = pci->bars[0].io_port;
+    }
+    pci_enable(pci, PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+
+    virtio_reset(vdev);
+    virtio_set_status(vdev, VIRTIO_STATUS_ACKNOWLEDGE);
+    virtio_set_status(vdev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    return 0;
+}
+
+int virtio_negotiate(struct virtio_dev *vdev, uint64_t wanted) {
+    uint64_t offered;
+    if (vdev->modern) {
+        vdev->common->device_feature_select = 0;
+        offered = vdev->common->device_feature;
+        vdev->common->device_feature_select = 1;
+        offered |= (uint64_t)vdev->common->device_feature << 32;
+        wanted |= 1ULL << VIRTIO_F_VERSION_1;
+    } else {
+        offered = inl(vdev->io_base + VIRTIO_LEGACY_HOST_FEATURES);
+    }
+    vdev->features = offered & wanted;
+
+    if (!vdev->modern) {
+        outl(vdev->io_base + VIRTIO_LEGACY_GUEST_FEATURES, (uint32_t)vdev->features);
+        return 0;
+    }
+    if (!(vdev->features & (1ULL << VIRTIO_F_VERSION_1))) {
+        printk("virtio: modern device without VERSION_1\n");
+        return -1;
+    }
+    vdev->common->driver_feature_select = 0;
+    vdev->common->driver_feature = (uint32_t)vdev->features;
+    vdev->common->driver_feature_select = 1;
+    vdev->common->driver_feature = (uint32_t)(vdev->features >> 32);
+    virtio_set_status(vdev, virtio_get_status(vdev) | VIRTIO_STATUS_FEATURES_OK);
+    if (!(virtio_get_status(vdev) & VIRTIO_STATUS_FEATURES_OK)) {
+        printk("virtio: device refused features 0x%lx\n", vdev->features);
+        return -1;
+    }
+    return 0;
+}
+
+// the device drops its queues and stops touching driver memory once this returns
+void virtio_reset(struct virtio_dev *vdev) {
+    virtio_set_status(vdev, 0);
+    // modern devices finish the reset when the status reads back 0
+    for (int i = 0; i < 1000000 && virtio_get_status(vdev) != 0; i++) {
+        __asm__ volatile("pause");
+    }
+}
+
+void virtio_driver_ok(struct virtio_dev *vdev) {
+    virtio_set_status(vdev, virtio_get_status(vdev) | VIRTIO_STATUS_DRIVER_OK);
+}
+
+void virtio_fail(struct virtio_dev *vdev) {
+    virtio_set_status(vdev, virtio_get_status(vdev) | VIRTIO_STATUS_FAILED);
+}
+
+// reading clears it, bit 0 is a used buffer notification and bit 1 a config change
+uint8_t virtio_read_isr(struct virtio_dev *vdev) {
+    if (vdev->modern) return *vdev->isr;
+    return inb(vdev->io_base + VIRTIO_LEGACY_ISR);
+}
+
+uint8_t virtio_config_read8(struct virtio_dev *vdev, uint32_t off) {
+    if (vdev->modern) return vdev->device_cfg ? vdev->device_cfg[off] : 0;
+    return inb(vdev->io_base + VIRTIO_LEGACY_CONFIG + off);
+}
+
+uint32_t virtio_config_read32(struct virtio_dev *vdev, uint32_t off) {
+    if (vdev->modern) return vdev->device_cfg ? *(volatile uint32_t *)(vdev->device_cfg + off) : 0;
+    return inl(vdev->io_base + VIRTIO_LEGACY_CONFIG + off);
+}
+
+// the two halves can tear if the device changes them, retried on a generation change
+uint64_t virtio_config_read64(struct virtio_dev *vdev, uint32_t off) {
+    uint64_t val;
+    uint8_t gen;
+    do {
+        gen = vdev->modern ? vdev->common->config_generation : 0;
+        val = virtio_config_read32(vdev, off) | ((uint64_t)virtio_config_read32(vdev, off + 4) << 32);
+    } while (vdev->modern && gen != vdev->common->config_generation);
+    return val;
+}
+
+/*-------------------Virtqueues-------------------*/
+
+static inline uint16_t vq_used_idx(struct virtq *vq) {
+    return *(volatile uint16_t *)&vq->used->idx;
+}
+
+// with VIRTIO_F_EVENT_IDX: we want an interrupt once used->idx passes used_event
+static inline volatile uint16_t *vq_used_event(struct virtq *vq) {
+    return (volatile uint16_t *)&vq->avail->ring[vq->size];
+}
+
+// and the device wants a kick once avail->idx passes avail_event
+static inline volatile uint16_t *vq_avail_event(struct virtq *vq) {
+    return (volatile uint16_t *)&vq->used->ring[vq->size];
+}
+
+// ring memory comes from the DMA pool, laid out the way the legacy interface requires
+int virtio_setup_queue(struct virtio_dev *vdev, struct virtq *vq, uint16_t index) {
+    uint16_t size;
+    if (vdev->modern) {
+        vdev->common->queue_select = index;
+        size = vdev->common->queue_size;
+        if (size > VIRTQ_MAX_SIZE) {
+            size = VIRTQ_MAX_SIZE;
+            vdev->common->queue_size = size;
+        }
+    } else {
+        outw(vdev->io_base + VIRTIO_LEGACY_QUEUE_SEL, index);
+        size = inw(vdev->io_base + VIRTIO_LEGACY_QUEUE_NUM);
+        if (size > VIRTQ_MAX_SIZE) {
+            printk("virtio: legacy queue %d has %d entries, max %d\n", index, size, VIRTQ_MAX_SIZE);
+            return -1;
+        }
+    }
+    if (size == 0) {
+        printk("virtio: queue %d not available\n", index);
+        return -1;
+    }
+
+    memset(vq, 0, sizeof(*vq));
+    uint64_t avail_off = sizeof(struct virtq_desc) * size;
+    uint64_t used_off = (avail_off + 6 + 2 * size + VIRTIO_LEGACY_QUEUE_ALIGN - 1) & ~(uint64_t)(VIRTIO_LEGACY_QUEUE_ALIGN - 1);
+    uint64_t bytes = used_off + 6 + sizeof(struct virtq_used_elem) * size;
+    vq->pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint8_t *mem = MMU_dma_alloc(vq->pages, &vq->desc_phys);
+    if (!mem) return -1;
+
+    vq->index = index;
+    vq->size = size;
+    vq->desc = (struct virtq_desc *)mem;
+    vq->avail = (struct virtq_avail *)(mem + avail_off);
+    vq->used = (struct virtq_used *)(mem + used_off);
+    vq->avail_phys = vq->desc_phys + avail_off;
+    vq->used_phys = vq->desc_phys + used_off;
+    vq->event_idx = (vdev->features >> VIRTIO_F_EVENT_IDX) & 1;
+    vq->indirect = (vdev->features >> VIRTIO_F_INDIRECT_DESC) & 1;
+    for (uint16_t i = 0; i < size; i++) {
+        vq->desc[i].next = i + 1;
+    }
+    vq->free_head = 0;
+    vq->num_free = size;
+
+    if (vdev->modern) {
+        vdev->common->queue_desc = vq->desc_phys;
+        vdev->common->queue_driver = vq->avail_phys;
+        vdev->common->queue_device = vq->used_phys;
+        vq->notify = (volatile uint16_t *)(vdev->notify_base +
+                     (uint32_t)vdev->common->queue_notify_off * vdev->notify_multiplier);
+        vdev->common->queue_enable = 1;
+    } else {
+        outl(vdev->io_base + VIRTIO_LEGACY_QUEUE_PFN, vq->desc_phys >> PAGE_SHIFT);
+    }
+    return 0;
+}
+
+// publishes one request, a multi-buffer request goes through the indirect table when
+// the device supports it so it takes a single ring slot, returns -1 if the ring is full
+int virtq_add(struct virtq *vq, const struct virtq_sg *sg, int n, struct virtq_desc *indirect,
+              uint64_t indirect_phys, void *cookie) {
+    if (n <= 0 || n > VIRTQ_MAX_SG) return -1;
+    uint16_t head = vq->free_head;
+
+    if (vq->indirect && indirect && n > 1) {
+        if (vq->num_free < 1) return -1;
+        for (int i = 0; i < n; i++) {
+            indirect[i].addr = sg[i].phys;
+            indirect[i].len = sg[i].len;
+            indirect[i].flags = (sg[i].write ? VIRTQ_DESC_F_WRITE : 0) | (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0);
+            indirect[i].next = i + 1;
+        }
+        struct virtq_desc *d = &vq->desc[head];
+        vq->free_head = d->next;
+        d->addr = indirect_phys;
+        d->len = n * sizeof(struct virtq_desc);
+        d->flags = VIRTQ_DESC_F_INDIRECT;
+        vq->num_free--;
+        vq->chain_len[head] = 1;
+    } else {
+        if (vq->num_free < n) return -1;
+        // the free list is already chained through next
+        uint16_t idx = head;
+        for (int i = 0; i < n; i++) {
+            struct virtq_desc *d = &vq->desc[idx];
+            d->addr = sg[i].phys;
+            d->len = sg[i].len;
+            d->flags = (sg[i].write ? VIRTQ_DESC_F_WRITE : 0) | (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0);
+            idx = d->next;
+        }
+        vq->free_head = idx;
+        vq->num_free -= n;
+        vq->chain_len[head] = n;
+    }
+    vq->cookies[head] = cookie;
+
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    virtio_wmb();
+    vq->avail_idx++;
+    *(volatile uint16_t *)&vq->avail->idx = vq->avail_idx;
+    return 0;
+}
+
+// notifies the device about everything added since the last kick, unless it asked not to be
+void virtq_kick(struct virtio_dev *vdev, struct virtq *vq) {
+    uint16_t old = vq->kicked_idx, new = vq->avail_idx;
+    if (old == new) return;
+    vq->kicked_idx = new;
+    virtio_mb();
+
+    int notify;
+    if (vq->event_idx) {
+        uint16_t event = *vq_avail_event(vq);
+        notify = (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+    } else {
+        notify = !(*(volatile uint16_t *)&vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+    if (!notify) return;
+    if (vdev->modern) {
+        *vq->notify = vq->index;
+    } else {
+        outw(vdev->io_base + VIRTIO_LEGACY_QUEUE_NOTIFY, vq->index);
+    }
+}
+
+// returns the cookie of the next completed request and frees its descriptors, NULL if none
+void *virtq_get_buf(struct virtq *vq, uint32_t *len) {
+    if (vq->last_used_idx == vq_used_idx(vq)) {
+        return NULL;
+    }
+    virtio_rmb();
+    volatile struct virtq_used_elem *elem = &vq->used->ring[vq->last_used_idx % vq->size];
+    uint16_t head = elem->id;
+    if (len) *len = elem->len;
+    vq->last_used_idx++;
+
+    void *cookie = vq->cookies[head];
+    vq->cookies[head] = NULL;
+    uint16_t tail = head;
+    for (int i = 1; i < vq->chain_len[head]; i++) {
+        tail = vq->desc[tail].next;
+    }
+    vq->desc[tail].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += vq->chain_len[head];
+    return cookie;
+}
+
+// with EVENT_IDX leaving used_event behind already stops interrupts
+void virtq_disable_cb(struct virtq *vq) {
+    if (!vq->event_idx) {
+        vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+// re-arms the interrupt, returns 1 if buffers were used meanwhile and need reaping first
+int virtq_enable_cb(struct virtq *vq) {
+    if (vq->event_idx) {
+        *vq_used_event(vq) = vq->last_used_idx;
+    } else {
+        vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+    virtio_mb();
+    return vq_used_idx(vq) != vq->last_used_idx;
+}
@@ -0,0 +1,157 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pci.h"
+
+#define VIRTIO_PCI_VENDOR 0x1AF4
+
+// device status
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED 0x80
+
+// transport feature bits
+#define VIRTIO_F_INDIRECT_DESC 28
+#define VIRTIO_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+
+// legacy transport, I/O BAR0
+#define VIRTIO_LEGACY_HOST_FEATURES 0x00
+#define VIRTIO_LEGACY_GUEST_FEATURES 0x04
+#define VIRTIO_LEGACY_QUEUE_PFN 0x08
+#define VIRTIO_LEGACY_QUEUE_NUM 0x0C
+#define VIRTIO_LEGACY_QUEUE_SEL 0x0E
+#define VIRTIO_LEGACY_QUEUE_NOTIFY 0x10
+#define VIRTIO_LEGACY_STATUS 0x12
+#define VIRTIO_LEGACY_ISR 0x13
+#define VIRTIO_LEGACY_CONFIG 0x14     // device config, no MSI-X
+#define VIRTIO_LEGACY_QUEUE_ALIGN 4096
+
+// modern transport, vendor specific PCI capabilities pointing into memory BARs
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+#define VIRTIO_PCI_CAP_CFG_TYPE 3     // offsets inside the capability
+#define VIRTIO_PCI_CAP_BAR 4
+#define VIRTIO_PCI_CAP_OFFSET 8
+#define VIRTIO_PCI_CAP_LENGTH 12
+#define VIRTIO_PCI_NOTIFY_MULTIPLIER 16
+
+struct virtio_pci_common_cfg {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint64_t queue_desc;
+    uint64_t queue_driver;
+    uint64_t queue_device;
+};
+
+// split virtqueue layout, all fields are naturally aligned
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2          // device writes this buffer
+#define VIRTQ_DESC_F_INDIRECT 4
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];    // followed by used_event with VIRTIO_F_EVENT_IDX
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[];  // followed by avail_event with VIRTIO_F_EVENT_IDX
+};
+
+#define VIRTQ_MAX_SIZE 256     // legacy devices dictate the size, QEMU uses 256
+#define VIRTQ_MAX_SG 40     // descriptors per request, 128 KiB of scattered pages plus header/status
+
+// one buffer of a request, physical address and length
+struct virtq_sg {
+    uint64_t phys;
+    uint32_t len;
+    int write;          // device writes into it
+};
+
+struct virtq {
+    uint16_t index;
+    uint16_t size;
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint64_t desc_phys, avail_phys, used_phys;
+    int pages;
+
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t last_used_idx;
+    uint16_t avail_idx;             // shadow of avail->idx
+    uint16_t kicked_idx;            // avail idx at the last notification
+    int event_idx;
+    int indirect;
+    void *cookies[VIRTQ_MAX_SIZE];  // per head descriptor
+    uint16_t chain_len[VIRTQ_MAX_SIZE];
+
+    volatile uint16_t *notify;      // modern notify register
+};
+
+struct virtio_dev {
+    struct pci_dev *pci;
+    int modern;
+    uint16_t io_base;                           // legacy
+    volatile struct virtio_pci_common_cfg *common;  // modern
+    volatile uint8_t *isr;
+    volatile uint8_t *device_cfg;
+    volatile uint8_t *notify_base;
+    uint32_t notify_multiplier;
+    uint64_t features;
+};
+
+int virtio_pci_init(struct virtio_dev *vdev, struct pci_dev *pci);
+int virtio_negotiate(struct virtio_dev *vdev, uint64_t wanted);
+int virtio_setup_queue(struct virtio_dev *vdev, struct virtq *vq, uint16_t index);
+void virtio_reset(struct virtio_dev *vdev);
+void virtio_driver_ok(struct virtio_dev *vdev);
+void virtio_fail(struct virtio_dev *vdev);
+uint8_t virtio_read_isr(struct virtio_dev *vdev);
+uint8_t virtio_config_read8(struct virtio_dev *vdev, uint32_t off);
+uint32_t virtio_config_read32(struct virtio_dev *vdev, uint32_t off);
+uint64_t virtio_config_read64(struct virtio_dev *vdev, uint32_t off);
+
+int virtq_add(struct virtq *vq, const struct virtq_sg *sg, int n, struct virtq_desc *indirect,
+              uint64_t indirect_phys, void *cookie);
+void virtq_kick(struct virtio_dev *vdev, struct virtq *vq);
+void *virtq_get_buf(struct virtq *vq, uint32_t *len);
+void virtq_disable_cb(struct virtq *vq);
+int virtq_enable_cb(struct virtq *vq);
+
+#endif
@@ -0,0 +1,618 @@
+#include "virtio_blk.h"
+#include "virtio.h"
+#include "block.h"
+#include "interrupts.h"
+#include "mmu.h"
+#include "pci.h"
+#include "printk.h"
+#include "string.h"
+#include "tsc.h"
+
+// virtio block device (first one found), one request queue with up to
+// VIRTIO_BLK_MAX_INFLIGHT requests outstanding
+
+static inline int are_interrupts_enabled() {
+    unsigned long flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0"
+                     : "=r"(flags));
+    return flags & 0x200; // Check IF (Interrupt Flag) bit
+}
+
+// per in-flight request, header/status/indirect table live in DMA memory
+struct vblk_slot {
+    struct virtio_blk_outhdr *hdr;
+    volatile uint8_t *status;
+    struct virtq_desc *indirect;
+    uint64_t hdr_phys, status_phys, indirect_phys;
+    struct virtio_blk_request *req;     // NULL once the waiter gave up
+    uint64_t submit_tsc;
+};
+
+static struct virtio_dev vdev;
+static struct virtq vq;
+static int present = 0;
+static int read_only = 0;
+static uint64_t capacity = 0;
+
+static struct vblk_slot slots[VIRTIO_BLK_MAX_INFLIGHT];
+static int free_slots[VIRTIO_BLK_MAX_INFLIGHT];
+static int num_free_slots = 0;
+static int inflight = 0;
+static struct virtio_blk_stats stats;
+
+static int hist_bucket(uint64_t val) {
+    int b = 0;
+    while (val && b < VIRTIO_BLK_HIST_BUCKETS - 1) {
+        val >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/*-------------------Requests-------------------*/
+
+// page by page, merging physically contiguous frames, returns the number of entries or -1
+static int vblk_map_buffer(void *buf, uint32_t len, int device_writes, struct virtq_sg *sg, int max) {
+    int n = 0;
+    uint8_t *p = buf;
+    struct pt_walker w;
+    pt_walker_init(&w, NULL);
+    while (len > 0) {
+        uint32_t chunk = PAGE_SIZE - ((uint64_t)p & (PAGE_SIZE - 1));
+        if (chunk > len) chunk = len;
+        // faults in demand paged buffers before asking for their frames
+        *(volatile uint8_t *)p;
+        uint64_t phys = virt_to_phys_cached(&w, p);
+        if (phys == 0) return -1;
+        if (n > 0 && sg[n - 1].phys + sg[n - 1].len == phys) {
+            sg[n - 1].len += chunk;
+        } else {
+            if (n == max) return -1;
+            sg[n].phys = phys;
+            sg[n].len = chunk;
+            sg[n].write = device_writes;
+            n++;
+        }
+        p += chunk;
+        len -= chunk;
+    }
+    return n;
+}
+
+// queues the request without notifying the device, see virtio_blk_kick()
+int virtio_blk_submit(struct virtio_blk_request *req) {
+    if (!present) return VIRTIO_BLK_ERR_NODEV;
+    if (req->type == VIRTIO_BLK_T_IN || req->type == VIRTIO_BLK_T_OUT) {
+        if (req->count == 0 || req->count > VIRTIO_BLK_MAX_SECTORS ||
+            req->sector + req->count > capacity || !req->buf) {
+            return VIRTIO_BLK_ERR_INVAL;
+        }
+        if (req->type == VIRTIO_BLK_T_OUT && read_only) {
+            return VIRTIO_BLK_ERR_INVAL;
+        }
+    } else if (req->type != VIRTIO_BLK_T_FLUSH) {
+        return VIRTIO_BLK_ERR_INVAL;
+    }
+
+    struct virtq_sg sg[VIRTQ_MAX_SG];
+    int n = 1;
+    if (req->type != VIRTIO_BLK_T_FLUSH) {
+        int data = vblk_map_buffer(req->buf, req->count * VIRTIO_BLK_SECTOR_SIZE,
+                                   req->type == VIRTIO_BLK_T_IN, &sg[1], VIRTQ_MAX_SG - 2);
+        if (data < 0) return VIRTIO_BLK_ERR_INVAL;
+        n += data;
+    }
+    req->done = 0;
+    req->status = VIRTIO_BLK_OK;
+
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    int ret = VIRTIO_BLK_OK;
+    if (num_free_slots == 0) {
+        ret = VIRTIO_BLK_ERR_FULL;
+    } else {
+        int s = free_slots[--num_free_slots];
+        struct vblk_slot *slot = &slots[s];
+        slot->hdr->type = req->type;
+        slot->hdr->reserved = 0;
+        slot->hdr->sector = req->sector;
+        *slot->status = 0xFF;
+        sg[0].phys = slot->hdr_phys;
+        sg[0].len = sizeof(struct virtio_blk_outhdr);
+        sg[0].write = 0;
+        sg[n].phys = slot->status_phys;
+        sg[n].len = 1;
+        sg[n].write = 1;
+        if (virtq_add(&vq, sg, n + 1, slot->indirect, slot->indirect_phys, slot) != 0) {
+            free_slots[num_free_slots++] = s;
+            ret = VIRTIO_BLK_ERR_FULL;
+        } else {
+            slot->req = req;
+            slot->submit_tsc = rdtsc();
+            inflight++;
+            stats.requests++;
+            stats.depth_hist[hist_bucket(inflight)]++;
+        }
+    }
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+    return ret;
+}
+
+// one notification for everything submitted since the last kick
+void virtio_blk_kick(void) {
+    if (!present) return;
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    uint16_t before = vq.kicked_idx;
+    virtq_kick(&vdev, &vq);
+    if (vq.kicked_idx != before) {
+        stats.kicks++;
+    }
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
+// called with interrupts off
+static void vblk_complete(struct vblk_slot *slot) {
+    uint64_t us = TSC_cycles_to_us(rdtsc() - slot->submit_tsc);
+    stats.latency_hist[hist_bucket(us)]++;
+    if (us > stats.max_latency_us) {
+        stats.max_latency_us = us;
+    }
+    int status = (*slot->status == VIRTIO_BLK_S_OK) ? VIRTIO_BLK_OK : VIRTIO_BLK_ERR_IO;
+    if (status != VIRTIO_BLK_OK) {
+        stats.errors++;
+    }
+
+    struct virtio_blk_request *req = slot->req;
+    slot->req = NULL;
+    free_slots[num_free_slots++] = slot - slots;
+    inflight--;
+    if (req) {
+        req->status = status;
+        req->done = 1;
+        if (req->callback) {
+            req->callback(req);
+        }
+    }
+}
+
+// reaps completions in batches, interrupts stay suppressed until the used ring is drained
+void virtio_blk_interrupt_handler(int irq, int error_code, void* arg) {
+    (void)irq;
+    (void)error_code;
+    (void)arg;
+    if (!present || !(virtio_read_isr(&vdev) & 1)) {
+        return;
+    }
+    stats.interrupts++;
+    int reaped = 0;
+    do {
+        virtq_disable_cb(&vq);
+        struct vblk_slot *slot;
+        while ((slot = virtq_get_buf(&vq, NULL)) != NULL) {
+            vblk_complete(slot);
+            reaped++;
+        }
+    } while (virtq_enable_cb(&vq));
+    stats.batch_hist[hist_bucket(reaped)]++;
+}
+
+// called with interrupts off. A device that stopped answering still owns every buffer in the ring,
+// only a reset guarantees it won't DMA into them after their owners are gone. All in flight
+// requests fail and the device stays off
+static void vblk_reset(void) {
+    virtio_reset(&vdev);
+    present = 0;
+    for (int i = 0; i < VIRTIO_BLK_MAX_INFLIGHT; i++) {
+        struct virtio_blk_request *req = slots[i].req;
+        if (!req) continue;
+        slots[i].req = NULL;
+        free_slots[num_free_slots++] = i;
+        inflight--;
+        req->status = VIRTIO_BLK_ERR_TIMEOUT;
+        req->done = 1;
+        if (req->callback) {
+            req->callback(req);
+        }
+    }
+}
+
+int virtio_blk_wait(struct virtio_blk_request *req) {
+    uint64_t deadline = TSC_deadline_us(VIRTIO_BLK_TIMEOUT_US);
+    while (!req->done) {
+        if (TSC_expired(deadline)) {
+            int enable_ints = 0;
+            if (are_interrupts_enabled()) {
+                enable_ints = 1;
+                __asm__ volatile("cli");
+            }
+            int timed_out = !req->done;
+            if (timed_out) {
+                vblk_reset();
+            }
+            if (enable_ints) {
+                __asm__ volatile("sti");
+            }
+            if (timed_out) {
+                printk("virtio-blk: request at sector %lu timed out, device reset\n", req->sector);
+                return VIRTIO_BLK_ERR_TIMEOUT;
+            }
+        }
+        __asm__ volatile("pause");
+    }
+    return req->status;
+}
+
+static int vblk_sync(int type, uint64_t sector, uint32_t count, void *buf) {
+    struct virtio_blk_request req = {
+        .type = type,
+        .sector = sector,
+        .count = count,
+        .buf = buf,
+    };
+    int ret = virtio_blk_submit(&req);
+    if (ret != VIRTIO_BLK_OK) return ret;
+    virtio_blk_kick();
+    return virtio_blk_wait(&req);
+}
+
+int virtio_blk_read(uint64_t sector, uint32_t count, void *buf) {
+    return vblk_sync(VIRTIO_BLK_T_IN, sector, count, buf);
+}
+
+int virtio_blk_write(uint64_t sector, uint32_t count, const void *buf) {
+    return vblk_sync(VIRTIO_BLK_T_OUT, sector, count, (void *)buf);
+}
+
+int virtio_blk_flush(void) {
+    if (present && !(vdev.features & (1ULL << VIRTIO_BLK_F_FLUSH))) {
+        // no volatile write cache to flush
+        return VIRTIO_BLK_OK;
+    }
+    return vblk_sync(VIRTIO_BLK_T_FLUSH, 0, 0, NULL);
+}
+
+int virtio_blk_present(void) {
+    return present;
+}
+
+uint64_t virtio_blk_capacity(void) {
+    return capacity;
+}
+
+/*-------------------Block device-------------------*/
+
+// block requests go out as one virtio request per virtually contiguous run
+struct vblk_seg {
+    struct virtio_blk_request vreq;
+    struct block_request *breq;
+    struct vblk_seg *next_free;
+};
+
+static struct block_device vblk_bdev;
+static struct vblk_seg segs[VIRTIO_BLK_MAX_INFLIGHT];
+static struct vblk_seg *free_segs = NULL;
+static int num_free_segs = 0;
+
+// interrupt context
+static void vblk_seg_done(struct virtio_blk_request *vreq) {
+    struct vblk_seg *seg = vreq->arg;
+    struct block_request *breq = seg->breq;
+    if (vreq->status != VIRTIO_BLK_OK) {
+        breq->driver_status = BLOCK_ERR_IO;
+    }
+    seg->next_free = free_segs;
+    free_segs = seg;
+    num_free_segs++;
+    if (--breq->driver_pending == 0) {
+        blk_request_done(&vblk_bdev, breq, breq->driver_status);
+    }
+}
+
+// called by the block layer with interrupts off
+static int vblk_blk_submit(struct block_device *dev, struct block_request *req) {
+    struct blk_cursor cur;
+    void *buf;
+    uint32_t bytes;
+    uint32_t max_bytes = VIRTIO_BLK_MAX_SECTORS * VIRTIO_BLK_SECTOR_SIZE;
+    int runs = 0;
+
+    blk_cursor_init(&cur, req);
+    while (blk_cursor_next(&cur, max_bytes, &buf) > 0) {
+        runs++;
+    }
+    if (runs > num_free_segs || runs > num_free_slots) {
+        return BLOCK_ERR_BUSY;
+    }
+
+    // held at one until every run is queued so an early completion can't finish the request
+    req->driver_pending = 1;
+    uint64_t sector = req->sector;
+    blk_cursor_init(&cur, req);
+    while ((bytes = blk_cursor_next(&cur, max_bytes, &buf)) > 0) {
+        struct vblk_seg *seg = free_segs;
+        free_segs = seg->next_free;
+        num_free_segs--;
+        seg->breq = req;
+        seg->vreq.type = (req->dir == BIO_WRITE) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        seg->vreq.sector = sector;
+        seg->vreq.count = bytes / VIRTIO_BLK_SECTOR_SIZE;
+        seg->vreq.buf = buf;
+        seg->vreq.callback = vblk_seg_done;
+        seg->vreq.arg = seg;
+        sector += seg->vreq.count;
+        if (virtio_blk_submit(&seg->vreq) != VIRTIO_BLK_OK) {
+            req->driver_status = BLOCK_ERR_IO;
+            seg->next_free = free_segs;
+            free_segs = seg;
+            num_free_segs++;
+            continue;
+        }
+        req->driver_pending++;
+    }
+    virtio_blk_kick();
+    if (--req->driver_pending == 0) {
+        blk_request_done(dev, req, req->driver_status);
+    }
+    return BLOCK_OK;
+}
+
+static const struct block_device_ops vblk_blk_ops = {
+    .submit = vblk_blk_submit,
+};
+
+static void vblk_register_block(void) {
+    for (int i = 0; i < VIRTIO_BLK_MAX_INFLIGHT; i++) {
+        segs[i].next_free = free_segs;
+        free_segs = &segs[i];
+    }
+    num_free_segs = VIRTIO_BLK_MAX_INFLIGHT;
+    strcpy(vblk_bdev.name, "vda");
+    vblk_bdev.sectors = capacity;
+    vblk_bdev.max_inflight = VIRTIO_BLK_BENCH_QD;
+    vblk_bdev.ops = &vblk_blk_ops;
+    blk_register(&vblk_bdev);
+}
+
+/*-------------------Init-------------------*/
+
+static int vblk_alloc_slots(void) {
+    uint64_t phys, indirect_phys;
+    // header and status for every slot in one page
+    uint8_t *page = MMU_dma_alloc(1, &phys);
+    int indirect_bytes = VIRTIO_BLK_MAX_INFLIGHT * VIRTQ_MAX_SG * sizeof(struct virtq_desc);
+    uint8_t *indirect = MMU_dma_alloc((indirect_bytes + PAGE_SIZE - 1) / PAGE_SIZE, &indirect_phys);
+    if (!page || !indirect) return -1;
+
+    uint32_t status_off = VIRTIO_BLK_MAX_INFLIGHT * sizeof(struct virtio_blk_outhdr);
+    for (int i = 0; i < VIRTIO_BLK_MAX_INFLIGHT; i++) {
+        struct vblk_slot *slot = &slots[i];
+        uint32_t hdr_off = i * sizeof(struct virtio_blk_outhdr);
+        uint32_t ind_off = i * VIRTQ_MAX_SG * sizeof(struct virtq_desc);
+        slot->hdr = (struct virtio_blk_outhdr *)(page + hdr_off);
+        slot->hdr_phys = phys + hdr_off;
+        slot->status = page + status_off + i;
+        slot->status_phys = phys + status_off + i;
+        slot->indirect = (struct virtq_desc *)(indirect + ind_off);
+        slot->indirect_phys = indirect_phys + ind_off;
+        free_slots[i] = VIRTIO_BLK_MAX_INFLIGHT - 1 - i;
+    }
+    num_free_slots = VIRTIO_BLK_MAX_INFLIGHT;
+    return 0;
+}
+
+static int virtio_blk_probe(struct pci_dev *dev) {
+    if (present) {
+        printk("virtio-blk: only one device is supported\n");
+        return -1;
+    }
+    if (virtio_pci_init(&vdev, dev) != 0) {
+        return -1;
+    }
+    uint64_t wanted = (1ULL << VIRTIO_F_INDIRECT_DESC) | (1ULL << VIRTIO_F_EVENT_IDX) |
+                      (1ULL << VIRTIO_BLK_F_RO) | (1ULL << VIRTIO_BLK_F_FLUSH) |
+                      (1ULL << VIRTIO_BLK_F_BLK_SIZE) | (1ULL << VIRTIO_BLK_F_SEG_MAX);
+    if (virtio_negotiate(&vdev, wanted) != 0 ||
+        virtio_setup_queue(&vdev, &vq, 0) != 0 ||
+        vblk_alloc_slots() != 0) {
+        virtio_fail(&vdev);
+        return -1;
+    }
+    capacity = virtio_config_read64(&vdev, VIRTIO_BLK_CFG_CAPACITY);
+    read_only = (vdev.features >> VIRTIO_BLK_F_RO) & 1;
+    if (vdev.features & (1ULL << VIRTIO_BLK_F_SEG_MAX)) {
+        // requests use at most 2 + data segments ring slots without indirect descriptors
+        uint32_t seg_max = virtio_config_read32(&vdev, VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max < VIRTQ_MAX_SG - 2) {
+            printk("virtio-blk: device allows only %u segments\n", seg_max);
+        }
+    }
+
+    IRQ_set_handler(dev->irq_line, virtio_blk_interrupt_handler, NULL);
+    if (dev->irq_line >= 8) {
+        IRQ_clear_mask(2);  // cascade
+    }
+    IRQ_clear_mask(dev->irq_line);
+    virtq_enable_cb(&vq);
+    virtio_driver_ok(&vdev);
+    present = 1;
+
+    printk("virtio-blk: %s transport, %lu sectors (%lu MB)%s, queue %d%s%s, irq %d\n",
+           vdev.modern ? "modern" : "legacy", capacity,
+           capacity * VIRTIO_BLK_SECTOR_SIZE / (1024 * 1024), read_only ? " read-only" : "",
+           vq.size, vq.indirect ? ", indirect" : "", vq.event_idx ? ", event idx" : "",
+           dev->irq_line);
+    vblk_register_block();
+    return 0;
+}
+
+static const struct pci_driver virtio_blk_legacy_driver = {
+    .name = "virtio-blk",
+    .vendor = VIRTIO_PCI_VENDOR,
+    .device = VIRTIO_BLK_DEVICE_LEGACY,
+    .class_code = PCI_ANY_CLASS,
+    .subclass = PCI_ANY_CLASS,
+    .probe = virtio_blk_probe,
+};
+
+static const struct pci_driver virtio_blk_modern_driver = {
+    .name = "virtio-blk",
+    .vendor = VIRTIO_PCI_VENDOR,
+    .device = VIRTIO_BLK_DEVICE_MODERN,
+    .class_code = PCI_ANY_CLASS,
+    .subclass = PCI_ANY_CLASS,
+    .probe = virtio_blk_probe,
+};
+
+// returns 0 if a device was found and set up
+int virtio_blk_init(void) {
+    pci_register_driver(&virtio_blk_legacy_driver);
+    pci_register_driver(&virtio_blk_modern_driver);
+    return present ? 0 : -1;
+}
+
+/*-------------------Stats-------------------*/
+
+static void print_hist(const char *name, const uint64_t *hist, const char *unit) {
+    printk("  %s:\n", name);
+    for (int i = 0; i < VIRTIO_BLK_HIST_BUCKETS; i++) {
+        if (!hist[i]) continue;
+        uint64_t lo = i ? ((uint64_t)1 << (i - 1)) : 0;
+        printk("    %lu-%lu%s: %lu\n", lo, (uint64_t)(1ULL << i) - 1, unit, hist[i]);
+    }
+}
+
+void virtio_blk_stats_dump(void) {
+    printk("virtio-blk: %lu requests, %lu kicks, %lu interrupts, %lu errors, max latency %lu us\n",
+           stats.requests, stats.kicks, stats.interrupts, stats.errors, stats.max_latency_us);
+    print_hist("queue depth at submit", stats.depth_hist, "");
+    print_hist("completion latency", stats.latency_hist, " us");
+    print_hist("completions per interrupt", stats.batch_hist, "");
+}
+
+void virtio_blk_stats_reset(void) {
+    int enable_ints = 0;
+    if (are_interrupts_enabled()) {
+        enable_ints = 1;
+        __asm__ volatile("cli");
+    }
+    memset(&stats, 0, sizeof(stats));
+    if (enable_ints) {
+        __asm__ volatile("sti");
+    }
+}
+
+/*-------------------Benchmark-------------------*/
+
+static uint64_t bench_rand_state;
+
+static uint64_t bench_rand(void) {
+    // xorshift64
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+// keeps qd reads of count sectors in flight, sequential or at random aligned offsets
+static int bench_run(const char *name, uint32_t count, uint64_t ops, int qd, int random, uint8_t *buf) {
+    struct virtio_blk_request reqs[VIRTIO_BLK_BENCH_QD];
+    uint64_t slots_on_disk = capacity / count;
+    uint64_t issued = 0, completed = 0, next = 0;
+    bench_rand_state = 0x2545F4914F6CDD1DULL;
+    memset(reqs, 0, sizeof(reqs));
+    for (int i = 0; i < qd; i++) {
+        reqs[i].type = -1;
+    }
+
+    uint64_t start = rdtsc();
+    while (completed < ops) {
+        int submitted = 0;
+        for (int i = 0; i < qd; i++) {
+            struct virtio_blk_request *req = &reqs[i];
+            if (req->type == VIRTIO_BLK_T_IN && req->done) {
+                // type doubles as the in-use marker, -1 when free
+                if (req->status != VIRTIO_BLK_OK) return -1;
+                req->type = -1;
+                completed++;
+            }
+            if (req->type != VIRTIO_BLK_T_IN && issued < ops) {
+                uint64_t slot = random ? bench_rand() % slots_on_disk : next++ % slots_on_disk;
+                req->type = VIRTIO_BLK_T_IN;
+                req->sector = slot * count;
+                req->count = count;
+                req->buf = buf + (uint64_t)i * count * VIRTIO_BLK_SECTOR_SIZE;
+                int ret = virtio_blk_submit(req);
+                if (ret == VIRTIO_BLK_ERR_FULL) {
+                    // ring full without indirect descriptors, retry once some complete
+                    req->type = -1;
+                    continue;
+                }
+                if (ret != VIRTIO_BLK_OK) return -1;
+                issued++;
+                submitted++;
+            }
+        }
+        if (submitted) {
+            virtio_blk_kick();
+        } else if (TSC_expired(start + TSC_us_to_cycles(10 * VIRTIO_BLK_TIMEOUT_US))) {
+            // buf is freed by the caller, the device must not be left holding it
+            int enable_ints = 0;
+            if (are_interrupts_enabled()) {
+                enable_ints = 1;
+                __asm__ volatile("cli");
+            }
+            vblk_reset();
+            if (enable_ints) {
+                __asm__ volatile("sti");
+            }
+            printk("virtio-blk benchmark: stalled, device reset\n");
+            return -1;
+        } else {
+            __asm__ volatile("pause");
+        }
+    }
+    uint64_t us = TSC_cycles_to_us(rdtsc() - start);
+    if (us == 0) us = 1;
+    uint64_t bytes = ops * count * VIRTIO_BLK_SECTOR_SIZE;
+    // bytes per microsecond is MB/s
+    uint64_t mbps_x10 = bytes * 10 / us;
+    printk("  %s QD%d: %lu KB in %lu us, %lu.%lu MB/s, %lu IOPS\n", name, qd, bytes / 1024, us,
+           mbps_x10 / 10, mbps_x10 % 10, ops * 1000000 / us);
+    return 0;
+}
+
+// sequential 128 KiB and random 4 KiB reads at queue depth 1 and VIRTIO_BLK_BENCH_QD
+void virtio_blk_benchmark(void) {
+    if (!present) return;
+    uint32_t seq_count = VIRTIO_BLK_MAX_SECTORS;
+    uint32_t rand_count = PAGE_SIZE / VIRTIO_BLK_SECTOR_SIZE;
+    if (capacity < seq_count) return;
+    // room for QD big reads
+    int buf_pages = VIRTIO_BLK_BENCH_QD * seq_count * VIRTIO_BLK_SECTOR_SIZE / PAGE_SIZE;
+    uint8_t *buf = MMU_alloc_pages(buf_pages);
+    if (!buf) return;
+    uint64_t seq_ops = VIRTIO_BLK_BENCH_SEQ_BYTES / (seq_count * VIRTIO_BLK_SECTOR_SIZE);
+
+    printk("virtio-blk benchmark\n");
+    virtio_blk_stats_reset();
+    if (bench_run("sequential 128K", seq_count, seq_ops, 1, 0, buf) ||
+        bench_run("sequential 128K", seq_count, seq_ops, VIRTIO_BLK_BENCH_QD, 0, buf) ||
+        bench_run("random 4K", rand_count, VIRTIO_BLK_BENCH_RANDOM_OPS, 1, 1, buf) ||
+        bench_run("random 4K", rand_count, VIRTIO_BLK_BENCH_RANDOM_OPS, VIRTIO_BLK_BENCH_QD, 1, buf)) {
+        printk("virtio-blk benchmark: read failed\n");
+    }
+    virtio_blk_stats_dump();
+    MMU_free_pages(buf, buf_pages);
+}
@@ -0,0 +1,91 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VIRTIO_BLK_DEVICE_LEGACY 0x1001     // transitional, legacy and modern
+#define VIRTIO_BLK_DEVICE_MODERN 0x1042
+
+// feature bits
+#define VIRTIO_BLK_F_SEG_MAX 2
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH 9
+
+// device config
+#define VIRTIO_BLK_CFG_CAPACITY 0   // in 512 byte sectors
+#define VIRTIO_BLK_CFG_SEG_MAX 12
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+#define VIRTIO_BLK_MAX_SECTORS 256      // per request
+#define VIRTIO_BLK_MAX_INFLIGHT 64
+#define VIRTIO_BLK_TIMEOUT_US 1000000
+#define VIRTIO_BLK_HIST_BUCKETS 16      // power of two buckets
+#define VIRTIO_BLK_BENCH_SEQ_BYTES (4 * 1024 * 1024)
+#define VIRTIO_BLK_BENCH_RANDOM_OPS 1024
+#define VIRTIO_BLK_BENCH_QD 32
+
+#define VIRTIO_BLK_OK 0
+#define VIRTIO_BLK_ERR_TIMEOUT -1
+#define VIRTIO_BLK_ERR_IO -2
+#define VIRTIO_BLK_ERR_NODEV -3
+#define VIRTIO_BLK_ERR_FULL -4
+#define VIRTIO_BLK_ERR_INVAL -5
+
+struct virtio_blk_request;
+typedef void (*virtio_blk_done_t)(struct virtio_blk_request *req);
+
+// asynchronous request, completed from the interrupt handler
+struct virtio_blk_request {
+    int type;               // VIRTIO_BLK_T_*
+    uint64_t sector;
+    uint32_t count;         // sectors, at most VIRTIO_BLK_MAX_SECTORS
+    void *buf;
+    volatile int status;    // VIRTIO_BLK_OK or VIRTIO_BLK_ERR_*, valid once done is set
+    volatile int done;
+    virtio_blk_done_t callback;     // may be NULL, runs in interrupt context
+    void *arg;
+};
+
+// histograms: bucket i counts values in [2^(i-1), 2^i)
+struct virtio_blk_stats {
+    uint64_t requests;
+    uint64_t interrupts;
+    uint64_t kicks;
+    uint64_t errors;
+    uint64_t depth_hist[VIRTIO_BLK_HIST_BUCKETS];       // requests in flight at submit
+    uint64_t latency_hist[VIRTIO_BLK_HIST_BUCKETS];     // submit to completion, us
+    uint64_t batch_hist[VIRTIO_BLK_HIST_BUCKETS];       // completions reaped per interrupt
+    uint64_t max_latency_us;
+};
+
+int virtio_blk_init(void);
+int virtio_blk_present(void);
+uint64_t virtio_blk_capacity(void);
+int virtio_blk_submit(struct virtio_blk_request *req);
+void virtio_blk_kick(void);
+int virtio_blk_wait(struct virtio_blk_request *req);
+int virtio_blk_read(uint64_t sector, uint32_t count, void *buf);
+int virtio_blk_write(uint64_t sector, uint32_t count, const void *buf);
+int virtio_blk_flush(void);
+void virtio_blk_interrupt_handler(int irq, int error_code, void* arg);
+void virtio_blk_stats_dump(void);
+void virtio_blk_stats_reset(void);
+void virtio_blk_benchmark(void);
+
+#endif
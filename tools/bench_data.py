@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+"""Writes the initrd's bench.bin: pseudo random bytes from a fixed seed, the same on every build.
+
+Usage: bench_data.py out.bin [bytes]
+
+xorshift64, so the kernel's initrd benchmark checksum only changes when this script does.
+"""
+import struct
+import sys
+
+SEED = 0x9E3779B97F4A7C15
+MASK = (1 << 64) - 1
+
+
+def generate(size):
+    x = SEED
+    out = bytearray()
+    while len(out) < size:
+        x ^= (x << 13) & MASK
+        x ^= x >> 7
+        x ^= (x << 17) & MASK
+        out += struct.pack("<Q", x)
+    return bytes(out[:size])
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__)
+    size = int(sys.argv[2]) if len(sys.argv) == 3 else 1024 * 1024
+    with open(sys.argv[1], "wb") as f:
+        f.write(generate(size))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""Turns a kernel trace dump (trace_dump() in src/kernel/trace.c) into Chrome trace JSON.
+
+Usage: trace_decode.py serial.log [out.json]
+
+The serial log may hold any other output around the dump, the last TRACE-DUMP block is used.
+Load the result in chrome://tracing or https://ui.perfetto.dev.
+"""
+import json
+import struct
+import sys
+
+DUMP_BEGIN = b"TRACE-DUMP\n"
+DUMP_END = b"\nTRACE-END\n"
+MAGIC = b"TRC1"
+HEADER = struct.Struct("<IQII")         # record_size, tsc_khz, ntracepoints, nrecords
+TRACEPOINT = struct.Struct("<HcBB")     # id, phase, name length, span length
+RECORD = struct.Struct("<QQIHBB")       # tsc, arg0, arg1, id, cpu, reserved
+
+
+def parse(data):
+    start = data.rfind(DUMP_BEGIN)
+    if start < 0:
+        raise ValueError("no TRACE-DUMP in the input")
+    pos = start + len(DUMP_BEGIN)
+    if data[pos:pos + len(MAGIC)] != MAGIC:
+        raise ValueError("bad trace magic")
+    pos += len(MAGIC)
+    record_size, tsc_khz, ntracepoints, nrecords = HEADER.unpack_from(data, pos)
+    pos += HEADER.size
+    if record_size != RECORD.size:
+        raise ValueError("record size %d, expected %d" % (record_size, RECORD.size))
+
+    tracepoints = {}
+    for _ in range(ntracepoints):
+        tp_id, phase, name_len, span_len = TRACEPOINT.unpack_from(data, pos)
+        pos += TRACEPOINT.size
+        name = data[pos:pos + name_len].decode()
+        pos += name_len
+        span = data[pos:pos + span_len].decode()
+        pos += span_len
+        tracepoints[tp_id] = (name, span, phase.decode())
+
+    records = []
+    for _ in range(nrecords):
+        if pos + RECORD.size > len(data):
+            print("warning: dump truncated after %d records" % len(records), file=sys.stderr)
+            break
+        records.append(RECORD.unpack_from(data, pos))
+        pos += RECORD.size
+    if data[pos:pos + len(DUMP_END)] != DUMP_END:
+        print("warning: no TRACE-END after the records", file=sys.stderr)
+    return tsc_khz, tracepoints, records
+
+
+def to_chrome(tsc_khz, tracepoints, records):
+    records.sort(key=lambda r: r[0])
+    base = records[0][0] if records else 0
+    events = []
+    for tsc, arg0, arg1, tp_id, cpu, _ in records:
+        name, span, phase = tracepoints.get(tp_id, ("tp%d" % tp_id, "tp%d" % tp_id, "i"))
+        event = {
+            "name": span if phase in "BE" else name,
+            "ph": phase,
+            "ts": (tsc - base) * 1000.0 / tsc_khz,     # microseconds
+            "pid": 0,
+            "tid": cpu,
+            "args": {"tracepoint": name, "arg0": hex(arg0), "arg1": arg1},
+        }
+        if phase == "i":
+            event["s"] = "t"
+        events.append(event)
+    for cpu in sorted({r[4] for r in records}):
+        events.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": cpu, "args": {"name": "cpu %d" % cpu}})
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    try:
+        tsc_khz, tracepoints, records = parse(data)
+    except ValueError as e:
+        print("trace_decode: %s" % e, file=sys.stderr)
+        return 1
+    trace = to_chrome(tsc_khz, tracepoints, records)
+    out = open(sys.argv[2], "w") if len(sys.argv) == 3 else sys.stdout
+    json.dump(trace, out)
+    if out is not sys.stdout:
+        out.close()
+    print("trace_decode: %d records, %d tracepoints" % (len(records), len(tracepoints)), file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,36 @@
+#include "syscall.h"
+
+// first user program: prints through the kernel and touches demand paged data, bss and stack
+
+static char bss_buf[64 * 1024];
+static const char greeting[] = "hello from ring 3\n";
+
+static unsigned long str_len(const char *s) {
+    unsigned long n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+static void print_num(long v) {
+    char buf[24];
+    int i = sizeof(buf);
+    buf[--i] = '\n';
+    do {
+        buf[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v && i > 0);
+    sys_write(1, &buf[i], sizeof(buf) - i);
+}
+
+void _start(void) {
+    sys_write(1, greeting, str_len(greeting));
+    const char *pid_msg = "pid ";
+    sys_write(1, pid_msg, str_len(pid_msg));
+    print_num(sys_getpid());
+
+    // one byte per page, each first touch is a demand fault
+    for (unsigned long i = 0; i < sizeof(bss_buf); i += 4096) {
+        bss_buf[i] = (char)i;
+    }
+    sys_exit(42);
+}
@@ -0,0 +1,61 @@
+#include "syscall.h"
+
+// null system call round trip: getpid through SYSCALL/SYSRET against the int 0x80 gate
+
+#define ROUNDS 100000
+
+static unsigned long str_len(const char *s) {
+    unsigned long n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+static void print(const char *s) {
+    sys_write(1, s, str_len(s));
+}
+
+static void print_num(unsigned long v) {
+    char buf[24];
+    int i = sizeof(buf);
+    do {
+        buf[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v && i > 0);
+    sys_write(1, &buf[i], sizeof(buf) - i);
+}
+
+static inline unsigned long rdtsc(void) {
+    unsigned int lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+}
+
+static void report(const char *name, unsigned long cycles) {
+    print(name);
+    print_num(cycles / ROUNDS);
+    print(" cycles per call\n");
+}
+
+void _start(void) {
+    // warm up both paths before timing
+    for (int i = 0; i < 1000; i++) {
+        sys_getpid();
+        int80_syscall3(SYS_GETPID, 0, 0, 0);
+    }
+
+    unsigned long start = rdtsc();
+    for (int i = 0; i < ROUNDS; i++) {
+        sys_getpid();
+    }
+    unsigned long fast = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < ROUNDS; i++) {
+        int80_syscall3(SYS_GETPID, 0, 0, 0);
+    }
+    unsigned long slow = rdtsc() - start;
+
+    report("syscall/sysret: ", fast);
+    report("int 0x80/iretq: ", slow);
+    sys_exit(0);
+}
@@ -0,0 +1,44 @@
+#ifndef USER_SYSCALL_H
+#define USER_SYSCALL_H
+
+// system calls from ring 3, numbers match src/kernel/syscall.h
+
+#define SYS_EXIT 0
+#define SYS_WRITE 1
+#define SYS_GETPID 2
+
+// SYSCALL, the kernel only preserves rbx, rbp, r12-r15 and rsp across it
+static inline long syscall3(long nr, long a0, long a1, long a2) {
+    long ret;
+    __asm__ volatile("syscall"
+                     : "=a"(ret), "+D"(a0), "+S"(a1), "+d"(a2)
+                     : "a"(nr)
+                     : "rcx", "r8", "r9", "r10", "r11", "memory");
+    return ret;
+}
+
+// the int 0x80 gate, slower but saves every register
+static inline long int80_syscall3(long nr, long a0, long a1, long a2) {
+    long ret;
+    __asm__ volatile("int $0x80"
+                     : "=a"(ret)
+                     : "a"(nr), "D"(a0), "S"(a1), "d"(a2)
+                     : "memory");
+    return ret;
+}
+
+static inline void sys_exit(int code) {
+    syscall3(SYS_EXIT, code, 0, 0);
+    while (1) {
+    }
+}
+
+static inline long sys_write(int fd, const void *buf, unsigned long len) {
+    return syscall3(SYS_WRITE, fd, (long)buf, len);
+}
+
+static inline long sys_getpid(void) {
+    return syscall3(SYS_GETPID, 0, 0, 0);
+}
+
+#endif